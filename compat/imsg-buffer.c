@@ -37,6 +37,34 @@ struct ibufqueue {
 	uint32_t		queued;
 };
 
+/*
+ * Small buffers closed on a coalescing msgbuf are copied back to back
+ * into chunks so that a burst of tiny messages costs neither a malloc
+ * nor an iovec each.  The chunk counts the messages it holds so that
+ * msgbuf_queuelen() keeps returning the number of queued messages.
+ */
+struct ibufchunk {
+	struct ibuf		 buf;
+	uint32_t		 msgs;
+};
+
+/*
+ * Single producer, single consumer byte ring living in memory shared
+ * between two processes.  head is only written by the producer, tail
+ * only by the consumer.  The socket is then only used for wakeups: the
+ * producer sends a byte when it adds data to an empty ring and the
+ * consumer sends one when it frees space for a blocked producer.
+ */
+struct ibufring {
+	volatile uint64_t	 head;
+	char			 pad0[64 - sizeof(uint64_t)];
+	volatile uint64_t	 tail;
+	char			 pad1[64 - sizeof(uint64_t)];
+	volatile uint32_t	 wblocked;
+	char			 pad2[64 - sizeof(uint32_t)];
+	unsigned char		 data[];
+};
+
 struct msgbuf {
 	struct ibufqueue	 bufs;
 	struct ibufqueue	 rbufs;
@@ -46,12 +74,27 @@ struct msgbuf {
 	void			*rarg;
 	size_t			 roff;
 	size_t			 hdrsize;
+	struct ibufchunk	*wchunk;
+	struct ibufchunk	*spare;
+	struct ibufring		*tx;
+	struct ibufring		*rx;
+	size_t			 ringsz;
+	int			 coalesce;
 };
 
 static void	msgbuf_drain(struct msgbuf *, size_t);
 static void	ibufq_init(struct ibufqueue *);
+static int	ibuf_read_process(struct msgbuf *, int);
+static int	ring_write(int, struct msgbuf *);
+static int	ring_read(int, struct msgbuf *);
+static int	ring_drain(int, struct msgbuf *);
 
 #define	IBUF_FD_MARK_ON_STACK	-2
+#define	IBUF_FD_MARK_CHUNK	-3
+
+#define	IBUF_CHUNK_SIZE		(64 * 1024)
+#define	IBUF_CHUNK_MAXMSG	4096
+#define	IBUF_RBUF_SIZE		(4 * IBUF_READ_SIZE)
 
 struct ibuf *
 ibuf_open(size_t len)
@@ -431,6 +474,14 @@ ibuf_rewind(struct ibuf *buf)
 void
 ibuf_close(struct msgbuf *msgbuf, struct ibuf *buf)
 {
+	void	*b;
+
+	if (buf->fd == -1 &&
+	    (b = msgbuf_reserve(msgbuf, ibuf_size(buf))) != NULL) {
+		memcpy(b, ibuf_data(buf), ibuf_size(buf));
+		ibuf_free(buf);
+		return;
+	}
 	ibufq_push(&msgbuf->bufs, buf);
 }
 
@@ -650,7 +701,7 @@ msgbuf_new_reader(size_t hdrsz,
 		return (NULL);
 	}
 
-	if ((buf = malloc(IBUF_READ_SIZE)) == NULL)
+	if ((buf = malloc(IBUF_RBUF_SIZE)) == NULL)
 		return (NULL);
 
 	msgbuf = msgbuf_new();
@@ -673,10 +724,67 @@ msgbuf_free(struct msgbuf *msgbuf)
 	if (msgbuf == NULL)
 		return;
 	msgbuf_clear(msgbuf);
+	if (msgbuf->spare != NULL) {
+		free(msgbuf->spare->buf.buf);
+		free(msgbuf->spare);
+	}
 	free(msgbuf->rbuf);
 	free(msgbuf);
 }
 
+/*
+ * Enable packing of small buffers into shared chunks on the write side.
+ * Only safe for stream sockets and files where message boundaries do
+ * not matter.
+ */
+void
+msgbuf_coalesce(struct msgbuf *msgbuf, int on)
+{
+	msgbuf->coalesce = on;
+	msgbuf->wchunk = NULL;
+}
+
+/*
+ * Reserve len bytes at the end of the write queue and return a pointer
+ * to them, the space counts as one queued message.  Returns NULL if
+ * coalescing is off, len is too large or memory is short; the caller
+ * then needs to queue a buffer of its own.
+ */
+void *
+msgbuf_reserve(struct msgbuf *msgbuf, size_t len)
+{
+	struct ibufchunk	*c = msgbuf->wchunk;
+	void			*b;
+
+	if (!msgbuf->coalesce || len > IBUF_CHUNK_MAXMSG)
+		return (NULL);
+
+	/* the chunk is only usable while it is the tail of the queue */
+	if (c == NULL || TAILQ_NEXT(&c->buf, entry) != NULL ||
+	    c->buf.size - c->buf.wpos < len) {
+		if ((c = msgbuf->spare) != NULL)
+			msgbuf->spare = NULL;
+		else {
+			if ((c = calloc(1, sizeof(*c))) == NULL)
+				return (NULL);
+			if ((c->buf.buf = malloc(IBUF_CHUNK_SIZE)) == NULL) {
+				free(c);
+				return (NULL);
+			}
+			c->buf.size = c->buf.max = IBUF_CHUNK_SIZE;
+			c->buf.fd = IBUF_FD_MARK_CHUNK;
+		}
+		TAILQ_INSERT_TAIL(&msgbuf->bufs.bufs, &c->buf, entry);
+		msgbuf->wchunk = c;
+	}
+
+	b = c->buf.buf + c->buf.wpos;
+	c->buf.wpos += len;
+	c->msgs++;
+	msgbuf->bufs.queued++;
+	return (b);
+}
+
 uint32_t
 msgbuf_queuelen(struct msgbuf *msgbuf)
 {
@@ -690,6 +798,7 @@ msgbuf_clear(struct msgbuf *msgbuf)
 
 	/* write side */
 	ibufq_flush(&msgbuf->bufs);
+	msgbuf->wchunk = NULL;
 
 	/* read side */
 	ibufq_flush(&msgbuf->rbufs);
@@ -718,6 +827,9 @@ ibuf_write(int fd, struct msgbuf *msgbuf)
 	unsigned int	 i = 0;
 	ssize_t	n;
 
+	if (msgbuf->tx != NULL)
+		return ring_write(fd, msgbuf);
+
 	memset(&iov, 0, sizeof(iov));
 	TAILQ_FOREACH(buf, &msgbuf->bufs.bufs, entry) {
 		if (i >= IOV_MAX)
@@ -763,12 +875,12 @@ msgbuf_write(int fd, struct msgbuf *msgbuf)
 	TAILQ_FOREACH(buf, &msgbuf->bufs.bufs, entry) {
 		if (i >= IOV_MAX)
 			break;
-		if (i > 0 && buf->fd != -1)
+		if (i > 0 && ibuf_fd_avail(buf))
 			break;
 		iov[i].iov_base = ibuf_data(buf);
 		iov[i].iov_len = ibuf_size(buf);
 		i++;
-		if (buf->fd != -1)
+		if (ibuf_fd_avail(buf))
 			buf0 = buf;
 	}
 
@@ -873,9 +985,11 @@ ibuf_read(int fd, struct msgbuf *msgbuf)
 		errno = EINVAL;
 		return (-1);
 	}
+	if (msgbuf->rx != NULL)
+		return ring_read(fd, msgbuf);
 
 	iov.iov_base = msgbuf->rbuf + msgbuf->roff;
-	iov.iov_len = IBUF_READ_SIZE - msgbuf->roff;
+	iov.iov_len = IBUF_RBUF_SIZE - msgbuf->roff;
 
  again:
 	if ((n = readv(fd, &iov, 1)) == -1) {
@@ -916,7 +1030,7 @@ msgbuf_read(int fd, struct msgbuf *msgbuf)
 	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
 
 	iov.iov_base = msgbuf->rbuf + msgbuf->roff;
-	iov.iov_len = IBUF_READ_SIZE - msgbuf->roff;
+	iov.iov_len = IBUF_RBUF_SIZE - msgbuf->roff;
 	msg.msg_iov = &iov;
 	msg.msg_iovlen = 1;
 	msg.msg_control = &cmsgbuf.buf;
@@ -971,17 +1085,213 @@ again:
 	return (ibuf_read_process(msgbuf, fdpass));
 }
 
+/*
+ * Switch the msgbuf over to a pair of rings in the shared region base
+ * of size len.  The two ends of a connection pass a different side so
+ * that the tx ring of one is the rx ring of the other.  The region must
+ * be zero filled and nothing may have been sent over fd yet.
+ */
+int
+msgbuf_set_rings(struct msgbuf *msgbuf, void *base, size_t len, int side)
+{
+	struct ibufring	*r0, *r1;
+	size_t		 ringsz;
+
+	if (len / 2 <= sizeof(*r0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	for (ringsz = 1; ringsz <= (len / 2 - sizeof(*r0)) / 2; )
+		ringsz *= 2;
+
+	r0 = base;
+	r1 = (struct ibufring *)((char *)base + sizeof(*r0) + ringsz);
+	msgbuf->tx = side ? r1 : r0;
+	msgbuf->rx = side ? r0 : r1;
+	msgbuf->ringsz = ringsz;
+	return (0);
+}
+
+/*
+ * Queue what the peer put into the rx ring without reading the socket.
+ * Any wakeup stays pending there so the event loop still picks up the
+ * queued messages.
+ */
+int
+msgbuf_ring_drain(int fd, struct msgbuf *msgbuf)
+{
+	if (msgbuf->rx == NULL)
+		return (0);
+	return (ring_drain(fd, msgbuf));
+}
+
+int
+msgbuf_ring_full(struct msgbuf *msgbuf)
+{
+	struct ibufring	*r = msgbuf->tx;
+
+	if (r == NULL)
+		return (0);
+	return (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+	    msgbuf->ringsz);
+}
+
 static void
-msgbuf_drain(struct msgbuf *msgbuf, size_t n)
+ring_wakeup(int fd)
+{
+	char	c = 0;
+
+	/* a full socket already holds a wakeup, so errors don't matter */
+	(void)send(fd, &c, sizeof(c), MSG_DONTWAIT);
+}
+
+static int
+ring_write(int fd, struct msgbuf *msgbuf)
 {
+	struct ibufring	*r = msgbuf->tx;
 	struct ibuf	*buf;
+	uint64_t	 head, tail;
+	size_t		 space, len, off, n, total = 0;
+
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	space = msgbuf->ringsz - (head - tail);
+
+	TAILQ_FOREACH(buf, &msgbuf->bufs.bufs, entry) {
+		if (space == 0)
+			break;
+		len = ibuf_size(buf);
+		if (len > space)
+			len = space;
+		for (n = 0; n < len; n += off) {
+			off = msgbuf->ringsz - ((head + n) & (msgbuf->ringsz - 1));
+			if (off > len - n)
+				off = len - n;
+			memcpy(r->data + ((head + n) & (msgbuf->ringsz - 1)),
+			    (char *)ibuf_data(buf) + n, off);
+		}
+		head += len;
+		space -= len;
+		total += len;
+	}
+	if (total == 0)
+		return (0);
+
+	__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+	msgbuf_drain(msgbuf, total);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head - total)
+		ring_wakeup(fd);
+
+	if (space == 0 && msgbuf_queuelen(msgbuf) > 0) {
+		__atomic_store_n(&r->wblocked, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return (0);
+}
+
+static int
+ring_read(int fd, struct msgbuf *msgbuf)
+{
+	char		 buf[256];
+	ssize_t		 rv;
+
+	/* the socket only carries wakeups, drain them */
+	for (;;) {
+		if ((rv = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return (-1);
+		}
+		if (rv == 0)	/* connection closed */
+			return (0);
+		if ((size_t)rv < sizeof(buf))
+			break;
+	}
+
+	if (ring_drain(fd, msgbuf) == -1)
+		return (-1);
+	return (1);
+}
+
+/*
+ * Empty the rx ring into the read buffer and queue the complete
+ * messages.  A producer blocked on the full ring is woken up.
+ */
+static int
+ring_drain(int fd, struct msgbuf *msgbuf)
+{
+	struct ibufring	*r = msgbuf->rx;
+	uint64_t	 head, tail;
+	size_t		 avail, len, off, n;
+
+	tail = r->tail;
+	for (;;) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+				break;
+			continue;
+		}
+		avail = head - tail;
+		len = IBUF_RBUF_SIZE - msgbuf->roff;
+		if (len > avail)
+			len = avail;
+		for (n = 0; n < len; n += off) {
+			off = msgbuf->ringsz - ((tail + n) & (msgbuf->ringsz - 1));
+			if (off > len - n)
+				off = len - n;
+			memcpy(msgbuf->rbuf + msgbuf->roff + n,
+			    r->data + ((tail + n) & (msgbuf->ringsz - 1)), off);
+		}
+		tail += len;
+		msgbuf->roff += len;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->wblocked, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&r->wblocked, 0, __ATOMIC_RELAXED);
+			ring_wakeup(fd);
+		}
+
+		if (ibuf_read_process(msgbuf, -1) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+static void
+msgbuf_drain(struct msgbuf *msgbuf, size_t n)
+{
+	struct ibuf		*buf;
+	struct ibufchunk	*c;
 
 	while ((buf = TAILQ_FIRST(&msgbuf->bufs.bufs)) != NULL) {
 		if (n >= ibuf_size(buf)) {
 			n -= ibuf_size(buf);
 			TAILQ_REMOVE(&msgbuf->bufs.bufs, buf, entry);
-			msgbuf->bufs.queued--;
-			ibuf_free(buf);
+			if (buf->fd != IBUF_FD_MARK_CHUNK) {
+				msgbuf->bufs.queued--;
+				ibuf_free(buf);
+				continue;
+			}
+			c = (struct ibufchunk *)buf;
+			msgbuf->bufs.queued -= c->msgs;
+			if (msgbuf->wchunk == c)
+				msgbuf->wchunk = NULL;
+			if (msgbuf->spare == NULL) {
+				/* keep one chunk around for reuse */
+				c->buf.wpos = c->buf.rpos = 0;
+				c->msgs = 0;
+				msgbuf->spare = c;
+			} else {
+				free(c->buf.buf);
+				free(c);
+			}
 		} else {
 			buf->rpos += n;
 			return;
@@ -23,6 +23,7 @@
 #include <sys/uio.h>
 
 #include <errno.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -43,6 +44,7 @@ imsgbuf_init(struct imsgbuf *imsgbuf, int fd)
 	    imsgbuf);
 	if (imsgbuf->w == NULL)
 		return (-1);
+	msgbuf_coalesce(imsgbuf->w, 1);
 	imsgbuf->pid = getpid();
 	imsgbuf->maxsize = MAX_IMSGSIZE;
 	imsgbuf->fd = fd;
@@ -56,6 +58,31 @@ imsgbuf_allow_fdpass(struct imsgbuf *imsgbuf)
 	imsgbuf->flags |= IMSG_ALLOW_FDPASS;
 }
 
+/*
+ * Move the data path of imsgbuf into a pair of shared memory rings, the
+ * socket is then only used for wakeups.  fd passing is not possible.
+ */
+int
+imsgbuf_set_shm(struct imsgbuf *imsgbuf, void *base, size_t len, int side)
+{
+	if (imsgbuf->flags & IMSG_ALLOW_FDPASS) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return msgbuf_set_rings(imsgbuf->w, base, len, side);
+}
+
+/*
+ * Returns 1 if there is queued data that can't be written right now
+ * because the shared memory ring is full.  Polling for POLLOUT would
+ * just spin in that case, the reader sends a wakeup once there is space.
+ */
+int
+imsgbuf_write_blocked(struct imsgbuf *imsgbuf)
+{
+	return msgbuf_ring_full(imsgbuf->w);
+}
+
 int
 imsgbuf_set_maxsize(struct imsgbuf *imsgbuf, uint32_t max)
 {
@@ -93,9 +120,40 @@ imsgbuf_write(struct imsgbuf *imsgbuf)
 int
 imsgbuf_flush(struct imsgbuf *imsgbuf)
 {
+	struct pollfd	 pfd;
+	int		 waited = 0;
+
 	while (imsgbuf_queuelen(imsgbuf) > 0) {
 		if (imsgbuf_write(imsgbuf) == -1)
 			return (-1);
+		if (!imsgbuf_write_blocked(imsgbuf)) {
+			waited = 0;
+			continue;
+		}
+
+		/*
+		 * The shared memory ring is full and the reader sends a
+		 * wakeup once it made space.  The reader may itself be
+		 * stuck flushing into our rx ring, so empty that first or
+		 * both ends wait for each other forever.  A wakeup for our
+		 * own rx ring has to stay for the caller's event loop, so
+		 * if poll returns without space back off.
+		 */
+		if (msgbuf_ring_drain(imsgbuf->fd, imsgbuf->w) == -1)
+			return (-1);
+		pfd.fd = imsgbuf->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, waited ? 0 : 1, waited ? 1 : -1) == -1) {
+			if (errno != EINTR)
+				return (-1);
+			continue;
+		}
+		if (pfd.revents & POLLHUP) {
+			errno = EPIPE;
+			return (-1);
+		}
+		waited = 1;
 	}
 	return (0);
 }
@@ -243,11 +301,46 @@ imsg_get_type(struct imsg *imsg)
 	return (imsg->hdr.type);
 }
 
+/*
+ * Write the header of a small imsg straight into the coalescing chunk of
+ * the write queue and return where the payload goes, or NULL if the
+ * message needs an ibuf of its own.
+ */
+static void *
+imsg_reserve(struct imsgbuf *imsgbuf, uint32_t type, uint32_t id, pid_t pid,
+    size_t datalen)
+{
+	struct imsg_hdr	 hdr;
+	char		*b;
+
+	if (datalen > imsgbuf->maxsize - IMSG_HEADER_SIZE)
+		return (NULL);
+	if ((b = msgbuf_reserve(imsgbuf->w, datalen + IMSG_HEADER_SIZE)) ==
+	    NULL)
+		return (NULL);
+
+	hdr.type = type;
+	hdr.len = datalen + IMSG_HEADER_SIZE;
+	hdr.peerid = id;
+	if ((hdr.pid = pid) == 0)
+		hdr.pid = imsgbuf->pid;
+	memcpy(b, &hdr, sizeof(hdr));
+	return (b + IMSG_HEADER_SIZE);
+}
+
 int
 imsg_compose(struct imsgbuf *imsgbuf, uint32_t type, uint32_t id, pid_t pid,
     int fd, const void *data, size_t datalen)
 {
 	struct ibuf	*wbuf;
+	char		*b;
+
+	if (fd < 0 &&
+	    (b = imsg_reserve(imsgbuf, type, id, pid, datalen)) != NULL) {
+		if (datalen != 0)
+			memcpy(b, data, datalen);
+		return (1);
+	}
 
 	if ((wbuf = imsg_create(imsgbuf, type, id, pid, datalen)) == NULL)
 		goto fail;
@@ -270,12 +363,24 @@ imsg_composev(struct imsgbuf *imsgbuf, uint32_t type, uint32_t id, pid_t pid,
     int fd, const struct iovec *iov, int iovcnt)
 {
 	struct ibuf	*wbuf;
+	char		*b;
 	int		 i;
 	size_t		 datalen = 0;
 
 	for (i = 0; i < iovcnt; i++)
 		datalen += iov[i].iov_len;
 
+	if (fd < 0 &&
+	    (b = imsg_reserve(imsgbuf, type, id, pid, datalen)) != NULL) {
+		for (i = 0; i < iovcnt; i++) {
+			if (iov[i].iov_len == 0)
+				continue;
+			memcpy(b, iov[i].iov_base, iov[i].iov_len);
+			b += iov[i].iov_len;
+		}
+		return (1);
+	}
+
 	if ((wbuf = imsg_create(imsgbuf, type, id, pid, datalen)) == NULL)
 		goto fail;
 
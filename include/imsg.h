@@ -31,6 +31,9 @@
 #define IMSG_HEADER_SIZE	sizeof(struct imsg_hdr)
 #define MAX_IMSGSIZE		16384
 
+/* imsgbuf_set_shm() is available */
+#define IMSGBUF_SHM		1
+
 struct ibuf {
 	TAILQ_ENTRY(ibuf)	 entry;
 	unsigned char		*buf;
@@ -122,6 +125,11 @@ struct msgbuf	*msgbuf_new_reader(size_t,
 void		 msgbuf_free(struct msgbuf *);
 void		 msgbuf_clear(struct msgbuf *);
 void		 msgbuf_concat(struct msgbuf *, struct ibufqueue *);
+void		 msgbuf_coalesce(struct msgbuf *, int);
+int		 msgbuf_set_rings(struct msgbuf *, void *, size_t, int);
+int		 msgbuf_ring_drain(int, struct msgbuf *);
+int		 msgbuf_ring_full(struct msgbuf *);
+void		*msgbuf_reserve(struct msgbuf *, size_t);
 uint32_t	 msgbuf_queuelen(struct msgbuf *);
 int		 ibuf_write(int, struct msgbuf *);
 int		 msgbuf_write(int, struct msgbuf *);
@@ -141,6 +149,8 @@ void		 ibufq_flush(struct ibufqueue *);
 int	 imsgbuf_init(struct imsgbuf *, int);
 void	 imsgbuf_allow_fdpass(struct imsgbuf *imsgbuf);
 int	 imsgbuf_set_maxsize(struct imsgbuf *, uint32_t);
+int	 imsgbuf_set_shm(struct imsgbuf *, void *, size_t, int);
+int	 imsgbuf_write_blocked(struct imsgbuf *);
 int	 imsgbuf_read(struct imsgbuf *);
 int	 imsgbuf_write(struct imsgbuf *);
 int	 imsgbuf_flush(struct imsgbuf *);
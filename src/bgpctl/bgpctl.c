@@ -73,8 +73,8 @@ usage(void)
 {
 	extern char	*__progname;
 
-	fprintf(stderr, "usage: %s [-jnV] [-s socket] command [argument ...]\n",
-	    __progname);
+	fprintf(stderr, "usage: %s [-jnV] [-b format] [-s socket] "
+	    "command [argument ...]\n", __progname);
 	exit(1);
 }
 
@@ -99,8 +99,13 @@ main(int argc, char *argv[])
 	if (asprintf(&sockname, "%s.%d", SOCKET_NAME, tableid) == -1)
 		err(1, "asprintf");
 
-	while ((ch = getopt(argc, argv, "jns:V")) != -1) {
+	while ((ch = getopt(argc, argv, "b:jns:V")) != -1) {
 		switch (ch) {
+		case 'b':
+			if (strcmp(optarg, "binary") != 0)
+				errx(1, "unknown output format: %s", optarg);
+			output = &binary_output;
+			break;
 		case 'n':
 			if (++nodescr > 1)
 				usage();
@@ -124,6 +129,8 @@ main(int argc, char *argv[])
 
 	if ((res = parse(argc, argv)) == NULL)
 		exit(1);
+	if (output == &binary_output && res->action != SHOW_RIB)
+		errx(1, "binary output is only supported by show rib");
 
 	memcpy(&neighbor.addr, &res->peeraddr, sizeof(neighbor.addr));
 	strlcpy(neighbor.descr, res->peerdesc, sizeof(neighbor.descr));
@@ -255,11 +262,17 @@ main(int argc, char *argv[])
 		ribreq.aid = res->aid;
 		ribreq.path_id = res->pathid;
 		ribreq.flags = res->flags;
+		if (output == &binary_output)
+			ribreq.flags |= F_CTL_BINARY;
 		imsg_compose(imsgbuf, type, 0, 0, -1, &ribreq, sizeof(ribreq));
 		break;
 	case SHOW_RIB_MEM:
 		imsg_compose(imsgbuf, IMSG_CTL_SHOW_RIB_MEM, 0, 0, -1, NULL, 0);
 		break;
+	case SHOW_RIB_LATENCY:
+		imsg_compose(imsgbuf, IMSG_CTL_SHOW_RIB_LATENCY, 0, 0, -1,
+		    NULL, 0);
+		break;
 	case SHOW_METRICS:
 		output = &ometric_output;
 		numdone = 2;
@@ -472,6 +485,7 @@ show(struct imsg *imsg, struct parse_result *res)
 	struct flowspec		 f;
 	struct ctl_show_rib	 rib;
 	struct rde_memstats	 stats;
+	struct ctl_latency	 lat;
 	struct ibuf		 ibuf;
 	u_int			 rescode;
 
@@ -550,6 +564,13 @@ show(struct imsg *imsg, struct parse_result *res)
 			err(1, "imsg_get_ibuf");
 		output->attr(&ibuf, res->flags, 0);
 		break;
+	case IMSG_CTL_SHOW_RIB_BULK:
+		if (output->rib_bulk == NULL)
+			break;
+		if (imsg_get_ibuf(imsg, &ibuf) == -1)
+			err(1, "imsg_get_ibuf");
+		output->rib_bulk(&ibuf);
+		break;
 	case IMSG_CTL_SHOW_RIB_MEM:
 		if (output->rib_mem == NULL)
 			break;
@@ -557,6 +578,13 @@ show(struct imsg *imsg, struct parse_result *res)
 			err(1, "imsg_get_data");
 		output->rib_mem(&stats);
 		return (1);
+	case IMSG_CTL_SHOW_RIB_LATENCY:
+		if (output->rib_latency == NULL)
+			break;
+		if (imsg_get_data(imsg, &lat, sizeof(lat)) == -1)
+			err(1, "imsg_get_data");
+		output->rib_latency(&lat);
+		return (1);
 	case IMSG_CTL_SHOW_SET:
 		if (output->set == NULL)
 			break;
@@ -747,10 +775,12 @@ const char *
 fmt_flags(uint32_t flags, int sum)
 {
 	static char buf[80];
-	char	 flagstr[5];
+	char	 flagstr[12];
 	char	*p = flagstr;
 
 	if (sum) {
+		if (flags & F_PREF_DAMPED)
+			*p++ = 'D';
 		if (flags & F_PREF_FILTERED)
 			*p++ = 'F';
 		if (flags & F_PREF_INVALID)
@@ -779,6 +809,8 @@ fmt_flags(uint32_t flags, int sum)
 		else
 			strlcpy(buf, "external", sizeof(buf));
 
+		if (flags & F_PREF_DAMPED)
+			strlcat(buf, ", damped", sizeof(buf));
 		if (flags & F_PREF_FILTERED)
 			strlcat(buf, ", filtered", sizeof(buf));
 		if (flags & F_PREF_INVALID)
@@ -1137,6 +1169,27 @@ fmt_set_type(struct ctl_show_set *set)
 	}
 }
 
+/*
+ * Return the upper bound of the histogram bucket holding quantile q or
+ * UINT64_MAX if it is in the overflow bucket.
+ */
+uint64_t
+hist_quantile(const struct bgpd_hist *h, double q)
+{
+	uint64_t	sum = 0, rank;
+	int		i;
+
+	rank = q * h->count;
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		sum += h->bucket[i];
+		if (sum >= rank)
+			return 1ULL << i;
+	}
+	return UINT64_MAX;
+}
+
 void
 send_filterset(struct imsgbuf *i, struct filter_set_head *set)
 {
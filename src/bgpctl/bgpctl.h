@@ -31,7 +31,9 @@ struct output {
 	void	(*communities)(struct ibuf *, struct parse_result *);
 	void	(*rib)(struct ctl_show_rib *, struct ibuf *,
 		    struct parse_result *);
+	void	(*rib_bulk)(struct ibuf *);
 	void	(*rib_mem)(struct rde_memstats *);
+	void	(*rib_latency)(struct ctl_latency *);
 	void	(*set)(struct ctl_show_set *);
 	void	(*rtr)(struct ctl_show_rtr *);
 	void	(*result)(u_int);
@@ -39,6 +41,7 @@ struct output {
 };
 
 extern const struct output show_output, json_output, ometric_output;
+extern const struct output binary_output;
 
 #define EOL0(flag)	((flag & F_CTL_SSV) ? ';' : '\n')
 
@@ -58,5 +61,6 @@ const char	*fmt_community(uint16_t, uint16_t);
 const char	*fmt_large_community(uint32_t, uint32_t, uint32_t);
 const char	*fmt_ext_community(uint64_t);
 const char	*fmt_set_type(struct ctl_show_set *);
+uint64_t	 hist_quantile(const struct bgpd_hist *, double);
 
 #define MPLS_LABEL_OFFSET 12
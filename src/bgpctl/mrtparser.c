@@ -25,6 +25,12 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "mrt.h"
 #include "mrtparser.h"
@@ -50,42 +56,184 @@ int	mrt_parse_state(struct mrt_bgp_state *, struct mrt_hdr *,
 int	mrt_parse_msg(struct mrt_bgp_msg *, struct mrt_hdr *,
 	    struct ibuf *, int);
 
-static size_t
-mrt_read_buf(int fd, void *buf, size_t len)
+/*
+ * MRT files may be compressed with gzip or zstd, this is detected by the
+ * magic at the start of the file and handled transparently.
+ */
+#define MRT_READ_RAW	0
+#define MRT_READ_GZIP	1
+#define MRT_READ_ZSTD	2
+
+struct mrt_reader {
+	int		 fd;
+	int		 type;
+	int		 eof;
+	size_t		 inpos;
+	size_t		 inlen;
+#ifdef HAVE_ZLIB
+	z_stream	 zs;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream	*zds;
+#endif
+	uint8_t		 in[64 * 1024];
+};
+
+static void
+mrt_read_fill(struct mrt_reader *r)
 {
-	char *b = buf;
 	ssize_t n;
 
-	while (len > 0) {
-		if ((n = read(fd, b, len)) == -1) {
-			if (errno == EINTR)
-				continue;
+	if (r->inpos < r->inlen || r->eof)
+		return;
+	r->inpos = r->inlen = 0;
+	while ((n = read(r->fd, r->in, sizeof(r->in))) == -1) {
+		if (errno != EINTR)
 			err(1, "read");
-		}
-		if (n == 0)
+	}
+	if (n == 0)
+		r->eof = 1;
+	r->inlen = n;
+}
+
+static void
+mrt_read_init(struct mrt_reader *r, int fd)
+{
+	static const uint8_t gzmagic[] = { 0x1f, 0x8b };
+	static const uint8_t zstdmagic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+	r->type = MRT_READ_RAW;
+	mrt_read_fill(r);
+
+	if (r->inlen >= sizeof(gzmagic) &&
+	    memcmp(r->in, gzmagic, sizeof(gzmagic)) == 0) {
+#ifdef HAVE_ZLIB
+		/* 15 + 32 auto detects the gzip header */
+		if (inflateInit2(&r->zs, 15 + 32) != Z_OK)
+			errx(1, "inflateInit2 failed");
+		r->type = MRT_READ_GZIP;
+#else
+		errx(1, "gzip compressed MRT files are not supported");
+#endif
+	} else if (r->inlen >= sizeof(zstdmagic) &&
+	    memcmp(r->in, zstdmagic, sizeof(zstdmagic)) == 0) {
+#ifdef HAVE_ZSTD
+		if ((r->zds = ZSTD_createDStream()) == NULL)
+			errx(1, "ZSTD_createDStream failed");
+		r->type = MRT_READ_ZSTD;
+#else
+		errx(1, "zstd compressed MRT files are not supported");
+#endif
+	}
+}
+
+static void
+mrt_read_free(struct mrt_reader *r)
+{
+#ifdef HAVE_ZLIB
+	if (r->type == MRT_READ_GZIP)
+		inflateEnd(&r->zs);
+#endif
+#ifdef HAVE_ZSTD
+	if (r->type == MRT_READ_ZSTD)
+		ZSTD_freeDStream(r->zds);
+#endif
+}
+
+/*
+ * Decompress up to len bytes into buf, returns the number of bytes
+ * produced or 0 at the end of the input.
+ */
+static size_t
+mrt_read_some(struct mrt_reader *r, uint8_t *buf, size_t len)
+{
+	size_t n = 0;
+
+	mrt_read_fill(r);
+	/* decompressors may still hold output after all input is consumed */
+	if (r->type == MRT_READ_RAW && r->inpos == r->inlen)
+		return (0);
+
+	switch (r->type) {
+	case MRT_READ_RAW:
+		n = r->inlen - r->inpos;
+		if (n > len)
+			n = len;
+		memcpy(buf, r->in + r->inpos, n);
+		r->inpos += n;
+		break;
+#ifdef HAVE_ZLIB
+	case MRT_READ_GZIP: {
+		int rv;
+
+		r->zs.next_in = r->in + r->inpos;
+		r->zs.avail_in = r->inlen - r->inpos;
+		r->zs.next_out = buf;
+		r->zs.avail_out = len;
+		rv = inflate(&r->zs, Z_NO_FLUSH);
+		if (rv != Z_OK && rv != Z_STREAM_END && rv != Z_BUF_ERROR)
+			errx(1, "corrupt gzip stream");
+		r->inpos = r->inlen - r->zs.avail_in;
+		n = len - r->zs.avail_out;
+		/* rotated files may be concatenated, continue with next */
+		if (rv == Z_STREAM_END)
+			inflateReset(&r->zs);
+		break;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case MRT_READ_ZSTD: {
+		ZSTD_inBuffer	 ib = { r->in, r->inlen, r->inpos };
+		ZSTD_outBuffer	 ob = { buf, len, 0 };
+		size_t		 rv;
+
+		rv = ZSTD_decompressStream(r->zds, &ob, &ib);
+		if (ZSTD_isError(rv))
+			errx(1, "corrupt zstd stream: %s",
+			    ZSTD_getErrorName(rv));
+		r->inpos = ib.pos;
+		n = ob.pos;
+		break;
+	}
+#endif
+	}
+	return (n);
+}
+
+static size_t
+mrt_read_buf(struct mrt_reader *r, void *buf, size_t len)
+{
+	uint8_t *b = buf;
+	size_t n;
+
+	while (len > 0) {
+		n = mrt_read_some(r, b, len);
+		if (n == 0 && r->eof && r->inpos == r->inlen)
 			break;
 		b += n;
 		len -= n;
 	}
 
-	return (b - (char *)buf);
+	return (b - (uint8_t *)buf);
 }
 
 static struct ibuf *
-mrt_read_msg(int fd, struct mrt_hdr *hdr)
+mrt_read_msg(struct mrt_reader *r, struct mrt_hdr *hdr)
 {
 	struct ibuf *buf;
 	size_t len;
 
 	memset(hdr, 0, sizeof(*hdr));
-	if (mrt_read_buf(fd, hdr, sizeof(*hdr)) != sizeof(*hdr))
+	if (mrt_read_buf(r, hdr, sizeof(*hdr)) != sizeof(*hdr))
 		return (NULL);
 
 	len = ntohl(hdr->length);
 	if ((buf = ibuf_open(len)) == NULL)
 		err(1, "ibuf_open(%zu)", len);
 
-	if (mrt_read_buf(fd, ibuf_reserve(buf, len), len) != len) {
+	if (mrt_read_buf(r, ibuf_reserve(buf, len), len) != len) {
 		ibuf_free(buf);
 		return (NULL);
 	}
@@ -100,9 +248,11 @@ mrt_parse(int fd, struct mrt_parser *p, int verbose)
 	struct mrt_bgp_msg	m;
 	struct mrt_peer		*pctx = NULL;
 	struct mrt_rib		*r;
+	struct mrt_reader	 reader;
 	struct ibuf		*msg;
 
-	while ((msg = mrt_read_msg(fd, &h)) != NULL) {
+	mrt_read_init(&reader, fd);
+	while ((msg = mrt_read_msg(&reader, &h)) != NULL) {
 		if (ibuf_size(msg) != ntohl(h.length))
 			errx(1, "corrupt message, %zu vs %u", ibuf_size(msg),
 			    ntohl(h.length));
@@ -235,6 +385,7 @@ mrt_parse(int fd, struct mrt_parser *p, int verbose)
 	}
 	if (pctx)
 		mrt_free_peers(pctx);
+	mrt_read_free(&reader);
 }
 
 static int
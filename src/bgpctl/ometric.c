@@ -49,6 +49,7 @@ enum ovalue_type {
 struct ovalue {
 	STAILQ_ENTRY(ovalue)	 entry;
 	struct olabels		*labels;
+	const char		*suffix;
 	union {
 		unsigned long long	i;
 		double			f;
@@ -71,6 +72,19 @@ struct ometric {
 
 STAILQ_HEAD(, ometric)	ometrics = STAILQ_HEAD_INITIALIZER(ometrics);
 
+#ifdef OMETRIC_NOEXIT
+/*
+ * Daemons must not exit on errors. They are recorded instead and make
+ * ometric_output_all() fail until ometric_free_all() is called.
+ */
+static int	ometric_failed;
+#define ometric_err()		(ometric_failed = 1)
+#define ometric_errx(...)	(ometric_failed = 1)
+#else
+#define ometric_err()		err(1, NULL)
+#define ometric_errx(...)	errx(1, __VA_ARGS__)
+#endif
+
 static const char *suffixes[] = { "_total", "_created", "_count",
 	"_sum", "_bucket", "_gcount", "_gsum", "_info",
 };
@@ -94,16 +108,21 @@ strsuffix(const char *name)
 	return 0;
 }
 
-static void
+static int
 ometric_check(const char *name)
 {
 	struct ometric *om;
 
-	if (strsuffix(name))
-		errx(1, "reserved name suffix used: %s", name);
+	if (strsuffix(name)) {
+		ometric_errx("reserved name suffix used: %s", name);
+		return -1;
+	}
 	STAILQ_FOREACH(om, &ometrics, entry)
-		if (strcmp(name, om->name) == 0)
-			errx(1, "duplicate name: %s", name);
+		if (strcmp(name, om->name) == 0) {
+			ometric_errx("duplicate name: %s", name);
+			return -1;
+		}
+	return 0;
 }
 
 /*
@@ -115,10 +134,13 @@ ometric_new(enum ometric_type type, const char *name, const char *help)
 {
 	struct ometric *om;
 
-	ometric_check(name);
+	if (ometric_check(name) == -1)
+		return NULL;
 
-	if ((om = calloc(1, sizeof(*om))) == NULL)
-		err(1, NULL);
+	if ((om = calloc(1, sizeof(*om))) == NULL) {
+		ometric_err();
+		return NULL;
+	}
 
 	om->name = name;
 	om->help = help;
@@ -141,10 +163,13 @@ ometric_new_state(const char * const *states, size_t statecnt, const char *name,
 {
 	struct ometric *om;
 
-	ometric_check(name);
+	if (ometric_check(name) == -1)
+		return NULL;
 
-	if ((om = calloc(1, sizeof(*om))) == NULL)
-		err(1, NULL);
+	if ((om = calloc(1, sizeof(*om))) == NULL) {
+		ometric_err();
+		return NULL;
+	}
 
 	om->name = name;
 	om->help = help;
@@ -173,6 +198,9 @@ ometric_free_all(void)
 		}
 		free(om);
 	}
+#ifdef OMETRIC_NOEXIT
+	ometric_failed = 0;
+#endif
 }
 
 static struct olabels *
@@ -200,19 +228,28 @@ olabels_new(const char * const *keys, const char **values)
 	struct olabels *ol;
 	struct olabel  *l;
 
-	if ((ol = malloc(sizeof(*ol))) == NULL)
-		err(1, NULL);
+	if ((ol = malloc(sizeof(*ol))) == NULL) {
+		ometric_err();
+		return NULL;
+	}
 	STAILQ_INIT(&ol->labels);
 	ol->refcnt = 1;
 	ol->next = NULL;
 
 	while (*keys != NULL) {
 		if (*values && **values != '\0') {
-			if ((l = malloc(sizeof(*l))) == NULL)
-				err(1, NULL);
+			if ((l = malloc(sizeof(*l))) == NULL) {
+				ometric_err();
+				olabels_free(ol);
+				return NULL;
+			}
 			l->key = *keys;
-			if ((l->value = strdup(*values)) == NULL)
-				err(1, NULL);
+			if ((l->value = strdup(*values)) == NULL) {
+				ometric_err();
+				free(l);
+				olabels_free(ol);
+				return NULL;
+			}
 			STAILQ_INSERT_TAIL(&ol->labels, l, entry);
 		}
 
@@ -255,7 +292,8 @@ olabels_add_extras(struct olabels *ol, const char **keys, const char **values)
 {
 	struct olabels *new;
 
-	new = olabels_new(keys, values);
+	if ((new = olabels_new(keys, values)) == NULL)
+		return NULL;
 	new->next = olabels_ref(ol);
 
 	return new;
@@ -326,10 +364,14 @@ ometric_output_value(FILE *out, const struct ovalue *ov)
 }
 
 static int
-ometric_output_name(FILE *out, const struct ometric *om)
+ometric_output_name(FILE *out, const struct ometric *om,
+    const struct ovalue *ov)
 {
 	const char *suffix;
 
+	if (ov->suffix != NULL)
+		return fprintf(out, "%s%s", om->name, ov->suffix);
+
 	switch (om->type) {
 	case OMT_COUNTER:
 		suffix = "_total";
@@ -353,6 +395,11 @@ ometric_output_all(FILE *out)
 	struct ometric *om;
 	struct ovalue *ov;
 
+#ifdef OMETRIC_NOEXIT
+	if (ometric_failed)
+		return -1;
+#endif
+
 	STAILQ_FOREACH(om, &ometrics, entry) {
 		if (om->help)
 			if (fprintf(out, "# HELP %s %s\n", om->name,
@@ -364,7 +411,7 @@ ometric_output_all(FILE *out)
 			return -1;
 
 		STAILQ_FOREACH(ov, &om->vals, entry) {
-			if (ometric_output_name(out, om) < 0)
+			if (ometric_output_name(out, om, ov) < 0)
 				return -1;
 			if (ometric_output_labels(out, ov->labels) < 0)
 				return -1;
@@ -383,19 +430,23 @@ ometric_output_all(FILE *out)
 /*
  * Value setters
  */
-static void
+static struct ovalue *
 ometric_set_int_value(struct ometric *om, uint64_t val, struct olabels *ol)
 {
 	struct ovalue *ov;
 
-	if ((ov = malloc(sizeof(*ov))) == NULL)
-		err(1, NULL);
+	if ((ov = malloc(sizeof(*ov))) == NULL) {
+		ometric_err();
+		return NULL;
+	}
 
 	ov->value.i = val;
 	ov->valtype = OVT_INTEGER;
 	ov->labels = olabels_ref(ol);
+	ov->suffix = NULL;
 
 	STAILQ_INSERT_TAIL(&om->vals, ov, entry);
+	return ov;
 }
 
 /*
@@ -404,8 +455,12 @@ ometric_set_int_value(struct ometric *om, uint64_t val, struct olabels *ol)
 void
 ometric_set_int(struct ometric *om, uint64_t val, struct olabels *ol)
 {
-	if (om->type != OMT_COUNTER && om->type != OMT_GAUGE)
-		errx(1, "%s incorrect ometric type", __func__);
+	if (om == NULL)
+		return;
+	if (om->type != OMT_COUNTER && om->type != OMT_GAUGE) {
+		ometric_errx("%s incorrect ometric type", __func__);
+		return;
+	}
 
 	ometric_set_int_value(om, val, ol);
 }
@@ -418,15 +473,22 @@ ometric_set_float(struct ometric *om, double val, struct olabels *ol)
 {
 	struct ovalue *ov;
 
-	if (om->type != OMT_COUNTER && om->type != OMT_GAUGE)
-		errx(1, "%s incorrect ometric type", __func__);
+	if (om == NULL)
+		return;
+	if (om->type != OMT_COUNTER && om->type != OMT_GAUGE) {
+		ometric_errx("%s incorrect ometric type", __func__);
+		return;
+	}
 
-	if ((ov = malloc(sizeof(*ov))) == NULL)
-		err(1, NULL);
+	if ((ov = malloc(sizeof(*ov))) == NULL) {
+		ometric_err();
+		return;
+	}
 
 	ov->value.f = val;
 	ov->valtype = OVT_DOUBLE;
 	ov->labels = olabels_ref(ol);
+	ov->suffix = NULL;
 
 	STAILQ_INSERT_TAIL(&om->vals, ov, entry);
 }
@@ -440,15 +502,22 @@ ometric_set_timespec(struct ometric *om, const struct timespec *ts,
 {
 	struct ovalue *ov;
 
-	if (om->type != OMT_GAUGE)
-		errx(1, "%s incorrect ometric type", __func__);
+	if (om == NULL)
+		return;
+	if (om->type != OMT_GAUGE) {
+		ometric_errx("%s incorrect ometric type", __func__);
+		return;
+	}
 
-	if ((ov = malloc(sizeof(*ov))) == NULL)
-		err(1, NULL);
+	if ((ov = malloc(sizeof(*ov))) == NULL) {
+		ometric_err();
+		return;
+	}
 
 	ov->value.ts = *ts;
 	ov->valtype = OVT_TIMESPEC;
 	ov->labels = olabels_ref(ol);
+	ov->suffix = NULL;
 
 	STAILQ_INSERT_TAIL(&om->vals, ov, entry);
 }
@@ -462,8 +531,12 @@ ometric_set_info(struct ometric *om, const char **keys, const char **values,
 {
 	struct olabels *extra = NULL;
 
-	if (om->type != OMT_INFO)
-		errx(1, "%s incorrect ometric type", __func__);
+	if (om == NULL)
+		return;
+	if (om->type != OMT_INFO) {
+		ometric_errx("%s incorrect ometric type", __func__);
+		return;
+	}
 
 	if (keys != NULL)
 		extra = olabels_add_extras(ol, keys, values);
@@ -482,8 +555,12 @@ ometric_set_state(struct ometric *om, const char *state, struct olabels *ol)
 	size_t i;
 	int val;
 
-	if (om->type != OMT_STATESET)
-		errx(1, "%s incorrect ometric type", __func__);
+	if (om == NULL)
+		return;
+	if (om->type != OMT_STATESET) {
+		ometric_errx("%s incorrect ometric type", __func__);
+		return;
+	}
 
 	for (i = 0; i < om->setsize; i++) {
 		if (strcasecmp(state, om->stateset[i]) == 0)
@@ -498,6 +575,56 @@ ometric_set_state(struct ometric *om, const char *state, struct olabels *ol)
 	}
 }
 
+/*
+ * Set a histogram. counts holds the number of values per bucket (not
+ * cumulative) and bounds the upper bounds of the first n - 1 buckets,
+ * the last bucket is +Inf.
+ */
+void
+ometric_set_histogram(struct ometric *om, const double *bounds,
+    const uint64_t *counts, size_t n, double sum, struct olabels *ol)
+{
+	struct olabels *extra;
+	struct ovalue *ov;
+	char le[32];
+	uint64_t total = 0;
+	size_t i;
+
+	if (om == NULL)
+		return;
+	if (om->type != OMT_HISTOGRAM) {
+		ometric_errx("%s incorrect ometric type", __func__);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		total += counts[i];
+		if (i < n - 1)
+			snprintf(le, sizeof(le), "%g", bounds[i]);
+		else
+			strlcpy(le, "+Inf", sizeof(le));
+		extra = olabels_add_extras(ol, OKV("le"), OKV(le));
+		ov = ometric_set_int_value(om, total, extra);
+		olabels_free(extra);
+		if (ov == NULL)
+			return;
+		ov->suffix = "_bucket";
+	}
+	if ((ov = ometric_set_int_value(om, total, ol)) == NULL)
+		return;
+	ov->suffix = "_count";
+
+	if ((ov = malloc(sizeof(*ov))) == NULL) {
+		ometric_err();
+		return;
+	}
+	ov->value.f = sum;
+	ov->valtype = OVT_DOUBLE;
+	ov->labels = olabels_ref(ol);
+	ov->suffix = "_sum";
+	STAILQ_INSERT_TAIL(&om->vals, ov, entry);
+}
+
 /*
  * Set a value with an extra label, the key should be a constant string while
  * the value is copied into the extra label.
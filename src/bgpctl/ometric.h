@@ -46,6 +46,8 @@ void	ometric_set_timespec(struct ometric *, const struct timespec *,
 void	ometric_set_info(struct ometric *, const char **, const char **,
 	    struct olabels *);
 void	ometric_set_state(struct ometric *, const char *, struct olabels *);
+void	ometric_set_histogram(struct ometric *, const double *,
+	    const uint64_t *, size_t, double, struct olabels *);
 void	ometric_set_int_with_labels(struct ometric *, uint64_t, const char **,
 	    const char **, struct olabels *);
 void	ometric_set_timespec_with_labels(struct ometric *, struct timespec *,
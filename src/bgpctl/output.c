@@ -69,7 +69,8 @@ show_head(struct parse_result *res)
 			break;
 		printf("flags: "
 		    "* = Valid, > = Selected, I = via IBGP, A = Announced,\n"
-		    "       S = Stale, E = Error, F = Filtered, L = Leaked\n");
+		    "       S = Stale, E = Error, F = Filtered, L = Leaked,\n"
+		    "       D = Damped\n");
 		printf("origin validation state: "
 		    "N = not-found, V = valid, ! = invalid\n");
 		printf("aspa validation state: "
@@ -205,6 +206,17 @@ show_neighbor_capa_restart(struct capabilities *capa)
 	printf("\n");
 }
 
+static void
+show_neighbor_filter_cache(const char *name, unsigned long long hits,
+    unsigned long long misses)
+{
+	if (hits + misses == 0)
+		printf("  %-15s %10llu %10llu %10s\n", name, hits, misses, "-");
+	else
+		printf("  %-15s %10llu %10llu %9.1f%%\n", name, hits, misses,
+		    100.0 * hits / (hits + misses));
+}
+
 static void
 show_neighbor_msgstats(struct peer *p)
 {
@@ -240,6 +252,9 @@ show_neighbor_msgstats(struct peer *p)
 	    p->stats.pending_withdraw);
 	printf("  %-15s %10llu %10llu\n", "End-of-Rib",
 	    p->stats.prefix_sent_eor, p->stats.prefix_rcvd_eor);
+	printf("  %-15s %10llu\n", "Coalesced", p->stats.prefix_coalesced);
+	printf("  %-15s %7u ms (max %u ms)\n", "Time to drain",
+	    p->stats.drain_last, p->stats.drain_max);
 	printf("  Route Refresh statistics:\n");
 	printf("  %-15s %10llu %10llu\n", "Request",
 	    p->stats.refresh_sent_req, p->stats.refresh_rcvd_req);
@@ -247,6 +262,11 @@ show_neighbor_msgstats(struct peer *p)
 	    p->stats.refresh_sent_borr, p->stats.refresh_rcvd_borr);
 	printf("  %-15s %10llu %10llu\n", "End-of-RR",
 	    p->stats.refresh_sent_eorr, p->stats.refresh_rcvd_eorr);
+	printf("  Filter cache statistics:\n");
+	printf("  %-15s %-10s %-10s %-10s\n", "", "Hits", "Misses",
+	    "Hit rate");
+	show_neighbor_filter_cache("Outbound", p->stats.filter_out_hit,
+	    p->stats.filter_out_miss);
 }
 
 static void
@@ -1104,6 +1124,43 @@ show_rib_mem(struct rde_memstats *stats)
 	    stats->pset_size));
 }
 
+static const char *
+fmt_usec(uint64_t usec)
+{
+	static char	buf[16];
+
+	if (usec == UINT64_MAX)
+		return "-";
+	snprintf(buf, sizeof(buf), "%.3f", usec / 1000.0);
+	return (buf);
+}
+
+static void
+show_rib_latency(struct ctl_latency *lat)
+{
+	struct bgpd_hist	*h;
+	int			 i;
+
+	printf("Propagation latency of %llu sampled prefixes in ms, "
+	    "percentiles are bucket upper bounds\n",
+	    (unsigned long long)lat->sampled);
+	printf("%-10s %10s %10s %10s %10s %10s\n", "stage", "samples",
+	    "avg", "p50", "p90", "p99");
+	for (i = 0; i < LAT_STAGE_MAX; i++) {
+		h = &lat->stage[i];
+		printf("%-10s %10llu ", lat_stagenames[i],
+		    (unsigned long long)h->count);
+		if (h->count == 0) {
+			printf("%10s %10s %10s %10s\n", "-", "-", "-", "-");
+			continue;
+		}
+		printf("%10s ", fmt_usec(h->sum / h->count));
+		printf("%10s ", fmt_usec(hist_quantile(h, 0.5)));
+		printf("%10s ", fmt_usec(hist_quantile(h, 0.9)));
+		printf("%10s\n", fmt_usec(hist_quantile(h, 0.99)));
+	}
+}
+
 static void
 show_rib_set(struct ctl_show_set *set)
 {
@@ -1192,6 +1249,7 @@ const struct output show_output = {
 	.attr = show_attr,
 	.rib = show_rib,
 	.rib_mem = show_rib_mem,
+	.rib_latency = show_rib_latency,
 	.set = show_rib_set,
 	.rtr = show_rtr,
 	.result = show_result,
@@ -0,0 +1,72 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2025 The OpenBGPD portable contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bgpd.h"
+#include "session.h"
+
+#include "bgpctl.h"
+#include "parser.h"
+
+/*
+ * Binary bulk RIB export. The record stream sent by the RDE is written
+ * to stdout unmodified, the format is documented in bgpd.h.
+ */
+
+static void
+binary_head(struct parse_result *res)
+{
+	if (isatty(STDOUT_FILENO))
+		errx(1, "refusing to write binary output to a terminal");
+}
+
+static void
+binary_rib_bulk(struct ibuf *buf)
+{
+	if (ibuf_size(buf) == 0)
+		return;
+	if (fwrite(ibuf_data(buf), ibuf_size(buf), 1, stdout) != 1)
+		err(1, "write");
+}
+
+static void
+binary_result(u_int rescode)
+{
+	if (rescode == 0)
+		return;
+	if (rescode >= sizeof(ctl_res_strerror)/sizeof(ctl_res_strerror[0]))
+		errx(1, "unknown result error code %u", rescode);
+	errx(1, "%s", ctl_res_strerror[rescode]);
+}
+
+static void
+binary_tail(void)
+{
+	if (fflush(stdout) == EOF)
+		err(1, "write");
+}
+
+const struct output binary_output = {
+	.head = binary_head,
+	.rib_bulk = binary_rib_bulk,
+	.result = binary_result,
+	.tail = binary_tail,
+};
@@ -186,6 +186,7 @@ json_neighbor_stats(struct peer *p)
 	json_do_uint("updates", p->stats.prefix_sent_update);
 	json_do_uint("withdraws", p->stats.prefix_sent_withdraw);
 	json_do_uint("eor", p->stats.prefix_sent_eor);
+	json_do_uint("coalesced", p->stats.prefix_coalesced);
 	json_do_end();
 
 	json_do_object("received", 1);
@@ -199,6 +200,11 @@ json_neighbor_stats(struct peer *p)
 	json_do_uint("withdraws", p->stats.pending_withdraw);
 	json_do_end();
 
+	json_do_object("time_to_drain", 1);
+	json_do_uint("last_msec", p->stats.drain_last);
+	json_do_uint("max_msec", p->stats.drain_max);
+	json_do_end();
+
 	json_do_end();
 
 	json_do_object("route-refresh", 0);
@@ -217,6 +223,15 @@ json_neighbor_stats(struct peer *p)
 
 	json_do_end();
 
+	json_do_object("filter-cache", 0);
+
+	json_do_object("outbound", 1);
+	json_do_uint("hits", p->stats.filter_out_hit);
+	json_do_uint("misses", p->stats.filter_out_miss);
+	json_do_end();
+
+	json_do_end();
+
 	json_do_end();
 }
 
@@ -842,6 +857,8 @@ json_rib(struct ctl_show_rib *r, struct ibuf *asbuf, struct parse_result *res)
 	json_do_bool("valid", r->flags & F_PREF_ELIGIBLE);
 	if (r->flags & F_PREF_FILTERED)
 		json_do_bool("filtered", 1);
+	if (r->flags & F_PREF_DAMPED)
+		json_do_bool("damped", 1);
 	if (r->flags & F_PREF_BEST)
 		json_do_bool("best", 1);
 	if (r->flags & F_PREF_ECMP)
@@ -936,6 +953,36 @@ json_rib_mem(struct rde_memstats *stats)
 	json_do_end();
 }
 
+static void
+json_rib_latency(struct ctl_latency *lat)
+{
+	struct bgpd_hist	*h;
+	uint64_t		 v;
+	int			 i;
+
+	json_do_object("latency", 0);
+	json_do_uint("sampled", lat->sampled);
+	json_do_array("stages");
+	for (i = 0; i < LAT_STAGE_MAX; i++) {
+		h = &lat->stage[i];
+		json_do_object("stage", 1);
+		json_do_string("stage", lat_stagenames[i]);
+		json_do_uint("samples", h->count);
+		if (h->count != 0) {
+			json_do_uint("avg_usec", h->sum / h->count);
+			if ((v = hist_quantile(h, 0.5)) != UINT64_MAX)
+				json_do_uint("p50_usec", v);
+			if ((v = hist_quantile(h, 0.9)) != UINT64_MAX)
+				json_do_uint("p90_usec", v);
+			if ((v = hist_quantile(h, 0.99)) != UINT64_MAX)
+				json_do_uint("p99_usec", v);
+		}
+		json_do_end();
+	}
+	json_do_end();
+	json_do_end();
+}
+
 static void
 json_rib_set(struct ctl_show_set *set)
 {
@@ -1028,6 +1075,7 @@ const struct output json_output = {
 	.attr = json_attr,
 	.rib = json_rib,
 	.rib_mem = json_rib_mem,
+	.rib_latency = json_rib_latency,
 	.set = json_rib_set,
 	.rtr = json_rtr,
 	.result = json_result,
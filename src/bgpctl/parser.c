@@ -188,6 +188,7 @@ static const struct token t_show_rib[] = {
 	{ FLAG,		"filtered",	F_CTL_FILTERED,	t_show_rib},
 	{ FLAG,		"in",		F_CTL_ADJ_IN,	t_show_rib},
 	{ LRGCOMMUNITY,	"large-community", NONE,	t_show_rib},
+	{ KEYWORD,	"latency",	SHOW_RIB_LATENCY, NULL},
 	{ FLAG,		"leaked",	F_CTL_LEAKED,	t_show_rib},
 	{ KEYWORD,	"memory",	SHOW_RIB_MEM,	NULL},
 	{ KEYWORD,	"neighbor",	NONE,		t_show_rib_neigh},
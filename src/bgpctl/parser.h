@@ -35,6 +35,7 @@ enum actions {
 	SHOW_SET,
 	SHOW_RTR,
 	SHOW_RIB_MEM,
+	SHOW_RIB_LATENCY,
 	SHOW_NEXTHOP,
 	SHOW_INTERFACE,
 	SHOW_METRICS,
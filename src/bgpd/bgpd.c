@@ -17,6 +17,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
@@ -47,10 +48,15 @@ int main(int, char *[]);
 pid_t start_child(enum bgpd_process, char *, int, int, int);
 int send_filterset(struct imsgbuf *, struct filter_set_head *);
 int reconfigure(const char *, struct bgpd_config *);
+static struct bgpd_config *load_config(const char *, struct peer_head *,
+									   struct rtr_config_head *);
 int send_config(struct bgpd_config *);
+int send_set_keep(int, const char *);
 int dispatch_imsg(struct imsgbuf *, int, struct bgpd_config *);
 int control_setup(struct bgpd_config *);
 static void getsockpair(int[2]);
+static void replay_trace(struct trace *, int, struct bgpd_config *,
+						 struct imsgbuf *, struct imsgbuf *, struct imsgbuf *);
 int imsg_send_sockets(struct imsgbuf *, struct imsgbuf *,
 					  struct imsgbuf *);
 void bgpd_rtr_conn_setup(struct rtr_config *);
@@ -69,6 +75,11 @@ struct imsgbuf *ibuf_rtr;
 struct rib_names ribnames = SIMPLEQ_HEAD_INITIALIZER(ribnames);
 char *cname;
 char *rcname;
+char *mname;
+static char *metricspath;
+static char *cachefile;
+static char *tracedir;
+static uint16_t cmd_mrai;
 
 struct connect_elm
 {
@@ -110,7 +121,8 @@ usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-cdnvV] [-D macro=value] [-f file]\n",
+	fprintf(stderr, "usage: %s [-cdFLMnpQvV] [-A interval] [-D macro=value] "
+			"[-f file] [-m metrics] [-o cache] [-r trace] [-t tracedir]\n",
 			__progname);
 	exit(1);
 }
@@ -186,10 +198,11 @@ int main(int argc, char *argv[])
 	struct connect_elm *ce;
 	time_t timeout;
 	pid_t se_pid = 0, rde_pid = 0, rtr_pid = 0, pid;
-	const char *conffile;
+	const char *conffile, *replayfile = NULL, *errstr;
+	struct trace *replay = NULL;
 	char *saved_argv0;
 	u_int pfd_elms = 0, npfd, i;
-	int debug = 0;
+	int debug = 0, paced = 0;
 	int rfd, keyfd;
 	int ch, status;
 	int pipe_m2s[2];
@@ -206,10 +219,16 @@ int main(int argc, char *argv[])
 	if (saved_argv0 == NULL)
 		saved_argv0 = "bgpd";
 
-	while ((ch = getopt(argc, argv, "cdD:f:nRSTvV")) != -1)
+	while ((ch = getopt(argc, argv, "A:cdD:f:FLm:Mno:pQr:Rt:STvV")) != -1)
 	{
 		switch (ch)
 		{
+		case 'A':
+			cmd_mrai = strtonum(optarg, 0, UINT16_MAX, &errstr);
+			if (errstr)
+				errx(1, "advertisement interval is %s: %s", errstr,
+					 optarg);
+			break;
 		case 'c':
 			cmd_opts |= BGPD_OPT_FORCE_DEMOTE;
 			break;
@@ -220,13 +239,41 @@ int main(int argc, char *argv[])
 			if (cmdline_symset(optarg) < 0)
 				log_warnx("could not parse macro definition %s",
 						  optarg);
+			confcache_symset(optarg);
 			break;
 		case 'f':
 			conffile = optarg;
 			break;
+		case 'F':
+			cmd_opts |= BGPD_OPT_DAMPING;
+			break;
+		case 'L':
+			cmd_opts |= BGPD_OPT_LAT_TRACE;
+			break;
+		case 'm':
+			metricspath = optarg;
+			break;
+		case 'M':
+			cmd_opts |= BGPD_OPT_SHM;
+			break;
 		case 'n':
 			cmd_opts |= BGPD_OPT_NOACTION;
 			break;
+		case 'o':
+			cachefile = optarg;
+			break;
+		case 'p':
+			paced = 1;
+			break;
+		case 'Q':
+			cmd_opts |= BGPD_OPT_CTL_DIRECT;
+			break;
+		case 'r':
+			replayfile = optarg;
+			break;
+		case 't':
+			tracedir = optarg;
+			break;
 		case 'v':
 			if (cmd_opts & BGPD_OPT_VERBOSE)
 				cmd_opts |= BGPD_OPT_VERBOSE2;
@@ -259,6 +306,9 @@ int main(int argc, char *argv[])
 	{
 		if ((conf = parse_config(conffile, NULL, NULL)) == NULL)
 			exit(1);
+		if (cachefile != NULL &&
+			confcache_write(conf, &ribnames, conffile, cachefile) == -1)
+			exit(1);
 
 		if (cmd_opts & BGPD_OPT_VERBOSE)
 			print_config(conf, &ribnames);
@@ -274,6 +324,9 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
+	if (tracedir != NULL)
+		trace_init(tracedir, proc);
+
 	switch (proc)
 	{
 	case PROC_MAIN:
@@ -295,7 +348,7 @@ int main(int argc, char *argv[])
 	if (getpwnam(BGPD_USER) == NULL)
 		errx(1, "unknown user %s", BGPD_USER);
 
-	if ((conf = parse_config(conffile, NULL, NULL)) == NULL)
+	if ((conf = load_config(conffile, NULL, NULL)) == NULL)
 	{
 		log_warnx("config file %s has errors", conffile);
 		exit(1);
@@ -347,14 +400,30 @@ int main(int argc, char *argv[])
 		fatal(NULL);
 	imsgbuf_allow_fdpass(&ibuf_fuzz_rtr);
 
+	if (replayfile != NULL)
+	{
+		enum bgpd_process rproc;
+
+		if ((replay = trace_open(replayfile, &rproc)) == NULL)
+			exit(1);
+		/* only the parent's traces can be fed to dispatch_imsg() */
+		if (rproc != PROC_MAIN)
+		{
+			log_warnx("%s: recorded in %s, only traces of the "
+					  "parent can be replayed",
+					  replayfile, log_procnames[rproc]);
+			exit(1);
+		}
+	}
+
 	uint8_t fuzz_iter;
 	uint8_t poll_iter;
-	if (read(STDIN_FILENO, &fuzz_iter, sizeof(uint8_t)) != sizeof(uint8_t))
-		exit(1);
-	if (read(STDIN_FILENO, &poll_iter, sizeof(uint8_t)) != sizeof(uint8_t))
+	if (replay == NULL &&
+		(read(STDIN_FILENO, &fuzz_iter, sizeof(uint8_t)) != sizeof(uint8_t) ||
+		 read(STDIN_FILENO, &poll_iter, sizeof(uint8_t)) != sizeof(uint8_t)))
 		exit(1);
 
-	for (unsigned int f = 0; f < 5; f++)
+	for (unsigned int f = 0; replay == NULL && f < 5; f++)
 	{
 		printf("fuzz_iter: %u\n", f);
 		uint8_t compartment;
@@ -454,8 +523,14 @@ BROKEN	if (pledge("stdio rpath wpath cpath fattr unix route recvfd sendfd",
 		quit = 1;
 	if (pftable_clear_all() != 0)
 		quit = 1;
+	if (replay != NULL)
+	{
+		replay_trace(replay, paced, conf, &ibuf_fuzz_se,
+					 &ibuf_fuzz_rde, &ibuf_fuzz_rtr);
+		trace_close(replay);
+	}
 	// FUZZ
-	for (unsigned int f = 0; f < 5; f++)
+	for (unsigned int f = 0; replay == NULL && f < 5; f++)
 	{
 		// while (quit == 0) {
 		printf("poll_iter: %u\n", f);
@@ -682,16 +757,22 @@ BROKEN	if (pledge("stdio rpath wpath cpath fattr unix route recvfd sendfd",
 		}
 	} while (pid != -1 || (pid == -1 && errno == EINTR));
 
+	/* children are gone, let the compressors finalize the dumps */
+	mrt_compress_shutdown();
+
+	free(mname);
+	set_digest_flush();
 	free(rcname);
 	free(cname);
 
+	trace_flush();
 	log_info("terminating");
 	return (0);
 }
 
 pid_t start_child(enum bgpd_process p, char *argv0, int fd, int debug, int verbose)
 {
-	char *argv[5];
+	char *argv[7];
 	int argc = 0;
 	pid_t pid;
 
@@ -733,6 +814,11 @@ pid_t start_child(enum bgpd_process p, char *argv0, int fd, int debug, int verbo
 		argv[argc++] = "-d";
 	if (verbose)
 		argv[argc++] = "-v";
+	if (tracedir != NULL)
+	{
+		argv[argc++] = "-t";
+		argv[argc++] = tracedir;
+	}
 	argv[argc++] = NULL;
 
 	execvp(argv0, argv);
@@ -750,6 +836,28 @@ int send_filterset(struct imsgbuf *i, struct filter_set_head *set)
 	return (0);
 }
 
+/*
+ * Use the compiled config if it matches conffile, else parse conffile
+ * and refresh the compiled config for the next time.
+ */
+static struct bgpd_config *
+load_config(const char *conffile, struct peer_head *ph,
+			struct rtr_config_head *rh)
+{
+	struct bgpd_config *new_conf;
+
+	if (cachefile != NULL &&
+		(new_conf = confcache_load(conffile, cachefile, ph, rh)) != NULL)
+		return (new_conf);
+
+	if ((new_conf = parse_config(conffile, ph, rh)) == NULL)
+		return (NULL);
+
+	if (cachefile != NULL)
+		confcache_write(new_conf, &ribnames, conffile, cachefile);
+	return (new_conf);
+}
+
 int reconfigure(const char *conffile, struct bgpd_config *conf)
 {
 	struct bgpd_config *new_conf;
@@ -758,8 +866,8 @@ int reconfigure(const char *conffile, struct bgpd_config *conf)
 		return (2);
 
 	log_info("rereading config");
-	if ((new_conf = parse_config(conffile, &conf->peers,
-								 &conf->rtrs)) == NULL)
+	if ((new_conf = load_config(conffile, &conf->peers,
+								&conf->rtrs)) == NULL)
 		return (1);
 
 	merge_config(conf, new_conf);
@@ -773,6 +881,17 @@ int reconfigure(const char *conffile, struct bgpd_config *conf)
 	return send_config(conf);
 }
 
+int send_set_keep(int type, const char *name)
+{
+	struct set_keep keep;
+
+	memset(&keep, 0, sizeof(keep));
+	keep.type = type;
+	strlcpy(keep.name, name, sizeof(keep.name));
+	return (imsg_compose(ibuf_rde, IMSG_RECONF_SET_KEEP, 0, 0, -1,
+						 &keep, sizeof(keep)));
+}
+
 int send_config(struct bgpd_config *conf)
 {
 	struct peer *p;
@@ -794,6 +913,18 @@ int send_config(struct bgpd_config *conf)
 	SIMPLEQ_FOREACH(vpn, &conf->l3vpns, entry)
 	expand_networks(conf, &vpn->net_l);
 
+	/* let the RDE answer rib dumps directly on the control connection */
+	if (cmd_opts & BGPD_OPT_CTL_DIRECT)
+		conf->flags |= BGPD_FLAG_CTL_DIRECT;
+	/* sample prefixes for propagation latency tracing */
+	if (cmd_opts & BGPD_OPT_LAT_TRACE)
+		conf->flags |= BGPD_FLAG_LAT_TRACE;
+	/* damp flapping routes received from peers */
+	if (cmd_opts & BGPD_OPT_DAMPING)
+		conf->flags |= BGPD_FLAG_DAMPING;
+	/* default minimum route advertisement interval of all peers */
+	conf->mrai = cmd_mrai;
+
 	cflags = conf->flags;
 
 	/* start reconfiguration */
@@ -879,20 +1010,42 @@ int send_config(struct bgpd_config *conf)
 		}
 	}
 
-	/* prefixsets for filters in the RDE */
+	/*
+	 * prefixsets for filters in the RDE, unchanged sets are only
+	 * named and the items are sent in batches
+	 */
 	while ((ps = SIMPLEQ_FIRST(&conf->prefixsets)) != NULL)
 	{
+		struct filter_prefix fp[(MAX_IMSGSIZE - IMSG_HEADER_SIZE) /
+								sizeof(struct filter_prefix)];
+		size_t n = 0;
+
 		SIMPLEQ_REMOVE_HEAD(&conf->prefixsets, entry);
+		if (set_digest_keep(PREFIX_SET, ps->name, ps, NULL))
+		{
+			if (send_set_keep(PREFIX_SET, ps->name) == -1)
+				return (-1);
+			free_prefixtree(&ps->psitems);
+			free(ps);
+			continue;
+		}
 		if (imsg_compose(ibuf_rde, IMSG_RECONF_PREFIX_SET, 0, 0, -1,
 						 ps->name, sizeof(ps->name)) == -1)
 			return (-1);
 		RB_FOREACH_SAFE(psi, prefixset_tree, &ps->psitems, npsi)
 		{
 			RB_REMOVE(prefixset_tree, &ps->psitems, psi);
-			if (imsg_compose(ibuf_rde, IMSG_RECONF_PREFIX_SET_ITEM,
-							 0, 0, -1, psi, sizeof(*psi)) == -1)
-				return (-1);
+			fp[n++] = psi->p;
 			free(psi);
+			if (n == sizeof(fp) / sizeof(fp[0]) ||
+				RB_EMPTY(&ps->psitems))
+			{
+				if (imsg_compose(ibuf_rde,
+								 IMSG_RECONF_PREFIX_SET_ITEMS, 0, 0, -1,
+								 fp, n * sizeof(*fp)) == -1)
+					return (-1);
+				n = 0;
+			}
 		}
 		free(ps);
 	}
@@ -901,6 +1054,14 @@ int send_config(struct bgpd_config *conf)
 	while ((ps = SIMPLEQ_FIRST(&conf->originsets)) != NULL)
 	{
 		SIMPLEQ_REMOVE_HEAD(&conf->originsets, entry);
+		if (set_digest_keep(ORIGIN_SET, ps->name, ps, NULL))
+		{
+			if (send_set_keep(ORIGIN_SET, ps->name) == -1)
+				return (-1);
+			free_roatree(&ps->roaitems);
+			free(ps);
+			continue;
+		}
 		if (imsg_compose(ibuf_rde, IMSG_RECONF_ORIGIN_SET, 0, 0, -1,
 						 ps->name, sizeof(ps->name)) == -1)
 			return (-1);
@@ -955,6 +1116,15 @@ int send_config(struct bgpd_config *conf)
 
 		SIMPLEQ_REMOVE_HEAD(&conf->as_sets, entry);
 
+		if (set_digest_keep(ASNUM_SET, aset->name, NULL, aset))
+		{
+			if (send_set_keep(ASNUM_SET, aset->name) == -1)
+				return -1;
+			set_free(aset->set);
+			free(aset);
+			continue;
+		}
+
 		as = set_get(aset->set, &n);
 		if ((wbuf = imsg_create(ibuf_rde, IMSG_RECONF_AS_SET, 0, 0,
 								sizeof(n) + sizeof(aset->name))) == NULL)
@@ -979,6 +1149,7 @@ int send_config(struct bgpd_config *conf)
 		set_free(aset->set);
 		free(aset);
 	}
+	set_digest_expire();
 
 	/* filters for the RDE */
 	while ((r = TAILQ_FIRST(conf->filters)) != NULL)
@@ -1068,6 +1239,9 @@ int dispatch_imsg(struct imsgbuf *imsgbuf, int idx, struct bgpd_config *conf)
 
 		if (n == 0)
 			break;
+		trace_imsg(idx == PFD_PIPE_SESSION ? PROC_SE :
+				   idx == PFD_PIPE_RDE ? PROC_RDE : PROC_RTR,
+				   &imsg);
 
 		switch (imsg_get_type(&imsg))
 		{
@@ -1379,6 +1553,13 @@ int dispatch_imsg(struct imsgbuf *imsgbuf, int idx, struct bgpd_config *conf)
 				}
 			}
 			break;
+		case IMSG_RDE_SNAPSHOT:
+			printf("Received IMSG_RDE_SNAPSHOT\n");
+			if (idx != PFD_PIPE_RDE)
+				log_warnx("snapshot ack not from RDE");
+			else
+				log_debug("RDE snapshot ready");
+			break;
 		case IMSG_CTL_END:
 		case IMSG_CTL_SHOW_TIMER:
 			printf("Received IMSG_CTL_END/CTL_SHOW_TIMER\n");
@@ -1517,6 +1698,21 @@ int control_setup(struct bgpd_config *conf)
 						 &restricted, sizeof(restricted)) == -1)
 			return (-1);
 	}
+	/* metrics socket comes from the command line and never changes */
+	if (metricspath && !mname)
+	{
+		if ((mname = strdup(metricspath)) == NULL)
+			fatal("strdup");
+		if (control_check(mname) == -1)
+			return (-1);
+		if ((fd = control_init(1, mname)) == -1)
+			fatalx("metrics socket setup failed");
+		if (control_listen(fd) == -1)
+			fatalx("metrics socket setup failed");
+		if (imsg_compose(ibuf_se, IMSG_RECONF_METRICS, 0, 0, fd,
+						 NULL, 0) == -1)
+			return (-1);
+	}
 	return (0);
 }
 
@@ -1529,10 +1725,58 @@ void set_pollfd(struct pollfd *pfd, struct imsgbuf *i)
 	}
 	pfd->fd = i->fd;
 	pfd->events = POLLIN;
+#ifdef IMSGBUF_SHM
+	if (imsgbuf_queuelen(i) > 0 && !imsgbuf_write_blocked(i))
+#else
 	if (imsgbuf_queuelen(i) > 0)
+#endif
 		pfd->events |= POLLOUT;
 }
 
+/*
+ * Map the shared memory region fd received with IMSG_SOCKET_SHM and move
+ * the data path of the SE - RDE imsgbuf i into it. The SE uses side 0,
+ * the RDE side 1. Must happen before anything is sent over i.
+ */
+void imsgbuf_attach_shm(struct imsgbuf *i, int fd, int side)
+{
+#ifdef IMSGBUF_SHM
+	void *base;
+
+	base = mmap(NULL, IMSG_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+	if (base == MAP_FAILED)
+		fatal("%s: mmap", __func__);
+	close(fd);
+	if (imsgbuf_set_shm(i, base, IMSG_SHM_SIZE, side) == -1)
+		fatal("%s", __func__);
+#else
+	fatalx("%s: shared memory transport not supported", __func__);
+#endif
+}
+
+static int
+shm_create(void)
+{
+	int fd;
+#ifdef HAVE_MEMFD_CREATE
+	if ((fd = memfd_create("bgpd-imsg", MFD_CLOEXEC)) == -1)
+		return (-1);
+#else
+	char path[] = "/tmp/bgpd-imsg.XXXXXXXXXX";
+
+	if ((fd = mkstemp(path)) == -1)
+		return (-1);
+	unlink(path);
+#endif
+	if (ftruncate(fd, IMSG_SHM_SIZE) == -1)
+	{
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
 int handle_pollfd(struct pollfd *pfd, struct imsgbuf *i)
 {
 	ssize_t n;
@@ -1614,6 +1858,21 @@ int imsg_send_sockets(struct imsgbuf *se, struct imsgbuf *rde, struct imsgbuf *r
 	getsockpair(pipe_s2r_ctl);
 	getsockpair(pipe_r2r);
 
+	/* the shared memory region needs to be there before the socket */
+	if (cmd_opts & BGPD_OPT_SHM)
+	{
+		int shmfd, shmfd2;
+
+		if ((shmfd = shm_create()) == -1 || (shmfd2 = dup(shmfd)) == -1)
+			fatal("imsg shared memory");
+		if (imsg_compose(se, IMSG_SOCKET_SHM, 0, 0, shmfd,
+						 NULL, 0) == -1)
+			return (-1);
+		if (imsg_compose(rde, IMSG_SOCKET_SHM, 0, 0, shmfd2,
+						 NULL, 0) == -1)
+			return (-1);
+	}
+
 	if (imsg_compose(se, IMSG_SOCKET_CONN, 0, 0, pipe_s2r[0],
 					 NULL, 0) == -1)
 		return (-1);
@@ -1804,3 +2063,121 @@ void bgpd_rtr_conn_teardown(uint32_t id)
 		}
 	}
 }
+
+/*
+ * Discard everything the parent sent towards a replayed peer process so
+ * that neither side of the socketpair fills up during a replay.
+ */
+static void
+replay_drain(struct imsgbuf *out, struct imsgbuf *in)
+{
+	struct pollfd pfd;
+	struct imsg imsg;
+
+	if (out == NULL)
+		return;
+	if (imsgbuf_queuelen(out) > 0 && imsgbuf_write(out) == -1)
+		fatal("replay write");
+
+	pfd.fd = in->fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN) &&
+		   imsgbuf_read(in) == 1)
+		;
+	while (imsg_get(in, &imsg) > 0)
+		imsg_free(&imsg);
+}
+
+/*
+ * Feed a recorded imsg trace into dispatch_imsg() one message at a time,
+ * either as fast as possible or at the pace it was recorded, and print
+ * the per imsg type service time histograms at the end.
+ */
+static void
+replay_trace(struct trace *t, int paced, struct bgpd_config *conf,
+			 struct imsgbuf *to_se, struct imsgbuf *to_rde, struct imsgbuf *to_rtr)
+{
+	static char buf[MAX_BGPD_IMSGSIZE];
+	struct trace_rec tr;
+	struct imsgbuf *to, *from;
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64_t first = 0, start = 0, now, due, t0;
+	u_int cnt = 0, skipped = 0;
+	int idx, rv;
+
+	while ((rv = trace_read(t, &tr, buf, sizeof(buf))) == 1)
+	{
+		switch (tr.proc)
+		{
+		case PROC_SE:
+			to = to_se;
+			from = ibuf_se;
+			idx = PFD_PIPE_SESSION;
+			break;
+		case PROC_RDE:
+			to = to_rde;
+			from = ibuf_rde;
+			idx = PFD_PIPE_RDE;
+			break;
+		case PROC_RTR:
+			to = to_rtr;
+			from = ibuf_rtr;
+			idx = PFD_PIPE_RTR;
+			break;
+		default:
+			skipped++;
+			continue;
+		}
+		if (from == NULL || tr.type >= IMSG_TYPE_COUNT)
+		{
+			skipped++;
+			continue;
+		}
+
+		if (paced)
+		{
+			now = trace_now();
+			if (cnt == 0)
+			{
+				first = tr.ts;
+				start = now;
+			}
+			due = start + (tr.ts > first ? tr.ts - first : 0);
+			if (due > now)
+			{
+				ts.tv_sec = (due - now) / 1000000000;
+				ts.tv_nsec = (due - now) % 1000000000;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		if (imsg_compose(to, tr.type, tr.peerid, tr.pid, -1, buf,
+						 tr.len) == -1 ||
+			imsgbuf_flush(to) == -1)
+			fatal("replay compose");
+
+		/* pull the complete message into the parent's read buffer */
+		pfd.fd = from->fd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN) &&
+			   imsgbuf_read(from) == 1)
+			;
+
+		t0 = trace_now();
+		if (dispatch_imsg(from, idx, conf) == -1)
+			log_warnx("replay: dispatch of imsg type %u failed",
+					  tr.type);
+		trace_hist_add(tr.type, trace_now() - t0);
+		cnt++;
+
+		replay_drain(ibuf_se, to_se);
+		replay_drain(ibuf_rde, to_rde);
+		replay_drain(ibuf_rtr, to_rtr);
+	}
+	if (rv == -1)
+		log_warnx("replay: trace is corrupt, stopped early");
+
+	printf("replayed %u imsgs, skipped %u\n", cnt, skipped);
+	trace_hist_print();
+}
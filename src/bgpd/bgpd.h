@@ -49,6 +49,7 @@
 #define	MAX_EXT_PKTSIZE			65535
 #define	MAX_BGPD_IMSGSIZE		(128 * 1024)
 #define	MAX_SOCK_BUF			(4 * IBUF_READ_SIZE)
+#define	IMSG_SHM_SIZE			(8 * 1024 * 1024)
 #define	RT_BUF_SIZE			16384
 #define	MAX_RTSOCK_BUF			(2 * 1024 * 1024)
 #define	MAX_COMM_MATCH			3
@@ -59,6 +60,10 @@
 #define	BGPD_OPT_VERBOSE2		0x0002
 #define	BGPD_OPT_NOACTION		0x0004
 #define	BGPD_OPT_FORCE_DEMOTE		0x0008
+#define	BGPD_OPT_SHM			0x0010
+#define	BGPD_OPT_CTL_DIRECT		0x0020
+#define	BGPD_OPT_LAT_TRACE		0x0040
+#define	BGPD_OPT_DAMPING		0x0080
 
 #define	BGPD_FLAG_REFLECTOR		0x0004
 #define	BGPD_FLAG_NEXTHOP_BGP		0x0010
@@ -69,6 +74,9 @@
 #define	BGPD_FLAG_DECISION_MED_ALWAYS	0x0400
 #define	BGPD_FLAG_DECISION_ALL_PATHS	0x0800
 #define	BGPD_FLAG_PERMIT_AS_SET		0x1000
+#define	BGPD_FLAG_CTL_DIRECT		0x2000
+#define	BGPD_FLAG_LAT_TRACE		0x4000
+#define	BGPD_FLAG_DAMPING		0x8000
 
 #define	BGPD_LOG_UPDATES		0x0001
 
@@ -112,6 +120,7 @@
 #define	F_CTL_AVS_INVALID	0x2000000
 #define	F_CTL_AVS_UNKNOWN	0x4000000
 #define	F_CTL_FILTERED		0x8000000	/* only set on requests */
+#define	F_CTL_BINARY		0x10000000	/* only set on requests */
 #define	F_CTL_SSV		0x80000000	/* only used by bgpctl */
 
 #define CTASSERT(x)	extern char  _ctassert[(x) ? 1 : -1 ] \
@@ -293,6 +302,7 @@ struct rde_prefixset {
 	SIMPLEQ_ENTRY(rde_prefixset)	entry;
 	monotime_t			lastchange;
 	int				dirty;
+	int				kept;
 };
 SIMPLEQ_HEAD(rde_prefixset_head, rde_prefixset);
 
@@ -353,6 +363,7 @@ struct bgpd_config {
 	uint16_t				 min_holdtime;
 	uint16_t				 connectretry;
 	uint16_t				 staletime;
+	uint16_t				 mrai;
 	uint8_t					 fib_priority;
 	uint8_t					 filtered_in_locrib;
 };
@@ -518,6 +529,7 @@ struct peer_config {
 	uint16_t		 min_holdtime;
 	uint16_t		 connectretry;
 	uint16_t		 staletime;
+	uint16_t		 mrai;		/* 0 = use global */
 	uint16_t		 local_short_as;
 	uint16_t		 remote_port;
 	uint8_t			 template;
@@ -549,10 +561,15 @@ struct rde_peer_stats {
 	uint64_t			 prefix_sent_update;
 	uint64_t			 prefix_sent_withdraw;
 	uint64_t			 prefix_sent_eor;
+	uint64_t			 filter_out_hit;
+	uint64_t			 filter_out_miss;
+	uint64_t			 prefix_coalesced;
 	uint32_t			 prefix_cnt;
 	uint32_t			 prefix_out_cnt;
 	uint32_t			 pending_update;
 	uint32_t			 pending_withdraw;
+	uint32_t			 drain_last;	/* msec */
+	uint32_t			 drain_max;	/* msec */
 };
 
 enum network_type {
@@ -746,6 +763,17 @@ enum imsg_type {
 	IMSG_DEMOTE,
 	IMSG_XON,
 	IMSG_XOFF,
+	IMSG_RDE_SNAPSHOT,
+	IMSG_RDE_RESTORE,
+	IMSG_SOCKET_SHM,
+	IMSG_UPDATE_BATCH,
+	IMSG_CTL_SHOW_RIB_BULK,
+	IMSG_CTL_SHOW_METRICS,
+	IMSG_RECONF_METRICS,
+	IMSG_UPDATE_TRACE,
+	IMSG_CTL_SHOW_RIB_LATENCY,
+	IMSG_RECONF_PREFIX_SET_ITEMS,
+	IMSG_RECONF_SET_KEEP,
 	//FUZZ
 	IMSG_TYPE_COUNT
 };
@@ -825,10 +853,18 @@ RB_HEAD(kroute6_tree, kroute6);
 RB_HEAD(knexthop_tree, knexthop);
 RB_HEAD(kredist_tree, kredist_node);
 
+struct ktrie_node;
+struct ktrie_head {
+	struct ktrie_node	*root;
+	uint8_t			 alen;
+};
+
 struct ktable {
 	char			 descr[PEER_DESCR_LEN];
 	struct kroute_tree	 krt;
 	struct kroute6_tree	 krt6;
+	struct ktrie_head	 krt_lpm;   /* longest prefix match on krt */
+	struct ktrie_head	 krt6_lpm;  /* longest prefix match on krt6 */
 	struct knexthop_tree	 knt;
 	struct kredist_tree	 kredist;
 	struct network_head	 krn;
@@ -941,6 +977,7 @@ struct ctl_neighbor {
 #define	F_PREF_ECMP	0x100
 #define	F_PREF_AS_WIDE	0x200
 #define	F_PREF_FILTERED	0x400
+#define	F_PREF_DAMPED	0x800
 
 struct ctl_show_rib {
 	struct bgpd_addr	true_nexthop;
@@ -1050,6 +1087,35 @@ struct ctl_show_rib_request {
 	uint8_t			aid;
 };
 
+/*
+ * Binary bulk RIB export, sent in IMSG_CTL_SHOW_RIB_BULK chunks when
+ * F_CTL_BINARY is set on a show rib request. The chunks form a stream of
+ * records, a record is never split over two chunks. Each record starts
+ * with a n8 type and a n32 payload length. Peers, path attributes and
+ * communities are sent once in a definition record and are afterwards
+ * referenced by their id, id 0 means none. An addr is a n8 aid followed
+ * by a n64 rd for VPN aids and by the 4 or 16 byte address for IPv4 and
+ * IPv6 based aids. All values are in network byte order.
+ */
+#define	BULK_MAGIC		0x62677262	/* "bgrb" */
+#define	BULK_VERSION		1
+
+enum bulk_rec_type {
+	BULK_REC_HEADER = 1,	/* n32 magic, n16 version */
+	BULK_REC_PEER,		/* n32 id, n32 remote as, addr, n32 bgp id,
+				   n8 descr len, descr */
+	BULK_REC_PATH,		/* n32 id, n8 origin, n32 med, n32 lpref,
+				   n32 weight, n16 aspath len, aspath,
+				   other attributes in UPDATE encoding */
+	BULK_REC_COMMUNITIES,	/* n32 id, n8 type, n32 data1, n32 data2,
+				   n32 data3 per community */
+	BULK_REC_PREFIX,	/* addr, n8 prefixlen, n32 add-path id,
+				   n32 peer id, n32 path id, n32 communities id,
+				   nexthop addr, n32 F_PREF flags, n8 roa state,
+				   n8 aspa state, n8 dmetric, n64 lastchange
+				   as unix time */
+};
+
 struct ctl_kroute_req {
 	int			flags;
 	sa_family_t		af;
@@ -1346,8 +1412,17 @@ struct as_set {
 	struct set_table		*set;
 	monotime_t			 lastchange;
 	int				 dirty;
+	int				 kept;
 };
 
+/* set unchanged since the last reload, the RDE reuses its old copy */
+struct set_keep {
+	char				 name[SET_NAME_LEN];
+	uint8_t				 type;
+};
+
+RB_HEAD(set_index, set_idx);
+
 struct aspa_set {
 	time_t				 expires;
 	uint32_t			 as;
@@ -1420,6 +1495,62 @@ struct rde_memstats {
 	long long	pset_size;
 };
 
+/*
+ * Histogram with power of two buckets. Bucket i counts the values up to
+ * 2^i, the last bucket everything above. Latencies are in microseconds.
+ */
+#define	HIST_BUCKETS	24
+
+struct bgpd_hist {
+	uint64_t	bucket[HIST_BUCKETS];
+	uint64_t	count;
+	uint64_t	sum;
+};
+
+static inline void
+hist_add(struct bgpd_hist *h, uint64_t val)
+{
+	unsigned int	i = 0;
+
+	while (i < HIST_BUCKETS - 1 && val > (1ULL << i))
+		i++;
+	h->bucket[i]++;
+	h->count++;
+	h->sum += val;
+}
+
+/*
+ * Stages of a sampled prefix on its way from the socket of the sending
+ * peer to the sockets of the peers it is announced to.
+ */
+enum lat_stage {
+	LAT_TRANSIT,		/* SE receive to RDE dispatch */
+	LAT_DECISION,		/* decision process and Adj-RIB-Out update */
+	LAT_QUEUE,		/* Adj-RIB-Out queue until written to UPDATE */
+	LAT_WRITE,		/* RDE UPDATE until written to the socket */
+	LAT_TOTAL,		/* SE receive until written to the socket */
+	LAT_STAGE_MAX
+};
+
+struct ctl_latency {
+	struct bgpd_hist	stage[LAT_STAGE_MAX];
+	uint64_t		sampled;
+};
+
+/* sent along with an UPDATE carrying a sampled prefix */
+struct lat_stamp {
+	monotime_t		received;
+	monotime_t		dumped;
+};
+
+struct ctl_metrics {
+	struct bgpd_hist	rde_loop;	/* RDE main loop work time */
+	struct bgpd_hist	update_rde;	/* SE receive to RDE decision */
+	struct bgpd_hist	update_adjout;	/* Adj-RIB-Out queue time */
+	struct ctl_latency	latency;
+	struct rde_memstats	mem;
+};
+
 #define	MRT_FILE_LEN	512
 #define	MRT2MC(x)	((struct mrt_config *)(x))
 
@@ -1445,6 +1576,7 @@ struct mrt {
 	char			rib[PEER_DESCR_LEN];
 	LIST_ENTRY(mrt)		entry;
 	struct msgbuf		*wbuf;
+	struct mrt_writer	*writer;	/* SE dumps only */
 	uint32_t		peer_id;
 	uint32_t		group_id;
 	int			fd;
@@ -1472,6 +1604,7 @@ int		 bgpd_oknexthop(struct kroute_full *);
 int		 bgpd_has_bgpnh(void);
 void		 set_pollfd(struct pollfd *, struct imsgbuf *);
 int		 handle_pollfd(struct pollfd *, struct imsgbuf *);
+void		 imsgbuf_attach_shm(struct imsgbuf *, int, int);
 
 /* control.c */
 int	control_imsg_relay(struct imsg *, struct peer *);
@@ -1495,11 +1628,22 @@ void		filterlist_free(struct filter_head *);
 int		host(const char *, struct bgpd_addr *, uint8_t *);
 uint32_t	get_bgpid(void);
 void		expand_networks(struct bgpd_config *, struct network_head *);
+int		set_digest_keep(int, const char *, struct prefixset *,
+		    struct as_set *);
+void		set_digest_expire(void);
+void		set_digest_flush(void);
 RB_PROTOTYPE(prefixset_tree, prefixset_item, entry, prefixset_cmp);
 RB_PROTOTYPE(roa_tree, roa, entry, roa_cmp);
 RB_PROTOTYPE(aspa_tree, aspa_set, entry, aspa_cmp);
 RB_PROTOTYPE(flowspec_tree, flowspec_config, entry, flowspec_config_cmp);
 
+/* confcache.c */
+int		 confcache_write(struct bgpd_config *, struct rib_names *,
+		    const char *, const char *);
+struct bgpd_config *confcache_load(const char *, const char *,
+		    struct peer_head *, struct rtr_config_head *);
+void		 confcache_symset(const char *);
+
 /* kroute.c */
 int		 kr_init(int *, uint8_t);
 int		 kr_default_prio(void);
@@ -1527,6 +1671,13 @@ int		 kr_reload(void);
 int		 get_mpe_config(const char *, u_int *, u_int *);
 uint8_t		 mask2prefixlen(sa_family_t, struct sockaddr *);
 
+/* kroute_trie.c */
+void		 ktrie_init(struct ktrie_head *, uint8_t);
+int		 ktrie_add(struct ktrie_head *, const void *, uint8_t);
+void		 ktrie_del(struct ktrie_head *, const void *, uint8_t);
+int		 ktrie_match(struct ktrie_head *, const void *, uint8_t *);
+void		 ktrie_free(struct ktrie_head *);
+
 /* log.c */
 void		 log_peer_info(const struct peer_config *, const char *, ...)
 			__attribute__((__format__ (printf, 2, 3)));
@@ -1545,6 +1696,10 @@ void		 mrt_handler(struct mrt_head *);
 struct mrt	*mrt_get(struct mrt_head *, struct mrt *);
 void		 mrt_mergeconfig(struct mrt_head *, struct mrt_head *);
 
+/* mrt_compress.c */
+int		 mrt_compress_open(const char *, int);
+void		 mrt_compress_shutdown(void);
+
 /* name2id.c */
 uint16_t	 rtlabel_name2id(const char *);
 const char	*rtlabel_id2name(uint16_t);
@@ -1581,7 +1736,7 @@ struct as_set	*as_sets_lookup(struct as_set_head *, const char *);
 struct as_set	*as_sets_new(struct as_set_head *, const char *, size_t,
 		    size_t);
 void		 as_sets_free(struct as_set_head *);
-void		 as_sets_mark_dirty(struct as_set_head *, struct as_set_head *);
+void		 as_sets_mark_dirty(struct set_index *, struct as_set_head *);
 int		 as_set_match(const struct as_set *, uint32_t);
 
 struct set_table	*set_new(size_t, size_t);
@@ -1589,6 +1744,10 @@ void			 set_free(struct set_table *);
 int			 set_add(struct set_table *, void *, size_t);
 void			*set_get(struct set_table *, size_t *);
 void			 set_prep(struct set_table *);
+void			 set_index_add(struct set_index *, int, const char *,
+			    void *);
+void			*set_index_get(struct set_index *, int, const char *);
+void			 set_index_free(struct set_index *);
 void			*set_match(const struct set_table *, uint32_t);
 int			 set_equal(const struct set_table *,
 			    const struct set_table *);
@@ -1605,6 +1764,27 @@ int	trie_roa_check(struct trie_head *, struct bgpd_addr *, uint8_t,
 void	trie_dump(struct trie_head *);
 int	trie_equal(struct trie_head *, struct trie_head *);
 
+/* trace.c */
+struct trace;
+struct trace_rec {
+	uint64_t	ts;
+	uint32_t	type;
+	uint32_t	peerid;
+	uint32_t	pid;
+	uint32_t	len;
+	uint8_t		proc;
+};
+
+uint64_t	 trace_now(void);
+void		 trace_init(const char *, enum bgpd_process);
+void		 trace_imsg(enum bgpd_process, struct imsg *);
+void		 trace_flush(void);
+struct trace	*trace_open(const char *, enum bgpd_process *);
+int		 trace_read(struct trace *, struct trace_rec *, void *, size_t);
+void		 trace_close(struct trace *);
+void		 trace_hist_add(uint32_t, uint64_t);
+void		 trace_hist_print(void);
+
 /* util.c */
 const char	*log_addr(const struct bgpd_addr *);
 const char	*log_evpnaddr(const struct bgpd_addr *, struct sockaddr *,
@@ -1815,4 +1995,12 @@ static const char * const timernames[] = {
 	""
 };
 
+static const char * const lat_stagenames[] = {
+	"transit",
+	"decision",
+	"queue",
+	"write",
+	"total"
+};
+
 #endif /* __BGPD_H__ */
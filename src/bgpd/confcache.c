@@ -0,0 +1,1257 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2025 The OpenBGPD portable contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bgpd.h"
+#include "session.h"
+#include "log.h"
+#include "version.h"
+
+/*
+ * Compiled config cache.
+ *
+ * The parsed config is written as a sequence of records right after a
+ * header holding a hash of the config source, a layout fingerprint of
+ * the structs involved, the defaults the parser takes from the host and
+ * a checksum of all records. Records carry the
+ * plain structs with all pointers and list entries cleared, so loading
+ * is a single pass over the mmap(2)ed file without any parsing.
+ *
+ * Peer, group and rtr ids are renumbered on load the same way the parser
+ * does it, so a cache written by "bgpd -n -o" can be used by a running
+ * bgpd. Things the parser asks the kernel for (rtlabels, pf tables and
+ * mpe(4) interfaces) are redone as well. The router-id, fib priority
+ * and routing table defaults can't be told apart from explicit settings
+ * once parsed, so the cache is stale once they change on the host.
+ */
+
+#define CC_MAGIC	"BGPDCONF"
+#define CC_VERSION	2
+#define CC_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+#define CC_MAXDEPTH	8
+
+enum cc_type {
+	CC_CONF = 1,
+	CC_CSOCK,
+	CC_RCSOCK,
+	CC_RIB,
+	CC_PEER,
+	CC_LISTEN,
+	CC_MRT,
+	CC_NETWORK,
+	CC_VPN,
+	CC_VPN_IMPORT,
+	CC_VPN_EXPORT,
+	CC_VPN_NETWORK,
+	CC_FLOWSPEC,
+	CC_FILTER,
+	CC_SET,
+	CC_PREFIXSET,
+	CC_ORIGINSET,
+	CC_PREFIXSET_ITEMS,
+	CC_ROA_ITEMS,
+	CC_ROA,
+	CC_ASPA,
+	CC_ASSET,
+	CC_ASSET_ITEMS,
+	CC_RTR,
+	CC_END,
+};
+
+struct cc_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	pad;
+	uint64_t	layout;
+	uint64_t	srchash;
+	uint64_t	bodylen;
+	uint64_t	bodysum;
+	uint32_t	bgpid;
+	u_int		tableid;
+	int		fib_prio;
+	uint32_t	pad2;
+};
+
+struct cc_rec {
+	uint32_t	type;
+	uint32_t	len;
+};
+
+struct cc_conf {
+	int		flags;
+	int		log;
+	u_int		default_tableid;
+	uint32_t	bgpid;
+	uint32_t	clusterid;
+	uint32_t	as;
+	uint16_t	short_as;
+	uint16_t	holdtime;
+	uint16_t	min_holdtime;
+	uint16_t	connectretry;
+	uint16_t	staletime;
+	uint16_t	mrai;
+	uint8_t		fib_priority;
+	uint8_t		filtered_in_locrib;
+};
+
+struct cc_peer {
+	struct peer_config	conf;
+	struct auth_config	auth;
+};
+
+struct cc_network {
+	struct network_config	net;
+	char			rtlabel[ROUTELABEL_LEN];
+};
+
+struct cc_set {
+	char			name[SET_NAME_LEN];
+	int			sflags;
+};
+
+struct cc_aspa {
+	time_t			expires;
+	uint32_t		as;
+	uint32_t		num;
+};
+
+struct cc_writer {
+	FILE		*f;
+	uint64_t	 sum;
+	uint64_t	 len;
+};
+
+struct cc_id {
+	uint32_t	 old;
+	uint32_t	 new;
+};
+
+static uint64_t	cc_symhash;
+
+static uint64_t
+cc_hash(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t	*p = data;
+	uint64_t	 w;
+
+	for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+	}
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, p, len);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+	}
+	return h;
+}
+
+#define CC_OFF(t, m)	offsetof(struct t, m)
+
+/*
+ * Most records are the structs themselves, so the cache is only valid
+ * for the bgpd version and struct layout that wrote it. Sizes alone miss
+ * members being moved around.
+ */
+static uint64_t
+cc_layout(void)
+{
+	size_t	layout[] = {
+		sizeof(struct cc_conf), sizeof(struct cc_peer),
+		sizeof(struct listen_addr), sizeof(struct mrt_config),
+		sizeof(struct cc_network), sizeof(struct l3vpn),
+		sizeof(struct filter_rule), sizeof(struct filter_set),
+		sizeof(struct filter_prefix), sizeof(struct roa),
+		sizeof(struct rde_rib), sizeof(struct rtr_config),
+		sizeof(struct cc_aspa), sizeof(time_t),
+		sizeof(struct bgpd_addr), sizeof(struct capabilities),
+		sizeof(struct filter_match), sizeof(struct flowspec),
+
+		CC_OFF(peer_config, local_addr_v4),
+		CC_OFF(peer_config, local_addr_v6),
+		CC_OFF(peer_config, capabilities),
+		CC_OFF(peer_config, eval), CC_OFF(peer_config, group),
+		CC_OFF(peer_config, descr), CC_OFF(peer_config, reason),
+		CC_OFF(peer_config, rib), CC_OFF(peer_config, if_depend),
+		CC_OFF(peer_config, demote_group), CC_OFF(peer_config, id),
+		CC_OFF(peer_config, groupid), CC_OFF(peer_config, remote_as),
+		CC_OFF(peer_config, local_as), CC_OFF(peer_config, max_prefix),
+		CC_OFF(peer_config, max_out_prefix),
+		CC_OFF(peer_config, export_type),
+		CC_OFF(peer_config, enforce_as),
+		CC_OFF(peer_config, enforce_local_as),
+		CC_OFF(peer_config, role),
+		CC_OFF(peer_config, max_prefix_restart),
+		CC_OFF(peer_config, max_out_prefix_restart),
+		CC_OFF(peer_config, holdtime),
+		CC_OFF(peer_config, min_holdtime),
+		CC_OFF(peer_config, connectretry),
+		CC_OFF(peer_config, staletime), CC_OFF(peer_config, mrai),
+		CC_OFF(peer_config, local_short_as),
+		CC_OFF(peer_config, remote_port),
+		CC_OFF(peer_config, template),
+		CC_OFF(peer_config, remote_masklen),
+		CC_OFF(peer_config, ebgp), CC_OFF(peer_config, distance),
+		CC_OFF(peer_config, passive), CC_OFF(peer_config, down),
+		CC_OFF(peer_config, reflector_client),
+		CC_OFF(peer_config, ttlsec), CC_OFF(peer_config, flags),
+		CC_OFF(capabilities, mp), CC_OFF(capabilities, add_path),
+		CC_OFF(capabilities, ext_nh), CC_OFF(capabilities, refresh),
+		CC_OFF(capabilities, ext_msg),
+		CC_OFF(auth_config, spi_in), CC_OFF(auth_config, method),
+		CC_OFF(auth_config, md5key_len),
+		CC_OFF(auth_config, enc_keylen_out),
+		CC_OFF(listen_addr, sa), CC_OFF(listen_addr, fd),
+		CC_OFF(listen_addr, reconf), CC_OFF(listen_addr, sa_len),
+		CC_OFF(listen_addr, flags),
+		CC_OFF(mrt, peer_id), CC_OFF(mrt, group_id), CC_OFF(mrt, type),
+		CC_OFF(mrt, state), CC_OFF(mrt_config, name),
+		CC_OFF(mrt_config, file), CC_OFF(mrt_config, ReopenTimer),
+		CC_OFF(mrt_config, ReopenTimerInterval),
+		CC_OFF(network_config, psname), CC_OFF(network_config, rd),
+		CC_OFF(network_config, type), CC_OFF(network_config, rtlabel),
+		CC_OFF(network_config, prefixlen),
+		CC_OFF(network_config, priority),
+		CC_OFF(l3vpn, descr), CC_OFF(l3vpn, ifmpe), CC_OFF(l3vpn, rd),
+		CC_OFF(l3vpn, rtableid), CC_OFF(l3vpn, label),
+		CC_OFF(l3vpn, flags),
+		CC_OFF(filter_rule, rib), CC_OFF(filter_rule, peer),
+		CC_OFF(filter_rule, match), CC_OFF(filter_rule, action),
+		CC_OFF(filter_rule, dir), CC_OFF(filter_rule, quick),
+		CC_OFF(filter_match, nexthop), CC_OFF(filter_match, as),
+		CC_OFF(filter_match, aslen), CC_OFF(filter_match, community),
+		CC_OFF(filter_match, prefixset),
+		CC_OFF(filter_match, originset), CC_OFF(filter_match, ovs),
+		CC_OFF(filter_match, avs), CC_OFF(filter_match, maxcomm),
+		CC_OFF(filter_match, maxlargecomm),
+		CC_OFF(filter_peers, groupid), CC_OFF(filter_peers, remote_as),
+		CC_OFF(filter_peers, ribid), CC_OFF(filter_peers, ibgp),
+		CC_OFF(filter_set, action), CC_OFF(filter_set, type),
+		CC_OFF(filter_prefix, op), CC_OFF(filter_prefix, len_max),
+		CC_OFF(roa, aid), CC_OFF(roa, asnum), CC_OFF(roa, expires),
+		CC_OFF(roa, prefix),
+		CC_OFF(rde_rib, name), CC_OFF(rde_rib, rtableid),
+		CC_OFF(rde_rib, id), CC_OFF(rde_rib, flags),
+		CC_OFF(rtr_config, descr), CC_OFF(rtr_config, auth),
+		CC_OFF(rtr_config, remote_addr), CC_OFF(rtr_config, local_addr),
+		CC_OFF(rtr_config, id), CC_OFF(rtr_config, remote_port),
+		CC_OFF(rtr_config, min_version),
+		CC_OFF(flowspec, aid), CC_OFF(flowspec, len),
+		CC_OFF(flowspec, data),
+	};
+	uint64_t	h;
+
+	h = cc_hash(CC_VERSION, BGPD_VERSION, strlen(BGPD_VERSION));
+	return cc_hash(h, layout, sizeof(layout));
+}
+
+/*
+ * Macros given with -D change the outcome of the parser, they are part
+ * of the cache key.
+ */
+void
+confcache_symset(const char *s)
+{
+	cc_symhash = cc_hash(cc_symhash ^ 0x5bd1e995, s, strlen(s));
+}
+
+/*
+ * Hash a config file and, recursively, all files it includes. Include
+ * statements that can't be followed, e.g. because they use a macro,
+ * make the config uncacheable.
+ */
+static int
+cc_srchash(const char *path, uint64_t *h, int depth)
+{
+	struct stat	 st;
+	const char	*p, *end, *eol, *q;
+	char		 inc[PATH_MAX];
+	void		*map = NULL;
+	size_t		 len;
+	int		 fd, rv = -1;
+
+	if (depth > CC_MAXDEPTH)
+		return -1;
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("config cache: %s", path);
+		return -1;
+	}
+	if (fstat(fd, &st) == -1)
+		goto done;
+	*h = cc_hash(*h, path, strlen(path));
+	if (st.st_size == 0) {
+		rv = 0;
+		goto done;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		goto done;
+	}
+	*h = cc_hash(*h, map, st.st_size);
+
+	end = (const char *)map + st.st_size;
+	for (p = map; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		while (p < eol && isspace((unsigned char)*p))
+			p++;
+		if (eol - p < 7 || strncmp(p, "include", 7) != 0 ||
+		    (eol - p > 7 && !isspace((unsigned char)p[7])))
+			continue;
+		for (p += 7; p < eol && isspace((unsigned char)*p); p++)
+			;
+		if (p >= eol || *p++ != '"' ||
+		    (q = memchr(p, '"', eol - p)) == NULL ||
+		    (len = q - p) >= sizeof(inc)) {
+			log_warnx("config cache: can't follow include in %s",
+			    path);
+			goto done;
+		}
+		memcpy(inc, p, len);
+		inc[len] = '\0';
+		if (cc_srchash(inc, h, depth + 1) == -1)
+			goto done;
+	}
+	rv = 0;
+
+ done:
+	if (map != NULL)
+		munmap(map, st.st_size);
+	close(fd);
+	return rv;
+}
+
+/*
+ * The defaults init_config() takes from the host.
+ */
+static void
+cc_host_defaults(struct cc_header *hdr)
+{
+	hdr->bgpid = get_bgpid();
+	hdr->tableid = getrtable();
+	hdr->fib_prio = kr_default_prio();
+}
+
+static int
+cc_key(const char *conffile, uint64_t *h)
+{
+	*h = cc_symhash ^ 0xcbf29ce484222325ULL;
+	return cc_srchash(conffile, h, 0);
+}
+
+static void
+cc_put(struct cc_writer *w, enum cc_type type, const void *data, size_t len)
+{
+	static const uint8_t	 zero[8];
+	struct cc_rec		 rec;
+	size_t			 pad = CC_ALIGN(len) - len;
+
+	if (len > UINT32_MAX)
+		fatalx("%s: record too large", __func__);
+	rec.type = type;
+	rec.len = len;
+	fwrite(&rec, sizeof(rec), 1, w->f);
+	if (len > 0)
+		fwrite(data, len, 1, w->f);
+	fwrite(zero, pad, 1, w->f);
+
+	/* records are 8 byte aligned, so the word hash can be chained */
+	w->sum = cc_hash(w->sum, &rec, sizeof(rec));
+	if (len > 0) {
+		w->sum = cc_hash(w->sum, data, len - len % 8);
+		if (len % 8 != 0)
+			w->sum = cc_hash(w->sum, (const uint8_t *)data +
+			    len - len % 8, len % 8);
+	}
+	w->len += sizeof(rec) + len + pad;
+}
+
+static void
+cc_put_sets(struct cc_writer *w, struct filter_set_head *sh)
+{
+	struct filter_set	*s, fs;
+
+	TAILQ_FOREACH(s, sh, entry) {
+		fs = *s;
+		memset(&fs.entry, 0, sizeof(fs.entry));
+		cc_put(w, CC_SET, &fs, sizeof(fs));
+	}
+}
+
+static void
+cc_put_network(struct cc_writer *w, enum cc_type type, struct network *n)
+{
+	struct cc_network	 cn;
+	const char		*label;
+
+	memset(&cn, 0, sizeof(cn));
+	cn.net = n->net;
+	memset(&cn.net.attrset, 0, sizeof(cn.net.attrset));
+	if (n->net.type == NETWORK_RTLABEL &&
+	    (label = rtlabel_id2name(n->net.rtlabel)) != NULL)
+		strlcpy(cn.rtlabel, label, sizeof(cn.rtlabel));
+	cn.net.rtlabel = 0;
+	cc_put(w, type, &cn, sizeof(cn));
+	cc_put_sets(w, &n->net.attrset);
+}
+
+static void
+cc_put_roas(struct cc_writer *w, enum cc_type type, struct roa_tree *rt)
+{
+	struct roa	*roa, *items;
+	size_t		 n = 0;
+
+	RB_FOREACH(roa, roa_tree, rt)
+		n++;
+	if ((items = calloc(n > 0 ? n : 1, sizeof(*items))) == NULL)
+		fatal(NULL);
+	n = 0;
+	RB_FOREACH(roa, roa_tree, rt) {
+		items[n] = *roa;
+		memset(&items[n].entry, 0, sizeof(items[n].entry));
+		n++;
+	}
+	cc_put(w, type, items, n * sizeof(*items));
+	free(items);
+}
+
+static void
+cc_put_prefixset(struct cc_writer *w, enum cc_type type,
+    struct prefixset *ps)
+{
+	struct prefixset_item	*psi;
+	struct filter_prefix	*items;
+	struct cc_set		 cs;
+	size_t			 n = 0;
+
+	memset(&cs, 0, sizeof(cs));
+	strlcpy(cs.name, ps->name, sizeof(cs.name));
+	cs.sflags = ps->sflags;
+	cc_put(w, type, &cs, sizeof(cs));
+
+	if (type == CC_ORIGINSET) {
+		cc_put_roas(w, CC_ROA_ITEMS, &ps->roaitems);
+		return;
+	}
+
+	RB_FOREACH(psi, prefixset_tree, &ps->psitems)
+		n++;
+	if ((items = calloc(n > 0 ? n : 1, sizeof(*items))) == NULL)
+		fatal(NULL);
+	n = 0;
+	RB_FOREACH(psi, prefixset_tree, &ps->psitems)
+		items[n++] = psi->p;
+	cc_put(w, CC_PREFIXSET_ITEMS, items, n * sizeof(*items));
+	free(items);
+}
+
+static void
+cc_put_config(struct cc_writer *w, struct bgpd_config *conf,
+    struct rib_names *ribs)
+{
+	struct cc_conf		 cc;
+	struct cc_peer		 cp;
+	struct cc_aspa		 ca;
+	struct peer		*p;
+	struct listen_addr	*la, lac;
+	struct mrt		*m;
+	struct mrt_config	 mc;
+	struct network		*n;
+	struct l3vpn		*vpn, vc;
+	struct flowspec_config	*f;
+	struct filter_rule	*r, rc;
+	struct prefixset	*ps;
+	struct aspa_set		*aspa;
+	struct as_set		*aset;
+	struct rde_rib		*rr, rrc;
+	struct rtr_config	*rtr, rtc;
+	uint32_t		*as;
+	size_t			 nas;
+
+	memset(&cc, 0, sizeof(cc));
+	cc.flags = conf->flags;
+	cc.log = conf->log;
+	cc.default_tableid = conf->default_tableid;
+	cc.bgpid = conf->bgpid;
+	cc.clusterid = conf->clusterid;
+	cc.as = conf->as;
+	cc.short_as = conf->short_as;
+	cc.holdtime = conf->holdtime;
+	cc.min_holdtime = conf->min_holdtime;
+	cc.connectretry = conf->connectretry;
+	cc.staletime = conf->staletime;
+	cc.mrai = conf->mrai;
+	cc.fib_priority = conf->fib_priority;
+	cc.filtered_in_locrib = conf->filtered_in_locrib;
+	cc_put(w, CC_CONF, &cc, sizeof(cc));
+	if (conf->csock != NULL)
+		cc_put(w, CC_CSOCK, conf->csock, strlen(conf->csock) + 1);
+	if (conf->rcsock != NULL)
+		cc_put(w, CC_RCSOCK, conf->rcsock, strlen(conf->rcsock) + 1);
+
+	SIMPLEQ_FOREACH(rr, ribs, entry) {
+		rrc = *rr;
+		memset(&rrc.entry, 0, sizeof(rrc.entry));
+		cc_put(w, CC_RIB, &rrc, sizeof(rrc));
+	}
+	RB_FOREACH(p, peer_head, &conf->peers) {
+		memset(&cp, 0, sizeof(cp));
+		cp.conf = p->conf;
+		cp.auth = p->auth_conf;
+		cc_put(w, CC_PEER, &cp, sizeof(cp));
+	}
+	TAILQ_FOREACH(la, conf->listen_addrs, entry) {
+		lac = *la;
+		memset(&lac.entry, 0, sizeof(lac.entry));
+		lac.fd = -1;
+		cc_put(w, CC_LISTEN, &lac, sizeof(lac));
+	}
+	LIST_FOREACH(m, conf->mrt, entry) {
+		mc = *(struct mrt_config *)m;
+		memset(&mc.conf.entry, 0, sizeof(mc.conf.entry));
+		mc.conf.wbuf = NULL;
+		mc.conf.fd = -1;
+		cc_put(w, CC_MRT, &mc, sizeof(mc));
+	}
+	TAILQ_FOREACH(n, &conf->networks, entry)
+		cc_put_network(w, CC_NETWORK, n);
+	SIMPLEQ_FOREACH(vpn, &conf->l3vpns, entry) {
+		vc = *vpn;
+		memset(&vc.entry, 0, sizeof(vc.entry));
+		memset(&vc.import, 0, sizeof(vc.import));
+		memset(&vc.export, 0, sizeof(vc.export));
+		memset(&vc.net_l, 0, sizeof(vc.net_l));
+		cc_put(w, CC_VPN, &vc, sizeof(vc));
+		cc_put(w, CC_VPN_IMPORT, NULL, 0);
+		cc_put_sets(w, &vpn->import);
+		cc_put(w, CC_VPN_EXPORT, NULL, 0);
+		cc_put_sets(w, &vpn->export);
+		TAILQ_FOREACH(n, &vpn->net_l, entry)
+			cc_put_network(w, CC_VPN_NETWORK, n);
+	}
+	RB_FOREACH(f, flowspec_tree, &conf->flowspecs) {
+		cc_put(w, CC_FLOWSPEC, f->flow, FLOWSPEC_SIZE + f->flow->len);
+		cc_put_sets(w, &f->attrset);
+	}
+	TAILQ_FOREACH(r, conf->filters, entry) {
+		rc = *r;
+		memset(&rc.entry, 0, sizeof(rc.entry));
+		memset(&rc.set, 0, sizeof(rc.set));
+		memset(rc.skip, 0, sizeof(rc.skip));
+		cc_put(w, CC_FILTER, &rc, sizeof(rc));
+		cc_put_sets(w, &r->set);
+	}
+	SIMPLEQ_FOREACH(ps, &conf->prefixsets, entry)
+		cc_put_prefixset(w, CC_PREFIXSET, ps);
+	SIMPLEQ_FOREACH(ps, &conf->originsets, entry)
+		cc_put_prefixset(w, CC_ORIGINSET, ps);
+	cc_put_roas(w, CC_ROA, &conf->roa);
+	RB_FOREACH(aspa, aspa_tree, &conf->aspa) {
+		struct ibuf	*buf;
+
+		memset(&ca, 0, sizeof(ca));
+		ca.expires = aspa->expires;
+		ca.as = aspa->as;
+		ca.num = aspa->num;
+		if ((buf = ibuf_dynamic(sizeof(ca),
+		    sizeof(ca) + ca.num * sizeof(*aspa->tas))) == NULL ||
+		    ibuf_add(buf, &ca, sizeof(ca)) == -1 ||
+		    ibuf_add(buf, aspa->tas, ca.num * sizeof(*aspa->tas)) == -1)
+			fatal(NULL);
+		cc_put(w, CC_ASPA, ibuf_data(buf), ibuf_size(buf));
+		ibuf_free(buf);
+	}
+	SIMPLEQ_FOREACH(aset, &conf->as_sets, entry) {
+		cc_put(w, CC_ASSET, aset->name, sizeof(aset->name));
+		as = set_get(aset->set, &nas);
+		cc_put(w, CC_ASSET_ITEMS, as, nas * sizeof(*as));
+	}
+	SIMPLEQ_FOREACH(rtr, &conf->rtrs, entry) {
+		rtc = *rtr;
+		memset(&rtc.entry, 0, sizeof(rtc.entry));
+		cc_put(w, CC_RTR, &rtc, sizeof(rtc));
+	}
+	cc_put(w, CC_END, NULL, 0);
+}
+
+/*
+ * Write the parsed config to the cache file. The file is written next
+ * to the final one and renamed into place once complete.
+ */
+int
+confcache_write(struct bgpd_config *conf, struct rib_names *ribs,
+    const char *conffile, const char *cachefile)
+{
+	struct cc_header	 hdr;
+	struct cc_writer	 w;
+	char			*tmp;
+	int			 fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CC_MAGIC, sizeof(hdr.magic));
+	hdr.version = CC_VERSION;
+	hdr.layout = cc_layout();
+	cc_host_defaults(&hdr);
+	if (cc_key(conffile, &hdr.srchash) == -1) {
+		log_warnx("config cache disabled for %s", conffile);
+		return -1;
+	}
+
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", cachefile) == -1)
+		fatal(NULL);
+	if ((fd = mkstemp(tmp)) == -1) {
+		log_warn("%s: %s", __func__, tmp);
+		free(tmp);
+		return -1;
+	}
+	if ((w.f = fdopen(fd, "w")) == NULL) {
+		log_warn("%s: fdopen", __func__);
+		close(fd);
+		goto fail;
+	}
+	w.sum = 0;
+	w.len = 0;
+
+	fwrite(&hdr, sizeof(hdr), 1, w.f);
+	cc_put_config(&w, conf, ribs);
+	hdr.bodylen = w.len;
+	hdr.bodysum = w.sum;
+
+	if (fseek(w.f, 0, SEEK_SET) == -1 ||
+	    fwrite(&hdr, sizeof(hdr), 1, w.f) != 1 ||
+	    fflush(w.f) == EOF || ferror(w.f) || fsync(fileno(w.f)) == -1) {
+		log_warn("%s: %s", __func__, tmp);
+		fclose(w.f);
+		goto fail;
+	}
+	if (fclose(w.f) == EOF || rename(tmp, cachefile) == -1) {
+		log_warn("%s: %s", __func__, cachefile);
+		goto fail;
+	}
+	free(tmp);
+	return 0;
+
+ fail:
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+static int
+cc_id_cmp(const void *a, const void *b)
+{
+	const struct cc_id	*x = a, *y = b;
+
+	if (x->old != y->old)
+		return x->old < y->old ? -1 : 1;
+	return 0;
+}
+
+static uint32_t
+cc_id_map(struct cc_id *ids, size_t nids, uint32_t old)
+{
+	struct cc_id	 needle, *id;
+
+	if (old == 0)
+		return 0;
+	needle.old = old;
+	if ((id = bsearch(&needle, ids, nids, sizeof(*ids), cc_id_cmp)) ==
+	    NULL)
+		return 0;
+	return id->new;
+}
+
+/*
+ * Give the cached peers, groups and rtr sessions the ids of the running
+ * ones, matched the same way the parser does it, and fresh ids to new
+ * ones. Filter rules and mrt dumps refer to these ids and follow.
+ */
+static int
+cc_renumber(struct bgpd_config *conf, struct peer **peers, size_t npeers,
+    struct peer_head *ph, struct rtr_config_head *rh)
+{
+	struct cc_id		*ids;
+	struct peer		*p, *op;
+	struct filter_rule	*r;
+	struct mrt		*m;
+	struct rtr_config	*rtr, *ortr;
+	size_t			 nids = 0, i, j;
+	uint32_t		 next = PEER_ID_STATIC_MIN, rnext = 1;
+
+	if (ph != NULL)
+		RB_FOREACH(op, peer_head, ph) {
+			if (op->conf.id < PEER_ID_STATIC_MAX &&
+			    op->conf.id >= next)
+				next = op->conf.id + 1;
+			if (op->conf.groupid >= next)
+				next = op->conf.groupid + 1;
+		}
+
+	if ((ids = calloc(npeers * 2 + 1, sizeof(*ids))) == NULL)
+		fatal(NULL);
+	for (i = 0; i < npeers; i++) {
+		p = peers[i];
+		for (j = 0; j < nids; j++)
+			if (ids[j].old == p->conf.id)
+				break;
+		if (j == nids) {
+			ids[nids].old = p->conf.id;
+			ids[nids].new = 0;
+			if (ph != NULL)
+				RB_FOREACH(op, peer_head, ph)
+					if (op->conf.remote_masklen ==
+					    p->conf.remote_masklen &&
+					    memcmp(&op->conf.remote_addr,
+					    &p->conf.remote_addr,
+					    sizeof(op->conf.remote_addr)) == 0)
+						break;
+			if (ph != NULL && op != NULL)
+				ids[nids].new = op->conf.id;
+			else
+				ids[nids].new = next++;
+			nids++;
+		}
+		if (p->conf.groupid == 0)
+			continue;
+		for (j = 0; j < nids; j++)
+			if (ids[j].old == p->conf.groupid)
+				break;
+		if (j == nids) {
+			ids[nids].old = p->conf.groupid;
+			op = NULL;
+			if (ph != NULL)
+				RB_FOREACH(op, peer_head, ph)
+					if (op->conf.groupid != 0 &&
+					    strcmp(op->conf.group,
+					    p->conf.group) == 0)
+						break;
+			if (op != NULL)
+				ids[nids].new = op->conf.groupid;
+			else
+				ids[nids].new = next++;
+			nids++;
+		}
+	}
+	if (next >= PEER_ID_STATIC_MAX) {
+		free(ids);
+		return -1;
+	}
+	qsort(ids, nids, sizeof(*ids), cc_id_cmp);
+
+	for (i = 0; i < npeers; i++) {
+		p = peers[i];
+		p->conf.id = cc_id_map(ids, nids, p->conf.id);
+		p->conf.groupid = cc_id_map(ids, nids, p->conf.groupid);
+		if (RB_INSERT(peer_head, &conf->peers, p) != NULL) {
+			free(ids);
+			return -1;
+		}
+		peers[i] = NULL;
+	}
+	TAILQ_FOREACH(r, conf->filters, entry) {
+		r->peer.peerid = cc_id_map(ids, nids, r->peer.peerid);
+		r->peer.groupid = cc_id_map(ids, nids, r->peer.groupid);
+	}
+	LIST_FOREACH(m, conf->mrt, entry) {
+		m->peer_id = cc_id_map(ids, nids, m->peer_id);
+		m->group_id = cc_id_map(ids, nids, m->group_id);
+	}
+	free(ids);
+
+	if (rh != NULL)
+		SIMPLEQ_FOREACH(ortr, rh, entry)
+			if (ortr->id >= rnext)
+				rnext = ortr->id + 1;
+	SIMPLEQ_FOREACH(rtr, &conf->rtrs, entry) {
+		ortr = NULL;
+		if (rh != NULL)
+			SIMPLEQ_FOREACH(ortr, rh, entry)
+				if (memcmp(&ortr->remote_addr,
+				    &rtr->remote_addr,
+				    sizeof(ortr->remote_addr)) == 0 &&
+				    ortr->remote_port == rtr->remote_port)
+					break;
+		rtr->id = ortr != NULL ? ortr->id : rnext++;
+	}
+	return 0;
+}
+
+static struct network *
+cc_get_network(struct ibuf *b)
+{
+	struct cc_network	 cn;
+	struct network		*n;
+
+	if (ibuf_get(b, &cn, sizeof(cn)) == -1)
+		return NULL;
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		fatal(NULL);
+	n->net = cn.net;
+	TAILQ_INIT(&n->net.attrset);
+	if (n->net.type == NETWORK_RTLABEL) {
+		cn.rtlabel[sizeof(cn.rtlabel) - 1] = '\0';
+		n->net.rtlabel = rtlabel_name2id(cn.rtlabel);
+	}
+	return n;
+}
+
+static int
+cc_get_roas(struct ibuf *b, struct roa_tree *rt)
+{
+	struct roa	*roa;
+
+	if (ibuf_size(b) % sizeof(*roa) != 0)
+		return -1;
+	while (ibuf_size(b) > 0) {
+		if ((roa = malloc(sizeof(*roa))) == NULL)
+			fatal(NULL);
+		if (ibuf_get(b, roa, sizeof(*roa)) == -1 ||
+		    RB_INSERT(roa_tree, rt, roa) != NULL) {
+			free(roa);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+cc_get_config(struct ibuf *body, struct bgpd_config *conf,
+    struct rib_names *ribs, struct peer ***peersp, size_t *npeersp)
+{
+	struct ibuf		 rb;
+	struct cc_rec		 rec;
+	struct cc_conf		 cc;
+	struct cc_peer		 cp;
+	struct cc_set		 cs;
+	struct cc_aspa		 ca;
+	struct filter_prefix	 fp;
+	struct filter_set_head	*curset = NULL;
+	struct filter_set	*s;
+	struct peer		*p, **peers = NULL;
+	struct listen_addr	*la;
+	struct mrt_config	*mc;
+	struct mrt		*lastmrt = NULL;
+	struct network		*n;
+	struct l3vpn		*vpn = NULL;
+	struct flowspec_config	*f;
+	struct flowspec		*flow;
+	struct filter_rule	*r;
+	struct prefixset	*ps = NULL;
+	struct prefixset_item	*psi;
+	struct aspa_set		*aspa;
+	struct as_set		*aset = NULL;
+	struct rde_rib		*rr;
+	struct rtr_config	*rtr;
+	char			 name[SET_NAME_LEN];
+	size_t			 npeers = 0, maxpeers = 0;
+	u_int			 rdomain, label;
+
+	while (ibuf_size(body) > 0) {
+		if (ibuf_get(body, &rec, sizeof(rec)) == -1 ||
+		    ibuf_size(body) < CC_ALIGN(rec.len))
+			goto bad;
+		ibuf_from_buffer(&rb, ibuf_data(body), rec.len);
+		ibuf_skip(body, CC_ALIGN(rec.len));
+
+		switch (rec.type) {
+		case CC_CONF:
+			if (ibuf_get(&rb, &cc, sizeof(cc)) == -1)
+				goto bad;
+			conf->flags = cc.flags;
+			conf->log = cc.log;
+			conf->default_tableid = cc.default_tableid;
+			conf->bgpid = cc.bgpid;
+			conf->clusterid = cc.clusterid;
+			conf->as = cc.as;
+			conf->short_as = cc.short_as;
+			conf->holdtime = cc.holdtime;
+			conf->min_holdtime = cc.min_holdtime;
+			conf->connectretry = cc.connectretry;
+			conf->staletime = cc.staletime;
+			conf->mrai = cc.mrai;
+			conf->fib_priority = cc.fib_priority;
+			conf->filtered_in_locrib = cc.filtered_in_locrib;
+			break;
+		case CC_CSOCK:
+		case CC_RCSOCK:
+			if (rec.len == 0 ||
+			    ((char *)ibuf_data(&rb))[rec.len - 1] != '\0')
+				goto bad;
+			if (rec.type == CC_CSOCK) {
+				free(conf->csock);
+				if ((conf->csock = strdup(ibuf_data(&rb))) ==
+				    NULL)
+					fatal(NULL);
+			} else {
+				free(conf->rcsock);
+				if ((conf->rcsock = strdup(ibuf_data(&rb))) ==
+				    NULL)
+					fatal(NULL);
+			}
+			break;
+		case CC_RIB:
+			if ((rr = malloc(sizeof(*rr))) == NULL)
+				fatal(NULL);
+			if (ibuf_get(&rb, rr, sizeof(*rr)) == -1) {
+				free(rr);
+				goto bad;
+			}
+			SIMPLEQ_INSERT_TAIL(ribs, rr, entry);
+			break;
+		case CC_PEER:
+			if (ibuf_get(&rb, &cp, sizeof(cp)) == -1)
+				goto bad;
+			if ((p = calloc(1, sizeof(*p))) == NULL)
+				fatal(NULL);
+			p->state = STATE_NONE;
+			p->reconf_action = RECONF_REINIT;
+			p->conf = cp.conf;
+			p->auth_conf = cp.auth;
+			if (npeers == maxpeers) {
+				struct peer **np;
+
+				maxpeers = maxpeers ? maxpeers * 2 : 64;
+				np = reallocarray(peers, maxpeers,
+				    sizeof(*peers));
+				if (np == NULL)
+					fatal(NULL);
+				peers = np;
+			}
+			peers[npeers++] = p;
+			break;
+		case CC_LISTEN:
+			if ((la = malloc(sizeof(*la))) == NULL)
+				fatal(NULL);
+			if (ibuf_get(&rb, la, sizeof(*la)) == -1) {
+				free(la);
+				goto bad;
+			}
+			la->fd = -1;
+			TAILQ_INSERT_TAIL(conf->listen_addrs, la, entry);
+			break;
+		case CC_MRT:
+			if ((mc = malloc(sizeof(*mc))) == NULL)
+				fatal(NULL);
+			if (ibuf_get(&rb, mc, sizeof(*mc)) == -1) {
+				free(mc);
+				goto bad;
+			}
+			mc->conf.wbuf = NULL;
+			mc->conf.fd = -1;
+			if (lastmrt == NULL)
+				LIST_INSERT_HEAD(conf->mrt, &mc->conf, entry);
+			else
+				LIST_INSERT_AFTER(lastmrt, &mc->conf, entry);
+			lastmrt = &mc->conf;
+			break;
+		case CC_NETWORK:
+		case CC_VPN_NETWORK:
+			if (rec.type == CC_VPN_NETWORK && vpn == NULL)
+				goto bad;
+			if ((n = cc_get_network(&rb)) == NULL)
+				goto bad;
+			if (rec.type == CC_VPN_NETWORK)
+				TAILQ_INSERT_TAIL(&vpn->net_l, n, entry);
+			else
+				TAILQ_INSERT_TAIL(&conf->networks, n, entry);
+			curset = &n->net.attrset;
+			break;
+		case CC_VPN:
+			if ((vpn = calloc(1, sizeof(*vpn))) == NULL)
+				fatal(NULL);
+			if (ibuf_get(&rb, vpn, sizeof(*vpn)) == -1) {
+				free(vpn);
+				vpn = NULL;
+				goto bad;
+			}
+			TAILQ_INIT(&vpn->import);
+			TAILQ_INIT(&vpn->export);
+			TAILQ_INIT(&vpn->net_l);
+			SIMPLEQ_INSERT_TAIL(&conf->l3vpns, vpn, entry);
+			/* rdomain and label of the mpe(4) may have changed */
+			if (get_mpe_config(vpn->ifmpe, &rdomain, &label) == -1) {
+				log_warnx("config cache: no mpe interface %s",
+				    vpn->ifmpe);
+				goto fail;
+			}
+			vpn->rtableid = rdomain;
+			vpn->label = label;
+			curset = NULL;
+			break;
+		case CC_VPN_IMPORT:
+		case CC_VPN_EXPORT:
+			if (vpn == NULL)
+				goto bad;
+			curset = rec.type == CC_VPN_IMPORT ?
+			    &vpn->import : &vpn->export;
+			break;
+		case CC_FLOWSPEC:
+			if (rec.len <= FLOWSPEC_SIZE)
+				goto bad;
+			flow = ibuf_data(&rb);
+			if (flow->len + FLOWSPEC_SIZE != rec.len)
+				goto bad;
+			if ((f = flowspec_alloc(flow->aid, flow->len)) == NULL)
+				fatal(NULL);
+			memcpy(f->flow, flow, rec.len);
+			if (RB_INSERT(flowspec_tree, &conf->flowspecs, f) !=
+			    NULL) {
+				flowspec_free(f);
+				goto bad;
+			}
+			curset = &f->attrset;
+			break;
+		case CC_FILTER:
+			if ((r = malloc(sizeof(*r))) == NULL)
+				fatal(NULL);
+			if (ibuf_get(&rb, r, sizeof(*r)) == -1) {
+				free(r);
+				goto bad;
+			}
+			TAILQ_INIT(&r->set);
+			TAILQ_INSERT_TAIL(conf->filters, r, entry);
+			curset = &r->set;
+			break;
+		case CC_SET:
+			if (curset == NULL)
+				goto bad;
+			if ((s = malloc(sizeof(*s))) == NULL)
+				fatal(NULL);
+			if (ibuf_get(&rb, s, sizeof(*s)) == -1) {
+				free(s);
+				goto bad;
+			}
+			TAILQ_INSERT_TAIL(curset, s, entry);
+			if (s->type == ACTION_PFTABLE) {
+				s->action.pftable[
+				    sizeof(s->action.pftable) - 1] = '\0';
+				if (pftable_add(s->action.pftable) != 0) {
+					log_warnx("config cache: couldn't "
+					    "register table %s",
+					    s->action.pftable);
+					goto fail;
+				}
+			}
+			break;
+		case CC_PREFIXSET:
+		case CC_ORIGINSET:
+			if (ibuf_get(&rb, &cs, sizeof(cs)) == -1)
+				goto bad;
+			if ((ps = calloc(1, sizeof(*ps))) == NULL)
+				fatal(NULL);
+			memcpy(ps->name, cs.name, sizeof(ps->name));
+			ps->name[sizeof(ps->name) - 1] = '\0';
+			ps->sflags = cs.sflags;
+			RB_INIT(&ps->psitems);
+			RB_INIT(&ps->roaitems);
+			if (rec.type == CC_ORIGINSET)
+				SIMPLEQ_INSERT_TAIL(&conf->originsets, ps,
+				    entry);
+			else
+				SIMPLEQ_INSERT_TAIL(&conf->prefixsets, ps,
+				    entry);
+			break;
+		case CC_PREFIXSET_ITEMS:
+			if (ps == NULL || rec.len % sizeof(fp) != 0)
+				goto bad;
+			while (ibuf_size(&rb) > 0) {
+				if ((psi = calloc(1, sizeof(*psi))) == NULL)
+					fatal(NULL);
+				if (ibuf_get(&rb, &psi->p, sizeof(psi->p)) ==
+				    -1 || RB_INSERT(prefixset_tree,
+				    &ps->psitems, psi) != NULL) {
+					free(psi);
+					goto bad;
+				}
+			}
+			break;
+		case CC_ROA_ITEMS:
+			if (ps == NULL || cc_get_roas(&rb, &ps->roaitems) == -1)
+				goto bad;
+			break;
+		case CC_ROA:
+			if (cc_get_roas(&rb, &conf->roa) == -1)
+				goto bad;
+			break;
+		case CC_ASPA:
+			if (ibuf_get(&rb, &ca, sizeof(ca)) == -1 ||
+			    ibuf_size(&rb) != ca.num * sizeof(uint32_t))
+				goto bad;
+			if ((aspa = calloc(1, sizeof(*aspa))) == NULL)
+				fatal(NULL);
+			aspa->expires = ca.expires;
+			aspa->as = ca.as;
+			aspa->num = ca.num;
+			if (ca.num > 0) {
+				aspa->tas = calloc(ca.num, sizeof(uint32_t));
+				if (aspa->tas == NULL)
+					fatal(NULL);
+				ibuf_get(&rb, aspa->tas,
+				    ca.num * sizeof(uint32_t));
+			}
+			if (RB_INSERT(aspa_tree, &conf->aspa, aspa) != NULL) {
+				free_aspa(aspa);
+				goto bad;
+			}
+			break;
+		case CC_ASSET:
+			if (ibuf_get(&rb, name, sizeof(name)) == -1)
+				goto bad;
+			name[sizeof(name) - 1] = '\0';
+			aset = as_sets_new(&conf->as_sets, name, 0,
+			    sizeof(uint32_t));
+			if (aset == NULL)
+				fatal(NULL);
+			break;
+		case CC_ASSET_ITEMS:
+			if (aset == NULL || rec.len % sizeof(uint32_t) != 0)
+				goto bad;
+			if (rec.len > 0 && set_add(aset->set, ibuf_data(&rb),
+			    rec.len / sizeof(uint32_t)) != 0)
+				fatal(NULL);
+			break;
+		case CC_RTR:
+			if ((rtr = malloc(sizeof(*rtr))) == NULL)
+				fatal(NULL);
+			if (ibuf_get(&rb, rtr, sizeof(*rtr)) == -1) {
+				free(rtr);
+				goto bad;
+			}
+			SIMPLEQ_INSERT_TAIL(&conf->rtrs, rtr, entry);
+			break;
+		case CC_END:
+			if (ibuf_size(body) != 0)
+				goto bad;
+			*peersp = peers;
+			*npeersp = npeers;
+			return 0;
+		default:
+			goto bad;
+		}
+	}
+
+ bad:
+	log_warnx("config cache: bad record");
+ fail:
+	while (npeers > 0)
+		free(peers[--npeers]);
+	free(peers);
+	return -1;
+}
+
+/*
+ * Load the config from the cache file if it was compiled from the
+ * current content of conffile. Returns NULL if the cache is missing,
+ * stale or unusable, the caller then parses conffile as usual.
+ */
+struct bgpd_config *
+confcache_load(const char *conffile, const char *cachefile,
+    struct peer_head *ph, struct rtr_config_head *rh)
+{
+	struct bgpd_config	*conf;
+	struct rib_names	 ribs = SIMPLEQ_HEAD_INITIALIZER(ribs);
+	struct rde_rib		*rr;
+	struct cc_header	 hdr, host;
+	struct stat		 st;
+	struct ibuf		 body;
+	struct peer		**peers = NULL;
+	uint64_t		 srchash;
+	size_t			 npeers = 0;
+	void			*map;
+	int			 fd;
+
+	if ((fd = open(cachefile, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			log_warn("config cache %s", cachefile);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(hdr)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_warn("config cache %s: mmap", cachefile);
+		return NULL;
+	}
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if (memcmp(hdr.magic, CC_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != CC_VERSION || hdr.layout != cc_layout()) {
+		log_info("config cache %s: incompatible format", cachefile);
+		goto stale;
+	}
+	if (cc_key(conffile, &srchash) == -1 || srchash != hdr.srchash) {
+		log_info("config cache %s: %s changed", cachefile, conffile);
+		goto stale;
+	}
+	cc_host_defaults(&host);
+	if (hdr.bgpid != host.bgpid || hdr.tableid != host.tableid ||
+	    hdr.fib_prio != host.fib_prio) {
+		log_info("config cache %s: host defaults changed", cachefile);
+		goto stale;
+	}
+	if (hdr.bodylen != st.st_size - sizeof(hdr) ||
+	    cc_hash(0, (char *)map + sizeof(hdr), hdr.bodylen) !=
+	    hdr.bodysum) {
+		log_warnx("config cache %s: checksum mismatch", cachefile);
+		goto stale;
+	}
+
+	conf = new_config();
+	ibuf_from_buffer(&body, (char *)map + sizeof(hdr), hdr.bodylen);
+	if (cc_get_config(&body, conf, &ribs, &peers, &npeers) == -1 ||
+	    cc_renumber(conf, peers, npeers, ph, rh) == -1) {
+		while (npeers > 0)
+			free(peers[--npeers]);
+		free(peers);
+		while ((rr = SIMPLEQ_FIRST(&ribs)) != NULL) {
+			SIMPLEQ_REMOVE_HEAD(&ribs, entry);
+			free(rr);
+		}
+		free_config(conf);
+		goto stale;
+	}
+	free(peers);
+	munmap(map, st.st_size);
+
+	SIMPLEQ_CONCAT(&ribnames, &ribs);
+	log_info("config loaded from cache %s", cachefile);
+	return conf;
+
+ stale:
+	munmap(map, st.st_size);
+	return NULL;
+}
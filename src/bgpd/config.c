@@ -86,6 +86,7 @@ copy_config(struct bgpd_config *to, struct bgpd_config *from)
 	to->holdtime = from->holdtime;
 	to->min_holdtime = from->min_holdtime;
 	to->staletime = from->staletime;
+	to->mrai = from->mrai;
 	to->connectretry = from->connectretry;
 	to->fib_priority = from->fib_priority;
 	to->filtered_in_locrib = from->filtered_in_locrib;
@@ -771,3 +772,151 @@ flowspec_config_cmp(struct flowspec_config *a, struct flowspec_config *b)
 }
 
 RB_GENERATE(flowspec_tree, flowspec_config, entry, flowspec_config_cmp);
+
+/*
+ * Content digests of the prefix-, origin- and as-sets last sent to the
+ * RDE. A set with the same name, type and digest on the next reload is
+ * not resent, the RDE keeps its old copy instead. Each digest is two
+ * independent 64bit hashes over the set items in tree order.
+ */
+struct set_digest {
+	RB_ENTRY(set_digest)	 entry;
+	char			 name[SET_NAME_LEN];
+	uint64_t		 hash[2];
+	unsigned int		 gen;
+	int			 type;
+};
+
+static inline int
+set_digest_cmp(struct set_digest *a, struct set_digest *b)
+{
+	if (a->type != b->type)
+		return (a->type < b->type ? -1 : 1);
+	return (strcmp(a->name, b->name));
+}
+
+static RB_HEAD(set_digest_tree, set_digest) set_digests =
+    RB_INITIALIZER(&set_digests);
+RB_GENERATE_STATIC(set_digest_tree, set_digest, entry, set_digest_cmp);
+
+static unsigned int	set_digest_gen;
+
+static void
+set_digest_add(uint64_t hash[2], const void *data, size_t len)
+{
+	const uint8_t	*p = data;
+	size_t		 i;
+
+	for (i = 0; i < len; i++) {
+		/* FNV-1a and a multiply-xorshift mix */
+		hash[0] = (hash[0] ^ p[i]) * 0x100000001b3ULL;
+		hash[1] = (hash[1] + p[i]) * 0x9e3779b97f4a7c15ULL;
+		hash[1] ^= hash[1] >> 29;
+	}
+}
+
+static void
+set_digest_roa(uint64_t hash[2], struct roa *roa)
+{
+	set_digest_add(hash, &roa->aid, sizeof(roa->aid));
+	set_digest_add(hash, &roa->prefixlen, sizeof(roa->prefixlen));
+	set_digest_add(hash, &roa->maxlen, sizeof(roa->maxlen));
+	set_digest_add(hash, &roa->asnum, sizeof(roa->asnum));
+	set_digest_add(hash, &roa->expires, sizeof(roa->expires));
+	if (roa->aid == AID_INET6)
+		set_digest_add(hash, &roa->prefix.inet6,
+		    sizeof(roa->prefix.inet6));
+	else
+		set_digest_add(hash, &roa->prefix.inet,
+		    sizeof(roa->prefix.inet));
+}
+
+/*
+ * Record the digest of a set that is about to be sent to the RDE.
+ * Returns 1 if the RDE already has the same set from the last reload.
+ */
+int
+set_digest_keep(int type, const char *name, struct prefixset *ps,
+    struct as_set *aset)
+{
+	struct set_digest	*sd, needle;
+	struct prefixset_item	*psi;
+	struct roa		*roa;
+	uint64_t		 hash[2];
+	uint32_t		*as;
+	size_t			 n = 0;
+	int			 same;
+
+	hash[0] = 0xcbf29ce484222325ULL;
+	hash[1] = 0x6a09e667f3bcc909ULL;
+	switch (type) {
+	case PREFIX_SET:
+		RB_FOREACH(psi, prefixset_tree, &ps->psitems) {
+			set_digest_add(hash, &psi->p, sizeof(psi->p));
+			n++;
+		}
+		break;
+	case ORIGIN_SET:
+		RB_FOREACH(roa, roa_tree, &ps->roaitems) {
+			set_digest_roa(hash, roa);
+			n++;
+		}
+		break;
+	case ASNUM_SET:
+		as = set_get(aset->set, &n);
+		set_digest_add(hash, as, n * sizeof(*as));
+		break;
+	default:
+		fatalx("%s: bad set type %d", __func__, type);
+	}
+	set_digest_add(hash, &n, sizeof(n));
+
+	memset(&needle, 0, sizeof(needle));
+	needle.type = type;
+	if (strlcpy(needle.name, name, sizeof(needle.name)) >=
+	    sizeof(needle.name))
+		fatalx("%s: set name too long", __func__);
+	if ((sd = RB_FIND(set_digest_tree, &set_digests, &needle)) == NULL) {
+		if ((sd = malloc(sizeof(*sd))) == NULL)
+			fatal(NULL);
+		*sd = needle;
+		RB_INSERT(set_digest_tree, &set_digests, sd);
+		same = 0;
+	} else
+		same = memcmp(sd->hash, hash, sizeof(hash)) == 0;
+
+	memcpy(sd->hash, hash, sizeof(hash));
+	sd->gen = set_digest_gen;
+	return (same);
+}
+
+/*
+ * Drop the digests of sets that were not part of the config just sent.
+ */
+void
+set_digest_expire(void)
+{
+	struct set_digest	*sd, *nsd;
+
+	RB_FOREACH_SAFE(sd, set_digest_tree, &set_digests, nsd) {
+		if (sd->gen != set_digest_gen) {
+			RB_REMOVE(set_digest_tree, &set_digests, sd);
+			free(sd);
+		}
+	}
+	set_digest_gen++;
+}
+
+/*
+ * Forget all digests, the next config is sent in full.
+ */
+void
+set_digest_flush(void)
+{
+	struct set_digest	*sd, *nsd;
+
+	RB_FOREACH_SAFE(sd, set_digest_tree, &set_digests, nsd) {
+		RB_REMOVE(set_digest_tree, &set_digests, sd);
+		free(sd);
+	}
+}
@@ -37,6 +37,7 @@ TAILQ_HEAD(ctl_conns, ctl_conn) ctl_conns = TAILQ_HEAD_INITIALIZER(ctl_conns);
 struct ctl_conn	*control_connbyfd(int);
 struct ctl_conn	*control_connbypid(pid_t);
 int		 control_close(struct ctl_conn *);
+static int	 control_release(struct ctl_conn *);
 void		 control_result(struct ctl_conn *, u_int);
 
 int
@@ -237,6 +238,20 @@ control_close(struct ctl_conn *c)
 	return (1);
 }
 
+/*
+ * Forget about connection c after its fd was passed to the RDE. The imsg
+ * layer closes the fd once it is sent.
+ */
+static int
+control_release(struct ctl_conn *c)
+{
+	imsgbuf_clear(&c->imsgbuf);
+	TAILQ_REMOVE(&ctl_conns, c, entry);
+	free(c);
+	pauseaccept = monotime_clear();
+	return (1);
+}
+
 int
 control_dispatch_msg(struct pollfd *pfd, struct peer_head *peers)
 {
@@ -286,6 +301,7 @@ control_dispatch_msg(struct pollfd *pfd, struct peer_head *peers)
 			case IMSG_CTL_SHOW_NEXTHOP:
 			case IMSG_CTL_SHOW_INTERFACE:
 			case IMSG_CTL_SHOW_RIB_MEM:
+			case IMSG_CTL_SHOW_RIB_LATENCY:
 			case IMSG_CTL_SHOW_TERSE:
 			case IMSG_CTL_SHOW_TIMER:
 			case IMSG_CTL_SHOW_NETWORK:
@@ -492,6 +508,19 @@ control_dispatch_msg(struct pollfd *pfd, struct peer_head *peers)
 				break;
 			}
 
+			if (imsgbuf_queuelen(&c->imsgbuf) == 0) {
+				switch (imsg_ctl_rde_handover(&imsg,
+				    c->imsgbuf.fd)) {
+				case -1:
+					log_warn("control_dispatch_msg: "
+					    "handover");
+					imsg_free(&imsg);
+					return control_close(c);
+				case 1:
+					imsg_free(&imsg);
+					return control_release(c);
+				}
+			}
 			c->terminate = 1;
 			imsg_ctl_rde(&imsg);
 			break;
@@ -500,6 +529,7 @@ control_dispatch_msg(struct pollfd *pfd, struct peer_head *peers)
 			c->terminate = 1;
 			/* FALLTHROUGH */
 		case IMSG_CTL_SHOW_RIB_MEM:
+		case IMSG_CTL_SHOW_RIB_LATENCY:
 		case IMSG_CTL_SHOW_SET:
 			imsg_ctl_rde(&imsg);
 			break;
@@ -572,14 +602,32 @@ control_imsg_relay(struct imsg *imsg, struct peer *p)
 		peer.stats.prefix_sent_update = stats.prefix_sent_update;
 		peer.stats.prefix_sent_withdraw = stats.prefix_sent_withdraw;
 		peer.stats.prefix_sent_eor = stats.prefix_sent_eor;
+		peer.stats.filter_out_hit = stats.filter_out_hit;
+		peer.stats.filter_out_miss = stats.filter_out_miss;
+		peer.stats.prefix_coalesced = stats.prefix_coalesced;
 		peer.stats.pending_update = stats.pending_update;
 		peer.stats.pending_withdraw = stats.pending_withdraw;
+		peer.stats.drain_last = stats.drain_last;
+		peer.stats.drain_max = stats.drain_max;
 		peer.stats.msg_queue_len = msgbuf_queuelen(p->wbuf);
 
 		return imsg_compose(&c->imsgbuf, type, 0, pid, -1,
 		    &peer, sizeof(peer));
 	}
 
+	/* the last stages of the latency trace are measured by the SE */
+	if (type == IMSG_CTL_SHOW_RIB_LATENCY) {
+		struct ctl_latency lat;
+
+		if (imsg_get_data(imsg, &lat, sizeof(lat)) == -1)
+			return (-1);
+		lat.stage[LAT_WRITE] = se_latency.stage[LAT_WRITE];
+		lat.stage[LAT_TOTAL] = se_latency.stage[LAT_TOTAL];
+
+		return imsg_compose(&c->imsgbuf, type, 0, pid, -1,
+		    &lat, sizeof(lat));
+	}
+
 	/* if command finished no need to send exit message */
 	if (type == IMSG_CTL_END || type == IMSG_CTL_RESULT)
 		c->terminate = 0;
@@ -61,6 +61,7 @@ struct {
 
 struct kroute {
 	RB_ENTRY(kroute)	 entry;
+	LIST_HEAD(, knexthop)	 nexthops;
 	struct kroute		*next;
 	struct in_addr		 prefix;
 	struct in_addr		 nexthop;
@@ -74,6 +75,7 @@ struct kroute {
 
 struct kroute6 {
 	RB_ENTRY(kroute6)	 entry;
+	LIST_HEAD(, knexthop)	 nexthops;
 	struct kroute6		*next;
 	struct in6_addr		 prefix;
 	struct in6_addr		 nexthop;
@@ -89,8 +91,11 @@ struct kroute6 {
 
 struct knexthop {
 	RB_ENTRY(knexthop)	 entry;
+	LIST_ENTRY(knexthop)	 kentry;	/* list on kroute */
+	LIST_ENTRY(knexthop)	 ifentry;	/* list on kif */
 	struct bgpd_addr	 nexthop;
 	void			*kroute;
+	struct kif		*kif;
 	u_short			 ifindex;
 };
 
@@ -104,6 +109,7 @@ struct kredist_node {
 
 struct kif {
 	RB_ENTRY(kif)		 entry;
+	LIST_HEAD(, knexthop)	 nexthops;	/* resolved over this kif */
 	char			 ifname[IFNAMSIZ];
 	uint64_t		 baudrate;
 	u_int			 rdomain;
@@ -161,8 +167,9 @@ int		 kroute_validate(struct kroute *);
 int		 kroute6_validate(struct kroute6 *);
 int		 knexthop_true_nexthop(struct ktable *, struct kroute_full *);
 void		 knexthop_validate(struct ktable *, struct knexthop *);
-void		 knexthop_track(struct ktable *, u_short);
+void		 knexthop_track(struct ktable *, struct kif *);
 void		 knexthop_update(struct ktable *, struct kroute_full *);
+void		 knexthop_revalidate(struct ktable *, struct kroute_full *);
 void		 knexthop_send_update(struct knexthop *);
 struct kroute	*kroute_match(struct ktable *, struct bgpd_addr *, int);
 struct kroute6	*kroute6_match(struct ktable *, struct bgpd_addr *, int);
@@ -303,6 +310,8 @@ ktable_new(u_int rtableid, u_int rdomid, char *name, int fs)
 	strlcpy(kt->descr, name, sizeof(kt->descr));
 	RB_INIT(&kt->krt);
 	RB_INIT(&kt->krt6);
+	ktrie_init(&kt->krt_lpm, sizeof(struct in_addr));
+	ktrie_init(&kt->krt6_lpm, sizeof(struct in6_addr));
 	RB_INIT(&kt->knt);
 	TAILQ_INIT(&kt->krn);
 	kt->fib_conf = kt->fib_sync = fs;
@@ -363,6 +372,8 @@ ktable_destroy(struct ktable *kt)
 		knexthop_clear(kt);
 	kroute_clear(kt);
 	kroute6_clear(kt);
+	ktrie_free(&kt->krt_lpm);
+	ktrie_free(&kt->krt6_lpm);
 	kr_net_clear(kt);
 
 	krt[kt->rtableid] = NULL;
@@ -905,6 +916,8 @@ kr_show_route(struct imsg *imsg)
 			/* do not leak internal information */
 			RB_INIT(&ktab.krt);
 			RB_INIT(&ktab.krt6);
+			ktrie_init(&ktab.krt_lpm, 0);
+			ktrie_init(&ktab.krt6_lpm, 0);
 			RB_INIT(&ktab.knt);
 			TAILQ_INIT(&ktab.krn);
 
@@ -1516,7 +1529,6 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 {
 	struct kroute	*kr, *krm;
 	struct kroute6	*kr6, *kr6m;
-	struct knexthop	*n;
 	uint32_t	 mplslabel = 0;
 	int		 multipath = 0;
 
@@ -1555,6 +1567,12 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 		kr->priority = kf->priority;
 		kr->labelid = rtlabel_name2id(kf->label);
 
+		if (ktrie_add(&kt->krt_lpm, &kr->prefix, kr->prefixlen) == -1) {
+			log_warn("%s", __func__);
+			rtlabel_unref(kr->labelid);
+			free(kr);
+			return (-1);
+		}
 		if ((krm = RB_INSERT(kroute_tree, &kt->krt, kr)) != NULL) {
 			/* multipath route, add at end of list */
 			while (krm->next != NULL)
@@ -1595,6 +1613,13 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 		kr6->priority = kf->priority;
 		kr6->labelid = rtlabel_name2id(kf->label);
 
+		if (ktrie_add(&kt->krt6_lpm, &kr6->prefix,
+		    kr6->prefixlen) == -1) {
+			log_warn("%s", __func__);
+			rtlabel_unref(kr6->labelid);
+			free(kr6);
+			return (-1);
+		}
 		if ((kr6m = RB_INSERT(kroute6_tree, &kt->krt6, kr6)) != NULL) {
 			/* multipath route, add at end of list */
 			while (kr6m->next != NULL)
@@ -1612,12 +1637,8 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 		break;
 	}
 
-	if (bgpd_has_bgpnh() || !(kf->flags & F_BGPD)) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt))
-			if (prefix_compare(&kf->prefix, &n->nexthop,
-			    kf->prefixlen) == 0)
-				knexthop_validate(kt, n);
-	}
+	if (bgpd_has_bgpnh() || !(kf->flags & F_BGPD))
+		knexthop_revalidate(kt, kf);
 
 	if (!(kf->flags & F_BGPD)) {
 		/* redistribute multipath routes only once */
@@ -1684,16 +1705,13 @@ kroute4_remove(struct ktable *kt, struct kroute_full *kf, int any)
 		kr->next = krm->next;
 	}
 
-	/* check whether a nexthop depends on this kroute */
-	if (krm->flags & F_NEXTHOP) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt)) {
-			if (n->kroute == krm)
-				knexthop_validate(kt, n);
-		}
-	}
+	/* revalidate the nexthops depending on this kroute */
+	while ((n = LIST_FIRST(&krm->nexthops)) != NULL)
+		knexthop_validate(kt, n);
 
 	*kf = *kr_tofull(krm);
 
+	ktrie_del(&kt->krt_lpm, &krm->prefix, krm->prefixlen);
 	rtlabel_unref(krm->labelid);
 	free(krm);
 	return (multipath);
@@ -1753,16 +1771,13 @@ kroute6_remove(struct ktable *kt, struct kroute_full *kf, int any)
 		kr->next = krm->next;
 	}
 
-	/* check whether a nexthop depends on this kroute */
-	if (krm->flags & F_NEXTHOP) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt)) {
-			if (n->kroute == krm)
-				knexthop_validate(kt, n);
-		}
-	}
+	/* revalidate the nexthops depending on this kroute */
+	while ((n = LIST_FIRST(&krm->nexthops)) != NULL)
+		knexthop_validate(kt, n);
 
 	*kf = *kr6_tofull(krm);
 
+	ktrie_del(&kt->krt6_lpm, &krm->prefix, krm->prefixlen);
 	rtlabel_unref(krm->labelid);
 	free(krm);
 	return (multipath);
@@ -1926,12 +1941,25 @@ kif_find(int ifindex)
 int
 kif_insert(struct kif *kif)
 {
+	struct ktable	*kt;
+	struct knexthop	*kn;
+
+	LIST_INIT(&kif->nexthops);
 	if (RB_INSERT(kif_tree, &kit, kif) != NULL) {
 		log_warnx("RB_INSERT(kif_tree, &kit, kif)");
 		free(kif);
 		return (-1);
 	}
 
+	/* nexthops may already resolve over a route using this interface */
+	if ((kt = ktable_get(kif->rdomain)) != NULL)
+		RB_FOREACH(kn, knexthop_tree, KT2KNT(kt))
+			if (kn->kroute != NULL && kn->kif == NULL &&
+			    kn->ifindex == kif->ifindex) {
+				kn->kif = kif;
+				LIST_INSERT_HEAD(&kif->nexthops, kn, ifentry);
+			}
+
 	return (0);
 }
 
@@ -1939,6 +1967,7 @@ int
 kif_remove(struct kif *kif)
 {
 	struct ktable	*kt;
+	struct knexthop	*kn;
 
 	kif->flags &= ~IFF_UP;
 
@@ -1949,7 +1978,13 @@ kif_remove(struct kif *kif)
 	 */
 
 	if ((kt = ktable_get(kif->rdomain)) != NULL)
-		knexthop_track(kt, kif->ifindex);
+		knexthop_track(kt, kif);
+
+	/* routes still using the interface keep their nexthops */
+	while ((kn = LIST_FIRST(&kif->nexthops)) != NULL) {
+		LIST_REMOVE(kn, ifentry);
+		kn->kif = NULL;
+	}
 
 	RB_REMOVE(kif_tree, &kit, kif);
 	free(kif);
@@ -2090,6 +2125,14 @@ knexthop_true_nexthop(struct ktable *kt, struct kroute_full *kf)
 	return 1;
 }
 
+/* put kn on the list of the interface its route uses */
+static void
+knexthop_attach_kif(struct knexthop *kn)
+{
+	if ((kn->kif = kif_find(kn->ifindex)) != NULL)
+		LIST_INSERT_HEAD(&kn->kif->nexthops, kn, ifentry);
+}
+
 void
 knexthop_validate(struct ktable *kt, struct knexthop *kn)
 {
@@ -2111,6 +2154,8 @@ knexthop_validate(struct ktable *kt, struct knexthop *kn)
 			kn->kroute = kr;
 			kn->ifindex = kr->ifindex;
 			kr->flags |= F_NEXTHOP;
+			LIST_INSERT_HEAD(&kr->nexthops, kn, kentry);
+			knexthop_attach_kif(kn);
 		}
 
 		/*
@@ -2128,6 +2173,8 @@ knexthop_validate(struct ktable *kt, struct knexthop *kn)
 			kn->kroute = kr6;
 			kn->ifindex = kr6->ifindex;
 			kr6->flags |= F_NEXTHOP;
+			LIST_INSERT_HEAD(&kr6->nexthops, kn, kentry);
+			knexthop_attach_kif(kn);
 		}
 
 		if (kr6 != oldk)
@@ -2137,30 +2184,67 @@ knexthop_validate(struct ktable *kt, struct knexthop *kn)
 }
 
 /*
- * Called on interface state change.
+ * Called on interface state change, only the nexthops resolved over
+ * this interface are affected. Revalidation may put a nexthop back at
+ * the head of the list, the safe walk does not visit it twice.
  */
 void
-knexthop_track(struct ktable *kt, u_short ifindex)
+knexthop_track(struct ktable *kt, struct kif *kif)
 {
-	struct knexthop	*kn;
+	struct knexthop	*kn, *nkn;
 
-	RB_FOREACH(kn, knexthop_tree, KT2KNT(kt))
-		if (kn->ifindex == ifindex)
-			knexthop_validate(kt, kn);
+	LIST_FOREACH_SAFE(kn, &kif->nexthops, ifentry, nkn)
+		knexthop_validate(kt, kn);
 }
 
 /*
- * Called on route change.
+ * Called on route change, only the nexthops resolved by this route
+ * are affected.
  */
 void
 knexthop_update(struct ktable *kt, struct kroute_full *kf)
 {
+	struct kroute	*kr;
+	struct kroute6	*kr6;
 	struct knexthop	*kn;
 
-	RB_FOREACH(kn, knexthop_tree, KT2KNT(kt))
-		if (prefix_compare(&kf->prefix, &kn->nexthop,
-		    kf->prefixlen) == 0)
+	switch (kf->prefix.aid) {
+	case AID_INET:
+		if ((kr = kroute_find(kt, &kf->prefix, kf->prefixlen,
+		    kf->priority)) == NULL)
+			return;
+		LIST_FOREACH(kn, &kr->nexthops, kentry)
 			knexthop_send_update(kn);
+		break;
+	case AID_INET6:
+		if ((kr6 = kroute6_find(kt, &kf->prefix, kf->prefixlen,
+		    kf->priority)) == NULL)
+			return;
+		LIST_FOREACH(kn, &kr6->nexthops, kentry)
+			knexthop_send_update(kn);
+		break;
+	}
+}
+
+/*
+ * Called on route insertion, a new route may be a better match for any
+ * nexthop it covers. The knexthop tree is sorted by address so these
+ * nexthops are next to each other.
+ */
+void
+knexthop_revalidate(struct ktable *kt, struct kroute_full *kf)
+{
+	struct knexthop	 s, *kn;
+
+	if (kf->prefix.aid != AID_INET && kf->prefix.aid != AID_INET6)
+		return;
+
+	memset(&s, 0, sizeof(s));
+	applymask(&s.nexthop, &kf->prefix, kf->prefixlen);
+	for (kn = RB_NFIND(knexthop_tree, KT2KNT(kt), &s); kn != NULL &&
+	    prefix_compare(&kf->prefix, &kn->nexthop, kf->prefixlen) == 0;
+	    kn = RB_NEXT(knexthop_tree, KT2KNT(kt), kn))
+		knexthop_validate(kt, kn);
 }
 
 void
@@ -2220,10 +2304,13 @@ kroute_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
 	int			 i;
 	struct kroute		*kr;
 	struct bgpd_addr	 masked;
+	uint8_t			 plens[32 + 1];
 
-	for (i = 32; i >= 0; i--) {
-		applymask(&masked, key, i);
-		if ((kr = kroute_find(kt, &masked, i, RTP_ANY)) != NULL)
+	/* walk the covering prefixes from the most specific one */
+	i = ktrie_match(&kt->krt_lpm, &key->v4, plens);
+	while (--i >= 0) {
+		applymask(&masked, key, plens[i]);
+		if ((kr = kroute_find(kt, &masked, plens[i], RTP_ANY)) != NULL)
 			if (matchany || bgpd_oknexthop(kr_tofull(kr)))
 				return (kr);
 	}
@@ -2237,10 +2324,14 @@ kroute6_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
 	int			 i;
 	struct kroute6		*kr6;
 	struct bgpd_addr	 masked;
-
-	for (i = 128; i >= 0; i--) {
-		applymask(&masked, key, i);
-		if ((kr6 = kroute6_find(kt, &masked, i, RTP_ANY)) != NULL)
+	uint8_t			 plens[128 + 1];
+
+	/* walk the covering prefixes from the most specific one */
+	i = ktrie_match(&kt->krt6_lpm, &key->v6, plens);
+	while (--i >= 0) {
+		applymask(&masked, key, plens[i]);
+		if ((kr6 = kroute6_find(kt, &masked, plens[i],
+		    RTP_ANY)) != NULL)
 			if (matchany || bgpd_oknexthop(kr6_tofull(kr6)))
 				return (kr6);
 	}
@@ -2251,32 +2342,30 @@ kroute6_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
 void
 kroute_detach_nexthop(struct ktable *kt, struct knexthop *kn)
 {
-	struct knexthop	*s;
 	struct kroute	*k;
 	struct kroute6	*k6;
 
 	if (kn->kroute == NULL)
 		return;
 
-	/*
-	 * check whether there's another nexthop depending on this kroute
-	 * if not remove the flag
-	 */
-	RB_FOREACH(s, knexthop_tree, KT2KNT(kt))
-		if (s->kroute == kn->kroute && s != kn)
-			break;
+	if (kn->kif != NULL) {
+		LIST_REMOVE(kn, ifentry);
+		kn->kif = NULL;
+	}
 
-	if (s == NULL) {
-		switch (kn->nexthop.aid) {
-		case AID_INET:
-			k = kn->kroute;
+	/* remove the flag once no other nexthop depends on this kroute */
+	LIST_REMOVE(kn, kentry);
+	switch (kn->nexthop.aid) {
+	case AID_INET:
+		k = kn->kroute;
+		if (LIST_EMPTY(&k->nexthops))
 			k->flags &= ~F_NEXTHOP;
-			break;
-		case AID_INET6:
-			k6 = kn->kroute;
+		break;
+	case AID_INET6:
+		k6 = kn->kroute;
+		if (LIST_EMPTY(&k6->nexthops))
 			k6->flags &= ~F_NEXTHOP;
-			break;
-		}
+		break;
 	}
 
 	kn->kroute = NULL;
@@ -2505,7 +2594,7 @@ if_change(u_short ifindex, int flags, struct if_data *ifd)
 	if (kt == NULL)
 		return;
 
-	knexthop_track(kt, ifindex);
+	knexthop_track(kt, kif);
 }
 
 void
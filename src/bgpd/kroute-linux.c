@@ -34,10 +34,16 @@
 #include <libmnl/libmnl.h>
 #include <linux/rtnetlink.h>
 #include <linux/if.h>
+#ifdef HAVE_LINUX_NEXTHOP_H
+#include <linux/nexthop.h>
+#endif
 
 #define	RTP_ANY		0x0
 #define	RTP_MINE	0xff
 
+#define	KR_NHID_BASE	0x62670000	/* first kernel nexthop object id */
+#define	KR_NHID_TRIES	16
+
 enum {
 	RTM_ADD=1,
 	RTM_CHANGE,
@@ -55,20 +61,26 @@ u_int			  krt_size;
 
 struct {
 	struct mnl_socket	*nl;
+	struct mnl_socket	*nhnl;		/* for nexthop objects */
 	uint32_t		pid;
+	uint32_t		nhpid;
 	uint32_t		nlmsg_seq;
 	uint32_t		query_seq;
+	uint32_t		nhid_next;
+	int			nhobj;		/* use kernel nexthop objects */
 	uint8_t			fib_prio;
 } kr_state;
 
 struct kroute {
 	RB_ENTRY(kroute)	 entry;
+	LIST_HEAD(, knexthop)	 nexthops;
 	struct kroute		*next;
 	struct in_addr		 prefix;
 	struct in_addr		 nexthop;
 	uint32_t		 mplslabel;
 	uint16_t		 flags;
 	uint16_t		 labelid;
+	uint32_t		 nhid;		/* nexthop object in use */
 	u_short			 ifindex;
 	uint8_t			 prefixlen;
 	uint8_t			 priority;
@@ -76,6 +88,7 @@ struct kroute {
 
 struct kroute6 {
 	RB_ENTRY(kroute6)	 entry;
+	LIST_HEAD(, knexthop)	 nexthops;
 	struct kroute6		*next;
 	struct in6_addr		 prefix;
 	struct in6_addr		 nexthop;
@@ -84,6 +97,7 @@ struct kroute6 {
 	uint32_t		 mplslabel;
 	uint16_t		 flags;
 	uint16_t		 labelid;
+	uint32_t		 nhid;		/* nexthop object in use */
 	u_short			 ifindex;
 	uint8_t			 prefixlen;
 	uint8_t			 priority;
@@ -91,11 +105,26 @@ struct kroute6 {
 
 struct knexthop {
 	RB_ENTRY(knexthop)	 entry;
+	LIST_ENTRY(knexthop)	 kentry;	/* list on kroute */
+	LIST_ENTRY(knexthop)	 ifentry;	/* list on kif */
 	struct bgpd_addr	 nexthop;
 	void			*kroute;
+	struct kif		*kif;
+	struct bgpd_addr	 nhgw;		/* gateway of nexthop object */
+	uint32_t		 nhid;		/* kernel nexthop object id */
+	u_short			 nhoif;		/* ifindex of nexthop object */
 	u_short			 ifindex;
 };
 
+#ifdef HAVE_LINUX_NEXTHOP_H
+/* a kernel nexthop object, referenced by its knexthop and its routes */
+struct knhobj {
+	RB_ENTRY(knhobj)	 entry;
+	uint32_t		 id;
+	uint32_t		 refcnt;
+};
+#endif
+
 struct kredist_node {
 	RB_ENTRY(kredist_node)	 entry;
 	struct bgpd_addr	 prefix;
@@ -106,6 +135,7 @@ struct kredist_node {
 
 struct kif {
 	RB_ENTRY(kif)		 entry;
+	LIST_HEAD(, knexthop)	 nexthops;	/* resolved over this kif */
 	char			 ifname[IFNAMSIZ];
 	uint64_t		 baudrate;
 	u_int			 rdomain;
@@ -167,9 +197,18 @@ int		 kroute_validate(struct kroute *);
 int		 kroute6_validate(struct kroute6 *);
 int		 knexthop_true_nexthop(struct ktable *, struct kroute_full *);
 void		 knexthop_validate(struct ktable *, struct knexthop *);
-void		 knexthop_track(struct ktable *, u_short);
+void		 knexthop_track(struct ktable *, struct kif *);
 void		 knexthop_update(struct ktable *, struct kroute_full *);
+void		 knexthop_revalidate(struct ktable *, struct kroute_full *);
 void		 knexthop_send_update(struct knexthop *);
+#ifdef HAVE_LINUX_NEXTHOP_H
+uint32_t	 knexthop_nhobj_get(struct ktable *, struct kroute_full *);
+void		 knexthop_nhobj_sync(struct knexthop *);
+void		 knexthop_nhobj_delete(struct knexthop *);
+int		 knhobj_compare(struct knhobj *, struct knhobj *);
+void		 knhobj_ref(uint32_t);
+void		 knhobj_unref(uint32_t);
+#endif
 struct kroute	*kroute_match(struct ktable *, struct bgpd_addr *, int);
 struct kroute6	*kroute6_match(struct ktable *, struct bgpd_addr *, int);
 void		 kroute_detach_nexthop(struct ktable *, struct knexthop *);
@@ -184,7 +223,8 @@ void		if_change(u_short, int, struct if_data *);
 #endif
 const char	*get_linkstate(uint8_t, int);
 
-int		send_rtmsg(int, struct ktable *, struct kroute_full *);
+int		send_rtmsg(int, struct ktable *, struct kroute_full *,
+		    uint32_t *);
 int		dispatch_rtmsg(void);
 int		fetchtable(struct ktable *);
 int		fetchifs(int);
@@ -203,6 +243,12 @@ RB_GENERATE(kroute6_tree, kroute6, entry, kroute6_compare)
 RB_PROTOTYPE(knexthop_tree, knexthop, entry, knexthop_compare)
 RB_GENERATE(knexthop_tree, knexthop, entry, knexthop_compare)
 
+#ifdef HAVE_LINUX_NEXTHOP_H
+RB_HEAD(knhobj_tree, knhobj)	knhobjs = RB_INITIALIZER(&knhobjs);
+RB_PROTOTYPE(knhobj_tree, knhobj, entry, knhobj_compare)
+RB_GENERATE(knhobj_tree, knhobj, entry, knhobj_compare)
+#endif
+
 RB_PROTOTYPE(kredist_tree, kredist_node, entry, kredist_compare)
 RB_GENERATE(kredist_tree, kredist_node, entry, kredist_compare)
 
@@ -240,6 +286,22 @@ kr_init(int *fd, uint8_t fib_prio)
 	kr_state.pid = mnl_socket_get_portid(kr_state.nl);
 	kr_state.nlmsg_seq = 1;
 	kr_state.fib_prio = fib_prio;
+#ifdef HAVE_LINUX_NEXTHOP_H
+	kr_state.nhid_next = KR_NHID_BASE;
+	kr_state.nhobj = 1;
+
+	/*
+	 * Nexthop object requests wait for their ack on a socket of their
+	 * own so that it can't be confused with route messages.
+	 */
+	kr_state.nhnl = mnl_socket_open2(NETLINK_ROUTE, SOCK_CLOEXEC);
+	if (kr_state.nhnl == NULL ||
+	    mnl_socket_bind(kr_state.nhnl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		log_warn("%s: nexthop object socket", __func__);
+		kr_state.nhobj = 0;
+	} else
+		kr_state.nhpid = mnl_socket_get_portid(kr_state.nhnl);
+#endif
 
 	RB_INIT(&kit);
 
@@ -299,6 +361,8 @@ ktable_new(u_int rtableid, u_int rdomid, char *name, int fs)
 	strlcpy(kt->descr, name, sizeof(kt->descr));
 	RB_INIT(&kt->krt);
 	RB_INIT(&kt->krt6);
+	ktrie_init(&kt->krt_lpm, sizeof(struct in_addr));
+	ktrie_init(&kt->krt6_lpm, sizeof(struct in6_addr));
 	RB_INIT(&kt->knt);
 	TAILQ_INIT(&kt->krn);
 	kt->fib_conf = kt->fib_sync = fs;
@@ -359,6 +423,8 @@ ktable_destroy(struct ktable *kt)
 		knexthop_clear(kt);
 	kroute_clear(kt);
 	kroute6_clear(kt);
+	ktrie_free(&kt->krt_lpm);
+	ktrie_free(&kt->krt6_lpm);
 	knexthop_clear(kt);
 	kr_net_clear(kt);
 
@@ -495,7 +561,7 @@ kr4_change(struct ktable *kt, struct kroute_full *kf)
 		if (kr->flags & F_NEXTHOP)
 			knexthop_update(kt, kf);
 
-		if (send_rtmsg(RTM_CHANGE, kt, kf))
+		if (send_rtmsg(RTM_CHANGE, kt, kf, &kr->nhid))
 			kr->flags |= F_BGPD_INSERTED;
 	}
 
@@ -536,7 +602,7 @@ kr6_change(struct ktable *kt, struct kroute_full *kf)
 		if (kr6->flags & F_NEXTHOP)
 			knexthop_update(kt, kf);
 
-		if (send_rtmsg(RTM_CHANGE, kt, kf))
+		if (send_rtmsg(RTM_CHANGE, kt, kf, &kr6->nhid))
 			kr6->flags |= F_BGPD_INSERTED;
 	}
 
@@ -589,7 +655,7 @@ krVPN4_change(struct ktable *kt, struct kroute_full *kf)
 		else
 			kr->flags &= ~F_REJECT;
 
-		if (send_rtmsg(RTM_CHANGE, kt, kf))
+		if (send_rtmsg(RTM_CHANGE, kt, kf, &kr->nhid))
 			kr->flags |= F_BGPD_INSERTED;
 	}
 
@@ -642,7 +708,7 @@ krVPN6_change(struct ktable *kt, struct kroute_full *kf)
 		else
 			kr6->flags &= ~F_REJECT;
 
-		if (send_rtmsg(RTM_CHANGE, kt, kf))
+		if (send_rtmsg(RTM_CHANGE, kt, kf, &kr6->nhid))
 			kr6->flags |= F_BGPD_INSERTED;
 	}
 
@@ -699,6 +765,10 @@ kr_shutdown(void)
 	kif_clear();
 	free(krt);
 	mnl_socket_close(kr_state.nl);
+#ifdef HAVE_LINUX_NEXTHOP_H
+	if (kr_state.nhnl != NULL)
+		mnl_socket_close(kr_state.nhnl);
+#endif
 }
 
 void
@@ -718,12 +788,13 @@ kr_fib_couple(u_int rtableid)
 
 	RB_FOREACH(kr, kroute_tree, &kt->krt)
 		if (kr->flags & F_BGPD) {
-			if (send_rtmsg(RTM_ADD, kt, kr_tofull(kr)))
+			if (send_rtmsg(RTM_ADD, kt, kr_tofull(kr), &kr->nhid))
 				kr->flags |= F_BGPD_INSERTED;
 		}
 	RB_FOREACH(kr6, kroute6_tree, &kt->krt6)
 		if (kr6->flags & F_BGPD) {
-			if (send_rtmsg(RTM_ADD, kt, kr6_tofull(kr6)))
+			if (send_rtmsg(RTM_ADD, kt, kr6_tofull(kr6),
+			    &kr6->nhid))
 				kr6->flags |= F_BGPD_INSERTED;
 		}
 	log_info("kernel routing table %u (%s) coupled", kt->rtableid,
@@ -754,12 +825,14 @@ kr_fib_decouple(u_int rtableid)
 
 	RB_FOREACH(kr, kroute_tree, &kt->krt)
 		if ((kr->flags & F_BGPD_INSERTED)) {
-			if (send_rtmsg(RTM_DELETE, kt, kr_tofull(kr)))
+			if (send_rtmsg(RTM_DELETE, kt, kr_tofull(kr),
+			    &kr->nhid))
 				kr->flags &= ~F_BGPD_INSERTED;
 		}
 	RB_FOREACH(kr6, kroute6_tree, &kt->krt6)
 		if ((kr6->flags & F_BGPD_INSERTED)) {
-			if (send_rtmsg(RTM_DELETE, kt, kr6_tofull(kr6)))
+			if (send_rtmsg(RTM_DELETE, kt, kr6_tofull(kr6),
+			    &kr6->nhid))
 				kr6->flags &= ~F_BGPD_INSERTED;
 		}
 
@@ -1005,6 +1078,8 @@ kr_show_route(struct imsg *imsg)
 			/* do not leak internal information */
 			RB_INIT(&ktab.krt);
 			RB_INIT(&ktab.krt6);
+			ktrie_init(&ktab.krt_lpm, 0);
+			ktrie_init(&ktab.krt6_lpm, 0);
 			RB_INIT(&ktab.knt);
 			TAILQ_INIT(&ktab.krn);
 
@@ -1615,7 +1690,6 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 {
 	struct kroute	*kr, *krm;
 	struct kroute6	*kr6, *kr6m;
-	struct knexthop	*n;
 	uint32_t	 mplslabel = 0;
 	int		 multipath = 0;
 
@@ -1654,6 +1728,12 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 		kr->priority = kf->priority;
 		kr->labelid = rtlabel_name2id(kf->label);
 
+		if (ktrie_add(&kt->krt_lpm, &kr->prefix, kr->prefixlen) == -1) {
+			log_warn("%s", __func__);
+			rtlabel_unref(kr->labelid);
+			free(kr);
+			return (-1);
+		}
 		if ((krm = RB_INSERT(kroute_tree, &kt->krt, kr)) != NULL) {
 			/* multipath route, add at end of list */
 			while (krm->next != NULL)
@@ -1663,7 +1743,7 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 		}
 
 		if (kf->flags & F_BGPD)
-			if (send_rtmsg(RTM_ADD, kt, kf))
+			if (send_rtmsg(RTM_ADD, kt, kf, &kr->nhid))
 				kr->flags |= F_BGPD_INSERTED;
 		break;
 	case AID_INET6:
@@ -1691,6 +1771,13 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 		kr6->priority = kf->priority;
 		kr6->labelid = rtlabel_name2id(kf->label);
 
+		if (ktrie_add(&kt->krt6_lpm, &kr6->prefix,
+		    kr6->prefixlen) == -1) {
+			log_warn("%s", __func__);
+			rtlabel_unref(kr6->labelid);
+			free(kr6);
+			return (-1);
+		}
 		if ((kr6m = RB_INSERT(kroute6_tree, &kt->krt6, kr6)) != NULL) {
 			/* multipath route, add at end of list */
 			while (kr6m->next != NULL)
@@ -1700,17 +1787,13 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 		}
 
 		if (kf->flags & F_BGPD)
-			if (send_rtmsg(RTM_ADD, kt, kf))
+			if (send_rtmsg(RTM_ADD, kt, kf, &kr6->nhid))
 				kr6->flags |= F_BGPD_INSERTED;
 		break;
 	}
 
-	if (bgpd_has_bgpnh() || !(kf->flags & F_BGPD)) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt))
-			if (prefix_compare(&kf->prefix, &n->nexthop,
-			    kf->prefixlen) == 0)
-				knexthop_validate(kt, n);
-	}
+	if (bgpd_has_bgpnh() || !(kf->flags & F_BGPD))
+		knexthop_revalidate(kt, kf);
 
 	if (!(kf->flags & F_BGPD)) {
 		/* redistribute multipath routes only once */
@@ -1723,7 +1806,8 @@ kroute_insert(struct ktable *kt, struct kroute_full *kf)
 
 
 static int
-kroute4_remove(struct ktable *kt, struct kroute_full *kf, int any)
+kroute4_remove(struct ktable *kt, struct kroute_full *kf, int any,
+    uint32_t *nhid)
 {
 	struct kroute	*kr, *krm;
 	struct knexthop	*n;
@@ -1777,23 +1861,22 @@ kroute4_remove(struct ktable *kt, struct kroute_full *kf, int any)
 		kr->next = krm->next;
 	}
 
-	/* check whether a nexthop depends on this kroute */
-	if (krm->flags & F_NEXTHOP) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt)) {
-			if (n->kroute == krm)
-				knexthop_validate(kt, n);
-		}
-	}
+	/* revalidate the nexthops depending on this kroute */
+	while ((n = LIST_FIRST(&krm->nexthops)) != NULL)
+		knexthop_validate(kt, n);
 
 	*kf = *kr_tofull(krm);
+	*nhid = krm->nhid;
 
+	ktrie_del(&kt->krt_lpm, &krm->prefix, krm->prefixlen);
 	rtlabel_unref(krm->labelid);
 	free(krm);
 	return (multipath);
 }
 
 static int
-kroute6_remove(struct ktable *kt, struct kroute_full *kf, int any)
+kroute6_remove(struct ktable *kt, struct kroute_full *kf, int any,
+    uint32_t *nhid)
 {
 	struct kroute6	*kr, *krm;
 	struct knexthop	*n;
@@ -1846,16 +1929,14 @@ kroute6_remove(struct ktable *kt, struct kroute_full *kf, int any)
 		kr->next = krm->next;
 	}
 
-	/* check whether a nexthop depends on this kroute */
-	if (krm->flags & F_NEXTHOP) {
-		RB_FOREACH(n, knexthop_tree, KT2KNT(kt)) {
-			if (n->kroute == krm)
-				knexthop_validate(kt, n);
-		}
-	}
+	/* revalidate the nexthops depending on this kroute */
+	while ((n = LIST_FIRST(&krm->nexthops)) != NULL)
+		knexthop_validate(kt, n);
 
 	*kf = *kr6_tofull(krm);
+	*nhid = krm->nhid;
 
+	ktrie_del(&kt->krt6_lpm, &krm->prefix, krm->prefixlen);
 	rtlabel_unref(krm->labelid);
 	free(krm);
 	return (multipath);
@@ -1865,14 +1946,15 @@ kroute6_remove(struct ktable *kt, struct kroute_full *kf, int any)
 int
 kroute_remove(struct ktable *kt, struct kroute_full *kf, int any)
 {
+	uint32_t nhid = 0;
 	int multipath;
 
 	switch (kf->prefix.aid) {
 	case AID_INET:
-		multipath = kroute4_remove(kt, kf, any);
+		multipath = kroute4_remove(kt, kf, any, &nhid);
 		break;
 	case AID_INET6:
-		multipath = kroute6_remove(kt, kf, any);
+		multipath = kroute6_remove(kt, kf, any, &nhid);
 		break;
 	default:
 		log_warnx("%s: not handled AID", __func__);
@@ -1883,7 +1965,11 @@ kroute_remove(struct ktable *kt, struct kroute_full *kf, int any)
 		return (multipath + 1);
 
 	if (kf->flags & F_BGPD_INSERTED)
-		send_rtmsg(RTM_DELETE, kt, kf);
+		send_rtmsg(RTM_DELETE, kt, kf, &nhid);
+#ifdef HAVE_LINUX_NEXTHOP_H
+	/* the route is gone, drop its reference if the delete did not */
+	knhobj_unref(nhid);
+#endif
 
 	/* remove only once all multipath routes are gone */
 	if (!(kf->flags & F_BGPD) && !multipath)
@@ -1990,6 +2076,9 @@ knexthop_insert(struct ktable *kt, struct knexthop *kn)
 void
 knexthop_remove(struct ktable *kt, struct knexthop *kn)
 {
+#ifdef HAVE_LINUX_NEXTHOP_H
+	knexthop_nhobj_delete(kn);
+#endif
 	kroute_detach_nexthop(kt, kn);
 	RB_REMOVE(knexthop_tree, KT2KNT(kt), kn);
 	free(kn);
@@ -2021,12 +2110,25 @@ kif_find(int ifindex)
 int
 kif_insert(struct kif *kif)
 {
+	struct ktable	*kt;
+	struct knexthop	*kn;
+
+	LIST_INIT(&kif->nexthops);
 	if (RB_INSERT(kif_tree, &kit, kif) != NULL) {
 		log_warnx("RB_INSERT(kif_tree, &kit, kif)");
 		free(kif);
 		return (-1);
 	}
 
+	/* nexthops may already resolve over a route using this interface */
+	if ((kt = ktable_get(kif->rdomain)) != NULL)
+		RB_FOREACH(kn, knexthop_tree, KT2KNT(kt))
+			if (kn->kroute != NULL && kn->kif == NULL &&
+			    kn->ifindex == kif->ifindex) {
+				kn->kif = kif;
+				LIST_INSERT_HEAD(&kif->nexthops, kn, ifentry);
+			}
+
 	return (0);
 }
 
@@ -2034,6 +2136,7 @@ int
 kif_remove(struct kif *kif)
 {
 	struct ktable	*kt;
+	struct knexthop	*kn;
 
 	kif->flags &= ~IFF_UP;
 
@@ -2044,7 +2147,13 @@ kif_remove(struct kif *kif)
 	 */
 
 	if ((kt = ktable_get(kif->rdomain)) != NULL)
-		knexthop_track(kt, kif->ifindex);
+		knexthop_track(kt, kif);
+
+	/* routes still using the interface keep their nexthops */
+	while ((kn = LIST_FIRST(&kif->nexthops)) != NULL) {
+		LIST_REMOVE(kn, ifentry);
+		kn->kif = NULL;
+	}
 
 	RB_REMOVE(kif_tree, &kit, kif);
 	free(kif);
@@ -2190,6 +2299,14 @@ knexthop_true_nexthop(struct ktable *kt, struct kroute_full *kf)
 	return 1;
 }
 
+/* put kn on the list of the interface its route uses */
+static void
+knexthop_attach_kif(struct knexthop *kn)
+{
+	if ((kn->kif = kif_find(kn->ifindex)) != NULL)
+		LIST_INSERT_HEAD(&kn->kif->nexthops, kn, ifentry);
+}
+
 void
 knexthop_validate(struct ktable *kt, struct knexthop *kn)
 {
@@ -2211,6 +2328,8 @@ knexthop_validate(struct ktable *kt, struct knexthop *kn)
 			kn->kroute = kr;
 			kn->ifindex = kr->ifindex;
 			kr->flags |= F_NEXTHOP;
+			LIST_INSERT_HEAD(&kr->nexthops, kn, kentry);
+			knexthop_attach_kif(kn);
 		}
 
 		/*
@@ -2228,6 +2347,8 @@ knexthop_validate(struct ktable *kt, struct knexthop *kn)
 			kn->kroute = kr6;
 			kn->ifindex = kr6->ifindex;
 			kr6->flags |= F_NEXTHOP;
+			LIST_INSERT_HEAD(&kr6->nexthops, kn, kentry);
+			knexthop_attach_kif(kn);
 		}
 
 		if (kr6 != oldk)
@@ -2237,30 +2358,67 @@ knexthop_validate(struct ktable *kt, struct knexthop *kn)
 }
 
 /*
- * Called on interface state change.
+ * Called on interface state change, only the nexthops resolved over
+ * this interface are affected. Revalidation may put a nexthop back at
+ * the head of the list, the safe walk does not visit it twice.
  */
 void
-knexthop_track(struct ktable *kt, u_short ifindex)
+knexthop_track(struct ktable *kt, struct kif *kif)
 {
-	struct knexthop	*kn;
+	struct knexthop	*kn, *nkn;
 
-	RB_FOREACH(kn, knexthop_tree, KT2KNT(kt))
-		if (kn->ifindex == ifindex)
-			knexthop_validate(kt, kn);
+	LIST_FOREACH_SAFE(kn, &kif->nexthops, ifentry, nkn)
+		knexthop_validate(kt, kn);
 }
 
 /*
- * Called on route change.
+ * Called on route change, only the nexthops resolved by this route
+ * are affected.
  */
 void
 knexthop_update(struct ktable *kt, struct kroute_full *kf)
 {
+	struct kroute	*kr;
+	struct kroute6	*kr6;
 	struct knexthop	*kn;
 
-	RB_FOREACH(kn, knexthop_tree, KT2KNT(kt))
-		if (prefix_compare(&kf->prefix, &kn->nexthop,
-		    kf->prefixlen) == 0)
+	switch (kf->prefix.aid) {
+	case AID_INET:
+		if ((kr = kroute_find(kt, &kf->prefix, kf->prefixlen,
+		    kf->priority)) == NULL)
+			return;
+		LIST_FOREACH(kn, &kr->nexthops, kentry)
 			knexthop_send_update(kn);
+		break;
+	case AID_INET6:
+		if ((kr6 = kroute6_find(kt, &kf->prefix, kf->prefixlen,
+		    kf->priority)) == NULL)
+			return;
+		LIST_FOREACH(kn, &kr6->nexthops, kentry)
+			knexthop_send_update(kn);
+		break;
+	}
+}
+
+/*
+ * Called on route insertion, a new route may be a better match for any
+ * nexthop it covers. The knexthop tree is sorted by address so these
+ * nexthops are next to each other.
+ */
+void
+knexthop_revalidate(struct ktable *kt, struct kroute_full *kf)
+{
+	struct knexthop	 s, *kn;
+
+	if (kf->prefix.aid != AID_INET && kf->prefix.aid != AID_INET6)
+		return;
+
+	memset(&s, 0, sizeof(s));
+	applymask(&s.nexthop, &kf->prefix, kf->prefixlen);
+	for (kn = RB_NFIND(knexthop_tree, KT2KNT(kt), &s); kn != NULL &&
+	    prefix_compare(&kf->prefix, &kn->nexthop, kf->prefixlen) == 0;
+	    kn = RB_NEXT(knexthop_tree, KT2KNT(kt), kn))
+		knexthop_validate(kt, kn);
 }
 
 void
@@ -2270,6 +2428,10 @@ knexthop_send_update(struct knexthop *kn)
 	struct kroute		*kr;
 	struct kroute6		*kr6;
 
+#ifdef HAVE_LINUX_NEXTHOP_H
+	knexthop_nhobj_sync(kn);
+#endif
+
 	memset(&n, 0, sizeof(n));
 	n.nexthop = kn->nexthop;
 
@@ -2320,10 +2482,13 @@ kroute_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
 	int			 i;
 	struct kroute		*kr;
 	struct bgpd_addr	 masked;
+	uint8_t			 plens[32 + 1];
 
-	for (i = 32; i >= 0; i--) {
-		applymask(&masked, key, i);
-		if ((kr = kroute_find(kt, &masked, i, RTP_ANY)) != NULL)
+	/* walk the covering prefixes from the most specific one */
+	i = ktrie_match(&kt->krt_lpm, &key->v4, plens);
+	while (--i >= 0) {
+		applymask(&masked, key, plens[i]);
+		if ((kr = kroute_find(kt, &masked, plens[i], RTP_ANY)) != NULL)
 			if (matchany || bgpd_oknexthop(kr_tofull(kr)))
 				return (kr);
 	}
@@ -2337,10 +2502,14 @@ kroute6_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
 	int			 i;
 	struct kroute6		*kr6;
 	struct bgpd_addr	 masked;
-
-	for (i = 128; i >= 0; i--) {
-		applymask(&masked, key, i);
-		if ((kr6 = kroute6_find(kt, &masked, i, RTP_ANY)) != NULL)
+	uint8_t			 plens[128 + 1];
+
+	/* walk the covering prefixes from the most specific one */
+	i = ktrie_match(&kt->krt6_lpm, &key->v6, plens);
+	while (--i >= 0) {
+		applymask(&masked, key, plens[i]);
+		if ((kr6 = kroute6_find(kt, &masked, plens[i],
+		    RTP_ANY)) != NULL)
 			if (matchany || bgpd_oknexthop(kr6_tofull(kr6)))
 				return (kr6);
 	}
@@ -2351,32 +2520,30 @@ kroute6_match(struct ktable *kt, struct bgpd_addr *key, int matchany)
 void
 kroute_detach_nexthop(struct ktable *kt, struct knexthop *kn)
 {
-	struct knexthop	*s;
 	struct kroute	*k;
 	struct kroute6	*k6;
 
 	if (kn->kroute == NULL)
 		return;
 
-	/*
-	 * check whether there's another nexthop depending on this kroute
-	 * if not remove the flag
-	 */
-	RB_FOREACH(s, knexthop_tree, KT2KNT(kt))
-		if (s->kroute == kn->kroute && s != kn)
-			break;
+	if (kn->kif != NULL) {
+		LIST_REMOVE(kn, ifentry);
+		kn->kif = NULL;
+	}
 
-	if (s == NULL) {
-		switch (kn->nexthop.aid) {
-		case AID_INET:
-			k = kn->kroute;
+	/* remove the flag once no other nexthop depends on this kroute */
+	LIST_REMOVE(kn, kentry);
+	switch (kn->nexthop.aid) {
+	case AID_INET:
+		k = kn->kroute;
+		if (LIST_EMPTY(&k->nexthops))
 			k->flags &= ~F_NEXTHOP;
-			break;
-		case AID_INET6:
-			k6 = kn->kroute;
+		break;
+	case AID_INET6:
+		k6 = kn->kroute;
+		if (LIST_EMPTY(&k6->nexthops))
 			k6->flags &= ~F_NEXTHOP;
-			break;
-		}
+		break;
 	}
 
 	kn->kroute = NULL;
@@ -2574,7 +2741,7 @@ if_change(u_short ifindex, int flags, struct if_data *ifd)
 	if (kt == NULL)
 		return;
 
-	knexthop_track(kt, ifindex);
+	knexthop_track(kt, kif);
 }
 #endif
 
@@ -2620,7 +2787,7 @@ if_announce(const struct nlmsghdr *nlh, const char *name)
 		if (kt == NULL)
 			return;
 
-		knexthop_track(kt, kif->ifindex);
+		knexthop_track(kt, kif);
 			break;
 	case RTM_DELLINK:
 		kif = kif_find(ifi->ifi_index);
@@ -2640,15 +2807,25 @@ get_mpe_config(const char *name, u_int *rdomain, u_int *label)
  * rtsock related functions
  */
 int
-send_rtmsg(int action, struct ktable *kt, struct kroute_full *kf)
+send_rtmsg(int action, struct ktable *kt, struct kroute_full *kf,
+    uint32_t *nhidp)
 {
 	char buf[MNL_SOCKET_BUFFER_SIZE];
 	struct nlmsghdr *nlh;
 	struct rtmsg *rtm;
+	uint32_t nhid = 0;
+	int gateway;
 
 	if (!kt->fib_sync)
 		return (0);
 
+#ifdef HAVE_LINUX_NEXTHOP_H
+	/* point the route at the shared nexthop object if possible */
+	if (action != RTM_DELETE && !(kf->flags & (F_BLACKHOLE|F_REJECT)) &&
+	    kf->nexthop.aid == kf->prefix.aid)
+		nhid = knexthop_nhobj_get(ktable_get(kt->nhtableid), kf);
+#endif
+
 	nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
 	switch (action) {
@@ -2678,17 +2855,24 @@ send_rtmsg(int action, struct ktable *kt, struct kroute_full *kf)
 	rtm->rtm_scope = RT_SCOPE_UNIVERSE;
 	rtm->rtm_flags = 0;
 
+	/*
+	 * A route using a nexthop object does not match a delete request
+	 * carrying a gateway, so delete by prefix and protocol in that case.
+	 */
+	gateway = kf->nexthop.aid != AID_UNSPEC && nhid == 0 &&
+	    !(action == RTM_DELETE && kr_state.nhobj);
+
 	switch (kf->prefix.aid) {
 	case AID_INET:
 		mnl_attr_put_u32(nlh, RTA_DST, kf->prefix.v4.s_addr);
-		if (kf->nexthop.aid != AID_UNSPEC)
+		if (gateway)
 			mnl_attr_put_u32(nlh, RTA_GATEWAY,
 			    kf->nexthop.v4.s_addr);
 		break;
 	case AID_INET6:
 		mnl_attr_put(nlh, RTA_DST, sizeof(struct in6_addr),
 		    &kf->prefix.v6);
-		if (kf->nexthop.aid != AID_UNSPEC)
+		if (gateway)
 			mnl_attr_put(nlh, RTA_GATEWAY, sizeof(struct in6_addr),
 			    &kf->nexthop.v6);
 		break;
@@ -2697,6 +2881,10 @@ send_rtmsg(int action, struct ktable *kt, struct kroute_full *kf)
 		    aid2str(kf->prefix.aid));
 		return (-1);
 	}
+#ifdef HAVE_LINUX_NEXTHOP_H
+	if (nhid != 0)
+		mnl_attr_put_u32(nlh, RTA_NH_ID, nhid);
+#endif
 
 	if (mnl_socket_sendto(kr_state.nl, nlh, nlh->nlmsg_len) < 0) {
 		log_warn("%s: action %u, prefix %s/%u", __func__,
@@ -2704,12 +2892,253 @@ send_rtmsg(int action, struct ktable *kt, struct kroute_full *kf)
 		    kf->prefixlen);
 		return (0);
 	}
+#ifdef HAVE_LINUX_NEXTHOP_H
+	/* routes hold a reference on the nexthop object they use */
+	if (*nhidp != nhid) {
+		knhobj_ref(nhid);
+		knhobj_unref(*nhidp);
+		*nhidp = nhid;
+	}
+#endif
 	if (dispatch_rtmsg() == -1)
 		return (0);
 
 	return (1);
 }
 
+#ifdef HAVE_LINUX_NEXTHOP_H
+/*
+ * Kernel nexthop objects: every tracked BGP nexthop gets a nexthop object
+ * pointing at the gateway and interface it currently resolves to. Routes
+ * using that BGP nexthop are installed with RTA_NH_ID so a change of the
+ * resolving route is a single RTM_NEWNEXTHOP instead of one RTM_NEWROUTE
+ * per prefix. Objects are created on first use and are refcounted by
+ * their knexthop and by the routes using them. Deleting an object makes
+ * the kernel drop all routes pointing at it, so it is only deleted once
+ * the last reference is gone. If the kernel does not support them routes
+ * are programmed with RTA_GATEWAY as before.
+ */
+static int
+knexthop_nhobj_gateway(struct knexthop *kn, struct bgpd_addr *gw,
+    u_short *oif)
+{
+	struct kroute	*kr;
+	struct kroute6	*kr6;
+
+	if (kn->kroute == NULL || kn->ifindex == 0)
+		return (-1);
+
+	*gw = kn->nexthop;
+	*oif = kn->ifindex;
+	switch (kn->nexthop.aid) {
+	case AID_INET:
+		kr = kn->kroute;
+		if (!kroute_validate(kr))
+			return (-1);
+		if (!(kr->flags & F_CONNECTED))
+			gw->v4 = kr->nexthop;
+		break;
+	case AID_INET6:
+		kr6 = kn->kroute;
+		if (!kroute6_validate(kr6))
+			return (-1);
+		if (!(kr6->flags & F_CONNECTED)) {
+			gw->v6 = kr6->nexthop;
+			gw->scope_id = kr6->nexthop_scope_id;
+		}
+		break;
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Send a nexthop object request with id and wait for the kernel's answer.
+ * kn supplies the gateway for RTM_NEWNEXTHOP. Returns -1 with errno set
+ * if the request failed.
+ */
+static int
+send_nhmsg(int type, uint16_t flags, uint32_t id, struct knexthop *kn)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct nhmsg *nhm;
+	uint32_t seq;
+	ssize_t n;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nlh->nlmsg_seq = seq = kr_next_seq();
+
+	nhm = mnl_nlmsg_put_extra_header(nlh, sizeof *nhm);
+	nhm->nh_family = AF_UNSPEC;
+	nhm->nh_protocol = kr_state.fib_prio;
+
+	mnl_attr_put_u32(nlh, NHA_ID, id);
+	if (type == RTM_NEWNEXTHOP) {
+		nhm->nh_family = aid2af(kn->nexthop.aid);
+		mnl_attr_put_u32(nlh, NHA_OIF, kn->nhoif);
+		switch (kn->nhgw.aid) {
+		case AID_INET:
+			mnl_attr_put_u32(nlh, NHA_GATEWAY,
+			    kn->nhgw.v4.s_addr);
+			break;
+		case AID_INET6:
+			mnl_attr_put(nlh, NHA_GATEWAY, sizeof(struct in6_addr),
+			    &kn->nhgw.v6);
+			break;
+		}
+	}
+
+	if (mnl_socket_sendto(kr_state.nhnl, nlh, nlh->nlmsg_len) < 0)
+		return (-1);
+
+	/* nothing but the answers to our requests arrives on this socket */
+	for (;;) {
+		n = mnl_socket_recvfrom(kr_state.nhnl, buf, sizeof(buf));
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		switch (mnl_cb_run(buf, n, seq, kr_state.nhpid, NULL, NULL)) {
+		case MNL_CB_STOP:
+			return (0);
+		case MNL_CB_ERROR:
+			return (-1);
+		}
+	}
+}
+
+/*
+ * Return the nexthop object to use for route kf, creating it if needed.
+ * Returns 0 if the route needs to be programmed with a gateway.
+ */
+uint32_t
+knexthop_nhobj_get(struct ktable *kt, struct kroute_full *kf)
+{
+	struct knexthop	*kn;
+	struct knhobj	*nho;
+	int		 i;
+
+	if (!kr_state.nhobj || kt == NULL)
+		return (0);
+	if ((kn = knexthop_find(kt, &kf->nexthop)) == NULL)
+		return (0);
+	if (kn->nhid != 0)
+		return (kn->nhid);
+	if (knexthop_nhobj_gateway(kn, &kn->nhgw, &kn->nhoif) == -1)
+		return (0);
+
+	for (i = 0; i < KR_NHID_TRIES; i++) {
+		if (kr_state.nhid_next == 0)
+			kr_state.nhid_next = KR_NHID_BASE;
+		kn->nhid = kr_state.nhid_next++;
+		if (send_nhmsg(RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_EXCL,
+		    kn->nhid, kn) == 0) {
+			if ((nho = calloc(1, sizeof(*nho))) == NULL)
+				fatal(NULL);
+			nho->id = kn->nhid;
+			nho->refcnt = 1;	/* the reference of kn */
+			RB_INSERT(knhobj_tree, &knhobjs, nho);
+			return (kn->nhid);
+		}
+		/* id used by someone else, try the next one */
+		if (errno != EEXIST)
+			break;
+	}
+	kn->nhid = 0;
+
+	if (errno == EOPNOTSUPP || errno == EINVAL || errno == EAFNOSUPPORT) {
+		log_info("kernel nexthop objects not supported, "
+		    "using per route gateways");
+		kr_state.nhobj = 0;
+	} else
+		log_warn("%s: nexthop %s", __func__, log_addr(&kn->nexthop));
+	return (0);
+}
+
+/*
+ * Called when the resolution of a nexthop changed. Repoint the nexthop
+ * object, this moves all routes using it in one go.
+ */
+void
+knexthop_nhobj_sync(struct knexthop *kn)
+{
+	struct bgpd_addr	 gw;
+	u_short			 oif;
+
+	if (kn->nhid == 0)
+		return;
+	/* unreachable nexthops keep the object, the RDE moves the routes */
+	if (knexthop_nhobj_gateway(kn, &gw, &oif) == -1)
+		return;
+	if (oif == kn->nhoif && memcmp(&gw, &kn->nhgw, sizeof(gw)) == 0)
+		return;
+
+	kn->nhgw = gw;
+	kn->nhoif = oif;
+	if (send_nhmsg(RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_REPLACE,
+	    kn->nhid, kn) == -1)
+		log_warn("%s: nexthop %s", __func__, log_addr(&kn->nexthop));
+}
+
+/*
+ * The knexthop goes away, routes still using its object keep it alive
+ * until they are removed or moved elsewhere.
+ */
+void
+knexthop_nhobj_delete(struct knexthop *kn)
+{
+	knhobj_unref(kn->nhid);
+	kn->nhid = 0;
+}
+
+int
+knhobj_compare(struct knhobj *a, struct knhobj *b)
+{
+	if (a->id < b->id)
+		return (-1);
+	if (a->id > b->id)
+		return (1);
+	return (0);
+}
+
+void
+knhobj_ref(uint32_t id)
+{
+	struct knhobj	*nho, s;
+
+	if (id == 0)
+		return;
+	s.id = id;
+	if ((nho = RB_FIND(knhobj_tree, &knhobjs, &s)) == NULL)
+		fatalx("%s: unknown nexthop object %u", __func__, id);
+	nho->refcnt++;
+}
+
+void
+knhobj_unref(uint32_t id)
+{
+	struct knhobj	*nho, s;
+
+	if (id == 0)
+		return;
+	s.id = id;
+	if ((nho = RB_FIND(knhobj_tree, &knhobjs, &s)) == NULL)
+		fatalx("%s: unknown nexthop object %u", __func__, id);
+	if (--nho->refcnt > 0)
+		return;
+
+	if (send_nhmsg(RTM_DELNEXTHOP, 0, id, NULL) == -1)
+		log_warn("%s: nexthop object %u", __func__, id);
+	RB_REMOVE(knhobj_tree, &knhobjs, nho);
+	free(nho);
+}
+#endif
+
 int
 fetchtable(struct ktable *kt)
 {
@@ -0,0 +1,247 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2025 The OpenBGPD portable contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgpd.h"
+
+#define MINIMUM(a, b)	((a) < (b) ? (a) : (b))
+
+/*
+ * Longest prefix match index for the kroute tables.
+ * The kroute RB trees are ordered by prefix and prefixlen which is great
+ * for exact lookups but a longest prefix match needs one lookup per
+ * possible prefixlen (33 for IPv4, 129 for IPv6). The trie here only
+ * tracks which prefix/prefixlen pairs exist in the table so a single walk
+ * down the trie returns all covering prefixes of an address. The kroute
+ * itself is then looked up in the RB tree for those few candidates.
+ *
+ * The trie is path compressed, every node checks the bit at position plen
+ * to decide which branch to take. Real nodes have a refcnt of the number
+ * of kroutes (including multipath and other priorities) using the prefix,
+ * internal branch nodes have a refcnt of 0 and always two children.
+ * Addresses are handled as byte strings in network byte order so the same
+ * code is used for IPv4 and IPv6.
+ */
+struct ktrie_node {
+	struct ktrie_node	*trie[2];
+	uint32_t		 refcnt;
+	uint8_t			 plen;
+	uint8_t			 addr[16];
+};
+
+static inline int
+ktrie_bit(const uint8_t *addr, uint8_t bit)
+{
+	return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/*
+ * Return the first bit where a and b differ but at most max.
+ */
+static uint8_t
+ktrie_diff(const uint8_t *a, const uint8_t *b, uint8_t max)
+{
+	uint8_t	i, x, r;
+
+	for (i = 0; i < max / 8 && a[i] == b[i]; i++)
+		;
+	if (i * 8 >= max)
+		return max;
+	x = a[i] ^ b[i];
+	for (r = i * 8; r < max && (x & 0x80) == 0; r++)
+		x <<= 1;
+	return r;
+}
+
+static void
+ktrie_mask(uint8_t *dst, const uint8_t *src, uint8_t plen)
+{
+	memset(dst, 0, 16);
+	memcpy(dst, src, plen / 8);
+	if (plen % 8)
+		dst[plen / 8] = src[plen / 8] & (0xff << (8 - plen % 8));
+}
+
+static struct ktrie_node *
+ktrie_node_new(const uint8_t *addr, uint8_t plen, uint32_t refcnt)
+{
+	struct ktrie_node	*n;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		return NULL;
+	ktrie_mask(n->addr, addr, plen);
+	n->plen = plen;
+	n->refcnt = refcnt;
+	return n;
+}
+
+void
+ktrie_init(struct ktrie_head *th, uint8_t alen)
+{
+	th->root = NULL;
+	th->alen = alen;
+}
+
+/*
+ * Add a reference for prefix addr/plen. Returns -1 on memory shortage.
+ */
+int
+ktrie_add(struct ktrie_head *th, const void *addr, uint8_t plen)
+{
+	struct ktrie_node	**np, *n, *new, *b;
+	uint8_t			  key[16], d;
+
+	if (plen > th->alen * 8)
+		return -1;
+	ktrie_mask(key, addr, plen);
+
+	np = &th->root;
+	while ((n = *np) != NULL) {
+		d = ktrie_diff(key, n->addr, MINIMUM(plen, n->plen));
+		if (d < n->plen)
+			break;
+		if (plen == n->plen) {
+			n->refcnt++;
+			return 0;
+		}
+		np = &n->trie[ktrie_bit(key, n->plen)];
+	}
+
+	if ((new = ktrie_node_new(key, plen, 1)) == NULL)
+		return -1;
+	if (n == NULL) {
+		*np = new;
+		return 0;
+	}
+
+	if (d == plen) {
+		/* new node covers n, insert it above */
+		new->trie[ktrie_bit(n->addr, plen)] = n;
+		*np = new;
+		return 0;
+	}
+
+	/* paths diverge at bit d, add a branch node */
+	if ((b = ktrie_node_new(key, d, 0)) == NULL) {
+		free(new);
+		return -1;
+	}
+	b->trie[ktrie_bit(key, d)] = new;
+	b->trie[ktrie_bit(n->addr, d)] = n;
+	*np = b;
+	return 0;
+}
+
+/*
+ * Drop a reference for prefix addr/plen and remove the node once it is
+ * no longer used.
+ */
+void
+ktrie_del(struct ktrie_head *th, const void *addr, uint8_t plen)
+{
+	struct ktrie_node	**np, **pp = NULL, *n, *p = NULL, *c;
+	uint8_t			  key[16];
+
+	if (plen > th->alen * 8)
+		return;
+	ktrie_mask(key, addr, plen);
+
+	np = &th->root;
+	while ((n = *np) != NULL) {
+		if (n->plen > plen ||
+		    ktrie_diff(key, n->addr, n->plen) < n->plen)
+			return;
+		if (n->plen == plen)
+			break;
+		pp = np;
+		p = n;
+		np = &n->trie[ktrie_bit(key, n->plen)];
+	}
+	if (n == NULL || n->refcnt == 0)
+		return;
+	if (--n->refcnt > 0)
+		return;
+
+	if (n->trie[0] != NULL && n->trie[1] != NULL)
+		/* keep as branch node */
+		return;
+
+	c = n->trie[0] != NULL ? n->trie[0] : n->trie[1];
+	*np = c;
+	free(n);
+
+	/* a branch node with a single child is no longer needed */
+	if (c == NULL && p != NULL && p->refcnt == 0) {
+		*pp = p->trie[0] != NULL ? p->trie[0] : p->trie[1];
+		free(p);
+	}
+}
+
+/*
+ * Collect the prefixlens of all prefixes in the trie covering addr.
+ * The prefixlens are stored in plens with increasing order, plens needs
+ * space for alen * 8 + 1 entries. Returns the number of prefixes found.
+ * The walk down only tests the branch bits, the prefixes are verified
+ * afterwards starting from the most specific one. Once a node matches all
+ * nodes above it on the path match as well.
+ */
+int
+ktrie_match(struct ktrie_head *th, const void *addr, uint8_t *plens)
+{
+	struct ktrie_node	*n, *path[128 + 1];
+	const uint8_t		*key = addr;
+	uint8_t			 max = th->alen * 8;
+	int			 cnt = 0, i;
+
+	for (n = th->root; n != NULL; n = n->trie[ktrie_bit(key, n->plen)]) {
+		if (n->refcnt > 0)
+			path[cnt++] = n;
+		if (n->plen == max)
+			break;
+	}
+	while (cnt > 0) {
+		n = path[cnt - 1];
+		if (ktrie_diff(key, n->addr, n->plen) == n->plen)
+			break;
+		cnt--;
+	}
+	for (i = 0; i < cnt; i++)
+		plens[i] = path[i]->plen;
+	return cnt;
+}
+
+static void
+ktrie_free_node(struct ktrie_node *n)
+{
+	if (n == NULL)
+		return;
+	ktrie_free_node(n->trie[0]);
+	ktrie_free_node(n->trie[1]);
+	free(n);
+}
+
+void
+ktrie_free(struct ktrie_head *th)
+{
+	ktrie_free_node(th->root);
+	th->root = NULL;
+}
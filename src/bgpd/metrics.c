@@ -0,0 +1,408 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2025 The OpenBGPD portable contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bgpd.h"
+#include "session.h"
+#include "log.h"
+#include "ometric.h"
+
+/*
+ * OpenMetrics exporter of the session engine.
+ * A scraper connects to the metrics socket and sends a HTTP request, the
+ * request itself is ignored. The SE then asks the RDE for its metrics and
+ * once they arrive the whole exposition is written as HTTP/1.0 response
+ * and the connection is closed. Everything is taken from counters kept in
+ * memory, no control requests are needed.
+ */
+
+#define METRICS_REQ_MAX	2048
+
+enum metrics_state {
+	METRICS_READ,
+	METRICS_WAIT,
+	METRICS_WRITE,
+};
+
+struct metrics_conn {
+	TAILQ_ENTRY(metrics_conn)	 entry;
+	struct msgbuf			*wbuf;
+	char				 req[METRICS_REQ_MAX];
+	size_t				 reqlen;
+	uint32_t			 id;
+	int				 fd;
+	enum metrics_state		 state;
+};
+
+TAILQ_HEAD(, metrics_conn) metrics_conns =
+    TAILQ_HEAD_INITIALIZER(metrics_conns);
+static uint32_t	metrics_id;
+
+static int	metrics_close(struct metrics_conn *);
+static void	metrics_respond(struct metrics_conn *, struct peer_head *,
+		    struct ctl_metrics *);
+
+int
+metrics_accept(int listenfd)
+{
+	struct metrics_conn	*mc;
+	struct sockaddr_un	 sa_un;
+	socklen_t		 len;
+	int			 connfd;
+
+	len = sizeof(sa_un);
+	if ((connfd = accept4(listenfd, (struct sockaddr *)&sa_un, &len,
+	    SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+		if (errno == ENFILE || errno == EMFILE)
+			pauseaccept = getmonotime();
+		else if (errno != EWOULDBLOCK && errno != EINTR &&
+		    errno != ECONNABORTED)
+			log_warn("%s: accept", __func__);
+		return (0);
+	}
+
+	if ((mc = calloc(1, sizeof(*mc))) == NULL ||
+	    (mc->wbuf = msgbuf_new()) == NULL) {
+		log_warn("%s", __func__);
+		free(mc);
+		close(connfd);
+		return (0);
+	}
+	mc->fd = connfd;
+	mc->id = ++metrics_id;
+	mc->state = METRICS_READ;
+	TAILQ_INSERT_TAIL(&metrics_conns, mc, entry);
+
+	return (1);
+}
+
+size_t
+metrics_fill_pfds(struct pollfd *pfd, size_t size)
+{
+	struct metrics_conn	*mc;
+	size_t			 i = 0;
+
+	TAILQ_FOREACH(mc, &metrics_conns, entry) {
+		if (i >= size)
+			break;
+		pfd[i].fd = mc->fd;
+		pfd[i].events = POLLIN;
+		if (mc->state == METRICS_WRITE)
+			pfd[i].events |= POLLOUT;
+		i++;
+	}
+	return i;
+}
+
+static struct metrics_conn *
+metrics_connbyfd(int fd)
+{
+	struct metrics_conn	*mc;
+
+	TAILQ_FOREACH(mc, &metrics_conns, entry)
+		if (mc->fd == fd)
+			break;
+	return (mc);
+}
+
+static int
+metrics_close(struct metrics_conn *mc)
+{
+	TAILQ_REMOVE(&metrics_conns, mc, entry);
+	msgbuf_free(mc->wbuf);
+	close(mc->fd);
+	free(mc);
+
+	/* abort fd exhaustion pause */
+	pauseaccept = monotime_clear();
+	return (1);
+}
+
+/*
+ * Returns 1 if the connection was closed.
+ */
+int
+metrics_dispatch_msg(struct pollfd *pfd, struct peer_head *peers)
+{
+	struct metrics_conn	*mc;
+	ssize_t			 n;
+
+	if ((mc = metrics_connbyfd(pfd->fd)) == NULL) {
+		log_warnx("%s: fd %d: not found", __func__, pfd->fd);
+		return (0);
+	}
+
+	if (pfd->revents & POLLOUT) {
+		if (ibuf_write(mc->fd, mc->wbuf) == -1)
+			return metrics_close(mc);
+		if (mc->state == METRICS_WRITE &&
+		    msgbuf_queuelen(mc->wbuf) == 0)
+			return metrics_close(mc);
+	}
+
+	if (!(pfd->revents & (POLLIN | POLLHUP)))
+		return (0);
+
+	if (mc->state != METRICS_READ) {
+		/* drain, the client may half close after the request */
+		char buf[256];
+
+		if ((n = read(mc->fd, buf, sizeof(buf))) == -1 &&
+		    (errno == EAGAIN || errno == EINTR))
+			return (0);
+		if (n <= 0)
+			return metrics_close(mc);
+		return (0);
+	}
+
+	n = read(mc->fd, mc->req + mc->reqlen,
+	    sizeof(mc->req) - 1 - mc->reqlen);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return (0);
+		return metrics_close(mc);
+	}
+	mc->reqlen += n;
+	mc->req[mc->reqlen] = '\0';
+
+	/* wait for the end of the request header */
+	if (n > 0 && strstr(mc->req, "\r\n\r\n") == NULL &&
+	    strstr(mc->req, "\n\n") == NULL &&
+	    mc->reqlen < sizeof(mc->req) - 1)
+		return (0);
+
+	mc->state = METRICS_WAIT;
+	if (imsg_ctl_rde_msg(IMSG_CTL_SHOW_METRICS, 0, mc->id) != 1)
+		/* no RDE, answer with what the SE knows */
+		metrics_respond(mc, peers, NULL);
+	return (0);
+}
+
+void
+metrics_rde_reply(struct imsg *imsg, struct peer_head *peers)
+{
+	struct ctl_metrics	 cm;
+	struct metrics_conn	*mc;
+
+	if (imsg_get_data(imsg, &cm, sizeof(cm)) == -1) {
+		log_warnx("%s: bad imsg", __func__);
+		return;
+	}
+	TAILQ_FOREACH(mc, &metrics_conns, entry)
+		if (mc->id == (uint32_t)imsg_get_pid(imsg))
+			break;
+	if (mc == NULL || mc->state != METRICS_WAIT)
+		/* client went away */
+		return;
+	cm.latency.stage[LAT_WRITE] = se_latency.stage[LAT_WRITE];
+	cm.latency.stage[LAT_TOTAL] = se_latency.stage[LAT_TOTAL];
+	metrics_respond(mc, peers, &cm);
+}
+
+void
+metrics_shutdown(void)
+{
+	struct metrics_conn	*mc;
+
+	while ((mc = TAILQ_FIRST(&metrics_conns)) != NULL)
+		metrics_close(mc);
+}
+
+/*
+ * Output helpers
+ */
+static void
+metrics_hist(struct ometric *om, const struct bgpd_hist *h, double scale,
+    struct olabels *ol)
+{
+	double	bounds[HIST_BUCKETS];
+	int	i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		bounds[i] = (double)(1ULL << i) / scale;
+	ometric_set_histogram(om, bounds, h->bucket, HIST_BUCKETS,
+	    h->sum / scale, ol);
+}
+
+static void
+metrics_rde(struct ctl_metrics *cm)
+{
+	struct ometric	*om;
+	struct olabels	*ol;
+	const char	*keys[2] = { "stage", NULL };
+	const char	*values[2] = { NULL, NULL };
+	long long	 pts = 0;
+	int		 i;
+
+	om = ometric_new(OMT_HISTOGRAM, "bgpd_rde_loop_seconds",
+	    "time the RDE spends per main loop iteration");
+	metrics_hist(om, &cm->rde_loop, 1e6, NULL);
+	om = ometric_new(OMT_HISTOGRAM, "bgpd_update_rde_latency_seconds",
+	    "time from receiving an UPDATE in the SE to the end of the "
+	    "RDE decision process");
+	metrics_hist(om, &cm->update_rde, 1e6, NULL);
+	om = ometric_new(OMT_HISTOGRAM, "bgpd_update_adjout_latency_seconds",
+	    "time a prefix waits in the Adj-RIB-Out before it is sent "
+	    "to the SE");
+	metrics_hist(om, &cm->update_adjout, 1e6, NULL);
+
+	om = ometric_new(OMT_HISTOGRAM, "bgpd_update_propagation_seconds",
+	    "time sampled prefixes spend per stage between the sockets of "
+	    "the sending and the receiving peers");
+	for (i = 0; i < LAT_STAGE_MAX; i++) {
+		values[0] = lat_stagenames[i];
+		ol = olabels_new(keys, values);
+		metrics_hist(om, &cm->latency.stage[i], 1e6, ol);
+		olabels_free(ol);
+	}
+	om = ometric_new(OMT_COUNTER, "bgpd_update_propagation_sampled",
+	    "number of prefixes sampled for propagation latency");
+	ometric_set_int(om, cm->latency.sampled, NULL);
+
+	for (i = 0; i < AID_MAX; i++)
+		pts += cm->mem.pt_cnt[i];
+	om = ometric_new(OMT_GAUGE, "bgpd_rde_objects",
+	    "number of objects in the RDE tables");
+	ometric_set_int_with_labels(om, pts, OKV("type"), OKV("prefix"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.rib_cnt, OKV("type"),
+	    OKV("rib_entry"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.prefix_cnt, OKV("type"),
+	    OKV("rib_prefix"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.path_cnt, OKV("type"),
+	    OKV("path"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.aspath_cnt, OKV("type"),
+	    OKV("aspath"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.comm_cnt, OKV("type"),
+	    OKV("community"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.attr_cnt, OKV("type"),
+	    OKV("attribute"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.nexthop_cnt, OKV("type"),
+	    OKV("nexthop"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.aset_cnt, OKV("type"),
+	    OKV("as_set"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.pset_cnt, OKV("type"),
+	    OKV("prefix_set"), NULL);
+
+	om = ometric_new(OMT_GAUGE, "bgpd_rde_object_references",
+	    "number of references to shared RDE objects");
+	ometric_set_int_with_labels(om, cm->mem.path_refs, OKV("type"),
+	    OKV("path"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.comm_refs, OKV("type"),
+	    OKV("community"), NULL);
+	ometric_set_int_with_labels(om, cm->mem.attr_refs, OKV("type"),
+	    OKV("attribute"), NULL);
+}
+
+static void
+metrics_peers(struct peer_head *peers)
+{
+	struct ometric	*state, *qlen, *qdepth, *tx, *rx;
+	struct olabels	*ol;
+	struct peer	*p;
+	const char	*keys[4] = {
+	    "remote_addr", "remote_as", "description", NULL };
+	const char	*values[4];
+
+	state = ometric_new(OMT_GAUGE, "bgpd_peer_state_raw",
+	    "peer session state");
+	qlen = ometric_new(OMT_GAUGE, "bgpd_peer_queue_messages",
+	    "messages queued for the peer");
+	qdepth = ometric_new(OMT_HISTOGRAM, "bgpd_peer_queue_depth",
+	    "peer output queue length when an UPDATE is queued");
+	tx = ometric_new(OMT_COUNTER, "bgpd_peer_message_transmit",
+	    "number of messages sent to the peer");
+	rx = ometric_new(OMT_COUNTER, "bgpd_peer_message_receive",
+	    "number of messages received from the peer");
+
+	RB_FOREACH(p, peer_head, peers) {
+		if (p->conf.template)
+			continue;
+		values[0] = log_addr(&p->conf.remote_addr);
+		values[1] = log_as(p->conf.remote_as);
+		values[2] = p->conf.descr;
+		values[3] = NULL;
+		ol = olabels_new(keys, values);
+
+		ometric_set_int(state, p->state, ol);
+		ometric_set_int(qlen, p->wbuf != NULL ?
+		    msgbuf_queuelen(p->wbuf) : 0, ol);
+		metrics_hist(qdepth, &p->queue_depth, 1, ol);
+		ometric_set_int_with_labels(tx, p->stats.msg_sent_update,
+		    OKV("messages"), OKV("update"), ol);
+		ometric_set_int_with_labels(tx, p->stats.msg_sent_keepalive,
+		    OKV("messages"), OKV("keepalive"), ol);
+		ometric_set_int_with_labels(rx, p->stats.msg_rcvd_update,
+		    OKV("messages"), OKV("update"), ol);
+		ometric_set_int_with_labels(rx, p->stats.msg_rcvd_keepalive,
+		    OKV("messages"), OKV("keepalive"), ol);
+		olabels_free(ol);
+	}
+}
+
+static void
+metrics_respond(struct metrics_conn *mc, struct peer_head *peers,
+    struct ctl_metrics *cm)
+{
+	struct ibuf	*buf = NULL;
+	FILE		*f;
+	char		*out = NULL;
+	size_t		 len = 0;
+
+	/* on errors the connection is closed once the empty queue is written */
+	mc->state = METRICS_WRITE;
+	if ((f = open_memstream(&out, &len)) == NULL) {
+		log_warn("%s", __func__);
+		return;
+	}
+
+	fprintf(f, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: application/openmetrics-text; version=1.0.0; "
+	    "charset=utf-8\r\n"
+	    "Connection: close\r\n\r\n");
+
+	metrics_peers(peers);
+	if (cm != NULL)
+		metrics_rde(cm);
+	if (ometric_output_all(f) == -1) {
+		log_warnx("%s: failed to build metrics", __func__);
+		ometric_free_all();
+		fclose(f);
+		free(out);
+		return;
+	}
+	ometric_free_all();
+
+	if (fclose(f) == EOF || (buf = ibuf_open(len)) == NULL ||
+	    ibuf_add(buf, out, len) == -1) {
+		log_warn("%s", __func__);
+		ibuf_free(buf);
+		free(out);
+		return;
+	}
+	free(out);
+	ibuf_close(mc->wbuf, buf);
+}
@@ -42,7 +42,7 @@ static int	mrt_dump_entry(struct mrt *, struct prefix *, uint16_t,
 		    struct rde_peer*);
 static int	mrt_dump_entry_v2(struct mrt *, struct rib_entry *, uint32_t);
 static int	mrt_dump_peer(struct ibuf *, struct rde_peer *);
-static int	mrt_dump_hdr_se(struct ibuf **, struct peer *, uint16_t,
+static int	mrt_dump_hdr_se(struct ibuf *, struct peer *, uint16_t,
 		    uint16_t, uint32_t, int);
 static int	mrt_dump_hdr_rde(struct ibuf **, uint16_t type, uint16_t,
 		    uint32_t);
@@ -160,6 +160,25 @@ mrt_bgp_msg_subtype(struct mrt *mrt, struct ibuf *pkg, struct peer *peer,
 	return subtype;
 }
 
+/*
+ * The BGP4MP records of the SE are assembled in this buffer and then
+ * copied into the ring of the dump's writer thread.
+ */
+static struct ibuf *
+mrt_se_hdrbuf(void)
+{
+	static struct ibuf	*hdr;
+
+	if (hdr == NULL) {
+		if ((hdr = ibuf_dynamic(MRT_ET_HEADER_SIZE,
+		    MRT_ET_HEADER_SIZE + MRT_BGP4MP_AS4_IPv6_HEADER_SIZE +
+		    2 * sizeof(uint16_t))) == NULL)
+			return (NULL);
+	}
+	ibuf_truncate(hdr, 0);
+	return (hdr);
+}
+
 void
 mrt_dump_bgp_msg(struct mrt *mrt, struct ibuf *pkg, struct peer *peer,
     enum msg_type msgtype)
@@ -174,19 +193,15 @@ mrt_dump_bgp_msg(struct mrt *mrt, struct ibuf *pkg, struct peer *peer,
 
 	subtype = mrt_bgp_msg_subtype(mrt, pkg, peer, msgtype, in);
 
-	if (mrt_dump_hdr_se(&buf, peer, MSG_PROTOCOL_BGP4MP_ET, subtype,
-	    ibuf_size(pkg), in) == -1)
-		goto fail;
-
-	if (ibuf_add_ibuf(buf, pkg) == -1)
-		goto fail;
-
-	ibuf_close(mrt->wbuf, buf);
-	return;
+	if ((buf = mrt_se_hdrbuf()) == NULL ||
+	    mrt_dump_hdr_se(buf, peer, MSG_PROTOCOL_BGP4MP_ET, subtype,
+	    ibuf_size(pkg), in) == -1) {
+		log_warn("%s: ibuf error", __func__);
+		return;
+	}
 
-fail:
-	log_warn("%s: ibuf error", __func__);
-	ibuf_free(buf);
+	/* a full ring is accounted by the writer */
+	mrt_writer_put(mrt->writer, buf, pkg);
 }
 
 void
@@ -199,7 +214,9 @@ mrt_dump_state(struct mrt *mrt, uint16_t old_state, uint16_t new_state,
 	if (peer->capa.neg.as4byte)
 		subtype = BGP4MP_STATE_CHANGE_AS4;
 
-	if (mrt_dump_hdr_se(&buf, peer, MSG_PROTOCOL_BGP4MP_ET, subtype,
+	if ((buf = mrt_se_hdrbuf()) == NULL)
+		goto fail;
+	if (mrt_dump_hdr_se(buf, peer, MSG_PROTOCOL_BGP4MP_ET, subtype,
 	    2 * sizeof(short), 0) == -1)
 		goto fail;
 
@@ -208,12 +225,11 @@ mrt_dump_state(struct mrt *mrt, uint16_t old_state, uint16_t new_state,
 	if (ibuf_add_n16(buf, new_state) == -1)
 		goto fail;
 
-	ibuf_close(mrt->wbuf, buf);
+	mrt_writer_put(mrt->writer, buf, NULL);
 	return;
 
 fail:
 	log_warn("%s: ibuf error", __func__);
-	ibuf_free(buf);
 }
 
 static int
@@ -929,22 +945,18 @@ mrt_done(struct mrt *mrtbuf)
 }
 
 static int
-mrt_dump_hdr_se(struct ibuf ** bp, struct peer *peer, uint16_t type,
+mrt_dump_hdr_se(struct ibuf *buf, struct peer *peer, uint16_t type,
     uint16_t subtype, uint32_t len, int swap)
 {
 	struct timespec	time;
 
-	if ((*bp = ibuf_dynamic(MRT_ET_HEADER_SIZE, MRT_ET_HEADER_SIZE +
-	    MRT_BGP4MP_AS4_IPv6_HEADER_SIZE + len)) == NULL)
-		return (-1);
-
 	clock_gettime(CLOCK_REALTIME, &time);
 
-	if (ibuf_add_n32(*bp, time.tv_sec) == -1)
+	if (ibuf_add_n32(buf, time.tv_sec) == -1)
 		goto fail;
-	if (ibuf_add_n16(*bp, type) == -1)
+	if (ibuf_add_n16(buf, type) == -1)
 		goto fail;
-	if (ibuf_add_n16(*bp, subtype) == -1)
+	if (ibuf_add_n16(buf, subtype) == -1)
 		goto fail;
 
 	switch (peer->local.aid) {
@@ -971,65 +983,65 @@ mrt_dump_hdr_se(struct ibuf ** bp, struct peer *peer, uint16_t type,
 		goto fail;
 	}
 
-	if (ibuf_add_n32(*bp, len) == -1)
+	if (ibuf_add_n32(buf, len) == -1)
 		goto fail;
 	/* microsecond field use by the _ET format */
-	if (ibuf_add_n32(*bp, time.tv_nsec / 1000) == -1)
+	if (ibuf_add_n32(buf, time.tv_nsec / 1000) == -1)
 		goto fail;
 
 	if (subtype == BGP4MP_STATE_CHANGE_AS4 ||
 	    subtype == BGP4MP_MESSAGE_AS4 ||
 	    subtype == BGP4MP_MESSAGE_AS4_ADDPATH) {
 		if (!swap)
-			if (ibuf_add_n32(*bp, peer->conf.local_as) == -1)
+			if (ibuf_add_n32(buf, peer->conf.local_as) == -1)
 				goto fail;
-		if (ibuf_add_n32(*bp, peer->conf.remote_as) == -1)
+		if (ibuf_add_n32(buf, peer->conf.remote_as) == -1)
 			goto fail;
 		if (swap)
-			if (ibuf_add_n32(*bp, peer->conf.local_as) == -1)
+			if (ibuf_add_n32(buf, peer->conf.local_as) == -1)
 				goto fail;
 	} else {
 		if (!swap)
-			if (ibuf_add_n16(*bp, peer->conf.local_short_as) == -1)
+			if (ibuf_add_n16(buf, peer->conf.local_short_as) == -1)
 				goto fail;
-		if (ibuf_add_n16(*bp, peer->short_as) == -1)
+		if (ibuf_add_n16(buf, peer->short_as) == -1)
 			goto fail;
 		if (swap)
-			if (ibuf_add_n16(*bp, peer->conf.local_short_as) == -1)
+			if (ibuf_add_n16(buf, peer->conf.local_short_as) == -1)
 				goto fail;
 	}
 
-	if (ibuf_add_n16(*bp, /* ifindex */ 0) == -1)
+	if (ibuf_add_n16(buf, /* ifindex */ 0) == -1)
 		goto fail;
 
 	switch (peer->local.aid) {
 	case AID_INET:
-		if (ibuf_add_n16(*bp, AFI_IPv4) == -1)
+		if (ibuf_add_n16(buf, AFI_IPv4) == -1)
 			goto fail;
 		if (!swap)
-			if (ibuf_add(*bp, &peer->local.v4,
+			if (ibuf_add(buf, &peer->local.v4,
 			    sizeof(peer->local.v4)) == -1)
 				goto fail;
-		if (ibuf_add(*bp, &peer->remote.v4,
+		if (ibuf_add(buf, &peer->remote.v4,
 		    sizeof(peer->remote.v4)) == -1)
 			goto fail;
 		if (swap)
-			if (ibuf_add(*bp, &peer->local.v4,
+			if (ibuf_add(buf, &peer->local.v4,
 			    sizeof(peer->local.v4)) == -1)
 				goto fail;
 		break;
 	case AID_INET6:
-		if (ibuf_add_n16(*bp, AFI_IPv6) == -1)
+		if (ibuf_add_n16(buf, AFI_IPv6) == -1)
 			goto fail;
 		if (!swap)
-			if (ibuf_add(*bp, &peer->local.v6,
+			if (ibuf_add(buf, &peer->local.v6,
 			    sizeof(peer->local.v6)) == -1)
 				goto fail;
-		if (ibuf_add(*bp, &peer->remote.v6,
+		if (ibuf_add(buf, &peer->remote.v6,
 		    sizeof(peer->remote.v6)) == -1)
 			goto fail;
 		if (swap)
-			if (ibuf_add(*bp, &peer->local.v6,
+			if (ibuf_add(buf, &peer->local.v6,
 			    sizeof(peer->local.v6)) == -1)
 				goto fail;
 		break;
@@ -1038,8 +1050,6 @@ mrt_dump_hdr_se(struct ibuf ** bp, struct peer *peer, uint16_t type,
 	return (0);
 
 fail:
-	ibuf_free(*bp);
-	*bp = NULL;
 	return (-1);
 }
 
@@ -1096,6 +1106,16 @@ fail:
 void
 mrt_write(struct mrt *mrt)
 {
+	/* dumps of the SE are written by their writer thread */
+	if (mrt->writer != NULL) {
+		if (mrt->state != MRT_STATE_REMOVE &&
+		    mrt_writer_check(mrt->writer) == -1) {
+			log_warn("mrt dump aborted, mrt_write");
+			mrt_done(mrt);
+		}
+		return;
+	}
+
 	if (ibuf_write(mrt->fd, mrt->wbuf) == -1) {
 		log_warn("mrt dump aborted, mrt_write");
 		mrt_clean(mrt);
@@ -1106,9 +1126,15 @@ mrt_write(struct mrt *mrt)
 void
 mrt_clean(struct mrt *mrt)
 {
-	close(mrt->fd);
-	msgbuf_free(mrt->wbuf);
-	mrt->wbuf = NULL;
+	if (mrt->writer != NULL) {
+		/* the writer owns the fd */
+		mrt_writer_free(mrt->writer);
+		mrt->writer = NULL;
+	} else if (mrt->wbuf != NULL) {
+		close(mrt->fd);
+		msgbuf_free(mrt->wbuf);
+		mrt->wbuf = NULL;
+	}
 }
 
 static struct imsgbuf	*mrt_imsgbuf[2];
@@ -1138,6 +1164,8 @@ mrt_open(struct mrt *mrt, time_t now)
 		log_warn("mrt_open %s", MRT2MC(mrt)->file);
 		return (1);
 	}
+	/* compressed dumps are written through a pipe to a compressor */
+	fd = mrt_compress_open(MRT2MC(mrt)->file, fd);
 
 	if (mrt->state == MRT_STATE_OPEN)
 		type = IMSG_MRT_OPEN;
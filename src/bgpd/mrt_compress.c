@@ -0,0 +1,299 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2025 The OpenBGPD portable contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "bgpd.h"
+#include "log.h"
+
+/*
+ * Streaming compression of MRT dump files, selected by a ".gz" or ".zst"
+ * suffix of the dump file name. The parent opens the file as before but
+ * hands the RDE or SE the write end of a pipe instead. A detached thread
+ * of the parent reads the raw MRT stream from the pipe and writes it
+ * compressed to the file, so neither the RDE nor the SE ever wait for
+ * the compressor. When a dump is rotated or finished its producer closes
+ * the pipe and the thread finalizes the compressed stream on EOF.
+ */
+
+#define MRT_COMP_NONE	0
+#define MRT_COMP_GZIP	1
+#define MRT_COMP_ZSTD	2
+
+#define MRT_COMP_BUFSIZE	(128 * 1024)
+
+struct mrt_comp {
+	int		 in;
+	int		 out;
+	int		 type;
+	int		 error;
+	char		 file[MRT_FILE_LEN];
+	uint8_t		 ibuf[MRT_COMP_BUFSIZE];
+	uint8_t		 obuf[MRT_COMP_BUFSIZE];
+};
+
+static pthread_mutex_t	mrt_comp_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	mrt_comp_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int	mrt_comp_running;
+
+static int
+mrt_comp_type(const char *file)
+{
+	size_t len = strlen(file);
+
+	if (len > 3 && strcmp(file + len - 3, ".gz") == 0)
+		return MRT_COMP_GZIP;
+	if (len > 4 && strcmp(file + len - 4, ".zst") == 0)
+		return MRT_COMP_ZSTD;
+	return MRT_COMP_NONE;
+}
+
+/* write out compressed data, on error the rest of the stream is dropped */
+static void
+mrt_comp_out(struct mrt_comp *c, size_t len)
+{
+	uint8_t	*b = c->obuf;
+	ssize_t	 n;
+
+	while (len > 0 && !c->error) {
+		if ((n = write(c->out, b, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			c->error = errno;
+			break;
+		}
+		b += n;
+		len -= n;
+	}
+}
+
+#ifdef HAVE_ZLIB
+static void
+mrt_comp_gzip(struct mrt_comp *c)
+{
+	z_stream	zs;
+	ssize_t		n;
+	int		flush = Z_NO_FLUSH;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 15 + 16 selects the gzip format */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		c->error = ENOMEM;
+		return;
+	}
+
+	do {
+		if ((n = read(c->in, c->ibuf, sizeof(c->ibuf))) == -1) {
+			if (errno == EINTR)
+				continue;
+			n = 0;
+		}
+		flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = c->ibuf;
+		zs.avail_in = n;
+		do {
+			zs.next_out = c->obuf;
+			zs.avail_out = sizeof(c->obuf);
+			deflate(&zs, flush);
+			mrt_comp_out(c, sizeof(c->obuf) - zs.avail_out);
+		} while (zs.avail_out == 0);
+	} while (flush != Z_FINISH);
+
+	deflateEnd(&zs);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void
+mrt_comp_zstd(struct mrt_comp *c)
+{
+	ZSTD_CCtx	*cctx;
+	ZSTD_inBuffer	 ib;
+	ZSTD_outBuffer	 ob;
+	ZSTD_EndDirective mode = ZSTD_e_continue;
+	ssize_t		 n;
+	size_t		 rv;
+
+	if ((cctx = ZSTD_createCCtx()) == NULL) {
+		c->error = ENOMEM;
+		return;
+	}
+
+	do {
+		if ((n = read(c->in, c->ibuf, sizeof(c->ibuf))) == -1) {
+			if (errno == EINTR)
+				continue;
+			n = 0;
+		}
+		mode = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+		ib.src = c->ibuf;
+		ib.size = n;
+		ib.pos = 0;
+		do {
+			ob.dst = c->obuf;
+			ob.size = sizeof(c->obuf);
+			ob.pos = 0;
+			rv = ZSTD_compressStream2(cctx, &ob, &ib, mode);
+			if (ZSTD_isError(rv)) {
+				c->error = EIO;
+				break;
+			}
+			mrt_comp_out(c, ob.pos);
+		} while (mode == ZSTD_e_end ? rv != 0 : ib.pos < ib.size);
+	} while (mode != ZSTD_e_end && !c->error);
+
+	ZSTD_freeCCtx(cctx);
+}
+#endif
+
+static void *
+mrt_comp_run(void *arg)
+{
+	struct mrt_comp	*c = arg;
+	ssize_t		 n;
+
+	switch (c->type) {
+#ifdef HAVE_ZLIB
+	case MRT_COMP_GZIP:
+		mrt_comp_gzip(c);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case MRT_COMP_ZSTD:
+		mrt_comp_zstd(c);
+		break;
+#endif
+	}
+	if (c->error) {
+		errno = c->error;
+		log_warn("mrt dump %s: compression failed, dump truncated",
+		    c->file);
+	}
+
+	/* keep the producer from blocking if compression failed early */
+	while ((n = read(c->in, c->ibuf, sizeof(c->ibuf))) != 0)
+		if (n == -1 && errno != EINTR)
+			break;
+
+	close(c->in);
+	close(c->out);
+	free(c);
+
+	pthread_mutex_lock(&mrt_comp_mtx);
+	if (--mrt_comp_running == 0)
+		pthread_cond_signal(&mrt_comp_cond);
+	pthread_mutex_unlock(&mrt_comp_mtx);
+	return NULL;
+}
+
+/*
+ * Start a compressor for the dump file open on fd if the file name asks
+ * for it. Returns the fd the producer should write to, this is either fd
+ * itself or the non-blocking write end of the compressor pipe.
+ */
+int
+mrt_compress_open(const char *file, int fd)
+{
+	struct mrt_comp	*c;
+	pthread_t	 thread;
+	sigset_t	 set, oset;
+	int		 type, error, pfd[2];
+
+	if ((type = mrt_comp_type(file)) == MRT_COMP_NONE)
+		return fd;
+#ifndef HAVE_ZLIB
+	if (type == MRT_COMP_GZIP) {
+		log_warnx("mrt dump %s: gzip not supported, writing "
+		    "uncompressed", file);
+		return fd;
+	}
+#endif
+#ifndef HAVE_ZSTD
+	if (type == MRT_COMP_ZSTD) {
+		log_warnx("mrt dump %s: zstd not supported, writing "
+		    "uncompressed", file);
+		return fd;
+	}
+#endif
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		log_warn("mrt dump %s", file);
+		return fd;
+	}
+	if (pipe(pfd) == -1) {
+		log_warn("mrt dump %s: pipe", file);
+		free(c);
+		return fd;
+	}
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[1], F_SETFL, O_NONBLOCK);
+	c->in = pfd[0];
+	c->out = fd;
+	c->type = type;
+	strlcpy(c->file, file, sizeof(c->file));
+
+	pthread_mutex_lock(&mrt_comp_mtx);
+	mrt_comp_running++;
+	pthread_mutex_unlock(&mrt_comp_mtx);
+	/* the parent handles signals in its poll loop, not in the thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	error = pthread_create(&thread, NULL, mrt_comp_run, c);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (error != 0) {
+		errno = error;
+		log_warn("mrt dump %s: compressor thread", file);
+		pthread_mutex_lock(&mrt_comp_mtx);
+		mrt_comp_running--;
+		pthread_mutex_unlock(&mrt_comp_mtx);
+		close(pfd[0]);
+		close(pfd[1]);
+		free(c);
+		return fd;
+	}
+	pthread_detach(thread);
+	return pfd[1];
+}
+
+/*
+ * Wait until all compressed dumps are finalized. Only call this once the
+ * RDE and SE are gone and with them all write ends of the pipes.
+ */
+void
+mrt_compress_shutdown(void)
+{
+	pthread_mutex_lock(&mrt_comp_mtx);
+	while (mrt_comp_running > 0)
+		pthread_cond_wait(&mrt_comp_cond, &mrt_comp_mtx);
+	pthread_mutex_unlock(&mrt_comp_mtx);
+}
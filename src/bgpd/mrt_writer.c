@@ -0,0 +1,375 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2025 The OpenBGPD portable contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bgpd.h"
+#include "session.h"
+#include "log.h"
+
+/*
+ * Asynchronous writer for the BGP4MP dumps of the session engine.
+ * Each dump has a single producer single consumer byte ring. The SE
+ * appends whole MRT records to the ring without taking any lock and a
+ * dedicated thread writes the ring out in large chunks with blocking
+ * writes, so a slow disk no longer stalls the SE poll loop. The ring is
+ * an unframed byte stream, records may wrap around its end.
+ * If a record does not fit into the ring it is dropped and accounted.
+ * The mutex only protects the rarely changed control state (reopen,
+ * stop) and the sleep of an idle writer thread.
+ * The threads are detached. A stopped writer drains its ring and frees
+ * itself, so the SE never waits for the disk. Only on shutdown the SE
+ * waits up to MRT_WRITER_GRACE seconds for the dumps to be completed.
+ */
+
+#define MRT_RING_SIZE		(4 * 1024 * 1024)
+#define MRT_WRITE_MAX		(256 * 1024)
+#define MRT_PREALLOC_SIZE	(16 * 1024 * 1024)
+#define MRT_WRITER_GRACE	10
+
+struct mrt_writer {
+	pthread_t		 thread;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cond;
+	uint8_t			*ring;
+	_Atomic uint64_t	 head;		/* written by the SE */
+	_Atomic uint64_t	 tail;		/* written by the thread */
+	_Atomic int		 sleeping;
+	_Atomic int		 error;		/* errno of failed write */
+	uint64_t		 mark;		/* switch to nextfd here */
+	off_t			 off;		/* thread only */
+	off_t			 prealloc;	/* thread only */
+	int			 fd;		/* thread only */
+	int			 nextfd;
+	int			 stop;
+	uint64_t		 drops;		/* SE only */
+	uint64_t		 dropbytes;
+};
+
+static pthread_mutex_t	mrt_writers_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	mrt_writers_cond = PTHREAD_COND_INITIALIZER;
+static int		mrt_writers;
+
+static int
+mrt_writer_adopt(struct mrt_writer *w, int fd)
+{
+	int flags;
+
+	w->fd = fd;
+	w->off = w->prealloc = 0;
+	/* the parent opens dumps non-blocking, the thread wants to block */
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+		return -1;
+	return 0;
+}
+
+static void
+mrt_writer_destroy(struct mrt_writer *w)
+{
+	close(w->fd);
+	if (w->nextfd != -1)
+		close(w->nextfd);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mtx);
+	free(w->ring);
+	free(w);
+}
+
+/*
+ * Reserve disk space ahead of the write position without changing the
+ * file size, so a live dump can still be read while it grows.
+ */
+static void
+mrt_writer_prealloc(struct mrt_writer *w)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (w->off < w->prealloc)
+		return;
+	if (fallocate(w->fd, FALLOC_FL_KEEP_SIZE, w->prealloc,
+	    MRT_PREALLOC_SIZE) == 0)
+		w->prealloc += MRT_PREALLOC_SIZE;
+	else
+		w->prealloc = INT64_MAX;	/* not supported, stop trying */
+#endif
+}
+
+static void *
+mrt_writer_run(void *arg)
+{
+	struct mrt_writer	*w = arg;
+	uint64_t		 head, tail, limit;
+	size_t			 len, pos;
+	ssize_t			 n;
+
+	for (;;) {
+		tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+		head = atomic_load(&w->head);
+
+		pthread_mutex_lock(&w->mtx);
+		if (w->nextfd != -1 && tail == w->mark) {
+			/* everything before the reopen is written out */
+			close(w->fd);
+			if (mrt_writer_adopt(w, w->nextfd) == -1)
+				atomic_store(&w->error, errno);
+			w->nextfd = -1;
+		}
+		limit = w->nextfd != -1 ? w->mark : head;
+		if (limit == tail) {
+			if (w->stop) {
+				pthread_mutex_unlock(&w->mtx);
+				break;
+			}
+			atomic_store(&w->sleeping, 1);
+			if (atomic_load(&w->head) == tail)
+				pthread_cond_wait(&w->cond, &w->mtx);
+			atomic_store(&w->sleeping, 0);
+			pthread_mutex_unlock(&w->mtx);
+			continue;
+		}
+		pthread_mutex_unlock(&w->mtx);
+
+		pos = tail % MRT_RING_SIZE;
+		len = limit - tail;
+		if (len > MRT_RING_SIZE - pos)
+			len = MRT_RING_SIZE - pos;
+		if (len > MRT_WRITE_MAX)
+			len = MRT_WRITE_MAX;
+
+		if (atomic_load_explicit(&w->error, memory_order_relaxed)) {
+			/* dump is dead, just discard until stopped */
+			n = len;
+		} else {
+			mrt_writer_prealloc(w);
+			if ((n = write(w->fd, w->ring + pos, len)) == -1) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				atomic_store(&w->error, errno);
+				n = len;
+			} else
+				w->off += n;
+		}
+		atomic_store_explicit(&w->tail, tail + n, memory_order_release);
+	}
+
+	mrt_writer_destroy(w);
+	pthread_mutex_lock(&mrt_writers_mtx);
+	mrt_writers--;
+	pthread_cond_broadcast(&mrt_writers_cond);
+	pthread_mutex_unlock(&mrt_writers_mtx);
+	return NULL;
+}
+
+/*
+ * Start a writer for fd. Returns NULL with errno set on failure, fd is
+ * not closed then.
+ */
+struct mrt_writer *
+mrt_writer_new(int fd)
+{
+	struct mrt_writer	*w;
+	sigset_t		 set, oset;
+	int			 error;
+
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		return NULL;
+	if ((w->ring = malloc(MRT_RING_SIZE)) == NULL) {
+		free(w);
+		return NULL;
+	}
+	atomic_init(&w->head, 0);
+	atomic_init(&w->tail, 0);
+	atomic_init(&w->sleeping, 0);
+	atomic_init(&w->error, 0);
+	w->nextfd = -1;
+	if (mrt_writer_adopt(w, fd) == -1) {
+		error = errno;
+		free(w->ring);
+		free(w);
+		errno = error;
+		return NULL;
+	}
+
+	pthread_mutex_init(&w->mtx, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	/* signals are for the SE poll loop, not for the writer thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	error = pthread_create(&w->thread, NULL, mrt_writer_run, w);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (error != 0) {
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mtx);
+		free(w->ring);
+		free(w);
+		errno = error;
+		return NULL;
+	}
+	pthread_detach(w->thread);
+
+	pthread_mutex_lock(&mrt_writers_mtx);
+	mrt_writers++;
+	pthread_mutex_unlock(&mrt_writers_mtx);
+	return w;
+}
+
+static void
+mrt_writer_wakeup(struct mrt_writer *w)
+{
+	pthread_mutex_lock(&w->mtx);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+static uint64_t
+mrt_writer_copy(struct mrt_writer *w, uint64_t head, const void *data,
+    size_t len)
+{
+	size_t pos, part;
+
+	pos = head % MRT_RING_SIZE;
+	part = MRT_RING_SIZE - pos;
+	if (part > len)
+		part = len;
+	memcpy(w->ring + pos, data, part);
+	memcpy(w->ring, (const uint8_t *)data + part, len - part);
+	return head + len;
+}
+
+/*
+ * Append the record hdr followed by msg (which may be NULL) to the ring.
+ * Returns -1 and accounts the drop if the ring has no space for it.
+ */
+int
+mrt_writer_put(struct mrt_writer *w, const struct ibuf *hdr,
+    const struct ibuf *msg)
+{
+	uint64_t	head, tail;
+	size_t		len;
+
+	len = ibuf_size(hdr);
+	if (msg != NULL)
+		len += ibuf_size(msg);
+
+	head = atomic_load_explicit(&w->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&w->tail, memory_order_acquire);
+	if (MRT_RING_SIZE - (head - tail) < len) {
+		w->drops++;
+		w->dropbytes += len;
+		return -1;
+	}
+
+	head = mrt_writer_copy(w, head, ibuf_data(hdr), ibuf_size(hdr));
+	if (msg != NULL)
+		head = mrt_writer_copy(w, head, ibuf_data(msg),
+		    ibuf_size(msg));
+	atomic_store(&w->head, head);
+
+	if (atomic_load(&w->sleeping))
+		mrt_writer_wakeup(w);
+	return 0;
+}
+
+/*
+ * Switch to a new file. Everything queued so far still goes to the old
+ * file. A reopen that is still pending is replaced by this one.
+ */
+void
+mrt_writer_reopen(struct mrt_writer *w, int fd)
+{
+	pthread_mutex_lock(&w->mtx);
+	if (w->nextfd != -1)
+		close(w->nextfd);
+	w->nextfd = fd;
+	w->mark = atomic_load_explicit(&w->head, memory_order_relaxed);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+/*
+ * Check the state of the writer from the SE poll loop. Drops are reported
+ * once the ring has drained to half its size again. Returns -1 with errno
+ * set if writing the dump failed.
+ */
+int
+mrt_writer_check(struct mrt_writer *w)
+{
+	uint64_t	 used;
+	int		 error;
+
+	if ((error = atomic_load(&w->error)) != 0) {
+		errno = error;
+		return -1;
+	}
+	used = atomic_load_explicit(&w->head, memory_order_relaxed) -
+	    atomic_load(&w->tail);
+	if (w->drops != 0 && used < MRT_RING_SIZE / 2) {
+		log_warnx("mrt dump too slow, dropped %llu messages "
+		    "(%llu bytes)", (unsigned long long)w->drops,
+		    (unsigned long long)w->dropbytes);
+		w->drops = w->dropbytes = 0;
+	}
+	return 0;
+}
+
+/*
+ * Stop the writer. The thread writes out everything queued, closes the
+ * files and frees the writer on its own, w must not be used afterwards.
+ */
+void
+mrt_writer_free(struct mrt_writer *w)
+{
+	if (w == NULL)
+		return;
+
+	pthread_mutex_lock(&w->mtx);
+	w->stop = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+/*
+ * Give the stopped writers some time to finish before the SE exits.
+ */
+void
+mrt_writer_shutdown(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += MRT_WRITER_GRACE;
+
+	pthread_mutex_lock(&mrt_writers_mtx);
+	while (mrt_writers > 0)
+		if (pthread_cond_timedwait(&mrt_writers_cond,
+		    &mrt_writers_mtx, &ts) == ETIMEDOUT)
+			break;
+	if (mrt_writers > 0)
+		log_warnx("%d mrt dumps not completed", mrt_writers);
+	pthread_mutex_unlock(&mrt_writers_mtx);
+}
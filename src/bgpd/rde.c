@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
 
 #include <errno.h>
 #include <pwd.h>
@@ -50,8 +51,11 @@ void		 rde_dispatch_imsg_parent(struct imsgbuf *);
 void		 rde_dispatch_imsg_rtr(struct imsgbuf *);
 void		 rde_dispatch_imsg_peer(struct rde_peer *, void *);
 void		 rde_update_dispatch(struct rde_peer *, struct ibuf *);
+void		 rde_update_intern(struct filterstate *, struct rde_aspath **,
+		    struct rde_community **);
 int		 rde_update_update(struct rde_peer *, uint32_t,
-		    struct filterstate *, struct bgpd_addr *, uint8_t);
+		    struct filterstate *, struct rde_aspath *,
+		    struct rde_community *, struct bgpd_addr *, uint8_t);
 void		 rde_update_withdraw(struct rde_peer *, uint32_t,
 		    struct bgpd_addr *, uint8_t);
 int		 rde_attr_parse(struct ibuf *, struct rde_peer *,
@@ -65,8 +69,9 @@ uint8_t		 rde_aspa_validity(struct rde_peer *, struct rde_aspath *,
 		    uint8_t);
 void		 rde_reflector(struct rde_peer *, struct rde_aspath *);
 
+struct rde_ctl_conn;
 void		 rde_dump_ctx_new(struct ctl_show_rib_request *, pid_t,
-		    enum imsg_type);
+		    enum imsg_type, struct rde_ctl_conn *);
 void		 rde_dump_ctx_throttle(pid_t, int);
 void		 rde_dump_ctx_terminate(pid_t);
 void		 rde_dump_mrt_new(struct mrt *, pid_t, int);
@@ -86,10 +91,14 @@ static void	 rde_rpki_reload(void);
 static int	 rde_roa_reload(void);
 static int	 rde_aspa_reload(void);
 int		 rde_update_queue_pending(void);
+int		 rde_update_queue_timeout(void);
 void		 rde_update_queue_runner(uint8_t);
-struct rde_prefixset *rde_find_prefixset(char *, struct rde_prefixset_head *);
-void		 rde_mark_prefixsets_dirty(struct rde_prefixset_head *,
+static void	 rde_lat_sample(uint64_t);
+static void	 rde_lat_record(struct bgpd_addr *, uint8_t);
+static void	 rde_lat_expire(int);
+void		 rde_mark_prefixsets_dirty(struct set_index *, int,
 		    struct rde_prefixset_head *);
+static void	 rde_filter_rebind(struct filter_head *);
 uint8_t		 rde_roa_validity(struct rde_prefixset *,
 		    struct bgpd_addr *, uint8_t, uint32_t);
 
@@ -109,6 +118,11 @@ static void	 flowspec_dump_upcall(struct rib_entry *, void *);
 static void	 flowspec_dump_done(void *, uint8_t);
 
 void		 rde_shutdown(void);
+static void	 rde_snapshot(void);
+static void	 rde_ctl_conn_new(int, struct ctl_show_rib_request *, pid_t,
+		    enum imsg_type);
+static void	 rde_ctl_conn_close(struct rde_ctl_conn *);
+static void	 rde_restore(void);
 static int	 ovs_match(struct prefix *, uint32_t);
 static int	 avs_match(struct prefix *, uint32_t);
 
@@ -118,27 +132,51 @@ static struct imsgbuf		*ibuf_rtr;
 static struct imsgbuf		*ibuf_main;
 static struct bgpd_config	*conf, *nconf;
 static struct rde_prefixset	 rde_roa, roa_new;
+static struct set_index		 reconf_sets = RB_INITIALIZER(&reconf_sets);
 static struct rde_aspa		*rde_aspa, *aspa_new;
 static uint8_t			 rde_aspa_generation;
 
 volatile sig_atomic_t	 rde_quit = 0;
 struct filter_head	*out_rules, *out_rules_tmp;
 struct rde_memstats	 rdemem;
+struct ctl_metrics	 rdemetrics;
 int			 softreconfig;
 static int		 rde_eval_all;
+static int		 rde_debug;
 
 extern struct peer_tree	 peertable;
 extern struct rde_peer	*peerself;
 
+struct rde_bulk;
+
 struct rde_dump_ctx {
 	LIST_ENTRY(rde_dump_ctx)	entry;
 	struct ctl_show_rib_request	req;
+	struct imsgbuf			*ibuf;
+	struct rde_ctl_conn		*conn;
+	struct rde_bulk			*bulk;
 	uint32_t			peerid;
 	uint8_t				throttled;
 };
 
 LIST_HEAD(, rde_dump_ctx) rde_dump_h = LIST_HEAD_INITIALIZER(rde_dump_h);
 
+/*
+ * Control connections handed over by the SE (bgpd -Q). The RDE answers
+ * the single rib request that came with the connection and closes it
+ * afterwards. Any message sent by the client is treated as an error so
+ * these connections stay read-only.
+ */
+struct rde_ctl_conn {
+	TAILQ_ENTRY(rde_ctl_conn)	 entry;
+	struct imsgbuf			 imsgbuf;
+	struct rde_dump_ctx		*ctx;
+};
+
+TAILQ_HEAD(, rde_ctl_conn) rde_ctl_conns =
+    TAILQ_HEAD_INITIALIZER(rde_ctl_conns);
+u_int rde_ctl_cnt;
+
 struct rde_mrt_ctx {
 	LIST_ENTRY(rde_mrt_ctx)	entry;
 	struct mrt		mrt;
@@ -164,9 +202,13 @@ rde_main(int debug, int verbose)
 	struct passwd		*pw;
 	struct pollfd		*pfd = NULL;
 	struct rde_mrt_ctx	*mctx, *xmctx;
+	struct rde_ctl_conn	*cconn, *xcconn;
+	struct imsg		 imsg;
 	void			*newp;
-	u_int			 pfd_elms = 0, i, j;
-	int			 timeout;
+	u_int			 pfd_elms = 0, i, j, ctl_idx;
+	ssize_t			 n;
+	monotime_t		 loopstart;
+	int			 timeout, t;
 	uint8_t			 aid;
 
 	log_init(debug, LOG_DAEMON);
@@ -189,7 +231,9 @@ rde_main(int debug, int verbose)
 	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
 		fatal("can't drop privileges");
 
-	if (pledge("stdio recvfd", NULL) == -1)
+	/* snapshots for harnesses are only available in debug mode */
+	rde_debug = debug;
+	if (pledge(debug ? "stdio recvfd proc" : "stdio recvfd", NULL) == -1)
 		fatal("pledge");
 
 	signal(SIGTERM, rde_sighdlr);
@@ -221,20 +265,19 @@ rde_main(int debug, int verbose)
 	log_info("route decision engine ready");
 
 	while (rde_quit == 0) {
-		if (pfd_elms < PFD_PIPE_COUNT + rde_mrt_cnt) {
+		if (pfd_elms < PFD_PIPE_COUNT + rde_mrt_cnt + rde_ctl_cnt) {
 			if ((newp = reallocarray(pfd,
-			    PFD_PIPE_COUNT + rde_mrt_cnt,
+			    PFD_PIPE_COUNT + rde_mrt_cnt + rde_ctl_cnt,
 			    sizeof(struct pollfd))) == NULL) {
 				/* panic for now  */
 				log_warn("could not resize pfd from %u -> %u"
 				    " entries", pfd_elms, PFD_PIPE_COUNT +
-				    rde_mrt_cnt);
+				    rde_mrt_cnt + rde_ctl_cnt);
 				fatalx("exiting");
 			}
 			pfd = newp;
-			pfd_elms = PFD_PIPE_COUNT + rde_mrt_cnt;
+			pfd_elms = PFD_PIPE_COUNT + rde_mrt_cnt + rde_ctl_cnt;
 		}
-		timeout = -1;
 		memset(pfd, 0, sizeof(struct pollfd) * pfd_elms);
 
 		set_pollfd(&pfd[PFD_PIPE_MAIN], ibuf_main);
@@ -259,6 +302,33 @@ rde_main(int debug, int verbose)
 			}
 		}
 
+		ctl_idx = i;
+		TAILQ_FOREACH_SAFE(cconn, &rde_ctl_conns, entry, xcconn) {
+			if (cconn->ctx == NULL &&
+			    imsgbuf_queuelen(&cconn->imsgbuf) == 0) {
+				/* request answered and all data sent */
+				rde_ctl_conn_close(cconn);
+				continue;
+			}
+			if (i >= pfd_elms)
+				fatalx("poll pfd too small");
+			/* same watermarks the SE uses for relayed dumps */
+			if (cconn->ctx != NULL) {
+				if (imsgbuf_queuelen(&cconn->imsgbuf) >
+				    CTL_MSG_HIGH_MARK)
+					cconn->ctx->throttled = 1;
+				else if (imsgbuf_queuelen(&cconn->imsgbuf) <
+				    CTL_MSG_LOW_MARK)
+					cconn->ctx->throttled = 0;
+			}
+			set_pollfd(&pfd[i], &cconn->imsgbuf);
+			i++;
+		}
+
+		timeout = damp_timeout();
+		if ((t = rde_update_queue_timeout()) != -1 &&
+		    (timeout == -1 || t < timeout))
+			timeout = t;
 		if (peer_work_pending() || rde_update_queue_pending() ||
 		    nexthop_pending() || rib_dump_pending())
 			timeout = 0;
@@ -268,6 +338,7 @@ rde_main(int debug, int verbose)
 				continue;
 			fatal("poll error");
 		}
+		loopstart = getmonotime();
 
 		if (handle_pollfd(&pfd[PFD_PIPE_MAIN], ibuf_main) == -1)
 			fatalx("Lost connection to parent");
@@ -307,16 +378,43 @@ rde_main(int debug, int verbose)
 			mctx = LIST_NEXT(mctx, entry);
 		}
 
+		for (j = ctl_idx, cconn = TAILQ_FIRST(&rde_ctl_conns);
+		    j < i && cconn != NULL; j++, cconn = xcconn) {
+			xcconn = TAILQ_NEXT(cconn, entry);
+			if (pfd[j].fd != cconn->imsgbuf.fd)
+				continue;
+			if (pfd[j].revents & POLLOUT &&
+			    imsgbuf_write(&cconn->imsgbuf) == -1) {
+				rde_ctl_conn_close(cconn);
+				continue;
+			}
+			if ((pfd[j].revents & (POLLIN | POLLHUP)) == 0)
+				continue;
+			/* read-only connection, anything but EOF is an error */
+			if (imsgbuf_read(&cconn->imsgbuf) == 1 &&
+			    (n = imsg_get(&cconn->imsgbuf, &imsg)) != 0) {
+				if (n > 0)
+					imsg_free(&imsg);
+				log_warnx("unexpected message on control "
+				    "connection");
+			}
+			rde_ctl_conn_close(cconn);
+		}
+
 		peer_foreach(rde_dispatch_imsg_peer, NULL);
 		peer_reaper(NULL);
 		rib_dump_runner();
 		nexthop_runner();
+		damp_runner();
 		if (ibuf_se && imsgbuf_queuelen(ibuf_se) < SESS_MSG_HIGH_MARK) {
 			for (aid = AID_MIN; aid < AID_MAX; aid++)
 				rde_update_queue_runner(aid);
 		}
 		/* commit pftable once per poll loop */
 		rde_commit_pftable();
+
+		hist_add(&rdemetrics.rde_loop,
+		    monotime_sub(getmonotime(), loopstart).monotime);
 	}
 
 	/* do not clean up on shutdown on production, it takes ages. */
@@ -351,7 +449,10 @@ rde_main(int debug, int verbose)
 		LIST_REMOVE(mctx, entry);
 		free(mctx);
 	}
+	while ((cconn = TAILQ_FIRST(&rde_ctl_conns)) != NULL)
+		rde_ctl_conn_close(cconn);
 
+	trace_flush();
 	log_info("route decision engine exiting");
 	exit(0);
 }
@@ -381,7 +482,7 @@ rde_dispatch_imsg_session(struct imsgbuf *imsgbuf)
 	ssize_t			 n;
 	uint32_t		 peerid;
 	pid_t			 pid;
-	int			 verbose;
+	int			 fd, verbose;
 	uint8_t			 aid;
 
 	while (imsgbuf) {
@@ -389,11 +490,13 @@ rde_dispatch_imsg_session(struct imsgbuf *imsgbuf)
 			fatal("rde_dispatch_imsg_session: imsg_get error");
 		if (n == 0)
 			break;
+		trace_imsg(PROC_SE, &imsg);
 
 		peerid = imsg_get_id(&imsg);
 		pid = imsg_get_pid(&imsg);
 		switch (imsg_get_type(&imsg)) {
 		case IMSG_UPDATE:
+		case IMSG_UPDATE_BATCH:
 		case IMSG_REFRESH:
 			if ((peer = peer_get(peerid)) == NULL) {
 				log_warnx("rde_dispatch: unknown peer id %d",
@@ -683,7 +786,12 @@ badnetdel:
 				log_warnx("rde_dispatch: wrong imsg len");
 				break;
 			}
-			rde_dump_ctx_new(&req, pid, imsg_get_type(&imsg));
+			if ((fd = imsg_get_fd(&imsg)) != -1)
+				rde_ctl_conn_new(fd, &req, pid,
+				    imsg_get_type(&imsg));
+			else
+				rde_dump_ctx_new(&req, pid,
+				    imsg_get_type(&imsg), NULL);
 			break;
 		case IMSG_CTL_SHOW_FLOWSPEC:
 			if (imsg_get_data(&imsg, &req, sizeof(req)) == -1) {
@@ -695,9 +803,12 @@ badnetdel:
 			break;
 		case IMSG_CTL_SHOW_NEIGHBOR:
 			peer = peer_get(peerid);
-			if (peer != NULL)
+			if (peer != NULL) {
 				memcpy(&stats, &peer->stats, sizeof(stats));
-			else
+				rde_filter_cache_stats(peer->out_cache,
+				    &stats.filter_out_hit,
+				    &stats.filter_out_miss);
+			} else
 				memset(&stats, 0, sizeof(stats));
 			imsg_compose(ibuf_se_ctl, IMSG_CTL_SHOW_NEIGHBOR,
 			    peerid, pid, -1, &stats, sizeof(stats));
@@ -706,6 +817,16 @@ badnetdel:
 			imsg_compose(ibuf_se_ctl, IMSG_CTL_SHOW_RIB_MEM, 0,
 			    pid, -1, &rdemem, sizeof(rdemem));
 			break;
+		case IMSG_CTL_SHOW_RIB_LATENCY:
+			imsg_compose(ibuf_se_ctl, IMSG_CTL_SHOW_RIB_LATENCY, 0,
+			    pid, -1, &rdemetrics.latency,
+			    sizeof(rdemetrics.latency));
+			break;
+		case IMSG_CTL_SHOW_METRICS:
+			rdemetrics.mem = rdemem;
+			imsg_compose(ibuf_se_ctl, IMSG_CTL_SHOW_METRICS, 0,
+			    pid, -1, &rdemetrics, sizeof(rdemetrics));
+			break;
 		case IMSG_CTL_SHOW_SET:
 			/* first roa set */
 			pset = &rde_roa;
@@ -813,6 +934,7 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 	static struct as_set	*last_as_set;
 	static struct l3vpn	*vpn;
 	static struct flowspec	*curflow;
+	static int		 shmfd = -1;
 	struct imsg		 imsg;
 	struct ibuf		 ibuf;
 	struct bgpd_config	 tconf;
@@ -820,6 +942,8 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 	struct kroute_nexthop	 knext;
 	struct mrt		 xmrt;
 	struct prefixset_item	 psi;
+	struct filter_prefix	 fp;
+	struct set_keep		 keep;
 	struct rde_rib		 rr;
 	struct roa		 roa;
 	char			 name[SET_NAME_LEN];
@@ -839,6 +963,7 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 			fatal("rde_dispatch_imsg_parent: imsg_get error");
 		if (n == 0)
 			break;
+		trace_imsg(PROC_MAIN, &imsg);
 
 		switch (imsg_get_type(&imsg)) {
 		case IMSG_SOCKET_CONN:
@@ -862,6 +987,10 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 					imsgbuf_clear(ibuf_se);
 					free(ibuf_se);
 				}
+				if (shmfd != -1) {
+					imsgbuf_attach_shm(i, shmfd, 1);
+					shmfd = -1;
+				}
 				ibuf_se = i;
 				break;
 			case IMSG_SOCKET_CONN_CTL:
@@ -871,6 +1000,8 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 					imsgbuf_clear(ibuf_se_ctl);
 					free(ibuf_se_ctl);
 				}
+				/* control connections from the SE (bgpd -Q) */
+				imsgbuf_allow_fdpass(i);
 				ibuf_se_ctl = i;
 				break;
 			case IMSG_SOCKET_CONN_RTR:
@@ -884,6 +1015,13 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 				break;
 			}
 			break;
+		case IMSG_SOCKET_SHM:
+			if (shmfd != -1)
+				close(shmfd);
+			if ((shmfd = imsg_get_fd(&imsg)) == -1)
+				log_warnx("expected to receive shared memory "
+				    "fd but didn't receive any");
+			break;
 		case IMSG_NETWORK_ADD:
 			if (imsg_get_data(&imsg, &netconf_p,
 			    sizeof(netconf_p)) == -1) {
@@ -1035,16 +1173,16 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 				fatalx("IMSG_RECONF_FILTER bad len");
 			if (r->match.prefixset.name[0] != '\0') {
 				r->match.prefixset.ps =
-				    rde_find_prefixset(r->match.prefixset.name,
-					&nconf->rde_prefixsets);
+				    set_index_get(&reconf_sets, PREFIX_SET,
+					r->match.prefixset.name);
 				if (r->match.prefixset.ps == NULL)
 					log_warnx("%s: no prefixset for %s",
 					    __func__, r->match.prefixset.name);
 			}
 			if (r->match.originset.name[0] != '\0') {
 				r->match.originset.ps =
-				    rde_find_prefixset(r->match.originset.name,
-					&nconf->rde_originsets);
+				    set_index_get(&reconf_sets, ORIGIN_SET,
+					r->match.originset.name);
 				if (r->match.originset.ps == NULL)
 					log_warnx("%s: no origin-set for %s",
 					    __func__, r->match.originset.name);
@@ -1052,7 +1190,7 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 			if (r->match.as.flags & AS_FLAG_AS_SET_NAME) {
 				struct as_set * aset;
 
-				aset = as_sets_lookup(&nconf->as_sets,
+				aset = set_index_get(&reconf_sets, ASNUM_SET,
 				    r->match.as.name);
 				if (aset == NULL) {
 					log_warnx("%s: no as-set for %s",
@@ -1098,9 +1236,13 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 			if (imsg_get_type(&imsg) == IMSG_RECONF_ORIGIN_SET) {
 				SIMPLEQ_INSERT_TAIL(&nconf->rde_originsets, ps,
 				    entry);
+				set_index_add(&reconf_sets, ORIGIN_SET,
+				    ps->name, ps);
 			} else {
 				SIMPLEQ_INSERT_TAIL(&nconf->rde_prefixsets, ps,
 				    entry);
+				set_index_add(&reconf_sets, PREFIX_SET,
+				    ps->name, ps);
 			}
 			last_prefixset = ps;
 			break;
@@ -1122,15 +1264,75 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 				    last_prefixset->name, log_addr(&psi.p.addr),
 				    psi.p.len);
 			break;
+		case IMSG_RECONF_PREFIX_SET_ITEMS:
+			if (imsg_get_ibuf(&imsg, &ibuf) == -1 ||
+			    ibuf_size(&ibuf) == 0 ||
+			    ibuf_size(&ibuf) % sizeof(fp) != 0)
+				fatalx("IMSG_RECONF_PREFIX_SET_ITEMS bad len");
+			if (last_prefixset == NULL)
+				fatalx("King Bula has no prefixset");
+			while (ibuf_size(&ibuf) > 0) {
+				if (ibuf_get(&ibuf, &fp, sizeof(fp)) == -1)
+					fatal("IMSG_RECONF_PREFIX_SET_ITEMS");
+				if (trie_add(&last_prefixset->th, &fp.addr,
+				    fp.len, fp.len_min, fp.len_max) == -1)
+					log_warnx("trie_add(%s) %s/%u failed",
+					    last_prefixset->name,
+					    log_addr(&fp.addr), fp.len);
+			}
+			break;
+		case IMSG_RECONF_SET_KEEP:
+			if (imsg_get_data(&imsg, &keep, sizeof(keep)) == -1)
+				fatalx("IMSG_RECONF_SET_KEEP bad len");
+			keep.name[sizeof(keep.name) - 1] = '\0';
+			/* empty placeholder, rde_reload_done() fills it */
+			switch (keep.type) {
+			case PREFIX_SET:
+			case ORIGIN_SET:
+				ps = calloc(1, sizeof(struct rde_prefixset));
+				if (ps == NULL)
+					fatal(NULL);
+				strlcpy(ps->name, keep.name, sizeof(ps->name));
+				ps->kept = 1;
+				if (keep.type == ORIGIN_SET)
+					SIMPLEQ_INSERT_TAIL(
+					    &nconf->rde_originsets, ps, entry);
+				else
+					SIMPLEQ_INSERT_TAIL(
+					    &nconf->rde_prefixsets, ps, entry);
+				set_index_add(&reconf_sets, keep.type,
+				    ps->name, ps);
+				last_prefixset = NULL;
+				break;
+			case ASNUM_SET:
+				last_as_set = as_sets_new(&nconf->as_sets,
+				    keep.name, 0, sizeof(uint32_t));
+				if (last_as_set == NULL)
+					fatal(NULL);
+				last_as_set->kept = 1;
+				set_index_add(&reconf_sets, ASNUM_SET,
+				    last_as_set->name, last_as_set);
+				last_as_set = NULL;
+				break;
+			default:
+				fatalx("IMSG_RECONF_SET_KEEP bad type %u",
+				    keep.type);
+			}
+			break;
 		case IMSG_RECONF_AS_SET:
 			if (imsg_get_ibuf(&imsg, &ibuf) == -1 ||
 			    ibuf_get(&ibuf, &nmemb, sizeof(nmemb)) == -1 ||
 			    ibuf_get(&ibuf, name, sizeof(name)) == -1)
 				fatalx("IMSG_RECONF_AS_SET bad len");
-			if (as_sets_lookup(&nconf->as_sets, name) != NULL)
+			if (set_index_get(&reconf_sets, ASNUM_SET,
+			    name) != NULL)
 				fatalx("duplicate as-set %s", name);
 			last_as_set = as_sets_new(&nconf->as_sets, name, nmemb,
 			    sizeof(uint32_t));
+			if (last_as_set == NULL)
+				fatal(NULL);
+			set_index_add(&reconf_sets, ASNUM_SET,
+			    last_as_set->name, last_as_set);
 			break;
 		case IMSG_RECONF_AS_SET_ITEMS:
 			if (imsg_get_ibuf(&imsg, &ibuf) == -1 ||
@@ -1222,6 +1424,12 @@ rde_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 		case IMSG_MRT_CLOSE:
 			/* ignore end message because a dump is atomic */
 			break;
+		case IMSG_RDE_SNAPSHOT:
+			rde_snapshot();
+			break;
+		case IMSG_RDE_RESTORE:
+			rde_restore();
+			break;
 		default:
 			fatalx("unhandled IMSG %u", imsg_get_type(&imsg));
 		}
@@ -1243,6 +1451,7 @@ rde_dispatch_imsg_rtr(struct imsgbuf *imsgbuf)
 			fatal("rde_dispatch_imsg_parent: imsg_get error");
 		if (n == 0)
 			break;
+		trace_imsg(PROC_RTR, &imsg);
 
 		switch (imsg_get_type(&imsg)) {
 		case IMSG_RECONF_ROA_SET:
@@ -1320,7 +1529,10 @@ rde_dispatch_imsg_peer(struct rde_peer *peer, void *bula)
 {
 	struct route_refresh rr;
 	struct imsg imsg;
-	struct ibuf ibuf;
+	struct ibuf ibuf, ubuf;
+	monotime_t now;
+	uint64_t stamp;
+	uint16_t len;
 
 	if (!peer_is_up(peer)) {
 		peer_imsg_flush(peer);
@@ -1337,6 +1549,34 @@ rde_dispatch_imsg_peer(struct rde_peer *peer, void *bula)
 		else
 			rde_update_dispatch(peer, &ibuf);
 		break;
+	case IMSG_UPDATE_BATCH:
+		/* a batch is bounded by MSG_PROCESS_LIMIT UPDATEs in the SE */
+		if (imsg_get_ibuf(&imsg, &ibuf) == -1 ||
+		    ibuf_get_n64(&ibuf, &stamp) == -1) {
+			log_warn("update batch: bad imsg");
+			break;
+		}
+		rde_lat_sample(stamp);
+		while (ibuf_size(&ibuf) > 0) {
+			if (ibuf_get_n16(&ibuf, &len) == -1 ||
+			    ibuf_get_ibuf(&ibuf, len, &ubuf) == -1) {
+				log_warnx("update batch: bad imsg");
+				break;
+			}
+			rde_update_dispatch(peer, &ubuf);
+			/* an UPDATE may have reset the session */
+			if (!peer_is_up(peer))
+				break;
+		}
+		rde_lat_sample(0);
+		/*
+		 * Time from reception in the SE until the decision is done.
+		 * The stamp comes from the SE, don't let a bogus one wrap.
+		 */
+		now = getmonotime();
+		hist_add(&rdemetrics.update_rde, now.monotime > stamp ?
+		    now.monotime - stamp : 0);
+		break;
 	case IMSG_REFRESH:
 		if (imsg_get_data(&imsg, &rr, sizeof(rr)) == -1) {
 			log_warnx("route refresh: wrong imsg len");
@@ -1392,12 +1632,34 @@ rde_dispatch_imsg_peer(struct rde_peer *peer, void *bula)
 	imsg_free(&imsg);
 }
 
+/*
+ * Replace asp and comm with references to the interned path attributes
+ * of state. All NLRI of an UPDATE share them, they are the key for the
+ * input filter caches.
+ */
+void
+rde_update_intern(struct filterstate *state, struct rde_aspath **asp,
+    struct rde_community **comm)
+{
+	struct rde_community	*c;
+
+	path_unref(*asp);
+	communities_unref(*comm);
+
+	*asp = path_intern(&state->aspath);
+	if ((c = communities_lookup(&state->communities)) == NULL)
+		c = communities_link(&state->communities);
+	*comm = communities_ref(c);
+}
+
 /* handle routing updates from the session engine. */
 void
 rde_update_dispatch(struct rde_peer *peer, struct ibuf *buf)
 {
 	struct filterstate	 state;
 	struct bgpd_addr	 prefix;
+	struct rde_aspath	*asp = NULL;
+	struct rde_community	*comm = NULL;
 	struct ibuf		 wdbuf, attrbuf, nlribuf, reachbuf, unreachbuf;
 	uint16_t		 afi, len;
 	uint8_t			 aid, prefixlen, safi, subtype;
@@ -1659,6 +1921,7 @@ rde_update_dispatch(struct rde_peer *peer, struct ibuf *buf)
 				break;
 			}
 		}
+		rde_update_intern(&state, &asp, &comm);
 	}
 	while (ibuf_size(&nlribuf) > 0) {
 		if (peer_has_add_path(peer, AID_INET, CAPA_AP_RECV)) {
@@ -1679,7 +1942,7 @@ rde_update_dispatch(struct rde_peer *peer, struct ibuf *buf)
 			goto done;
 		}
 
-		if (rde_update_update(peer, pathid, &state,
+		if (rde_update_update(peer, pathid, &state, asp, comm,
 		    &prefix, prefixlen) == -1)
 			goto done;
 	}
@@ -1732,6 +1995,9 @@ rde_update_dispatch(struct rde_peer *peer, struct ibuf *buf)
 			state.aspath.flags &= ~F_ATTR_OTC_LEAK;
 		}
 
+		/* the path attributes may have changed for this AFI */
+		rde_update_intern(&state, &asp, &comm);
+
 		/* unlock the previously locked nexthop, it is no longer used */
 		nexthop_unref(state.nexthop);
 		state.nexthop = NULL;
@@ -1825,13 +2091,15 @@ rde_update_dispatch(struct rde_peer *peer, struct ibuf *buf)
 				continue;
 			}
 
-			if (rde_update_update(peer, pathid, &state,
-			    &prefix, prefixlen) == -1)
+			if (rde_update_update(peer, pathid, &state, asp,
+			    comm, &prefix, prefixlen) == -1)
 				goto done;
 		}
 	}
 
 done:
+	path_unref(asp);
+	communities_unref(comm);
 	rde_filterstate_clean(&state);
 }
 
@@ -1887,15 +2155,23 @@ pathid_assign(struct rde_peer *peer, uint32_t path_id,
 	return path_id_tx;
 }
 
+/*
+ * Add prefix with the path attributes in to the RIBs. asp and comm are
+ * the interned aspath and communities of in.
+ */
 int
 rde_update_update(struct rde_peer *peer, uint32_t path_id,
-    struct filterstate *in, struct bgpd_addr *prefix, uint8_t prefixlen)
+    struct filterstate *in, struct rde_aspath *asp, struct rde_community *comm,
+    struct bgpd_addr *prefix, uint8_t prefixlen)
 {
 	struct filterstate	 state;
+	struct prefix		*p;
 	enum filter_actions	 action;
+	enum damp_event		 dev = DAMP_UPDATE;
 	uint32_t		 path_id_tx;
 	uint16_t		 i;
 	uint8_t			 roa_state, aspa_state;
+	int			 damped = 0;
 	const char		*wmsg = "filtered, withdraw";
 
 	peer->stats.prefix_rcvd_update++;
@@ -1906,6 +2182,12 @@ rde_update_update(struct rde_peer *peer, uint32_t path_id,
 	rde_filterstate_set_vstate(in, roa_state, aspa_state);
 
 	path_id_tx = pathid_assign(peer, path_id, prefix, prefixlen);
+	if (conf->flags & BGPD_FLAG_DAMPING) {
+		p = prefix_get(rib_byid(RIB_ADJ_IN), peer, path_id, prefix,
+		    prefixlen);
+		if (p != NULL && !prefix_same_state(p, in))
+			dev = DAMP_CHANGE;
+	}
 	/* add original path to the Adj-RIB-In */
 	if (prefix_update(rib_byid(RIB_ADJ_IN), peer, path_id, path_id_tx,
 	    in, 0, prefix, prefixlen) == 1)
@@ -1923,14 +2205,25 @@ rde_update_update(struct rde_peer *peer, uint32_t path_id,
 	if (in->aspath.flags & F_ATTR_PARSE_ERR)
 		wmsg = "path invalid, withdraw";
 
+	if (conf->flags & BGPD_FLAG_DAMPING) {
+		p = prefix_get(rib_byid(RIB_ADJ_IN), peer, path_id, prefix,
+		    prefixlen);
+		if (p != NULL && damp_update(peer, p->pt, path_id, dev)) {
+			damped = 1;
+			wmsg = "damped, withdraw";
+		}
+	}
+
 	for (i = RIB_LOC_START; i < rib_size; i++) {
 		struct rib *rib = rib_byid(i);
 		if (rib == NULL)
 			continue;
-		rde_filterstate_copy(&state, in);
 		/* input filter */
-		action = rde_filter(rib->in_rules, peer, peer, prefix,
-		    prefixlen, &state);
+		action = rde_filter_cached_state(rib->in_cache, rib->in_rules,
+		    peer, peer, asp, comm, in, prefix, prefixlen, &state);
+		/* suppressed routes are handled like filtered ones */
+		if (damped)
+			action = ACTION_DENY;
 
 		if (action == ACTION_ALLOW) {
 			rde_update_log("update", i, peer,
@@ -1951,6 +2244,7 @@ rde_update_update(struct rde_peer *peer, uint32_t path_id,
 
 		rde_filterstate_clean(&state);
 	}
+	rde_lat_record(prefix, prefixlen);
 	return (0);
 }
 
@@ -1958,7 +2252,16 @@ void
 rde_update_withdraw(struct rde_peer *peer, uint32_t path_id,
     struct bgpd_addr *prefix, uint8_t prefixlen)
 {
-	uint16_t i;
+	struct prefix	*p;
+	uint16_t	 i;
+
+	/* account the flap while the route still holds its pt_entry */
+	if (conf->flags & BGPD_FLAG_DAMPING) {
+		p = prefix_get(rib_byid(RIB_ADJ_IN), peer, path_id, prefix,
+		    prefixlen);
+		if (p != NULL)
+			damp_update(peer, p->pt, path_id, DAMP_WITHDRAW);
+	}
 
 	for (i = RIB_LOC_START; i < rib_size; i++) {
 		struct rib *rib = rib_byid(i);
@@ -1977,6 +2280,51 @@ rde_update_withdraw(struct rde_peer *peer, uint32_t path_id,
 	peer->stats.prefix_rcvd_withdraw++;
 }
 
+/*
+ * A damped route became usable again. Run the route still held in the
+ * Adj-RIB-In through the input filters into the Loc-RIBs.
+ */
+void
+rde_update_reuse(struct rde_peer *peer, struct pt_entry *pt,
+    uint32_t path_id)
+{
+	struct filterstate	 state;
+	struct prefix		*p;
+	struct rib		*rib;
+	struct bgpd_addr	 prefix;
+	enum filter_actions	 action;
+	uint16_t		 i;
+
+	pt_getaddr(pt, &prefix);
+	p = prefix_get(rib_byid(RIB_ADJ_IN), peer, path_id, &prefix,
+	    pt->prefixlen);
+	if (p == NULL)
+		/* withdrawn while suppressed */
+		return;
+
+	for (i = RIB_LOC_START; i < rib_size; i++) {
+		rib = rib_byid(i);
+		if (rib == NULL)
+			continue;
+
+		action = rde_filter_cached(rib->in_cache, rib->in_rules,
+		    peer, peer, p, &prefix, pt->prefixlen, &state);
+
+		if (action == ACTION_ALLOW) {
+			rde_update_log("reuse", i, peer,
+			    &state.nexthop->exit_nexthop, &prefix,
+			    pt->prefixlen);
+			prefix_update(rib, peer, p->path_id, p->path_id_tx,
+			    &state, 0, &prefix, pt->prefixlen);
+		} else if (conf->filtered_in_locrib && i == RIB_LOC_START) {
+			prefix_update(rib, peer, p->path_id, p->path_id_tx,
+			    &state, 1, &prefix, pt->prefixlen);
+		}
+
+		rde_filterstate_clean(&state);
+	}
+}
+
 /*
  * BGP UPDATE parser functions
  */
@@ -2811,62 +3159,38 @@ rde_reflector(struct rde_peer *peer, struct rde_aspath *asp)
 /*
  * control specific functions
  */
-static void
-rde_dump_rib_as(struct prefix *p, struct rde_aspath *asp, pid_t pid, int flags,
-    int adjout)
+
+/*
+ * Return the F_PREF flags of prefix p and store the path id shown for it
+ * in path_id.
+ */
+static uint32_t
+rde_dump_flags(struct prefix *p, struct rde_aspath *asp, int adjout,
+    uint32_t *path_id)
 {
-	struct ctl_show_rib	 rib;
-	struct ibuf		*wbuf;
-	struct attr		*a;
-	struct nexthop		*nexthop;
 	struct rib_entry	*re;
 	struct prefix		*xp;
 	struct rde_peer		*peer;
 	monotime_t		 staletime;
-	size_t			 aslen;
-	uint8_t			 l;
+	uint32_t		 flags = 0;
 
-	nexthop = prefix_nexthop(p);
 	peer = prefix_peer(p);
-	memset(&rib, 0, sizeof(rib));
-	rib.lastchange = p->lastchange;
-	rib.local_pref = asp->lpref;
-	rib.med = asp->med;
-	rib.weight = asp->weight;
-	strlcpy(rib.descr, peer->conf.descr, sizeof(rib.descr));
-	memcpy(&rib.remote_addr, &peer->remote_addr,
-	    sizeof(rib.remote_addr));
-	rib.remote_id = peer->remote_bgpid;
-	if (nexthop != NULL) {
-		rib.exit_nexthop = nexthop->exit_nexthop;
-		rib.true_nexthop = nexthop->true_nexthop;
-	} else {
-		/* announced network can have a NULL nexthop */
-		rib.exit_nexthop.aid = p->pt->aid;
-		rib.true_nexthop.aid = p->pt->aid;
-	}
-	pt_getaddr(p->pt, &rib.prefix);
-	rib.prefixlen = p->pt->prefixlen;
-	rib.origin = asp->origin;
-	rib.roa_validation_state = prefix_roa_vstate(p);
-	rib.aspa_validation_state = prefix_aspa_vstate(p);
-	rib.dmetric = p->dmetric;
-	rib.flags = 0;
+	*path_id = 0;
 	if (!adjout && prefix_eligible(p)) {
 		re = prefix_re(p);
 		TAILQ_FOREACH(xp, &re->prefix_h, entry.list.rib) {
 			switch (xp->dmetric) {
 			case PREFIX_DMETRIC_BEST:
 				if (xp == p)
-					rib.flags |= F_PREF_BEST;
+					flags |= F_PREF_BEST;
 				break;
 			case PREFIX_DMETRIC_ECMP:
 				if (xp == p)
-					rib.flags |= F_PREF_ECMP;
+					flags |= F_PREF_ECMP;
 				break;
 			case PREFIX_DMETRIC_AS_WIDE:
 				if (xp == p)
-					rib.flags |= F_PREF_AS_WIDE;
+					flags |= F_PREF_AS_WIDE;
 				break;
 			default:
 				xp = NULL;	/* stop loop */
@@ -2877,48 +3201,91 @@ rde_dump_rib_as(struct prefix *p, struct rde_aspath *asp, pid_t pid, int flags,
 		}
 	}
 	if (!peer->conf.ebgp)
-		rib.flags |= F_PREF_INTERNAL;
+		flags |= F_PREF_INTERNAL;
 	if (asp->flags & F_PREFIX_ANNOUNCED)
-		rib.flags |= F_PREF_ANNOUNCE;
+		flags |= F_PREF_ANNOUNCE;
 	if (prefix_eligible(p))
-		rib.flags |= F_PREF_ELIGIBLE;
+		flags |= F_PREF_ELIGIBLE;
 	if (prefix_filtered(p))
-		rib.flags |= F_PREF_FILTERED;
+		flags |= F_PREF_FILTERED;
+	if (!adjout && damp_suppressed(peer, p->pt, p->path_id))
+		flags |= F_PREF_DAMPED;
 	/* otc loop includes parse err so skip the latter if the first is set */
 	if (asp->flags & F_ATTR_OTC_LEAK)
-		rib.flags |= F_PREF_OTC_LEAK;
+		flags |= F_PREF_OTC_LEAK;
 	else if (asp->flags & F_ATTR_PARSE_ERR)
-		rib.flags |= F_PREF_INVALID;
+		flags |= F_PREF_INVALID;
 	staletime = peer->staletime[p->pt->aid];
 	if (monotime_valid(staletime) &&
 	    monotime_cmp(p->lastchange, staletime) <= 0)
-		rib.flags |= F_PREF_STALE;
+		flags |= F_PREF_STALE;
 	if (!adjout) {
 		if (peer_has_add_path(peer, p->pt->aid, CAPA_AP_RECV)) {
-			rib.path_id = p->path_id;
-			rib.flags |= F_PREF_PATH_ID;
+			*path_id = p->path_id;
+			flags |= F_PREF_PATH_ID;
 		}
 	} else {
 		if (peer_has_add_path(peer, p->pt->aid, CAPA_AP_SEND)) {
-			rib.path_id = p->path_id_tx;
-			rib.flags |= F_PREF_PATH_ID;
+			*path_id = p->path_id_tx;
+			flags |= F_PREF_PATH_ID;
 		}
 	}
+	return flags;
+}
+
+static void
+rde_dump_rib_as(struct prefix *p, struct rde_aspath *asp, struct imsgbuf *ibuf,
+    pid_t pid, int flags, int adjout)
+{
+	struct ctl_show_rib	 rib;
+	struct ibuf		*wbuf;
+	struct attr		*a;
+	struct nexthop		*nexthop;
+	struct rde_peer		*peer;
+	size_t			 aslen;
+	uint8_t			 l;
+
+	nexthop = prefix_nexthop(p);
+	peer = prefix_peer(p);
+	memset(&rib, 0, sizeof(rib));
+	rib.lastchange = p->lastchange;
+	rib.local_pref = asp->lpref;
+	rib.med = asp->med;
+	rib.weight = asp->weight;
+	strlcpy(rib.descr, peer->conf.descr, sizeof(rib.descr));
+	memcpy(&rib.remote_addr, &peer->remote_addr,
+	    sizeof(rib.remote_addr));
+	rib.remote_id = peer->remote_bgpid;
+	if (nexthop != NULL) {
+		rib.exit_nexthop = nexthop->exit_nexthop;
+		rib.true_nexthop = nexthop->true_nexthop;
+	} else {
+		/* announced network can have a NULL nexthop */
+		rib.exit_nexthop.aid = p->pt->aid;
+		rib.true_nexthop.aid = p->pt->aid;
+	}
+	pt_getaddr(p->pt, &rib.prefix);
+	rib.prefixlen = p->pt->prefixlen;
+	rib.origin = asp->origin;
+	rib.roa_validation_state = prefix_roa_vstate(p);
+	rib.aspa_validation_state = prefix_aspa_vstate(p);
+	rib.dmetric = p->dmetric;
+	rib.flags = rde_dump_flags(p, asp, adjout, &rib.path_id);
 	aslen = aspath_length(asp->aspath);
 
-	if ((wbuf = imsg_create(ibuf_se_ctl, IMSG_CTL_SHOW_RIB, 0, pid,
+	if ((wbuf = imsg_create(ibuf, IMSG_CTL_SHOW_RIB, 0, pid,
 	    sizeof(rib) + aslen)) == NULL)
 		return;
 	if (imsg_add(wbuf, &rib, sizeof(rib)) == -1 ||
 	    imsg_add(wbuf, aspath_dump(asp->aspath), aslen) == -1)
 		return;
-	imsg_close(ibuf_se_ctl, wbuf);
+	imsg_close(ibuf, wbuf);
 
 	if (flags & F_CTL_DETAIL) {
 		struct rde_community *comm = prefix_communities(p);
 		size_t len = comm->nentries * sizeof(struct community);
 		if (comm->nentries > 0) {
-			if (imsg_compose(ibuf_se_ctl,
+			if (imsg_compose(ibuf,
 			    IMSG_CTL_SHOW_RIB_COMMUNITIES, 0, pid, -1,
 			    comm->communities, len) == -1)
 				return;
@@ -2926,7 +3293,7 @@ rde_dump_rib_as(struct prefix *p, struct rde_aspath *asp, pid_t pid, int flags,
 		for (l = 0; l < asp->others_len; l++) {
 			if ((a = asp->others[l]) == NULL)
 				break;
-			if ((wbuf = imsg_create(ibuf_se_ctl,
+			if ((wbuf = imsg_create(ibuf,
 			    IMSG_CTL_SHOW_RIB_ATTR, 0, pid, 0)) == NULL)
 				return;
 			if (attr_writebuf(wbuf, a->flags, a->type, a->data,
@@ -2934,77 +3301,435 @@ rde_dump_rib_as(struct prefix *p, struct rde_aspath *asp, pid_t pid, int flags,
 				ibuf_free(wbuf);
 				return;
 			}
-			imsg_close(ibuf_se_ctl, wbuf);
+			imsg_close(ibuf, wbuf);
 		}
 	}
 }
 
-int
-rde_match_peer(struct rde_peer *p, struct ctl_neighbor *n)
-{
-	char *s;
+/*
+ * Binary bulk export, see enum bulk_rec_type in bgpd.h. Each peer, path
+ * and community set is sent once per dump and afterwards only referenced
+ * by id. The dump holds a reference on the paths and communities it sent
+ * so their memory, which is the key in the refs tree, can not be reused
+ * for a different object while the dump is running.
+ */
+struct rde_bulk_ref {
+	RB_ENTRY(rde_bulk_ref)	 entry;
+	void			*obj;
+	uintptr_t		 key;
+	uint32_t		 id;
+	uint8_t			 type;
+};
+RB_HEAD(rde_bulk_refs, rde_bulk_ref);
 
-	if (n && n->addr.aid) {
-		if (memcmp(&p->conf.remote_addr, &n->addr,
-		    sizeof(p->conf.remote_addr)))
-			return 0;
-	} else if (n && n->descr[0]) {
-		s = n->is_group ? p->conf.group : p->conf.descr;
-		/* cannot trust n->descr to be properly terminated */
-		if (strncmp(s, n->descr, sizeof(n->descr)))
-			return 0;
-	}
-	return 1;
+struct rde_bulk {
+	struct rde_bulk_refs	 refs;
+	struct ibuf		*chunk;
+	uint32_t		 nextid;
+};
+
+static inline int
+rde_bulk_ref_cmp(struct rde_bulk_ref *a, struct rde_bulk_ref *b)
+{
+	if (a->type != b->type)
+		return (a->type < b->type ? -1 : 1);
+	if (a->key > b->key)
+		return 1;
+	if (a->key < b->key)
+		return -1;
+	return 0;
 }
 
-static void
-rde_dump_filter(struct prefix *p, struct ctl_show_rib_request *req, int adjout)
+RB_GENERATE_STATIC(rde_bulk_refs, rde_bulk_ref, entry, rde_bulk_ref_cmp);
+
+#define BULK_CHUNK_SIZE		(MAX_BGPD_IMSGSIZE - IMSG_HEADER_SIZE)
+
+static struct ibuf	*bulkrec;
+
+static int
+rde_bulk_rec_start(uint8_t type)
 {
-	struct rde_aspath	*asp;
+	ibuf_truncate(bulkrec, 0);
+	if (ibuf_add_n8(bulkrec, type) == -1 ||
+	    ibuf_add_n32(bulkrec, 0) == -1)
+		return -1;
+	return 0;
+}
 
-	if (!rde_match_peer(prefix_peer(p), &req->neighbor))
-		return;
+/*
+ * Append the record in bulkrec to the current chunk, the chunk is sent
+ * off to the SE once the record does not fit anymore.
+ */
+static int
+rde_bulk_rec_end(struct rde_dump_ctx *ctx)
+{
+	struct rde_bulk	*bulk = ctx->bulk;
+	size_t		 len = ibuf_size(bulkrec);
 
-	asp = prefix_aspath(p);
-	if ((req->flags & F_CTL_BEST) && p->dmetric != PREFIX_DMETRIC_BEST)
-		return;
-	if ((req->flags & F_CTL_INVALID) &&
-	    (asp->flags & F_ATTR_PARSE_ERR) == 0)
-		return;
-	if ((req->flags & F_CTL_FILTERED) && !prefix_filtered(p))
-		return;
-	if ((req->flags & F_CTL_INELIGIBLE) && prefix_eligible(p))
-		return;
-	if ((req->flags & F_CTL_LEAKED) &&
-	    (asp->flags & F_ATTR_OTC_LEAK) == 0)
-		return;
-	if ((req->flags & F_CTL_HAS_PATHID)) {
-		/* Match against the transmit path id if adjout is used.  */
-		if (adjout) {
-			if (req->path_id != p->path_id_tx)
-				return;
-		} else {
-			if (req->path_id != p->path_id)
-				return;
-		}
+	if (len > BULK_CHUNK_SIZE) {
+		log_warnx("%s: record too large (%zu bytes)", __func__, len);
+		return -1;
 	}
-	if (req->as.type != AS_UNDEF &&
-	    !aspath_match(asp->aspath, &req->as, 0))
-		return;
-	if (req->community.flags != 0) {
-		if (!community_match(prefix_communities(p), &req->community,
-		    NULL))
-			return;
+	if (ibuf_set_n32(bulkrec, 1, len - 5) == -1)
+		return -1;
+	if (bulk->chunk != NULL && ibuf_size(bulk->chunk) + len >
+	    BULK_CHUNK_SIZE) {
+		if (imsg_compose_ibuf(ctx->ibuf, IMSG_CTL_SHOW_RIB_BULK, 0,
+		    ctx->req.pid, bulk->chunk) == -1)
+			log_warn("%s: imsg_compose_ibuf", __func__);
+		bulk->chunk = NULL;
 	}
-	if (!ovs_match(p, req->flags))
-		return;
-	if (!avs_match(p, req->flags))
-		return;
-	rde_dump_rib_as(p, asp, req->pid, req->flags, adjout);
+	if (bulk->chunk == NULL &&
+	    (bulk->chunk = ibuf_dynamic(len, BULK_CHUNK_SIZE)) == NULL)
+		return -1;
+	return ibuf_add_ibuf(bulk->chunk, bulkrec);
 }
 
-static void
-rde_dump_upcall(struct rib_entry *re, void *ptr)
+static int
+rde_bulk_addr(const struct bgpd_addr *addr)
+{
+	if (ibuf_add_n8(bulkrec, addr->aid) == -1)
+		return -1;
+	switch (addr->aid) {
+	case AID_VPN_IPv4:
+		if (ibuf_add_n64(bulkrec, addr->rd) == -1)
+			return -1;
+		/* FALLTHROUGH */
+	case AID_INET:
+		return ibuf_add(bulkrec, &addr->v4, sizeof(addr->v4));
+	case AID_VPN_IPv6:
+		if (ibuf_add_n64(bulkrec, addr->rd) == -1)
+			return -1;
+		/* FALLTHROUGH */
+	case AID_INET6:
+		return ibuf_add(bulkrec, &addr->v6, sizeof(addr->v6));
+	default:
+		return 0;
+	}
+}
+
+static int
+rde_bulk_init(struct rde_dump_ctx *ctx)
+{
+	if (ctx->bulk != NULL)
+		return 0;
+	if (bulkrec == NULL &&
+	    (bulkrec = ibuf_dynamic(64, BULK_CHUNK_SIZE)) == NULL)
+		goto fail;
+	if ((ctx->bulk = calloc(1, sizeof(*ctx->bulk))) == NULL)
+		goto fail;
+	RB_INIT(&ctx->bulk->refs);
+
+	if (rde_bulk_rec_start(BULK_REC_HEADER) == -1 ||
+	    ibuf_add_n32(bulkrec, BULK_MAGIC) == -1 ||
+	    ibuf_add_n16(bulkrec, BULK_VERSION) == -1 ||
+	    rde_bulk_rec_end(ctx) == -1)
+		goto fail;
+	return 0;
+
+ fail:
+	log_warn("%s", __func__);
+	return -1;
+}
+
+/*
+ * Find the ref for object key of type type. If it is not yet known a new
+ * ref with id 0 is added and *new is set.
+ */
+static struct rde_bulk_ref *
+rde_bulk_ref_get(struct rde_bulk *bulk, uint8_t type, uintptr_t key,
+    int *new)
+{
+	struct rde_bulk_ref	 needle, *ref;
+
+	*new = 0;
+	needle.type = type;
+	needle.key = key;
+	if ((ref = RB_FIND(rde_bulk_refs, &bulk->refs, &needle)) != NULL)
+		return ref;
+
+	if ((ref = calloc(1, sizeof(*ref))) == NULL) {
+		log_warn("%s", __func__);
+		return NULL;
+	}
+	ref->type = type;
+	ref->key = key;
+	RB_INSERT(rde_bulk_refs, &bulk->refs, ref);
+	*new = 1;
+	return ref;
+}
+
+static int
+rde_bulk_peer(struct rde_dump_ctx *ctx, struct rde_peer *peer)
+{
+	struct rde_bulk_ref	*ref;
+	size_t			 len;
+	int			 new;
+
+	if ((ref = rde_bulk_ref_get(ctx->bulk, BULK_REC_PEER,
+	    peer->conf.id, &new)) == NULL)
+		return -1;
+	if (!new)
+		return 0;
+
+	ref->id = peer->conf.id;
+	len = strnlen(peer->conf.descr, sizeof(peer->conf.descr));
+	if (rde_bulk_rec_start(BULK_REC_PEER) == -1 ||
+	    ibuf_add_n32(bulkrec, peer->conf.id) == -1 ||
+	    ibuf_add_n32(bulkrec, peer->conf.remote_as) == -1 ||
+	    rde_bulk_addr(&peer->remote_addr) == -1 ||
+	    ibuf_add_n32(bulkrec, peer->remote_bgpid) == -1 ||
+	    ibuf_add_n8(bulkrec, len) == -1 ||
+	    ibuf_add(bulkrec, peer->conf.descr, len) == -1)
+		return -1;
+	return rde_bulk_rec_end(ctx);
+}
+
+/*
+ * Return the id of the path attribute set asp, 0 if it could not be sent.
+ */
+static uint32_t
+rde_bulk_path(struct rde_dump_ctx *ctx, struct rde_aspath *asp)
+{
+	struct rde_bulk_ref	*ref;
+	struct attr		*a;
+	uint32_t		 id;
+	uint8_t			 l;
+	int			 new;
+
+	if ((ref = rde_bulk_ref_get(ctx->bulk, BULK_REC_PATH,
+	    (uintptr_t)asp, &new)) == NULL)
+		return 0;
+	if (!new)
+		return ref->id;
+	ref->obj = path_ref(asp);
+
+	id = ++ctx->bulk->nextid;
+	if (rde_bulk_rec_start(BULK_REC_PATH) == -1 ||
+	    ibuf_add_n32(bulkrec, id) == -1 ||
+	    ibuf_add_n8(bulkrec, asp->origin) == -1 ||
+	    ibuf_add_n32(bulkrec, asp->med) == -1 ||
+	    ibuf_add_n32(bulkrec, asp->lpref) == -1 ||
+	    ibuf_add_n32(bulkrec, asp->weight) == -1 ||
+	    ibuf_add_n16(bulkrec, aspath_length(asp->aspath)) == -1 ||
+	    ibuf_add(bulkrec, aspath_dump(asp->aspath),
+	    aspath_length(asp->aspath)) == -1)
+		return 0;
+	for (l = 0; l < asp->others_len; l++) {
+		if ((a = asp->others[l]) == NULL)
+			break;
+		if (attr_writebuf(bulkrec, a->flags, a->type, a->data,
+		    a->len) == -1)
+			return 0;
+	}
+	if (rde_bulk_rec_end(ctx) == -1)
+		return 0;
+	ref->id = id;
+	return id;
+}
+
+/*
+ * Return the id of the community set comm, 0 if it is empty or could not
+ * be sent.
+ */
+static uint32_t
+rde_bulk_communities(struct rde_dump_ctx *ctx, struct rde_community *comm)
+{
+	struct rde_bulk_ref	*ref;
+	struct community	*c;
+	uint32_t		 id;
+	int			 i, new;
+
+	if (comm->nentries == 0)
+		return 0;
+	if ((ref = rde_bulk_ref_get(ctx->bulk, BULK_REC_COMMUNITIES,
+	    (uintptr_t)comm, &new)) == NULL)
+		return 0;
+	if (!new)
+		return ref->id;
+	ref->obj = communities_ref(comm);
+
+	id = ++ctx->bulk->nextid;
+	if (rde_bulk_rec_start(BULK_REC_COMMUNITIES) == -1 ||
+	    ibuf_add_n32(bulkrec, id) == -1)
+		return 0;
+	for (i = 0; i < comm->nentries; i++) {
+		c = &comm->communities[i];
+		if (ibuf_add_n8(bulkrec, (uint8_t)c->flags) == -1 ||
+		    ibuf_add_n32(bulkrec, c->data1) == -1 ||
+		    ibuf_add_n32(bulkrec, c->data2) == -1 ||
+		    ibuf_add_n32(bulkrec, c->data3) == -1)
+			return 0;
+	}
+	if (rde_bulk_rec_end(ctx) == -1)
+		return 0;
+	ref->id = id;
+	return id;
+}
+
+static void
+rde_bulk_prefix(struct rde_dump_ctx *ctx, struct prefix *p,
+    struct rde_aspath *asp, int adjout)
+{
+	struct bgpd_addr	 addr, nh;
+	struct nexthop		*nexthop;
+	struct rde_peer		*peer;
+	uint32_t		 flags, path_id, pathref, commref;
+
+	if (rde_bulk_init(ctx) == -1)
+		return;
+
+	peer = prefix_peer(p);
+	if (rde_bulk_peer(ctx, peer) == -1)
+		return;
+	pathref = rde_bulk_path(ctx, asp);
+	commref = rde_bulk_communities(ctx, prefix_communities(p));
+
+	pt_getaddr(p->pt, &addr);
+	if ((nexthop = prefix_nexthop(p)) != NULL)
+		nh = nexthop->exit_nexthop;
+	else {
+		/* announced network can have a NULL nexthop */
+		memset(&nh, 0, sizeof(nh));
+		nh.aid = p->pt->aid;
+	}
+	flags = rde_dump_flags(p, asp, adjout, &path_id);
+
+	if (rde_bulk_rec_start(BULK_REC_PREFIX) == -1 ||
+	    rde_bulk_addr(&addr) == -1 ||
+	    ibuf_add_n8(bulkrec, p->pt->prefixlen) == -1 ||
+	    ibuf_add_n32(bulkrec, path_id) == -1 ||
+	    ibuf_add_n32(bulkrec, peer->conf.id) == -1 ||
+	    ibuf_add_n32(bulkrec, pathref) == -1 ||
+	    ibuf_add_n32(bulkrec, commref) == -1 ||
+	    rde_bulk_addr(&nh) == -1 ||
+	    ibuf_add_n32(bulkrec, flags) == -1 ||
+	    ibuf_add_n8(bulkrec, prefix_roa_vstate(p)) == -1 ||
+	    ibuf_add_n8(bulkrec, prefix_aspa_vstate(p)) == -1 ||
+	    ibuf_add_n8(bulkrec, p->dmetric) == -1 ||
+	    ibuf_add_n64(bulkrec, monotime_to_time(p->lastchange)) == -1 ||
+	    rde_bulk_rec_end(ctx) == -1)
+		log_warnx("%s: failed to add prefix", __func__);
+}
+
+/*
+ * Send the last chunk and drop all references held by the dump.
+ */
+static void
+rde_bulk_done(struct rde_dump_ctx *ctx)
+{
+	struct rde_bulk		*bulk;
+	struct rde_bulk_ref	*ref, *nref;
+
+	/* an empty dump still starts with a header */
+	if (rde_bulk_init(ctx) == -1 && ctx->bulk == NULL)
+		return;
+	bulk = ctx->bulk;
+	if (bulk->chunk != NULL && imsg_compose_ibuf(ctx->ibuf,
+	    IMSG_CTL_SHOW_RIB_BULK, 0, ctx->req.pid, bulk->chunk) == -1)
+		log_warn("%s: imsg_compose_ibuf", __func__);
+
+	RB_FOREACH_SAFE(ref, rde_bulk_refs, &bulk->refs, nref) {
+		RB_REMOVE(rde_bulk_refs, &bulk->refs, ref);
+		switch (ref->type) {
+		case BULK_REC_PATH:
+			path_unref(ref->obj);
+			break;
+		case BULK_REC_COMMUNITIES:
+			communities_unref(ref->obj);
+			break;
+		}
+		free(ref);
+	}
+	free(bulk);
+	ctx->bulk = NULL;
+}
+
+/*
+ * Finish a dump: send the IMSG_CTL_END and free the context.
+ */
+static void
+rde_dump_end(struct rde_dump_ctx *ctx)
+{
+	if (ctx->conn != NULL)
+		ctx->conn->ctx = NULL;
+	if (ctx->req.flags & F_CTL_BINARY)
+		rde_bulk_done(ctx);
+	imsg_compose(ctx->ibuf, IMSG_CTL_END, 0, ctx->req.pid, -1, NULL, 0);
+	free(ctx);
+}
+
+int
+rde_match_peer(struct rde_peer *p, struct ctl_neighbor *n)
+{
+	char *s;
+
+	if (n && n->addr.aid) {
+		if (memcmp(&p->conf.remote_addr, &n->addr,
+		    sizeof(p->conf.remote_addr)))
+			return 0;
+	} else if (n && n->descr[0]) {
+		s = n->is_group ? p->conf.group : p->conf.descr;
+		/* cannot trust n->descr to be properly terminated */
+		if (strncmp(s, n->descr, sizeof(n->descr)))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+rde_dump_filter(struct prefix *p, struct rde_dump_ctx *ctx, int adjout)
+{
+	struct ctl_show_rib_request	*req = &ctx->req;
+	struct rde_aspath		*asp;
+
+	if (!rde_match_peer(prefix_peer(p), &req->neighbor))
+		return;
+
+	asp = prefix_aspath(p);
+	if ((req->flags & F_CTL_BEST) && p->dmetric != PREFIX_DMETRIC_BEST)
+		return;
+	if ((req->flags & F_CTL_INVALID) &&
+	    (asp->flags & F_ATTR_PARSE_ERR) == 0)
+		return;
+	if ((req->flags & F_CTL_FILTERED) && !prefix_filtered(p))
+		return;
+	if ((req->flags & F_CTL_INELIGIBLE) && prefix_eligible(p))
+		return;
+	if ((req->flags & F_CTL_LEAKED) &&
+	    (asp->flags & F_ATTR_OTC_LEAK) == 0)
+		return;
+	if ((req->flags & F_CTL_HAS_PATHID)) {
+		/* Match against the transmit path id if adjout is used.  */
+		if (adjout) {
+			if (req->path_id != p->path_id_tx)
+				return;
+		} else {
+			if (req->path_id != p->path_id)
+				return;
+		}
+	}
+	if (req->as.type != AS_UNDEF &&
+	    !aspath_match(asp->aspath, &req->as, 0))
+		return;
+	if (req->community.flags != 0) {
+		if (!community_match(prefix_communities(p), &req->community,
+		    NULL))
+			return;
+	}
+	if (!ovs_match(p, req->flags))
+		return;
+	if (!avs_match(p, req->flags))
+		return;
+	if (req->flags & F_CTL_BINARY)
+		rde_bulk_prefix(ctx, p, asp, adjout);
+	else
+		rde_dump_rib_as(p, asp, ctx->ibuf, req->pid, req->flags,
+		    adjout);
+}
+
+static void
+rde_dump_upcall(struct rib_entry *re, void *ptr)
 {
 	struct rde_dump_ctx	*ctx = ptr;
 	struct prefix		*p;
@@ -3012,7 +3737,7 @@ rde_dump_upcall(struct rib_entry *re, void *ptr)
 	if (re == NULL)
 		return;
 	TAILQ_FOREACH(p, &re->prefix_h, entry.list.rib)
-		rde_dump_filter(p, &ctx->req, 0);
+		rde_dump_filter(p, ctx, 0);
 }
 
 static void
@@ -3024,7 +3749,7 @@ rde_dump_adjout_upcall(struct prefix *p, void *ptr)
 		fatalx("%s: prefix without PREFIX_FLAG_ADJOUT hit", __func__);
 	if (p->flags & (PREFIX_FLAG_WITHDRAW | PREFIX_FLAG_DEAD))
 		return;
-	rde_dump_filter(p, &ctx->req, 1);
+	rde_dump_filter(p, ctx, 1);
 }
 
 static int
@@ -3067,23 +3792,23 @@ rde_dump_done(void *arg, uint8_t aid)
 		return;
 	}
 done:
-	imsg_compose(ibuf_se_ctl, IMSG_CTL_END, 0, ctx->req.pid, -1, NULL, 0);
 	LIST_REMOVE(ctx, entry);
-	free(ctx);
+	rde_dump_end(ctx);
 	return;
 
 nomem:
 	log_warn(__func__);
 	error = CTL_RES_NOMEM;
-	imsg_compose(ibuf_se_ctl, IMSG_CTL_RESULT, 0, ctx->req.pid, -1, &error,
+	imsg_compose(ctx->ibuf, IMSG_CTL_RESULT, 0, ctx->req.pid, -1, &error,
 	    sizeof(error));
 	return;
 }
 
 void
 rde_dump_ctx_new(struct ctl_show_rib_request *req, pid_t pid,
-    enum imsg_type type)
+    enum imsg_type type, struct rde_ctl_conn *conn)
 {
+	struct imsgbuf		*ibuf = ibuf_se_ctl;
 	struct rde_dump_ctx	*ctx;
 	struct rib_entry	*re;
 	struct prefix		*p;
@@ -3091,11 +3816,13 @@ rde_dump_ctx_new(struct ctl_show_rib_request *req, pid_t pid,
 	uint8_t			 hostplen, plen;
 	uint16_t		 rid;
 
+	if (conn != NULL)
+		ibuf = &conn->imsgbuf;
 	if ((ctx = calloc(1, sizeof(*ctx))) == NULL) {
  nomem:
 		log_warn(__func__);
 		error = CTL_RES_NOMEM;
-		imsg_compose(ibuf_se_ctl, IMSG_CTL_RESULT, 0, pid, -1, &error,
+		imsg_compose(ibuf, IMSG_CTL_RESULT, 0, pid, -1, &error,
 		    sizeof(error));
 		free(ctx);
 		return;
@@ -3107,6 +3834,8 @@ rde_dump_ctx_new(struct ctl_show_rib_request *req, pid_t pid,
 	memcpy(&ctx->req, req, sizeof(struct ctl_show_rib_request));
 	ctx->req.pid = pid;
 	ctx->req.type = type;
+	ctx->ibuf = ibuf;
+	ctx->conn = conn;
 
 	if (req->flags & (F_CTL_ADJ_IN | F_CTL_INVALID)) {
 		rid = RIB_ADJ_IN;
@@ -3116,7 +3845,7 @@ rde_dump_ctx_new(struct ctl_show_rib_request *req, pid_t pid,
 		peer = peer_match(&req->neighbor, 0);
 		if (peer == NULL) {
 			error = CTL_RES_NOSUCHPEER;
-			imsg_compose(ibuf_se_ctl, IMSG_CTL_RESULT, 0, pid, -1,
+			imsg_compose(ibuf, IMSG_CTL_RESULT, 0, pid, -1,
 			    &error, sizeof(error));
 			free(ctx);
 			return;
@@ -3181,20 +3910,20 @@ rde_dump_ctx_new(struct ctl_show_rib_request *req, pid_t pid,
 			} while ((peer = peer_match(&req->neighbor,
 			    peer->conf.id)));
 
-			imsg_compose(ibuf_se_ctl, IMSG_CTL_END, 0, ctx->req.pid,
-			    -1, NULL, 0);
-			free(ctx);
+			rde_dump_end(ctx);
 			return;
 		default:
 			fatalx("%s: unsupported imsg type", __func__);
 		}
 
 		LIST_INSERT_HEAD(&rde_dump_h, ctx, entry);
+		if (conn != NULL)
+			conn->ctx = ctx;
 		return;
 	} else if ((rid = rib_find(req->rib)) == RIB_NOTFOUND) {
 		log_warnx("%s: no such rib %s", __func__, req->rib);
 		error = CTL_RES_NOSUCHRIB;
-		imsg_compose(ibuf_se_ctl, IMSG_CTL_RESULT, 0, pid, -1, &error,
+		imsg_compose(ibuf, IMSG_CTL_RESULT, 0, pid, -1, &error,
 		    sizeof(error));
 		free(ctx);
 		return;
@@ -3202,21 +3931,22 @@ rde_dump_ctx_new(struct ctl_show_rib_request *req, pid_t pid,
 
 	switch (ctx->req.type) {
 	case IMSG_CTL_SHOW_NETWORK:
-		if (rib_dump_new(rid, ctx->req.aid, CTL_MSG_HIGH_MARK, ctx,
+		if (rib_snapshot_new(rid, ctx->req.aid, CTL_MSG_HIGH_MARK, ctx,
 		    network_dump_upcall, rde_dump_done,
 		    rde_dump_throttled) == -1)
 			goto nomem;
 		break;
 	case IMSG_CTL_SHOW_RIB:
-		if (rib_dump_new(rid, ctx->req.aid, CTL_MSG_HIGH_MARK, ctx,
+		if (rib_snapshot_new(rid, ctx->req.aid, CTL_MSG_HIGH_MARK, ctx,
 		    rde_dump_upcall, rde_dump_done, rde_dump_throttled) == -1)
 			goto nomem;
 		break;
 	case IMSG_CTL_SHOW_RIB_PREFIX:
 		if (req->flags & F_LONGER) {
-			if (rib_dump_subtree(rid, &req->prefix, req->prefixlen,
-			    CTL_MSG_HIGH_MARK, ctx, rde_dump_upcall,
-			    rde_dump_done, rde_dump_throttled) == -1)
+			if (rib_snapshot_subtree(rid, &req->prefix,
+			    req->prefixlen, CTL_MSG_HIGH_MARK, ctx,
+			    rde_dump_upcall, rde_dump_done,
+			    rde_dump_throttled) == -1)
 				goto nomem;
 			break;
 		}
@@ -3247,14 +3977,14 @@ rde_dump_ctx_new(struct ctl_show_rib_request *req, pid_t pid,
 			    req->prefixlen);
 			rde_dump_upcall(re, ctx);
 		}
-		imsg_compose(ibuf_se_ctl, IMSG_CTL_END, 0, ctx->req.pid,
-		    -1, NULL, 0);
-		free(ctx);
+		rde_dump_end(ctx);
 		return;
 	default:
 		fatalx("%s: unsupported imsg type", __func__);
 	}
 	LIST_INSERT_HEAD(&rde_dump_h, ctx, entry);
+	if (conn != NULL)
+		conn->ctx = ctx;
 }
 
 void
@@ -3263,7 +3993,7 @@ rde_dump_ctx_throttle(pid_t pid, int throttle)
 	struct rde_dump_ctx	*ctx;
 
 	LIST_FOREACH(ctx, &rde_dump_h, entry) {
-		if (ctx->req.pid == pid) {
+		if (ctx->conn == NULL && ctx->req.pid == pid) {
 			ctx->throttled = throttle;
 			return;
 		}
@@ -3276,13 +4006,65 @@ rde_dump_ctx_terminate(pid_t pid)
 	struct rde_dump_ctx	*ctx;
 
 	LIST_FOREACH(ctx, &rde_dump_h, entry) {
-		if (ctx->req.pid == pid) {
+		if (ctx->conn == NULL && ctx->req.pid == pid) {
 			rib_dump_terminate(ctx);
 			return;
 		}
 	}
 }
 
+static void
+rde_ctl_conn_new(int fd, struct ctl_show_rib_request *req, pid_t pid,
+    enum imsg_type type)
+{
+	struct rde_ctl_conn	*conn;
+
+	if (type != IMSG_CTL_SHOW_RIB && type != IMSG_CTL_SHOW_RIB_PREFIX) {
+		log_warnx("%s: unsupported request", __func__);
+		close(fd);
+		return;
+	}
+	if ((conn = calloc(1, sizeof(*conn))) == NULL) {
+		log_warn("%s", __func__);
+		close(fd);
+		return;
+	}
+	if (imsgbuf_init(&conn->imsgbuf, fd) == -1 ||
+	    imsgbuf_set_maxsize(&conn->imsgbuf, MAX_BGPD_IMSGSIZE) == -1) {
+		log_warn("%s", __func__);
+		close(fd);
+		free(conn);
+		return;
+	}
+	TAILQ_INSERT_TAIL(&rde_ctl_conns, conn, entry);
+	rde_ctl_cnt++;
+
+	rde_dump_ctx_new(req, pid, type, conn);
+}
+
+static void
+rde_ctl_conn_close(struct rde_ctl_conn *conn)
+{
+	struct rde_dump_ctx	*ctx;
+
+	if ((ctx = conn->ctx) != NULL) {
+		/* don't let the done callback move on to the next peer */
+		ctx->req.flags &= ~F_CTL_ADJ_OUT;
+		rib_dump_terminate(ctx);
+		/* no dump was running, happens after memory shortage */
+		if (conn->ctx != NULL) {
+			LIST_REMOVE(ctx, entry);
+			rde_dump_end(ctx);
+		}
+	}
+
+	TAILQ_REMOVE(&rde_ctl_conns, conn, entry);
+	rde_ctl_cnt--;
+	imsgbuf_clear(&conn->imsgbuf);
+	close(conn->imsgbuf.fd);
+	free(conn);
+}
+
 static int
 rde_mrt_throttled(void *arg)
 {
@@ -3308,6 +4090,7 @@ rde_dump_mrt_new(struct mrt *mrt, pid_t pid, int fd)
 		return;
 	}
 	memcpy(&ctx->mrt, mrt, sizeof(struct mrt));
+	ctx->mrt.writer = NULL;
 	if ((ctx->mrt.wbuf = msgbuf_new()) == NULL) {
 		log_warn("rde_dump_mrt_new");
 		free(ctx);
@@ -3325,9 +4108,9 @@ rde_dump_mrt_new(struct mrt *mrt, pid_t pid, int fd)
 	if (ctx->mrt.type == MRT_TABLE_DUMP_V2)
 		mrt_dump_v2_hdr(&ctx->mrt, conf);
 
-	if (rib_dump_new(rid, AID_UNSPEC, CTL_MSG_HIGH_MARK, &ctx->mrt,
+	if (rib_snapshot_new(rid, AID_UNSPEC, CTL_MSG_HIGH_MARK, &ctx->mrt,
 	    mrt_dump_upcall, rde_mrt_done, rde_mrt_throttled) == -1)
-		fatal("%s: rib_dump_new", __func__);
+		fatal("%s: rib_snapshot_new", __func__);
 
 	LIST_INSERT_HEAD(&rde_mrts, ctx, entry);
 	rde_mrt_cnt++;
@@ -3441,18 +4224,74 @@ rde_evaluate_all(void)
 static void
 rde_up_flush_upcall(struct prefix *p, void *ptr)
 {
-	prefix_adjout_withdraw(p);
+	prefix_adjout_flush(p);
+}
+
+/*
+ * Minimum route advertisement interval. Once the queues of a peer for an
+ * aid drained, further changes are held back until the interval passed.
+ * Meanwhile they pile up in the Adj-RIB-Out where a newer change of a
+ * prefix replaces the pending one, so only the latest state goes out.
+ * The interval applies to withdraws as well so that a withdraw followed
+ * by an announce collapses into a single update.
+ */
+uint16_t
+peer_mrai(struct rde_peer *peer)
+{
+	return peer->conf.mrai != 0 ? peer->conf.mrai : conf->mrai;
+}
+
+static int
+rde_update_queue_ready(struct rde_peer *peer, uint8_t aid, monotime_t now)
+{
+	if (peer_mrai(peer) == 0 || peer->mrai_open & (1 << aid))
+		return 1;
+	if (monotime_cmp(now, peer->mrai_next[aid]) < 0)
+		return 0;
+	peer->mrai_open |= 1 << aid;
+	return 1;
+}
+
+/*
+ * The queues of peer for aid are empty. Account how long it took to drain
+ * them and start the advertisement interval.
+ */
+static void
+rde_update_queue_drained(struct rde_peer *peer, uint8_t aid)
+{
+	monotime_t	now;
+	long long	ms;
+
+	now = getmonotime();
+	if (monotime_valid(peer->drain_start[aid])) {
+		ms = monotime_to_msec(monotime_sub(now,
+		    peer->drain_start[aid]));
+		if (ms > UINT32_MAX)
+			ms = UINT32_MAX;
+		peer->stats.drain_last = ms;
+		if (peer->stats.drain_max < ms)
+			peer->stats.drain_max = ms;
+		peer->drain_start[aid] = monotime_clear();
+	}
+
+	if (peer_mrai(peer) == 0)
+		return;
+	peer->mrai_open &= ~(1 << aid);
+	peer->mrai_next[aid] = monotime_add(now,
+	    monotime_from_sec(peer_mrai(peer)));
 }
 
 int
 rde_update_queue_pending(void)
 {
 	struct rde_peer *peer;
+	monotime_t now;
 	uint8_t aid;
 
 	if (ibuf_se && imsgbuf_queuelen(ibuf_se) >= SESS_MSG_HIGH_MARK)
 		return 0;
 
+	now = getmonotime();
 	RB_FOREACH(peer, peer_tree, &peertable) {
 		if (peer->conf.id == 0)
 			continue;
@@ -3461,68 +4300,317 @@ rde_update_queue_pending(void)
 		if (peer->throttled)
 			continue;
 		for (aid = AID_MIN; aid < AID_MAX; aid++) {
-			if (!RB_EMPTY(&peer->updates[aid]) ||
-			    !RB_EMPTY(&peer->withdraws[aid]))
+			if ((!RB_EMPTY(&peer->updates[aid]) ||
+			    !RB_EMPTY(&peer->withdraws[aid])) &&
+			    rde_update_queue_ready(peer, aid, now))
 				return 1;
 		}
 	}
 	return 0;
 }
 
+/*
+ * Milliseconds until the advertisement interval of a peer with pending
+ * changes expires, -1 if no peer is held back.
+ */
+int
+rde_update_queue_timeout(void)
+{
+	struct rde_peer	*peer;
+	monotime_t	 now;
+	long long	 ms, timeout = -1;
+	uint8_t		 aid;
+
+	now = getmonotime();
+	RB_FOREACH(peer, peer_tree, &peertable) {
+		if (peer->conf.id == 0 || peer_mrai(peer) == 0)
+			continue;
+		if (!peer_is_up(peer))
+			continue;
+		for (aid = AID_MIN; aid < AID_MAX; aid++) {
+			if (peer->mrai_open & (1 << aid))
+				continue;
+			if (RB_EMPTY(&peer->updates[aid]) &&
+			    RB_EMPTY(&peer->withdraws[aid]))
+				continue;
+			ms = monotime_to_msec(monotime_sub(
+			    peer->mrai_next[aid], now));
+			if (ms < 0)
+				ms = 0;
+			if (timeout == -1 || ms < timeout)
+				timeout = ms;
+		}
+	}
+	return timeout;
+}
+
+/*
+ * Outbound updates are scheduled with deficit round robin. Each round
+ * every peer with pending changes gets a byte quantum scaled by its weight
+ * and sends UPDATE messages until its deficit is used up. The runner
+ * serves one aid at a time, each aid of a peer has its own deficit.
+ * A peer whose SE write queue is full (throttled) gets skipped and loses
+ * its deficit so a slow peer cannot bank credit and then flood the SE.
+ * Every round starts one peer further so low peer ids are not always
+ * served first.
+ */
+#define RDE_DRR_QUANTUM		MAX_PKTSIZE
+
+static inline int
+peer_weight(struct rde_peer *peer)
+{
+	if (peer->conf.reflector_client)
+		return 4;
+	if (!peer->conf.ebgp)
+		return 2;
+	return 1;
+}
+
+static int
+rde_update_queue_serve(struct rde_peer *peer, uint8_t aid, monotime_t now)
+{
+	size_t	size;
+	int	sent = 0, sent_eor;
+
+	if (peer->conf.id == 0)
+		return 0;
+	if (!peer_is_up(peer))
+		return 0;
+	if (RB_EMPTY(&peer->updates[aid]) && RB_EMPTY(&peer->withdraws[aid]))
+		return 0;
+	if (!monotime_valid(peer->drain_start[aid]))
+		peer->drain_start[aid] = now;
+	if (peer->throttled) {
+		peer->drr_deficit[aid] = 0;
+		return 0;
+	}
+	if (!rde_update_queue_ready(peer, aid, now))
+		return 0;
+
+	peer->drr_deficit[aid] += RDE_DRR_QUANTUM * peer_weight(peer);
+	while (peer->drr_deficit[aid] > 0) {
+		/* first withdraws ... */
+		if (!RB_EMPTY(&peer->withdraws[aid]))
+			size = up_dump_withdraws(ibuf_se, peer, aid);
+		/* ... then updates */
+		else if (RB_EMPTY(&peer->updates[aid]))
+			break;
+		else if (up_is_eor(peer, aid)) {
+			sent_eor = peer->sent_eor & (1 << aid);
+			if (peer->capa.grestart.restart && !sent_eor)
+				rde_peer_send_eor(peer, aid);
+			if (peer->capa.enhanced_rr && sent_eor)
+				rde_peer_send_rrefresh(peer, aid,
+				    ROUTE_REFRESH_END_RR);
+			continue;
+		} else
+			size = up_dump_update(ibuf_se, peer, aid);
+		if (size == 0)
+			break;
+		peer->drr_deficit[aid] -= size;
+		sent++;
+	}
+
+	if (RB_EMPTY(&peer->updates[aid]) && RB_EMPTY(&peer->withdraws[aid])) {
+		/* idle peers do not keep a deficit */
+		peer->drr_deficit[aid] = 0;
+		rde_update_queue_drained(peer, aid);
+	}
+	return sent;
+}
+
 void
 rde_update_queue_runner(uint8_t aid)
 {
-	struct rde_peer		*peer;
+	static uint32_t		 next[AID_MAX];
+	struct rde_peer		*peer, *start;
+	monotime_t		 now;
 	int			 sent, max = RDE_RUNNER_ROUNDS;
 
-	/* first withdraws ... */
+	now = getmonotime();
 	do {
 		sent = 0;
-		RB_FOREACH(peer, peer_tree, &peertable) {
-			if (peer->conf.id == 0)
-				continue;
-			if (!peer_is_up(peer))
-				continue;
-			if (peer->throttled)
-				continue;
-			if (RB_EMPTY(&peer->withdraws[aid]))
-				continue;
+		start = peer_get_next(next[aid]);
+		if (start == NULL)
+			start = RB_MIN(peer_tree, &peertable);
+		if (start == NULL)
+			return;
 
-			up_dump_withdraws(ibuf_se, peer, aid);
-			sent++;
-		}
+		peer = start;
+		do {
+			sent += rde_update_queue_serve(peer, aid, now);
+			if ((peer = RB_NEXT(peer_tree, &peertable, peer)) ==
+			    NULL)
+				peer = RB_MIN(peer_tree, &peertable);
+		} while (peer != start);
+
+		next[aid] = start->conf.id + 1;
 		max -= sent;
+		if (ibuf_se && imsgbuf_queuelen(ibuf_se) >= SESS_MSG_HIGH_MARK)
+			break;
 	} while (sent != 0 && max > 0);
+}
 
-	/* ... then updates */
-	max = RDE_RUNNER_ROUNDS;
-	do {
-		sent = 0;
-		RB_FOREACH(peer, peer_tree, &peertable) {
-			if (peer->conf.id == 0)
-				continue;
-			if (!peer_is_up(peer))
-				continue;
-			if (peer->throttled)
-				continue;
-			if (RB_EMPTY(&peer->updates[aid]))
-				continue;
+/*
+ * propagation latency tracing
+ *
+ * With BGPD_FLAG_LAT_TRACE one UPDATE batch out of LAT_SAMPLE_RATE is
+ * sampled and the first prefix announced in it is followed until every
+ * peer it got queued for wrote it into an UPDATE. The SE measures the
+ * rest of the way to the socket. Traces hold a reference on the prefix
+ * and are dropped if the prefix is not sent out within LAT_TRACE_TIMEOUT
+ * seconds, e.g. because a peer went down or the prefix changed again
+ * before it was written.
+ */
+#define LAT_SAMPLE_RATE		64
+#define LAT_TRACE_MAX		16
+#define LAT_TRACE_TIMEOUT	60
+
+struct rde_lat_trace {
+	struct pt_entry	*pt;
+	monotime_t	 received;
+	monotime_t	 dispatched;
+	monotime_t	 decided;
+	unsigned int	 pending;	/* queued UPDATEs not yet written */
+};
 
-			if (up_is_eor(peer, aid)) {
-				int sent_eor = peer->sent_eor & (1 << aid);
-				if (peer->capa.grestart.restart && !sent_eor)
-					rde_peer_send_eor(peer, aid);
-				if (peer->capa.enhanced_rr && sent_eor)
-					rde_peer_send_rrefresh(peer, aid,
-					    ROUTE_REFRESH_END_RR);
-				continue;
-			}
+static struct rde_lat_trace	 lat_traces[LAT_TRACE_MAX];
+static unsigned int		 lat_next, lat_batches;
+static monotime_t		 lat_received, lat_dispatched;
 
-			up_dump_update(ibuf_se, peer, aid);
-			sent++;
-		}
-		max -= sent;
-	} while (sent != 0 && max > 0);
+/*
+ * Called with the SE receive time before a batch is processed and with
+ * 0 once it is done.
+ */
+static void
+rde_lat_sample(uint64_t stamp)
+{
+	lat_received = monotime_clear();
+	if (stamp == 0)
+		return;
+	if ((conf->flags & BGPD_FLAG_LAT_TRACE) == 0) {
+		rde_lat_expire(1);
+		return;
+	}
+	if (lat_batches % LAT_SAMPLE_RATE == 0)
+		rde_lat_expire(0);
+	if (++lat_batches % LAT_SAMPLE_RATE != 0)
+		return;
+
+	lat_received.monotime = stamp;
+	lat_dispatched = getmonotime();
+	hist_add(&rdemetrics.latency.stage[LAT_TRANSIT],
+	    monotime_sub(lat_dispatched, lat_received).monotime);
+}
+
+static void
+rde_lat_release(struct rde_lat_trace *t)
+{
+	pt_unref(t->pt);
+	t->pt = NULL;
+	t->pending = 0;
+}
+
+/* an Adj-RIB-Out UPDATE queued by the decision of the traced batch */
+static int
+rde_lat_match(struct rde_lat_trace *t, struct prefix *p)
+{
+	return (p->flags & PREFIX_FLAG_UPDATE) &&
+	    monotime_cmp(p->lastchange, t->dispatched) >= 0 &&
+	    monotime_cmp(p->lastchange, t->decided) <= 0;
+}
+
+static void
+rde_lat_record(struct bgpd_addr *prefix, uint8_t prefixlen)
+{
+	struct rde_lat_trace	*t;
+	struct rde_peer		*peer;
+	struct prefix		*p;
+	struct pt_entry		*pt;
+
+	if (!monotime_valid(lat_received))
+		return;
+	if ((pt = pt_get(prefix, prefixlen)) == NULL)
+		return;
+
+	t = &lat_traces[lat_next++ % LAT_TRACE_MAX];
+	if (t->pt != NULL)
+		pt_unref(t->pt);
+	t->pt = pt_ref(pt);
+	t->received = lat_received;
+	t->dispatched = lat_dispatched;
+	t->decided = getmonotime();
+	hist_add(&rdemetrics.latency.stage[LAT_DECISION],
+	    monotime_sub(t->decided, t->dispatched).monotime);
+	rdemetrics.latency.sampled++;
+
+	/* the decision process queued the prefix for these peers */
+	t->pending = 0;
+	RB_FOREACH(peer, peer_tree, &peertable)
+		for (p = prefix_adjout_first(peer, pt); p != NULL;
+		    p = prefix_adjout_next(peer, p))
+			if (rde_lat_match(t, p))
+				t->pending++;
+	if (t->pending == 0)
+		rde_lat_release(t);
+
+	/* only one prefix per batch */
+	lat_received = monotime_clear();
+}
+
+/*
+ * Drop traces that were not written to all their peers in time, e.g.
+ * because a peer went down or the prefix changed again while queued.
+ * With all set every trace is dropped.
+ */
+static void
+rde_lat_expire(int all)
+{
+	struct rde_lat_trace	*t;
+	monotime_t		 limit;
+	unsigned int		 i;
+
+	limit = monotime_sub(getmonotime(),
+	    monotime_from_sec(LAT_TRACE_TIMEOUT));
+	for (i = 0; i < LAT_TRACE_MAX; i++) {
+		t = &lat_traces[i];
+		if (t->pt == NULL)
+			continue;
+		if (all || monotime_cmp(t->decided, limit) < 0)
+			rde_lat_release(t);
+	}
+}
+
+/*
+ * Called for every prefix written into an UPDATE. If the prefix was
+ * queued by the decision of a sampled update pass the timestamps to the
+ * SE ahead of the UPDATE.
+ */
+void
+rde_lat_dump(struct rde_peer *peer, struct prefix *p, monotime_t now)
+{
+	struct rde_lat_trace	*t;
+	struct lat_stamp	 ls;
+	unsigned int		 i;
+
+	if (rdemetrics.latency.sampled == 0)
+		return;
+
+	for (i = 0; i < LAT_TRACE_MAX; i++) {
+		t = &lat_traces[i];
+		if (t->pt != p->pt || !rde_lat_match(t, p))
+			continue;
+
+		hist_add(&rdemetrics.latency.stage[LAT_QUEUE],
+		    monotime_sub(now, p->lastchange).monotime);
+		ls.received = t->received;
+		ls.dumped = now;
+		imsg_compose(ibuf_se, IMSG_UPDATE_TRACE, peer->conf.id, 0, -1,
+		    &ls, sizeof(ls));
+		if (--t->pending == 0)
+			rde_lat_release(t);
+		break;
+	}
 }
 
 /*
@@ -3670,10 +4758,15 @@ rde_reload_done(void)
 	struct rde_prefixset_head prefixsets_old;
 	struct rde_prefixset_head originsets_old;
 	struct as_set_head	 as_sets_old;
+	struct set_index	 sets_old = RB_INITIALIZER(&sets_old);
+	struct rde_prefixset	*ps;
+	struct as_set		*aset;
 	uint16_t		 rid;
-	int			 reload = 0, force_locrib = 0;
+	int			 reload = 0, force_locrib = 0, out_same;
 
 	softreconfig = 0;
+	/* cached filter results are only valid for the old config */
+	rde_filter_cache_invalidate();
 
 	SIMPLEQ_INIT(&prefixsets_old);
 	SIMPLEQ_INIT(&originsets_old);
@@ -3681,6 +4774,12 @@ rde_reload_done(void)
 	SIMPLEQ_CONCAT(&prefixsets_old, &conf->rde_prefixsets);
 	SIMPLEQ_CONCAT(&originsets_old, &conf->rde_originsets);
 	SIMPLEQ_CONCAT(&as_sets_old, &conf->as_sets);
+	SIMPLEQ_FOREACH(ps, &prefixsets_old, entry)
+		set_index_add(&sets_old, PREFIX_SET, ps->name, ps);
+	SIMPLEQ_FOREACH(ps, &originsets_old, entry)
+		set_index_add(&sets_old, ORIGIN_SET, ps->name, ps);
+	SIMPLEQ_FOREACH(aset, &as_sets_old, entry)
+		set_index_add(&sets_old, ASNUM_SET, aset->name, aset);
 
 	/* run softreconfig in if filter mode changed */
 	if (conf->filtered_in_locrib != nconf->filtered_in_locrib) {
@@ -3713,14 +4812,22 @@ rde_reload_done(void)
 	peerself->conf.remote_masklen = 32;
 	peerself->short_as = conf->short_as;
 
-	rde_mark_prefixsets_dirty(&prefixsets_old, &conf->rde_prefixsets);
-	rde_mark_prefixsets_dirty(&originsets_old, &conf->rde_originsets);
-	as_sets_mark_dirty(&as_sets_old, &conf->as_sets);
-
+	rde_mark_prefixsets_dirty(&sets_old, PREFIX_SET,
+	    &conf->rde_prefixsets);
+	rde_mark_prefixsets_dirty(&sets_old, ORIGIN_SET,
+	    &conf->rde_originsets);
+	as_sets_mark_dirty(&sets_old, &conf->as_sets);
 
 	/* make sure that rde_eval_all is correctly set after a config change */
 	rde_eval_all = 0;
 
+	/*
+	 * If the outbound rules and their sets did not change, peers whose
+	 * filter selection is the same keep their rule copy and only need
+	 * to point it at the new sets.
+	 */
+	out_same = rde_filter_equal(out_rules_tmp, out_rules);
+
 	/* Make the new outbound filter rules the active one. */
 	filterlist_free(out_rules);
 	out_rules = out_rules_tmp;
@@ -3816,6 +4923,11 @@ rde_reload_done(void)
 			continue;
 		}
 
+		if (out_same && peer_out_filter_current(peer)) {
+			rde_filter_rebind(peer->out_rules);
+			continue;
+		}
+
 		/* reapply outbound filters for this peer */
 		fh = peer_apply_out_filter(peer, out_rules);
 
@@ -3900,6 +5012,8 @@ rde_reload_done(void)
 	free_rde_prefixsets(&prefixsets_old);
 	free_rde_prefixsets(&originsets_old);
 	as_sets_free(&as_sets_old);
+	set_index_free(&sets_old);
+	set_index_free(&reconf_sets);
 
 	log_info("RDE reconfigured");
 
@@ -3959,6 +5073,8 @@ rde_softreconfig_in_done(void *arg, uint8_t dummy)
 		uint8_t aid;
 
 		if (peer->reconf_out) {
+			/* filter verdicts are no longer valid */
+			up_denied_flush(peer);
 			if (peer->export_type == EXPORT_NONE) {
 				/* nothing to do here */
 				peer->reconf_out = 0;
@@ -4070,9 +5186,12 @@ rde_softreconfig_in(struct rib_entry *re, void *bula)
 			if (rib->state != RECONF_RELOAD)
 				continue;
 
-			rde_filterstate_prep(&state, p);
-			action = rde_filter(rib->in_rules, peer, peer, &prefix,
+			action = rde_filter_cached(rib->in_cache,
+			    rib->in_rules, peer, peer, p, &prefix,
 			    pt->prefixlen, &state);
+			if (action == ACTION_ALLOW &&
+			    damp_suppressed(peer, pt, p->path_id))
+				action = ACTION_DENY;
 
 			if (action == ACTION_ALLOW) {
 				/* update Local-RIB */
@@ -4224,9 +5343,12 @@ rde_rpki_softreload(struct rib_entry *re, void *bula)
 			if (rib == NULL)
 				continue;
 
-			rde_filterstate_prep(&state, p);
-			action = rde_filter(rib->in_rules, peer, peer, &prefix,
+			action = rde_filter_cached(rib->in_cache,
+			    rib->in_rules, peer, peer, p, &prefix,
 			    pt->prefixlen, &state);
+			if (action == ACTION_ALLOW &&
+			    damp_suppressed(peer, pt, p->path_id))
+				action = ACTION_DENY;
 
 			if (action == ACTION_ALLOW) {
 				/* update Local-RIB */
@@ -4620,7 +5742,7 @@ network_dump_upcall(struct rib_entry *re, void *ptr)
 			kf.nexthop.aid = kf.prefix.aid;
 		if ((asp->flags & F_ANN_DYNAMIC) == 0)
 			kf.flags = F_STATIC;
-		if (imsg_compose(ibuf_se_ctl, IMSG_CTL_SHOW_NETWORK, 0,
+		if (imsg_compose(ctx->ibuf, IMSG_CTL_SHOW_NETWORK, 0,
 		    ctx->req.pid, -1, &kf, sizeof(kf)) == -1)
 			log_warnx("%s: imsg_compose error", __func__);
 	}
@@ -4766,6 +5888,10 @@ rde_shutdown(void)
 	 * rde_shutdown depends on this.
 	 */
 
+	/* snapshots hold routes of peers, stop them before the peers go */
+	rib_snapshot_abort();
+	rde_lat_expire(1);
+
 	/* First all peers go down */
 	peer_shutdown();
 
@@ -4777,6 +5903,7 @@ rde_shutdown(void)
 	free_l3vpns(&conf->l3vpns);
 
 	/* now check everything */
+	damp_shutdown();
 	rib_shutdown();
 	nexthop_shutdown();
 	path_shutdown();
@@ -4784,27 +5911,110 @@ rde_shutdown(void)
 	pt_shutdown();
 }
 
-struct rde_prefixset *
-rde_find_prefixset(char *name, struct rde_prefixset_head *p)
+/*
+ * RDE state snapshots for fuzzing and replay harnesses.
+ *
+ * Building a large RIB is expensive, so a harness can load the RDE once
+ * and then ask for a snapshot. The RDE forks and the parent side keeps the
+ * untouched copy-on-write image of peertable, pttable, the RIBs, the
+ * attribute, aspath and community tables and the nexthop table while the
+ * child continues to run. IMSG_RDE_RESTORE terminates the child and the
+ * snapshot holder forks off a fresh copy. Every new child acknowledges with
+ * IMSG_RDE_SNAPSHOT carrying the iteration number so the harness knows
+ * when it is safe to send the next input. The harness must not send
+ * anything between a snapshot or restore request and that ack since
+ * already buffered messages would be replayed by every iteration.
+ * Snapshots can be nested, a restore always returns to the last one.
+ */
+#define RDE_SNAPSHOT_EXIT	3	/* exit code used by rde_restore() */
+
+static int	rde_snapshot_depth;
+
+static void
+rde_snapshot(void)
 {
-	struct rde_prefixset *ps;
+	struct imsgbuf	*bufs[] = { ibuf_main, ibuf_se, ibuf_se_ctl, ibuf_rtr };
+	pid_t		 pid;
+	uint32_t	 iter;
+	unsigned int	 i;
+	int		 status;
+
+	if (!rde_debug) {
+		log_warnx("%s: snapshots require debug mode", __func__);
+		return;
+	}
+
+	/* pending output must not be sent by every iteration */
+	for (i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++)
+		if (bufs[i] != NULL && imsgbuf_flush(bufs[i]) == -1)
+			fatal("%s: imsgbuf_flush", __func__);
+
+	for (iter = 0; ; iter++) {
+		switch (pid = fork()) {
+		case -1:
+			fatal("%s: fork", __func__);
+		case 0:
+			rde_snapshot_depth++;
+			imsg_compose(ibuf_main, IMSG_RDE_SNAPSHOT, 0, 0, -1,
+			    &iter, sizeof(iter));
+			return;
+		default:
+			break;
+		}
+
+		while (waitpid(pid, &status, 0) == -1) {
+			if (errno != EINTR)
+				fatal("%s: waitpid", __func__);
+			if (rde_quit)
+				kill(pid, SIGTERM);
+		}
+
+		if (WIFSIGNALED(status) && WTERMSIG(status) != SIGTERM) {
+			/* make the crash visible to the harness */
+			log_warnx("snapshot iteration %u terminated; signal %d",
+			    iter, WTERMSIG(status));
+			signal(WTERMSIG(status), SIG_DFL);
+			raise(WTERMSIG(status));
+		}
+		if (rde_quit || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != RDE_SNAPSHOT_EXIT)
+			break;
+	}
+
+	log_debug("snapshot done after %u iterations", iter + 1);
+	_exit(0);
+}
 
-	SIMPLEQ_FOREACH(ps, p, entry) {
-		if (!strcmp(ps->name, name))
-			return (ps);
+static void
+rde_restore(void)
+{
+	if (rde_snapshot_depth == 0) {
+		log_warnx("%s: no snapshot to restore", __func__);
+		return;
 	}
-	return (NULL);
+	/* skip all cleanup, the snapshot holder has the pristine state */
+	_exit(RDE_SNAPSHOT_EXIT);
 }
 
 void
-rde_mark_prefixsets_dirty(struct rde_prefixset_head *psold,
+rde_mark_prefixsets_dirty(struct set_index *psold, int type,
     struct rde_prefixset_head *psnew)
 {
 	struct rde_prefixset *new, *old;
+	struct trie_head th;
 
 	SIMPLEQ_FOREACH(new, psnew, entry) {
-		if ((psold == NULL) ||
-		    (old = rde_find_prefixset(new->name, psold)) == NULL) {
+		old = psold == NULL ? NULL :
+		    set_index_get(psold, type, new->name);
+		if (new->kept) {
+			/* the parent did not resend it, take the old trie */
+			if (old == NULL)
+				fatalx("kept set %s is unknown", new->name);
+			th = new->th;
+			new->th = old->th;
+			old->th = th;
+			new->lastchange = old->lastchange;
+		} else if (old == NULL) {
 			new->dirty = 1;
 			new->lastchange = getmonotime();
 		} else {
@@ -4817,6 +6027,41 @@ rde_mark_prefixsets_dirty(struct rde_prefixset_head *psold,
 	}
 }
 
+/*
+ * Point the set references of a kept filter list at the sets of the
+ * new config, the old sets are freed at the end of the reload. Sets are
+ * looked up by name like in IMSG_RECONF_FILTER so that a set missing
+ * from the old config is bound once it shows up.
+ */
+static void
+rde_filter_rebind(struct filter_head *fh)
+{
+	struct filter_rule	*r;
+	struct as_set		*aset;
+
+	if (fh == NULL)
+		return;
+	TAILQ_FOREACH(r, fh, entry) {
+		if (r->match.prefixset.name[0] != '\0')
+			r->match.prefixset.ps = set_index_get(&reconf_sets,
+			    PREFIX_SET, r->match.prefixset.name);
+		if (r->match.originset.name[0] != '\0')
+			r->match.originset.ps = set_index_get(&reconf_sets,
+			    ORIGIN_SET, r->match.originset.name);
+		if (r->match.as.flags & (AS_FLAG_AS_SET | AS_FLAG_AS_SET_NAME)) {
+			aset = set_index_get(&reconf_sets, ASNUM_SET,
+			    r->match.as.name);
+			if (aset == NULL) {
+				r->match.as.flags = AS_FLAG_AS_SET_NAME;
+				r->match.as.aset = NULL;
+			} else {
+				r->match.as.flags = AS_FLAG_AS_SET;
+				r->match.as.aset = aset;
+			}
+		}
+	}
+}
+
 uint8_t
 rde_roa_validity(struct rde_prefixset *ps, struct bgpd_addr *prefix,
     uint8_t plen, uint32_t as)
@@ -40,6 +40,7 @@ enum peer_state {
 LIST_HEAD(prefix_list, prefix);
 TAILQ_HEAD(prefix_queue, prefix);
 RB_HEAD(rib_tree, rib_entry);
+struct rde_filter_cache;
 
 struct rib_entry {
 	RB_ENTRY(rib_entry)	 rib_e;
@@ -47,6 +48,7 @@ struct rib_entry {
 	struct pt_entry		*prefix;
 	uint16_t		 rib_id;
 	uint16_t		 lock;
+	uint32_t		 snap_epoch;	/* last saved for snapshots */
 };
 
 struct rib {
@@ -54,6 +56,7 @@ struct rib {
 	char			name[PEER_DESCR_LEN];
 	struct filter_head	*in_rules;
 	struct filter_head	*in_rules_tmp;
+	struct rde_filter_cache	*in_cache;
 	u_int			rtableid;
 	u_int			rtableid_tmp;
 	enum reconf_action	state, fibstate;
@@ -73,6 +76,7 @@ struct rib {
 RB_HEAD(peer_tree, rde_peer);
 RB_HEAD(prefix_tree, prefix);
 RB_HEAD(prefix_index, prefix);
+RB_HEAD(up_denied_tree, up_denied);
 struct iq;
 
 struct rde_peer {
@@ -88,11 +92,20 @@ struct rde_peer {
 	struct prefix_index		 adj_rib_out;
 	struct prefix_tree		 updates[AID_MAX];
 	struct prefix_tree		 withdraws[AID_MAX];
+	LIST_HEAD(, prefix)		 adj_rib_in[AID_MAX];
+	struct up_denied_tree		 addpath_denied;
 	struct filter_head		*out_rules;
+	struct rde_filter_cache		*out_cache;
 	struct ibufqueue		*ibufq;
 	monotime_t			 staletime[AID_MAX];
+	monotime_t			 mrai_next[AID_MAX];
+	monotime_t			 drain_start[AID_MAX];
 	uint32_t			 remote_bgpid;
 	uint32_t			 path_id_tx;
+	uint32_t			 snap_refcnt;	/* held by rib snapshots */
+	uint32_t			 out_groupid;	/* out_rules built for */
+	uint32_t			 out_remote_as;
+	int32_t				 drr_deficit[AID_MAX];	/* bytes */
 	unsigned int			 local_if_scope;
 	enum peer_state			 state;
 	enum export_type		 export_type;
@@ -102,8 +115,10 @@ struct rde_peer {
 	uint16_t			 mrt_idx;
 	uint8_t				 recv_eor;	/* bitfield per AID */
 	uint8_t				 sent_eor;	/* bitfield per AID */
+	uint8_t				 mrai_open;	/* bitfield per AID */
 	uint8_t				 reconf_out;	/* out filter changed */
 	uint8_t				 reconf_rib;	/* rib changed */
+	uint8_t				 out_ebgp;
 	uint8_t				 throttled;
 	uint8_t				 flags;
 };
@@ -269,7 +284,9 @@ struct prefix {
 		struct {
 			TAILQ_ENTRY(prefix)	 rib;
 			LIST_ENTRY(prefix)	 nexthop;
+			LIST_ENTRY(prefix)	 adjin;	/* peer's Adj-RIB-In */
 			struct rib_entry	*re;
+			uint64_t		 dkey;	/* see rde_decide.c */
 		} list;
 		struct {
 			RB_ENTRY(prefix)	 index, update;
@@ -329,6 +346,7 @@ enum eval_mode {
 };
 
 extern struct rde_memstats rdemem;
+extern struct ctl_metrics rdemetrics;
 
 /* prototypes */
 /* mrt.c */
@@ -352,6 +370,25 @@ uint32_t	rde_local_as(void);
 int		rde_decisionflags(void);
 void		rde_peer_send_rrefresh(struct rde_peer *, uint8_t, uint8_t);
 int		rde_match_peer(struct rde_peer *, struct ctl_neighbor *);
+void		rde_lat_dump(struct rde_peer *, struct prefix *, monotime_t);
+void		rde_update_reuse(struct rde_peer *, struct pt_entry *, uint32_t);
+uint16_t	peer_mrai(struct rde_peer *);
+
+/* rde_damp.c */
+enum damp_event {
+	DAMP_UPDATE,
+	DAMP_CHANGE,
+	DAMP_WITHDRAW,
+};
+
+int		 damp_update(struct rde_peer *, struct pt_entry *, uint32_t,
+		    enum damp_event);
+int		 damp_suppressed(struct rde_peer *, struct pt_entry *,
+		    uint32_t);
+void		 damp_flush(struct rde_peer *);
+int		 damp_timeout(void);
+void		 damp_runner(void);
+void		 damp_shutdown(void);
 
 /* rde_peer.c */
 int		 peer_has_as4byte(struct rde_peer *);
@@ -363,10 +400,12 @@ void		 peer_init(struct filter_head *);
 void		 peer_shutdown(void);
 void		 peer_foreach(void (*)(struct rde_peer *, void *), void *);
 struct rde_peer	*peer_get(uint32_t);
+struct rde_peer	*peer_get_next(uint32_t);
 struct rde_peer *peer_match(struct ctl_neighbor *, uint32_t);
 struct rde_peer	*peer_add(uint32_t, struct peer_config *, struct filter_head *);
 struct filter_head	*peer_apply_out_filter(struct rde_peer *,
 			    struct filter_head *);
+int		 peer_out_filter_current(struct rde_peer *);
 
 void		 rde_generate_updates(struct rib_entry *, struct prefix *,
 		    struct prefix *, enum eval_mode);
@@ -505,6 +544,21 @@ void	rde_filter_calc_skip_steps(struct filter_head *);
 enum filter_actions rde_filter(struct filter_head *, struct rde_peer *,
 	    struct rde_peer *, struct bgpd_addr *, uint8_t,
 	    struct filterstate *);
+struct rde_filter_cache *rde_filter_cache_new(void);
+void	rde_filter_cache_free(struct rde_filter_cache *);
+void	rde_filter_cache_flush(struct rde_filter_cache *);
+void	rde_filter_cache_invalidate(void);
+void	rde_filter_cache_stats(struct rde_filter_cache *, uint64_t *,
+	    uint64_t *);
+enum filter_actions rde_filter_cached(struct rde_filter_cache *,
+	    struct filter_head *, struct rde_peer *, struct rde_peer *,
+	    struct prefix *, struct bgpd_addr *, uint8_t,
+	    struct filterstate *);
+enum filter_actions rde_filter_cached_state(struct rde_filter_cache *,
+	    struct filter_head *, struct rde_peer *, struct rde_peer *,
+	    struct rde_aspath *, struct rde_community *,
+	    struct filterstate *, struct bgpd_addr *, uint8_t,
+	    struct filterstate *);
 
 /* rde_prefix.c */
 void	 pt_init(void);
@@ -563,6 +617,17 @@ int		 rib_dump_subtree(uint16_t, struct bgpd_addr *, uint8_t,
 		    void (*)(void *, uint8_t),
 		    int (*)(void *));
 void		 rib_dump_terminate(void *);
+int		 rib_snapshot_new(uint16_t, uint8_t, unsigned int, void *,
+		    void (*)(struct rib_entry *, void *),
+		    void (*)(void *, uint8_t),
+		    int (*)(void *));
+int		 rib_snapshot_subtree(uint16_t, struct bgpd_addr *, uint8_t,
+		    unsigned int count, void *arg,
+		    void (*)(struct rib_entry *, void *),
+		    void (*)(void *, uint8_t),
+		    int (*)(void *));
+void		 rib_snapshot_abort(void);
+void		 rib_snap_save(struct rib_entry *);
 
 extern struct rib flowrib;
 
@@ -581,6 +646,9 @@ struct rde_aspath *path_prep(struct rde_aspath *);
 struct rde_aspath *path_get(void);
 void		 path_clean(struct rde_aspath *);
 void		 path_put(struct rde_aspath *);
+struct rde_aspath *path_ref(struct rde_aspath *);
+void		 path_unref(struct rde_aspath *);
+struct rde_aspath *path_intern(struct rde_aspath *);
 
 #define	PREFIX_SIZE(x)	(((x) + 7) / 8 + 1)
 struct prefix	*prefix_get(struct rib *, struct rde_peer *, uint32_t,
@@ -597,6 +665,7 @@ int		 prefix_update(struct rib *, struct rde_peer *, uint32_t,
 		    int);
 int		 prefix_withdraw(struct rib *, struct rde_peer *, uint32_t,
 		    struct bgpd_addr *, int);
+int		 prefix_same_state(struct prefix *, struct filterstate *);
 int		 prefix_flowspec_update(struct rde_peer *, struct filterstate *,
 		    struct pt_entry *, uint32_t);
 int		 prefix_flowspec_withdraw(struct rde_peer *, struct pt_entry *);
@@ -607,6 +676,7 @@ void		 prefix_add_eor(struct rde_peer *, uint8_t);
 void		 prefix_adjout_update(struct prefix *, struct rde_peer *,
 		    struct filterstate *, struct pt_entry *, uint32_t);
 void		 prefix_adjout_withdraw(struct prefix *);
+void		 prefix_adjout_flush(struct prefix *);
 void		 prefix_adjout_destroy(struct prefix *);
 void		 prefix_adjout_flush_pending(struct rde_peer *);
 int		 prefix_adjout_reaper(struct rde_peer *);
@@ -706,14 +776,16 @@ int		 nexthop_unref(struct nexthop *);
 
 /* rde_update.c */
 void		 up_generate_updates(struct rde_peer *, struct rib_entry *);
-void		 up_generate_addpath(struct rde_peer *, struct rib_entry *);
+void		 up_generate_addpath(struct rde_peer *, struct rib_entry *,
+		    struct prefix *, struct prefix *);
 void		 up_generate_addpath_all(struct rde_peer *, struct rib_entry *,
 		    struct prefix *, struct prefix *);
 void		 up_generate_default(struct rde_peer *, uint8_t);
+void		 up_denied_flush(struct rde_peer *);
 int		 up_is_eor(struct rde_peer *, uint8_t);
-void		 up_dump_withdraws(struct imsgbuf *, struct rde_peer *,
+size_t		 up_dump_withdraws(struct imsgbuf *, struct rde_peer *,
 		    uint8_t);
-void		 up_dump_update(struct imsgbuf *, struct rde_peer *, uint8_t);
+size_t		 up_dump_update(struct imsgbuf *, struct rde_peer *, uint8_t);
 
 /* rde_aspa.c */
 void		 aspa_validation(struct rde_aspa *, struct aspath *,
@@ -0,0 +1,379 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2025 The OpenBGPD portable contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bgpd.h"
+#include "rde.h"
+#include "log.h"
+
+/*
+ * Route flap damping (RFC 2439) with the parameters recommended by
+ * RFC 7196. As in RFC 2439 only routes learned over eBGP sessions are
+ * damped, iBGP peers pass on what the border routers already damped.
+ * State is only kept for routes that flapped, in a power of 2
+ * hash table keyed by (peer, pt_entry, path_id). The penalty decays
+ * exponentially and is only recalculated when the entry is touched.
+ * Every entry sits on a timer wheel at the time it either becomes usable
+ * again or its penalty dropped so low that it can be forgotten.
+ * A suppressed route stays in the Adj-RIB-In but is treated like a
+ * filtered route for the Loc-RIBs until it is reused.
+ */
+
+#define DAMP_HALFLIFE		(15 * 60)	/* seconds */
+#define DAMP_MAX_SUPPRESS	(60 * 60)	/* seconds */
+#define DAMP_SUPPRESS		6000
+#define DAMP_REUSE		750
+#define DAMP_FORGET		(DAMP_REUSE / 2)
+#define DAMP_CEILING		(DAMP_REUSE << (DAMP_MAX_SUPPRESS / DAMP_HALFLIFE))
+#define DAMP_PENALTY_WITHDRAW	1000
+#define DAMP_PENALTY_CHANGE	500
+
+#define DAMP_HASH_INIT		256
+#define DAMP_WHEEL_SLOTS	1024
+#define DAMP_WHEEL_TICK		5		/* seconds per slot */
+
+/* a half-life is split into 64 steps, 2^(-i/64) in 16.16 fixed point */
+#define DAMP_STEPS		64
+static const uint32_t damp_decay_tbl[DAMP_STEPS] = {
+	65536, 64830, 64132, 63441, 62757, 62081, 61413, 60751,
+	60097, 59449, 58809, 58176, 57549, 56929, 56316, 55709,
+	55109, 54515, 53928, 53347, 52773, 52204, 51642, 51085,
+	50535, 49991, 49452, 48920, 48393, 47871, 47356, 46846,
+	46341, 45842, 45348, 44859, 44376, 43898, 43425, 42958,
+	42495, 42037, 41584, 41136, 40693, 40255, 39821, 39392,
+	38968, 38548, 38133, 37722, 37316, 36914, 36516, 36123,
+	35734, 35349, 34968, 34591, 34219, 33850, 33486, 33125
+};
+
+struct damp_entry {
+	LIST_ENTRY(damp_entry)	 hash;
+	LIST_ENTRY(damp_entry)	 wheel;
+	struct pt_entry		*pt;
+	uint32_t		 peerid;
+	uint32_t		 path_id;
+	uint32_t		 penalty;
+	uint32_t		 updated;	/* seconds, monotonic */
+	uint32_t		 expire;	/* wheel tick */
+	uint8_t			 suppressed;
+};
+
+LIST_HEAD(damp_head, damp_entry);
+
+static struct damp_head	*damp_table;
+static uint32_t		 damp_mask;
+static uint32_t		 damp_cnt;
+static struct damp_head	 damp_wheel[DAMP_WHEEL_SLOTS];
+static uint32_t		 damp_tick;
+
+static inline uint32_t
+damp_now(void)
+{
+	return monotime_to_sec(getmonotime());
+}
+
+/* fmix32() of MurmurHash3, see rde_aspa.c */
+static inline uint32_t
+damp_mix(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline uint32_t
+damp_hash(uint32_t peerid, struct pt_entry *pt, uint32_t path_id)
+{
+	uint64_t ptr = (uintptr_t)pt;
+
+	return damp_mix(peerid ^ damp_mix(path_id ^ (uint32_t)ptr ^
+	    (uint32_t)(ptr >> 32)));
+}
+
+static struct damp_entry *
+damp_lookup(uint32_t peerid, struct pt_entry *pt, uint32_t path_id)
+{
+	struct damp_entry *e;
+
+	if (damp_table == NULL)
+		return NULL;
+	LIST_FOREACH(e, &damp_table[damp_hash(peerid, pt, path_id) &
+	    damp_mask], hash)
+		if (e->pt == pt && e->peerid == peerid &&
+		    e->path_id == path_id)
+			return e;
+	return NULL;
+}
+
+static void
+damp_grow(void)
+{
+	struct damp_head	*nt;
+	struct damp_entry	*e;
+	uint32_t		 i, nsize, size = damp_mask + 1;
+
+	if (damp_table == NULL)
+		nsize = DAMP_HASH_INIT;
+	else if (damp_cnt > size && size < UINT32_MAX / 2)
+		nsize = size * 2;
+	else
+		return;
+
+	if ((nt = calloc(nsize, sizeof(*nt))) == NULL)
+		fatal(NULL);
+	for (i = 0; damp_table != NULL && i < size; i++) {
+		while ((e = LIST_FIRST(&damp_table[i])) != NULL) {
+			LIST_REMOVE(e, hash);
+			LIST_INSERT_HEAD(&nt[damp_hash(e->peerid, e->pt,
+			    e->path_id) & (nsize - 1)], e, hash);
+		}
+	}
+	free(damp_table);
+	damp_table = nt;
+	damp_mask = nsize - 1;
+}
+
+/* penalty left after steps 1/64 half-lives */
+static uint32_t
+damp_decay_steps(uint32_t penalty, uint32_t steps)
+{
+	if (steps / DAMP_STEPS >= 32)
+		return 0;
+	penalty >>= steps / DAMP_STEPS;
+	return ((uint64_t)penalty * damp_decay_tbl[steps % DAMP_STEPS]) >> 16;
+}
+
+/* bring the penalty of e up to date */
+static void
+damp_decay(struct damp_entry *e, uint32_t now)
+{
+	uint32_t steps;
+
+	steps = (uint64_t)(now - e->updated) * DAMP_STEPS / DAMP_HALFLIFE;
+	if (steps == 0)
+		return;
+	e->penalty = damp_decay_steps(e->penalty, steps);
+	/* only consume the time accounted for, keeps the rounding error */
+	e->updated += (uint64_t)steps * DAMP_HALFLIFE / DAMP_STEPS;
+}
+
+/* seconds until penalty decayed below limit */
+static uint32_t
+damp_time_to(uint32_t penalty, uint32_t limit)
+{
+	uint32_t steps = 0;
+
+	while ((penalty >> (steps / DAMP_STEPS + 1)) >= limit)
+		steps += DAMP_STEPS;
+	while (damp_decay_steps(penalty, steps) >= limit)
+		steps++;
+	return ((uint64_t)steps * DAMP_HALFLIFE + DAMP_STEPS - 1) /
+	    DAMP_STEPS;
+}
+
+static void
+damp_schedule(struct damp_entry *e, uint32_t now)
+{
+	uint32_t tick, dt;
+
+	dt = damp_time_to(e->penalty, e->suppressed ? DAMP_REUSE :
+	    DAMP_FORGET);
+	tick = (now + dt + DAMP_WHEEL_TICK - 1) / DAMP_WHEEL_TICK;
+	if (tick <= damp_tick)
+		tick = damp_tick + 1;
+	/* too far out, check again once the wheel went around */
+	if (tick - damp_tick >= DAMP_WHEEL_SLOTS)
+		tick = damp_tick + DAMP_WHEEL_SLOTS - 1;
+	e->expire = tick;
+	LIST_INSERT_HEAD(&damp_wheel[tick % DAMP_WHEEL_SLOTS], e, wheel);
+}
+
+static void
+damp_free(struct damp_entry *e)
+{
+	LIST_REMOVE(e, hash);
+	LIST_REMOVE(e, wheel);
+	pt_unref(e->pt);
+	free(e);
+	damp_cnt--;
+}
+
+/*
+ * Account a flap event of a route received from peer. Must be called
+ * while the route is still in the Adj-RIB-In for withdraws so pt stays
+ * valid. Returns 1 if the route is suppressed.
+ */
+int
+damp_update(struct rde_peer *peer, struct pt_entry *pt, uint32_t path_id,
+    enum damp_event ev)
+{
+	struct damp_entry	*e;
+	uint32_t		 now, penalty;
+
+	if (!peer->conf.ebgp)
+		return 0;
+
+	switch (ev) {
+	case DAMP_WITHDRAW:
+		penalty = DAMP_PENALTY_WITHDRAW;
+		break;
+	case DAMP_CHANGE:
+		penalty = DAMP_PENALTY_CHANGE;
+		break;
+	default:
+		penalty = 0;
+		break;
+	}
+
+	now = damp_now();
+	if ((e = damp_lookup(peer->conf.id, pt, path_id)) == NULL) {
+		if (penalty == 0)
+			return 0;
+		if ((e = calloc(1, sizeof(*e))) == NULL)
+			fatal(NULL);
+		if (damp_cnt++ == 0)
+			damp_tick = now / DAMP_WHEEL_TICK;
+		damp_grow();
+		e->pt = pt_ref(pt);
+		e->peerid = peer->conf.id;
+		e->path_id = path_id;
+		e->updated = now;
+		LIST_INSERT_HEAD(&damp_table[damp_hash(e->peerid, pt,
+		    path_id) & damp_mask], e, hash);
+	} else {
+		if (penalty == 0)
+			return e->suppressed;
+		damp_decay(e, now);
+		LIST_REMOVE(e, wheel);
+	}
+
+	e->penalty += penalty;
+	if (e->penalty > DAMP_CEILING)
+		e->penalty = DAMP_CEILING;
+	if (e->penalty >= DAMP_SUPPRESS)
+		e->suppressed = 1;
+	damp_schedule(e, now);
+	return e->suppressed;
+}
+
+int
+damp_suppressed(struct rde_peer *peer, struct pt_entry *pt,
+    uint32_t path_id)
+{
+	struct damp_entry *e;
+
+	if (damp_cnt == 0)
+		return 0;
+	if ((e = damp_lookup(peer->conf.id, pt, path_id)) == NULL)
+		return 0;
+	return e->suppressed;
+}
+
+/* Forget all state of peer, the session was reset or removed. */
+void
+damp_flush(struct rde_peer *peer)
+{
+	struct damp_entry	*e, *ne;
+	uint32_t		 i;
+
+	if (damp_cnt == 0)
+		return;
+	for (i = 0; i <= damp_mask; i++)
+		LIST_FOREACH_SAFE(e, &damp_table[i], hash, ne)
+			if (e->peerid == peer->conf.id)
+				damp_free(e);
+}
+
+static void
+damp_expire(struct damp_entry *e, uint32_t now)
+{
+	struct rde_peer *peer;
+
+	damp_decay(e, now);
+	if (e->suppressed && e->penalty < DAMP_REUSE) {
+		e->suppressed = 0;
+		if ((peer = peer_get(e->peerid)) != NULL)
+			rde_update_reuse(peer, e->pt, e->path_id);
+	}
+	if (!e->suppressed && e->penalty < DAMP_FORGET) {
+		damp_free(e);
+		return;
+	}
+	LIST_REMOVE(e, wheel);
+	damp_schedule(e, now);
+}
+
+/*
+ * Milliseconds until the next slot of the timer wheel is due,
+ * -1 if there is nothing to damp.
+ */
+int
+damp_timeout(void)
+{
+	long long next, now;
+
+	if (damp_cnt == 0)
+		return -1;
+	now = monotime_to_msec(getmonotime());
+	next = (long long)(damp_tick + 1) * DAMP_WHEEL_TICK * 1000;
+	if (next <= now)
+		return 0;
+	return next - now;
+}
+
+void
+damp_runner(void)
+{
+	struct damp_head	*slot;
+	struct damp_entry	*e, *ne;
+	uint32_t		 now;
+
+	if (damp_cnt == 0)
+		return;
+	now = damp_now();
+	while (damp_tick < now / DAMP_WHEEL_TICK) {
+		damp_tick++;
+		slot = &damp_wheel[damp_tick % DAMP_WHEEL_SLOTS];
+		LIST_FOREACH_SAFE(e, slot, wheel, ne)
+			if (e->expire == damp_tick)
+				damp_expire(e, now);
+		if (damp_cnt == 0)
+			break;
+	}
+}
+
+void
+damp_shutdown(void)
+{
+	struct damp_entry	*e;
+	uint32_t		 i;
+
+	for (i = 0; damp_table != NULL && i <= damp_mask; i++)
+		while ((e = LIST_FIRST(&damp_table[i])) != NULL)
+			damp_free(e);
+	free(damp_table);
+	damp_table = NULL;
+	damp_mask = 0;
+}
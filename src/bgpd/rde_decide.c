@@ -103,6 +103,56 @@ void	prefix_remove(struct prefix *, struct rib_entry *);
  *  - state change of session (session down)
  */
 
+/*
+ * The decision key of a prefix in a RIB list packs the steps of
+ * prefix_cmp() that decide most comparisons, so that those do not touch
+ * the aspath, the peer or the attributes. The key is "bigger is better"
+ * and is computed by prefix_set_dkey() whenever a prefix is (re)inserted
+ * into the list, which happens on every attribute or nexthop state change.
+ * AS_PATH and CLUSTER_LIST counts are bound by the 16bit attribute length
+ * to 14 bits. The key shares the union with the RB tree linkage of the
+ * Adj-RIB-Out, so it must not make struct prefix grow. The BGP Id is not
+ * cached since it changes when a peer with stale routes comes back.
+ *
+ * dkey:	63	eligible
+ *		62-31	LOCAL_PREF
+ *		30-17	inverted AS_PATH count
+ *		16-15	inverted ORIGIN
+ *		14	EBGP
+ *		13-0	inverted CLUSTER_LIST count
+ */
+#define DKEY_ELIGIBLE		(1ULL << 63)
+#define DKEY_PREF_MASK		0x7fffffffffff8000ULL
+#define DKEY_EBGP		(1ULL << 14)
+#define DKEY_CLUSTER_MASK	0x3fffULL
+
+static void
+prefix_set_dkey(struct prefix *p)
+{
+	struct rde_aspath	*asp = prefix_aspath(p);
+	struct rde_peer		*peer = prefix_peer(p);
+	struct attr		*a;
+	uint64_t		 key;
+	uint16_t		 cnt = 0;
+
+	if (!prefix_eligible(p)) {
+		p->entry.list.dkey = 0;
+		return;
+	}
+
+	if ((a = attr_optget(asp, ATTR_CLUSTER_LIST)) != NULL)
+		cnt = a->len / sizeof(uint32_t);
+
+	key = DKEY_ELIGIBLE;
+	key |= (uint64_t)asp->lpref << 31;
+	key |= (uint64_t)(~asp->aspath->ascnt & 0x3fff) << 17;
+	key |= (uint64_t)(~asp->origin & 0x3) << 15;
+	if (peer->conf.ebgp)
+		key |= DKEY_EBGP;
+	key |= ~cnt & DKEY_CLUSTER_MASK;
+	p->entry.list.dkey = key;
+}
+
 /*
  * Compare two prefixes with equal pt_entry. Returns an integer greater than or
  * less than 0, according to whether the prefix p1 is more or less preferred
@@ -122,8 +172,9 @@ prefix_cmp(struct prefix *p1, struct prefix *p2, int *testall)
 	struct rde_aspath	*asp1, *asp2;
 	struct rde_peer		*peer1, *peer2;
 	struct attr		*a;
-	uint32_t		 p1id, p2id;
-	int			 p1cnt, p2cnt, i;
+	uint64_t		 k1, k2;
+	uint32_t		 p1id, p2id, flags;
+	int			 i;
 	int			 rv = 1;
 
 	/*
@@ -142,36 +193,26 @@ prefix_cmp(struct prefix *p1, struct prefix *p2, int *testall)
 	if (p2 == NULL)
 		return rv;
 
-	asp1 = prefix_aspath(p1);
-	asp2 = prefix_aspath(p2);
-	peer1 = prefix_peer(p1);
-	peer2 = prefix_peer(p2);
+	k1 = p1->entry.list.dkey;
+	k2 = p2->entry.list.dkey;
 
 	/* 1. check if prefix is eligible a.k.a reachable */
-	if (!prefix_eligible(p2))
+	if (!(k2 & DKEY_ELIGIBLE))
 		return rv;
-	if (!prefix_eligible(p1))
+	if (!(k1 & DKEY_ELIGIBLE))
 		return -rv;
 
 	/* bump rv, from here on prefix is considered valid */
 	rv++;
 
-	/* 2. local preference of prefix, bigger is better */
-	if (asp1->lpref > asp2->lpref)
-		return rv;
-	if (asp1->lpref < asp2->lpref)
-		return -rv;
-
-	/* 3. aspath count, the shorter the better */
-	if (asp1->aspath->ascnt < asp2->aspath->ascnt)
-		return rv;
-	if (asp1->aspath->ascnt > asp2->aspath->ascnt)
-		return -rv;
-
-	/* 4. origin, the lower the better */
-	if (asp1->origin < asp2->origin)
+	/*
+	 * 2. local preference of prefix, bigger is better
+	 * 3. aspath count, the shorter the better
+	 * 4. origin, the lower the better
+	 */
+	if ((k1 & DKEY_PREF_MASK) > (k2 & DKEY_PREF_MASK))
 		return rv;
-	if (asp1->origin > asp2->origin)
+	if ((k1 & DKEY_PREF_MASK) < (k2 & DKEY_PREF_MASK))
 		return -rv;
 
 	/*
@@ -181,9 +222,12 @@ prefix_cmp(struct prefix *p1, struct prefix *p2, int *testall)
 	 * set the testall flag since further elements need to be
 	 * evaluated as well.
 	 */
-	if ((rde_decisionflags() & BGPD_FLAG_DECISION_MED_ALWAYS) ||
+	flags = rde_decisionflags();
+	asp1 = prefix_aspath(p1);
+	asp2 = prefix_aspath(p2);
+	if ((flags & BGPD_FLAG_DECISION_MED_ALWAYS) ||
 	    aspath_neighbor(asp1->aspath) == aspath_neighbor(asp2->aspath)) {
-		if (!(rde_decisionflags() & BGPD_FLAG_DECISION_MED_ALWAYS))
+		if (!(flags & BGPD_FLAG_DECISION_MED_ALWAYS))
 			*testall = 2;
 		/* lowest value wins */
 		if (asp1->med < asp2->med)
@@ -192,7 +236,7 @@ prefix_cmp(struct prefix *p1, struct prefix *p2, int *testall)
 			return -rv;
 	}
 
-	if (!(rde_decisionflags() & BGPD_FLAG_DECISION_MED_ALWAYS))
+	if (!(flags & BGPD_FLAG_DECISION_MED_ALWAYS))
 		*testall = 1;
 
 	/*
@@ -200,10 +244,10 @@ prefix_cmp(struct prefix *p1, struct prefix *p2, int *testall)
 	 * It is absolutely important that the ebgp value in peer_config.ebgp
 	 * is bigger than all other ones (IBGP, confederations)
 	 */
-	if (peer1->conf.ebgp != peer2->conf.ebgp) {
-		if (peer1->conf.ebgp) /* peer1 is EBGP other is lower */
+	if ((k1 & DKEY_EBGP) != (k2 & DKEY_EBGP)) {
+		if (k1 & DKEY_EBGP) /* peer1 is EBGP other is lower */
 			return rv;
-		else if (peer2->conf.ebgp) /* peer2 is EBGP */
+		else /* peer2 is EBGP */
 			return -rv;
 	}
 
@@ -231,7 +275,7 @@ prefix_cmp(struct prefix *p1, struct prefix *p2, int *testall)
 	 * 9. older route (more stable) wins but only if route-age
 	 * evaluation is enabled.
 	 */
-	if (rde_decisionflags() & BGPD_FLAG_DECISION_ROUTEAGE) {
+	if (flags & BGPD_FLAG_DECISION_ROUTEAGE) {
 		switch (monotime_cmp(p1->lastchange, p2->lastchange)) {
 		case -1:	/* p1 is older */
 			return rv;
@@ -241,6 +285,8 @@ prefix_cmp(struct prefix *p1, struct prefix *p2, int *testall)
 	}
 
 	/* 10. lowest BGP Id wins, use ORIGINATOR_ID if present */
+	peer1 = prefix_peer(p1);
+	peer2 = prefix_peer(p2);
 	if ((a = attr_optget(asp1, ATTR_ORIGINATOR_ID)) != NULL) {
 		memcpy(&p1id, a->data, sizeof(p1id));
 		p1id = ntohl(p1id);
@@ -257,14 +303,9 @@ prefix_cmp(struct prefix *p1, struct prefix *p2, int *testall)
 		return -rv;
 
 	/* 11. compare CLUSTER_LIST length, shorter is better */
-	p1cnt = p2cnt = 0;
-	if ((a = attr_optget(asp1, ATTR_CLUSTER_LIST)) != NULL)
-		p1cnt = a->len / sizeof(uint32_t);
-	if ((a = attr_optget(asp2, ATTR_CLUSTER_LIST)) != NULL)
-		p2cnt = a->len / sizeof(uint32_t);
-	if (p1cnt < p2cnt)
+	if ((k1 & DKEY_CLUSTER_MASK) > (k2 & DKEY_CLUSTER_MASK))
 		return rv;
-	if (p1cnt > p2cnt)
+	if ((k1 & DKEY_CLUSTER_MASK) < (k2 & DKEY_CLUSTER_MASK))
 		return -rv;
 
 	/* 12. lowest peer address wins (IPv4 is better than IPv6) */
@@ -534,6 +575,8 @@ prefix_evaluate(struct rib_entry *re, struct prefix *new, struct prefix *old)
 	struct prefix	*newbest, *oldbest;
 	struct rib	*rib;
 
+	rib_snap_save(re);
+
 	rib = re_rib(re);
 	if (rib->flags & F_RIB_NOEVALUATE) {
 		/* decision process is turned off */
@@ -549,8 +592,10 @@ prefix_evaluate(struct rib_entry *re, struct prefix *new, struct prefix *old)
 	oldbest = prefix_best(re);
 	if (old != NULL)
 		prefix_remove(old, re);
-	if (new != NULL)
+	if (new != NULL) {
+		prefix_set_dkey(new);
 		prefix_insert(new, NULL, re);
+	}
 	newbest = prefix_best(re);
 
 	/*
@@ -617,6 +662,7 @@ prefix_evaluate_nexthop(struct prefix *p, enum nexthop_state state,
 	 * Re-evaluate the prefix by removing the prefix then updating the
 	 * nexthop state and reinserting the prefix again.
 	 */
+	rib_snap_save(re);
 	old = p;
 	oldbest = prefix_best(re);
 	prefix_remove(p, re);
@@ -626,6 +672,7 @@ prefix_evaluate_nexthop(struct prefix *p, enum nexthop_state state,
 	else
 		p->nhflags &= ~NEXTHOP_VALID;
 
+	prefix_set_dkey(p);
 	prefix_insert(p, NULL, re);
 	newbest = prefix_best(re);
 	new = p;
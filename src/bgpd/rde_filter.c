@@ -20,6 +20,7 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/tree.h>
 
 #include <limits.h>
 #include <stdlib.h>
@@ -870,3 +871,279 @@ rde_filter(struct filter_head *rules, struct rde_peer *peer,
 	}
 	return (action);
 }
+
+/*
+ * Filter result cache. Most filter rules only look at the path
+ * attributes, which are interned and shared by many prefixes. If no
+ * rule of a list depends on the prefix itself the result of rde_filter()
+ * only depends on the interned aspath, communities and nexthop, the
+ * nexthop flags, the validation state, the aid and the peer the path was
+ * learned from. The cache remembers the resulting action and filterstate
+ * for such a key and holds references on the interned objects so the
+ * pointers stay valid. The cache is flushed when the rule list changes,
+ * on any config reload and when the session of its peer goes down, and
+ * the least recently used entry is evicted when the cache is full.
+ */
+#define RDE_FILTER_CACHE_MAX	16384
+
+struct rde_filter_cache_entry {
+	RB_ENTRY(rde_filter_cache_entry)	 entry;
+	TAILQ_ENTRY(rde_filter_cache_entry)	 lru;
+	struct rde_aspath			*asp;
+	struct rde_community			*comm;
+	struct nexthop				*nexthop;
+	struct filterstate			 out;
+	enum filter_actions			 action;
+	uint32_t				 fromid;
+	uint8_t					 nhflags;
+	uint8_t					 vstate;
+	uint8_t					 aid;
+};
+
+RB_HEAD(rde_filter_cache_tree, rde_filter_cache_entry);
+TAILQ_HEAD(rde_filter_cache_lru, rde_filter_cache_entry);
+
+struct rde_filter_cache {
+	struct rde_filter_cache_tree	 tree;
+	struct rde_filter_cache_lru	 lru;
+	struct filter_head		*rules;
+	uint64_t			 gen;
+	uint64_t			 hits;
+	uint64_t			 misses;
+	uint32_t			 cnt;
+	int				 usable;
+};
+
+static uint64_t	rde_filter_gen = 1;
+
+static inline int
+rde_filter_cache_cmp(struct rde_filter_cache_entry *a,
+    struct rde_filter_cache_entry *b)
+{
+	if ((uintptr_t)a->asp != (uintptr_t)b->asp)
+		return ((uintptr_t)a->asp > (uintptr_t)b->asp ? 1 : -1);
+	if ((uintptr_t)a->comm != (uintptr_t)b->comm)
+		return ((uintptr_t)a->comm > (uintptr_t)b->comm ? 1 : -1);
+	if ((uintptr_t)a->nexthop != (uintptr_t)b->nexthop)
+		return ((uintptr_t)a->nexthop > (uintptr_t)b->nexthop ?
+		    1 : -1);
+	if (a->fromid != b->fromid)
+		return (a->fromid > b->fromid ? 1 : -1);
+	if (a->nhflags != b->nhflags)
+		return (a->nhflags > b->nhflags ? 1 : -1);
+	if (a->vstate != b->vstate)
+		return (a->vstate > b->vstate ? 1 : -1);
+	if (a->aid != b->aid)
+		return (a->aid > b->aid ? 1 : -1);
+	return (0);
+}
+
+RB_GENERATE_STATIC(rde_filter_cache_tree, rde_filter_cache_entry, entry,
+    rde_filter_cache_cmp);
+
+struct rde_filter_cache *
+rde_filter_cache_new(void)
+{
+	struct rde_filter_cache *fc;
+
+	if ((fc = calloc(1, sizeof(*fc))) == NULL)
+		fatal(NULL);
+	RB_INIT(&fc->tree);
+	TAILQ_INIT(&fc->lru);
+	return (fc);
+}
+
+static void
+rde_filter_cache_remove(struct rde_filter_cache *fc,
+    struct rde_filter_cache_entry *e)
+{
+	RB_REMOVE(rde_filter_cache_tree, &fc->tree, e);
+	TAILQ_REMOVE(&fc->lru, e, lru);
+	fc->cnt--;
+
+	if (e->action != ACTION_DENY)
+		rde_filterstate_clean(&e->out);
+	path_unref(e->asp);
+	communities_unref(e->comm);
+	nexthop_unref(e->nexthop);
+	free(e);
+}
+
+void
+rde_filter_cache_flush(struct rde_filter_cache *fc)
+{
+	struct rde_filter_cache_entry *e;
+
+	while ((e = TAILQ_FIRST(&fc->lru)) != NULL)
+		rde_filter_cache_remove(fc, e);
+}
+
+void
+rde_filter_cache_free(struct rde_filter_cache *fc)
+{
+	if (fc == NULL)
+		return;
+	rde_filter_cache_flush(fc);
+	free(fc);
+}
+
+/* Invalidate all filter caches, called when a new config is loaded. */
+void
+rde_filter_cache_invalidate(void)
+{
+	rde_filter_gen++;
+}
+
+void
+rde_filter_cache_stats(struct rde_filter_cache *fc, uint64_t *hits,
+    uint64_t *misses)
+{
+	*hits = fc != NULL ? fc->hits : 0;
+	*misses = fc != NULL ? fc->misses : 0;
+}
+
+/* return true if the result of the rules only depends on the path */
+static int
+rde_filter_cache_usable(struct filter_head *rules)
+{
+	struct filter_rule *f;
+
+	if (rules == NULL)
+		return (0);
+	TAILQ_FOREACH(f, rules, entry) {
+		if (f->match.prefixset.flags != 0 ||
+		    f->match.prefix.addr.aid != 0 ||
+		    f->match.originset.ps != NULL)
+			return (0);
+	}
+	return (1);
+}
+
+static void
+rde_filter_cache_check(struct rde_filter_cache *fc, struct filter_head *rules)
+{
+	if (fc->gen != rde_filter_gen || fc->rules != rules) {
+		rde_filter_cache_flush(fc);
+		fc->gen = rde_filter_gen;
+		fc->rules = rules;
+		fc->usable = rde_filter_cache_usable(rules);
+	}
+}
+
+/*
+ * Run the filter for the path described by key, the filterstate is either
+ * built from the prefix p or copied from in. On return the state is
+ * initialized and must be cleaned by the caller.
+ */
+static enum filter_actions
+rde_filter_cache_run(struct rde_filter_cache *fc, struct filter_head *rules,
+    struct rde_peer *peer, struct rde_peer *from,
+    struct rde_filter_cache_entry *key, struct prefix *p,
+    struct filterstate *in, struct bgpd_addr *prefix, uint8_t plen,
+    struct filterstate *state)
+{
+	struct rde_filter_cache_entry	*e;
+	enum filter_actions		 action;
+
+	if ((e = RB_FIND(rde_filter_cache_tree, &fc->tree, key)) != NULL) {
+		fc->hits++;
+		TAILQ_REMOVE(&fc->lru, e, lru);
+		TAILQ_INSERT_HEAD(&fc->lru, e, lru);
+		if (e->action != ACTION_DENY)
+			rde_filterstate_copy(state, &e->out);
+		else
+			rde_filterstate_init(state);
+		return (e->action);
+	}
+
+	fc->misses++;
+	if (p != NULL)
+		rde_filterstate_prep(state, p);
+	else
+		rde_filterstate_copy(state, in);
+	action = rde_filter(rules, peer, from, prefix, plen, state);
+
+	if (fc->cnt >= RDE_FILTER_CACHE_MAX)
+		rde_filter_cache_remove(fc, TAILQ_LAST(&fc->lru,
+		    rde_filter_cache_lru));
+
+	if ((e = malloc(sizeof(*e))) == NULL)
+		fatal(NULL);
+	*e = *key;
+	e->action = action;
+	if (e->asp != NULL)
+		path_ref(e->asp);
+	if (e->comm != NULL)
+		communities_ref(e->comm);
+	nexthop_ref(e->nexthop);
+	if (action != ACTION_DENY)
+		rde_filterstate_copy(&e->out, state);
+
+	RB_INSERT(rde_filter_cache_tree, &fc->tree, e);
+	TAILQ_INSERT_HEAD(&fc->lru, e, lru);
+	fc->cnt++;
+	return (action);
+}
+
+/*
+ * Like rde_filter() but for the path of prefix p and using the cache fc.
+ * The state is initialized from p and must be cleaned by the caller.
+ */
+enum filter_actions
+rde_filter_cached(struct rde_filter_cache *fc, struct filter_head *rules,
+    struct rde_peer *peer, struct rde_peer *from, struct prefix *p,
+    struct bgpd_addr *prefix, uint8_t plen, struct filterstate *state)
+{
+	struct rde_filter_cache_entry	 key;
+
+	rde_filter_cache_check(fc, rules);
+	if (!fc->usable) {
+		rde_filterstate_prep(state, p);
+		return (rde_filter(rules, peer, from, prefix, plen, state));
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.asp = prefix_aspath(p);
+	key.comm = prefix_communities(p);
+	key.nexthop = prefix_nexthop(p);
+	key.fromid = from != NULL ? from->conf.id : 0;
+	key.nhflags = prefix_nhflags(p);
+	key.vstate = p->validation_state;
+	key.aid = prefix->aid;
+
+	return (rde_filter_cache_run(fc, rules, peer, from, &key, p, NULL,
+	    prefix, plen, state));
+}
+
+/*
+ * Like rde_filter_cached() but the path is passed as filterstate in,
+ * asp and comm are the interned aspath and communities equal to the ones
+ * in the filterstate. The state is initialized as a copy of in.
+ */
+enum filter_actions
+rde_filter_cached_state(struct rde_filter_cache *fc,
+    struct filter_head *rules, struct rde_peer *peer, struct rde_peer *from,
+    struct rde_aspath *asp, struct rde_community *comm,
+    struct filterstate *in, struct bgpd_addr *prefix, uint8_t plen,
+    struct filterstate *state)
+{
+	struct rde_filter_cache_entry	 key;
+
+	rde_filter_cache_check(fc, rules);
+	if (!fc->usable) {
+		rde_filterstate_copy(state, in);
+		return (rde_filter(rules, peer, from, prefix, plen, state));
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.asp = asp;
+	key.comm = comm;
+	key.nexthop = in->nexthop;
+	key.fromid = from != NULL ? from->conf.id : 0;
+	key.nhflags = in->nhflags;
+	key.vstate = in->vstate;
+	key.aid = prefix->aid;
+
+	return (rde_filter_cache_run(fc, rules, peer, from, &key, NULL, in,
+	    prefix, plen, state));
+}
@@ -39,6 +39,8 @@ struct iq {
 	struct imsg		imsg;
 };
 
+static struct rde_peer	*peer_zombie_next(void);
+
 int
 peer_has_as4byte(struct rde_peer *peer)
 {
@@ -98,8 +100,11 @@ peer_shutdown(void)
 	RB_FOREACH_SAFE(peer, peer_tree, &peertable, np)
 		peer_delete(peer);
 
-	while (!RB_EMPTY(&zombietable))
-		peer_reaper(NULL);
+	/* rib snapshots are aborted before, so no zombie should be pinned */
+	while ((peer = peer_zombie_next()) != NULL)
+		peer_reaper(peer);
+	if (!RB_EMPTY(&zombietable))
+		log_warnx("%s: zombie peers held by rib snapshots", __func__);
 
 	if (!RB_EMPTY(&peertable))
 		log_warnx("%s: free non-free table", __func__);
@@ -129,6 +134,28 @@ peer_get(uint32_t id)
 	return RB_FIND(peer_tree, &peertable, &needle);
 }
 
+/*
+ * Lookup the peer with the lowest peer_id that is not below id, return
+ * NULL if there is none. Walks the tree by peer_id so no needle is needed.
+ */
+struct rde_peer *
+peer_get_next(uint32_t id)
+{
+	struct rde_peer	*peer, *res = NULL;
+
+	peer = RB_ROOT(&peertable);
+	while (peer != NULL) {
+		if (peer->conf.id == id)
+			return peer;
+		if (peer->conf.id > id) {
+			res = peer;
+			peer = RB_LEFT(peer, entry);
+		} else
+			peer = RB_RIGHT(peer, entry);
+	}
+	return res;
+}
+
 /*
  * Find next peer that matches neighbor options in *n.
  * If peerid was set then pickup the lookup after that peer.
@@ -183,6 +210,7 @@ peer_add(uint32_t id, struct peer_config *p_conf, struct filter_head *rules)
 		fatal(NULL);
 
 	peer_apply_out_filter(peer, rules);
+	peer->out_cache = rde_filter_cache_new();
 
 	/*
 	 * Assign an even random unique transmit path id.
@@ -217,6 +245,9 @@ peer_apply_out_filter(struct rde_peer *peer, struct filter_head *rules)
 	if ((peer->out_rules = malloc(sizeof(*peer->out_rules))) == NULL)
 		fatal(NULL);
 	TAILQ_INIT(peer->out_rules);
+	peer->out_groupid = peer->conf.groupid;
+	peer->out_remote_as = peer->conf.remote_as;
+	peer->out_ebgp = peer->conf.ebgp;
 
 	TAILQ_FOREACH(fr, rules, entry) {
 		if (rde_filter_skip_rule(peer, fr))
@@ -233,6 +264,19 @@ peer_apply_out_filter(struct rde_peer *peer, struct filter_head *rules)
 	return old;
 }
 
+/*
+ * Check if the peer's copy of the outbound rules was built with the
+ * same peer properties rde_filter_skip_rule() looks at.
+ */
+int
+peer_out_filter_current(struct rde_peer *peer)
+{
+	return (peer->out_rules != NULL &&
+	    peer->out_groupid == peer->conf.groupid &&
+	    peer->out_remote_as == peer->conf.remote_as &&
+	    peer->out_ebgp == peer->conf.ebgp);
+}
+
 static inline int
 peer_cmp(struct rde_peer *a, struct rde_peer *b)
 {
@@ -280,7 +324,7 @@ peer_generate_update(struct rde_peer *peer, struct rib_entry *re,
 		if (peer->eval.mode == ADDPATH_EVAL_ALL)
 			up_generate_addpath_all(peer, re, newpath, oldpath);
 		else
-			up_generate_addpath(peer, re);
+			up_generate_addpath(peer, re, newpath, oldpath);
 		return;
 	}
 
@@ -301,53 +345,69 @@ rde_generate_updates(struct rib_entry *re, struct prefix *newpath,
 }
 
 /*
- * Various RIB walker callbacks.
+ * Remove a route of the peer from the Adj-RIB-In and all Loc-RIBs.
  */
-struct peer_flush {
-	struct rde_peer *peer;
-	monotime_t	 staletime;
-};
-
 static void
-peer_flush_upcall(struct rib_entry *re, void *arg)
+peer_flush_prefix(struct rde_peer *peer, struct prefix *p)
 {
-	struct rde_peer *peer = ((struct peer_flush *)arg)->peer;
 	struct rde_aspath *asp;
 	struct bgpd_addr addr;
-	struct prefix *p, *np, *rp;
-	monotime_t staletime = ((struct peer_flush *)arg)->staletime;
+	struct prefix *rp;
 	uint32_t i;
 	uint8_t prefixlen;
 
-	pt_getaddr(re->prefix, &addr);
-	prefixlen = re->prefix->prefixlen;
-	TAILQ_FOREACH_SAFE(p, &re->prefix_h, entry.list.rib, np) {
-		if (peer != prefix_peer(p))
+	pt_getaddr(p->pt, &addr);
+	prefixlen = p->pt->prefixlen;
+	for (i = RIB_LOC_START; i < rib_size; i++) {
+		struct rib *rib = rib_byid(i);
+		if (rib == NULL)
 			continue;
-		if (monotime_valid(staletime) &&
-		    monotime_cmp(p->lastchange, staletime) > 0)
-			continue;
-
-		for (i = RIB_LOC_START; i < rib_size; i++) {
-			struct rib *rib = rib_byid(i);
-			if (rib == NULL)
-				continue;
-			rp = prefix_get(rib, peer, p->path_id,
+		rp = prefix_get(rib, peer, p->path_id, &addr, prefixlen);
+		if (rp) {
+			asp = prefix_aspath(rp);
+			if (asp && asp->pftableid)
+				rde_pftable_del(asp->pftableid, rp);
+
+			prefix_destroy(rp);
+			rde_update_log("flush", i, peer, NULL,
 			    &addr, prefixlen);
-			if (rp) {
-				asp = prefix_aspath(rp);
-				if (asp && asp->pftableid)
-					rde_pftable_del(asp->pftableid, rp);
-
-				prefix_destroy(rp);
-				rde_update_log("flush", i, peer, NULL,
-				    &addr, prefixlen);
-			}
 		}
+	}
+
+	prefix_destroy(p);
+	peer->stats.prefix_cnt--;
+}
+
+/*
+ * Flush the routes of the peer older than staletime from the Adj-RIB-In,
+ * walking only the peer's own prefixes. If max is not 0 at most max
+ * routes are removed and 0 is returned if that limit was hit.
+ */
+static int
+peer_flush_prefixes(struct rde_peer *peer, uint8_t aid, monotime_t staletime,
+    unsigned int max)
+{
+	struct prefix *p, *np;
+	uint8_t i, min, last;
 
-		prefix_destroy(p);
-		peer->stats.prefix_cnt--;
+	if (aid == AID_UNSPEC) {
+		min = AID_MIN;
+		last = AID_MAX - 1;
+	} else
+		min = last = aid;
+
+	for (i = min; i <= last; i++) {
+		LIST_FOREACH_SAFE(p, &peer->adj_rib_in[i], entry.list.adjin,
+		    np) {
+			if (monotime_valid(staletime) &&
+			    monotime_cmp(p->lastchange, staletime) > 0)
+				continue;
+			peer_flush_prefix(peer, p);
+			if (max != 0 && --max == 0)
+				return (0);
+		}
 	}
+	return (1);
 }
 
 /*
@@ -403,6 +463,13 @@ peer_up(struct rde_peer *peer, struct session_up *sup)
 		peer->sent_eor = ~0;
 		peer->recv_eor = ~0;
 	}
+	/* the initial table is sent without delay */
+	peer->mrai_open = 0;
+	for (i = AID_MIN; i < AID_MAX; i++) {
+		peer->mrai_next[i] = monotime_clear();
+		peer->drain_start[i] = monotime_clear();
+		peer->drr_deficit[i] = 0;
+	}
 	peer->state = PEER_UP;
 
 	if (!force_sync) {
@@ -418,6 +485,19 @@ peer_up(struct rde_peer *peer, struct session_up *sup)
 	}
 }
 
+/*
+ * Stop everything which depends on the session of the peer:
+ * all pending dumps and all pending imsg from the SE.
+ */
+static void
+peer_stop(struct rde_peer *peer)
+{
+	peer->state = PEER_DOWN;
+	rib_dump_terminate(peer);
+	prefix_adjout_flush_pending(peer);
+	peer_imsg_flush(peer);
+}
+
 /*
  * Session dropped and no graceful restart is done. Stop everything for
  * this peer and clean up.
@@ -426,28 +506,31 @@ void
 peer_down(struct rde_peer *peer)
 {
 	peer->remote_bgpid = 0;
-	peer->state = PEER_DOWN;
-	/*
-	 * stop all pending dumps which may depend on this peer
-	 * and flush all pending imsg from the SE.
-	 */
-	rib_dump_terminate(peer);
-	prefix_adjout_flush_pending(peer);
-	peer_imsg_flush(peer);
+	peer_stop(peer);
 
 	/* flush Adj-RIB-In */
 	peer_flush(peer, AID_UNSPEC, monotime_clear());
 	peer->stats.prefix_cnt = 0;
+	damp_flush(peer);
+	/* drop the references the cached verdicts hold */
+	rde_filter_cache_flush(peer->out_cache);
 }
 
+/*
+ * Remove the peer. Its Adj-RIB-In, including routes kept stale for
+ * graceful restart, is flushed in chunks by peer_reaper().
+ */
 void
 peer_delete(struct rde_peer *peer)
 {
-	if (peer->state != PEER_DOWN)
-		peer_down(peer);
+	if (peer->state != PEER_DOWN) {
+		peer->remote_bgpid = 0;
+		peer_stop(peer);
+	}
 
 	/* free filters */
 	filterlist_free(peer->out_rules);
+	damp_flush(peer);
 
 	RB_REMOVE(peer_tree, &peertable, peer);
 	while (RB_INSERT(peer_tree, &zombietable, peer) != NULL) {
@@ -466,12 +549,8 @@ peer_delete(struct rde_peer *peer)
 void
 peer_flush(struct rde_peer *peer, uint8_t aid, monotime_t staletime)
 {
-	struct peer_flush pf = { peer, staletime };
-
-	/* this dump must run synchronous, too much depends on that right now */
-	if (rib_dump_new(RIB_ADJ_IN, aid, 0, &pf, peer_flush_upcall,
-	    NULL, NULL) == -1)
-		fatal("%s: rib_dump_new", __func__);
+	/* this flush must run synchronous, too much depends on that */
+	peer_flush_prefixes(peer, aid, staletime, 0);
 
 	/* every route is gone so reset staletime */
 	if (aid == AID_UNSPEC) {
@@ -498,15 +577,7 @@ peer_stale(struct rde_peer *peer, uint8_t aid, int flushall)
 		peer_flush(peer, aid, peer->staletime[aid]);
 
 	peer->staletime[aid] = now = getmonotime();
-	peer->state = PEER_DOWN;
-
-	/*
-	 * stop all pending dumps which may depend on this peer
-	 * and flush all pending imsg from the SE.
-	 */
-	rib_dump_terminate(peer);
-	prefix_adjout_flush_pending(peer);
-	peer_imsg_flush(peer);
+	peer_stop(peer);
 
 	if (flushall)
 		peer_flush(peer, aid, monotime_clear());
@@ -643,30 +714,69 @@ peer_begin_rrefresh(struct rde_peer *peer, uint8_t aid)
 	}
 }
 
+/*
+ * A zombie is pinned once all its routes are flushed but a rib snapshot
+ * still shows some of them. It can only be freed after the snapshot ends.
+ */
+static int
+peer_pinned(struct rde_peer *peer)
+{
+	uint8_t i;
+
+	if (peer->snap_refcnt == 0)
+		return (0);
+	for (i = AID_MIN; i < AID_MAX; i++)
+		if (!LIST_EMPTY(&peer->adj_rib_in[i]))
+			return (0);
+	return (RB_EMPTY(&peer->adj_rib_out));
+}
+
+/*
+ * Return the first zombie that can be worked on or NULL.
+ */
+static struct rde_peer *
+peer_zombie_next(void)
+{
+	struct rde_peer *peer;
+
+	RB_FOREACH(peer, peer_tree, &zombietable)
+		if (!peer_pinned(peer))
+			return (peer);
+	return (NULL);
+}
+
 void
 peer_reaper(struct rde_peer *peer)
 {
 	if (peer == NULL)
-		peer = RB_ROOT(&zombietable);
+		peer = peer_zombie_next();
 	if (peer == NULL)
 		return;
 
+	if (!peer_flush_prefixes(peer, AID_UNSPEC, monotime_clear(),
+	    RDE_REAPER_ROUNDS))
+		return;
 	if (!prefix_adjout_reaper(peer))
 		return;
+	/* rib snapshots may still show routes of this peer */
+	if (peer->snap_refcnt > 0)
+		return;
 
+	up_denied_flush(peer);
+	rde_filter_cache_free(peer->out_cache);
 	ibufq_free(peer->ibufq);
 	RB_REMOVE(peer_tree, &zombietable, peer);
 	free(peer);
 }
 
 /*
- * Check if any imsg are pending or any zombie peers are around.
+ * Check if any imsg are pending or any zombie peers can be reaped.
  * Return 0 if no work is pending.
  */
 int
 peer_work_pending(void)
 {
-	if (!RB_EMPTY(&zombietable))
+	if (peer_zombie_next() != NULL)
 		return 1;
 	return imsg_pending != 0;
 }
@@ -49,10 +49,18 @@ static void rib_dump_abort(uint16_t);
 RB_PROTOTYPE(rib_tree, rib_entry, rib_e, rib_compare);
 RB_GENERATE(rib_tree, rib_entry, rib_e, rib_compare);
 
+struct rib_snap_entry {
+	RB_ENTRY(rib_snap_entry)	 entry;
+	struct rib_entry		 re;
+};
+RB_HEAD(rib_snap_tree, rib_snap_entry);
+
 struct rib_context {
 	LIST_ENTRY(rib_context)		 entry;
 	struct rib_entry		*ctx_re;
 	struct prefix			*ctx_p;
+	struct pt_entry			*ctx_pos;
+	struct rib_snap_tree		 ctx_saved;
 	uint32_t			 ctx_id;
 	void		(*ctx_rib_call)(struct rib_entry *, void *);
 	void		(*ctx_prefix_call)(struct prefix *, void *);
@@ -63,10 +71,16 @@ struct rib_context {
 	unsigned int			 ctx_count;
 	uint8_t				 ctx_aid;
 	uint8_t				 ctx_subtreelen;
+	uint8_t				 ctx_snap;
 };
 LIST_HEAD(, rib_context) rib_dumps = LIST_HEAD_INITIALIZER(rib_dumps);
 
 static void	prefix_dump_r(struct rib_context *);
+static void	rib_snap_dump_r(struct rib_context *);
+static void	rib_snap_end(struct rib_context *);
+
+static uint32_t		rib_epoch;
+static unsigned int	rib_snap_cnt;
 
 static inline struct rib_entry *
 re_lock(struct rib_entry *re)
@@ -167,6 +181,7 @@ rib_new(char *name, u_int rtableid, uint16_t flags)
 	if (new->in_rules == NULL)
 		fatal(NULL);
 	TAILQ_INIT(new->in_rules);
+	new->in_cache = rde_filter_cache_new();
 
 	ribs[id] = new;
 
@@ -267,6 +282,7 @@ rib_free(struct rib *rib)
 		return; /* never remove the default ribs */
 	filterlist_free(rib->in_rules_tmp);
 	filterlist_free(rib->in_rules);
+	rde_filter_cache_free(rib->in_cache);
 	ribs[rib->id] = NULL;
 	free(rib);
 }
@@ -293,6 +309,7 @@ rib_shutdown(void)
 			continue;
 		filterlist_free(rib->in_rules_tmp);
 		filterlist_free(rib->in_rules);
+		rde_filter_cache_free(rib->in_cache);
 		ribs[id] = NULL;
 		free(rib);
 	}
@@ -487,13 +504,30 @@ rib_dump_runner(void)
 	LIST_FOREACH_SAFE(ctx, &rib_dumps, entry, next) {
 		if (ctx->ctx_throttle && ctx->ctx_throttle(ctx->ctx_arg))
 			continue;
-		if (ctx->ctx_rib_call != NULL)
+		if (ctx->ctx_snap)
+			rib_snap_dump_r(ctx);
+		else if (ctx->ctx_rib_call != NULL)
 			rib_dump_r(ctx);
 		else
 			prefix_dump_r(ctx);
 	}
 }
 
+static void
+rib_dump_stop(struct rib_context *ctx)
+{
+	if (ctx->ctx_done)
+		ctx->ctx_done(ctx->ctx_arg, ctx->ctx_aid);
+	if (ctx->ctx_re && rib_empty(re_unlock(ctx->ctx_re)))
+		rib_remove(ctx->ctx_re);
+	if (ctx->ctx_p && prefix_is_dead(prefix_unlock(ctx->ctx_p)))
+		prefix_adjout_destroy(ctx->ctx_p);
+	if (ctx->ctx_snap)
+		rib_snap_end(ctx);
+	LIST_REMOVE(ctx, entry);
+	free(ctx);
+}
+
 static void
 rib_dump_abort(uint16_t id)
 {
@@ -502,14 +536,7 @@ rib_dump_abort(uint16_t id)
 	LIST_FOREACH_SAFE(ctx, &rib_dumps, entry, next) {
 		if (id != ctx->ctx_id)
 			continue;
-		if (ctx->ctx_done)
-			ctx->ctx_done(ctx->ctx_arg, ctx->ctx_aid);
-		if (ctx->ctx_re && rib_empty(re_unlock(ctx->ctx_re)))
-			rib_remove(ctx->ctx_re);
-		if (ctx->ctx_p && prefix_is_dead(prefix_unlock(ctx->ctx_p)))
-			prefix_adjout_destroy(ctx->ctx_p);
-		LIST_REMOVE(ctx, entry);
-		free(ctx);
+		rib_dump_stop(ctx);
 	}
 }
 
@@ -521,14 +548,22 @@ rib_dump_terminate(void *arg)
 	LIST_FOREACH_SAFE(ctx, &rib_dumps, entry, next) {
 		if (ctx->ctx_arg != arg)
 			continue;
-		if (ctx->ctx_done)
-			ctx->ctx_done(ctx->ctx_arg, ctx->ctx_aid);
-		if (ctx->ctx_re && rib_empty(re_unlock(ctx->ctx_re)))
-			rib_remove(ctx->ctx_re);
-		if (ctx->ctx_p && prefix_is_dead(prefix_unlock(ctx->ctx_p)))
-			prefix_adjout_destroy(ctx->ctx_p);
-		LIST_REMOVE(ctx, entry);
-		free(ctx);
+		rib_dump_stop(ctx);
+	}
+}
+
+/*
+ * Stop all snapshot dumps, the routes they still hold pin zombie peers.
+ */
+void
+rib_snapshot_abort(void)
+{
+	struct rib_context *ctx, *next;
+
+	LIST_FOREACH_SAFE(ctx, &rib_dumps, entry, next) {
+		if (!ctx->ctx_snap)
+			continue;
+		rib_dump_stop(ctx);
 	}
 }
 
@@ -594,6 +629,267 @@ rib_dump_subtree(uint16_t id, struct bgpd_addr *subtree, uint8_t subtreelen,
 	return 0;
 }
 
+/*
+ * RIB snapshots.
+ * A snapshot dump presents the RIB as it was when the dump started while
+ * the walk itself still runs in chunks over the live tree. Starting a
+ * snapshot opens a new epoch. Before a rib entry is modified
+ * rib_snap_save() copies its prefix list for every snapshot that has not
+ * passed the entry yet, at most once per epoch. The walk merges these
+ * saved versions with the live tree, an empty saved version means the
+ * entry did not exist when the snapshot was taken. Saved versions are
+ * reclaimed as soon as the walk passed them. Live entries are never
+ * locked and the update path only pays for entries it actually changes
+ * while a snapshot is running.
+ */
+static inline int
+rib_snap_cmp(struct rib_snap_entry *a, struct rib_snap_entry *b)
+{
+	return rib_compare(&a->re, &b->re);
+}
+
+RB_GENERATE_STATIC(rib_snap_tree, rib_snap_entry, entry, rib_snap_cmp);
+
+static void
+rib_snap_copy(struct rib_context *ctx, struct rib_entry *re)
+{
+	struct rib_snap_entry	*se;
+	struct prefix		*p, *np;
+
+	if ((se = calloc(1, sizeof(*se))) == NULL)
+		fatal(__func__);
+	TAILQ_INIT(&se->re.prefix_h);
+	se->re.prefix = re->prefix;
+	se->re.rib_id = re->rib_id;
+	if (RB_INSERT(rib_snap_tree, &ctx->ctx_saved, se) != NULL) {
+		/* version of the snapshot already saved */
+		free(se);
+		return;
+	}
+	pt_ref(se->re.prefix);
+
+	TAILQ_FOREACH(p, &re->prefix_h, entry.list.rib) {
+		if ((np = malloc(sizeof(*np))) == NULL)
+			fatal(__func__);
+		*np = *p;
+		np->entry.list.re = &se->re;
+		np->pt = pt_ref(p->pt);
+		np->aspath = path_ref(p->aspath);
+		np->communities = communities_ref(p->communities);
+		np->nexthop = nexthop_ref(p->nexthop);
+		np->peer->snap_refcnt++;
+		TAILQ_INSERT_TAIL(&se->re.prefix_h, np, entry.list.rib);
+	}
+}
+
+static void
+rib_snap_free(struct rib_context *ctx, struct rib_snap_entry *se)
+{
+	struct prefix		*p;
+
+	RB_REMOVE(rib_snap_tree, &ctx->ctx_saved, se);
+	while ((p = TAILQ_FIRST(&se->re.prefix_h)) != NULL) {
+		TAILQ_REMOVE(&se->re.prefix_h, p, entry.list.rib);
+		nexthop_unref(p->nexthop);
+		communities_unref(p->communities);
+		path_unref(p->aspath);
+		pt_unref(p->pt);
+		p->peer->snap_refcnt--;
+		free(p);
+	}
+	pt_unref(se->re.prefix);
+	free(se);
+}
+
+/*
+ * Save the current version of re for all running snapshots.
+ * Needs to be called before the prefix list of re is modified.
+ */
+void
+rib_snap_save(struct rib_entry *re)
+{
+	struct rib_context	*ctx;
+	struct bgpd_addr	 addr;
+
+	if (rib_snap_cnt == 0 || re->snap_epoch == rib_epoch)
+		return;
+	re->snap_epoch = rib_epoch;
+
+	LIST_FOREACH(ctx, &rib_dumps, entry) {
+		if (!ctx->ctx_snap || ctx->ctx_id != re->rib_id)
+			continue;
+		if (ctx->ctx_aid != AID_UNSPEC &&
+		    ctx->ctx_aid != re->prefix->aid)
+			continue;
+		/* walk already passed this entry */
+		if (ctx->ctx_pos != NULL &&
+		    pt_prefix_cmp(re->prefix, ctx->ctx_pos) < 0)
+			continue;
+		if (ctx->ctx_subtree.aid != AID_UNSPEC) {
+			pt_getaddr(re->prefix, &addr);
+			if (prefix_compare(&ctx->ctx_subtree, &addr,
+			    ctx->ctx_subtreelen) != 0)
+				continue;
+		}
+		rib_snap_copy(ctx, re);
+	}
+}
+
+static void
+rib_snap_setpos(struct rib_context *ctx, struct pt_entry *pt)
+{
+	pt_ref(pt);
+	if (ctx->ctx_pos != NULL)
+		pt_unref(ctx->ctx_pos);
+	ctx->ctx_pos = pt;
+}
+
+static void
+rib_snap_end(struct rib_context *ctx)
+{
+	struct rib_snap_entry	*se;
+
+	while ((se = RB_MIN(rib_snap_tree, &ctx->ctx_saved)) != NULL)
+		rib_snap_free(ctx, se);
+	if (ctx->ctx_pos != NULL)
+		pt_unref(ctx->ctx_pos);
+	ctx->ctx_pos = NULL;
+	rib_snap_cnt--;
+}
+
+static void
+rib_snap_dump_r(struct rib_context *ctx)
+{
+	struct rib_entry	 xre, *re, *next, *cur;
+	struct rib_snap_entry	*se;
+	struct rib		*rib;
+	struct bgpd_addr	 addr;
+	unsigned int		 i = 0;
+	int			 c;
+
+	rib = rib_byid(ctx->ctx_id);
+	if (rib == NULL)
+		fatalx("%s: rib id %u gone", __func__, ctx->ctx_id);
+
+	memset(&xre, 0, sizeof(xre));
+	if (ctx->ctx_pos != NULL) {
+		xre.prefix = ctx->ctx_pos;
+		re = RB_NFIND(rib_tree, rib_tree(rib), &xre);
+	} else if (ctx->ctx_subtree.aid != AID_UNSPEC) {
+		xre.prefix = pt_fill(&ctx->ctx_subtree, ctx->ctx_subtreelen);
+		re = RB_NFIND(rib_tree, rib_tree(rib), &xre);
+	} else
+		re = RB_MIN(rib_tree, rib_tree(rib));
+
+	for (;;) {
+		/* merge saved versions with the live tree */
+		se = RB_MIN(rib_snap_tree, &ctx->ctx_saved);
+		if (se == NULL && re == NULL)
+			break;
+		if (se != NULL && re != NULL)
+			c = rib_compare(&se->re, re);
+		else
+			c = se != NULL ? -1 : 1;
+		cur = c <= 0 ? &se->re : re;
+		next = c >= 0 ? RB_NEXT(rib_tree, unused, re) : re;
+
+		if (ctx->ctx_aid != AID_UNSPEC &&
+		    ctx->ctx_aid != cur->prefix->aid)
+			goto skip;
+		if (ctx->ctx_subtree.aid != AID_UNSPEC) {
+			pt_getaddr(cur->prefix, &addr);
+			if (prefix_compare(&ctx->ctx_subtree, &addr,
+			    ctx->ctx_subtreelen) != 0)
+				/* left subtree, walk is done */
+				break;
+		}
+		if (ctx->ctx_count && i++ >= ctx->ctx_count) {
+			/* remember where to continue */
+			rib_snap_setpos(ctx, cur->prefix);
+			return;
+		}
+		if (!rib_empty(cur))
+			ctx->ctx_rib_call(cur, ctx->ctx_arg);
+ skip:
+		if (c <= 0)
+			rib_snap_free(ctx, se);
+		re = next;
+	}
+
+	if (ctx->ctx_done)
+		ctx->ctx_done(ctx->ctx_arg, ctx->ctx_aid);
+	rib_snap_end(ctx);
+	LIST_REMOVE(ctx, entry);
+	free(ctx);
+}
+
+/*
+ * Like rib_dump_new() but the upcall sees a consistent view of the RIB
+ * as it was at the time of the call.
+ */
+int
+rib_snapshot_new(uint16_t id, uint8_t aid, unsigned int count, void *arg,
+    void (*upcall)(struct rib_entry *, void *), void (*done)(void *, uint8_t),
+    int (*throttle)(void *))
+{
+	struct rib_context *ctx;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return -1;
+	ctx->ctx_id = id;
+	ctx->ctx_aid = aid;
+	ctx->ctx_count = count;
+	ctx->ctx_arg = arg;
+	ctx->ctx_rib_call = upcall;
+	ctx->ctx_done = done;
+	ctx->ctx_throttle = throttle;
+	ctx->ctx_snap = 1;
+	RB_INIT(&ctx->ctx_saved);
+
+	LIST_INSERT_HEAD(&rib_dumps, ctx, entry);
+	rib_epoch++;
+	rib_snap_cnt++;
+
+	/* requested a sync traversal */
+	if (count == 0)
+		rib_snap_dump_r(ctx);
+
+	return 0;
+}
+
+int
+rib_snapshot_subtree(uint16_t id, struct bgpd_addr *subtree,
+    uint8_t subtreelen, unsigned int count, void *arg,
+    void (*upcall)(struct rib_entry *, void *), void (*done)(void *, uint8_t),
+    int (*throttle)(void *))
+{
+	struct rib_context *ctx;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return -1;
+	ctx->ctx_id = id;
+	ctx->ctx_aid = subtree->aid;
+	ctx->ctx_count = count;
+	ctx->ctx_arg = arg;
+	ctx->ctx_rib_call = upcall;
+	ctx->ctx_done = done;
+	ctx->ctx_throttle = throttle;
+	ctx->ctx_subtree = *subtree;
+	ctx->ctx_subtreelen = subtreelen;
+	ctx->ctx_snap = 1;
+	RB_INIT(&ctx->ctx_saved);
+
+	LIST_INSERT_HEAD(&rib_dumps, ctx, entry);
+	rib_epoch++;
+	rib_snap_cnt++;
+
+	/* requested a sync traversal */
+	if (count == 0)
+		rib_snap_dump_r(ctx);
+
+	return 0;
+}
+
 /* path specific functions */
 
 static struct rde_aspath *path_lookup(struct rde_aspath *);
@@ -654,7 +950,7 @@ path_compare(struct rde_aspath *a, struct rde_aspath *b)
 RB_HEAD(path_tree, rde_aspath)	pathtable = RB_INITIALIZER(&pathtable);
 RB_GENERATE_STATIC(path_tree, rde_aspath, entry, path_compare);
 
-static inline struct rde_aspath *
+struct rde_aspath *
 path_ref(struct rde_aspath *asp)
 {
 	if ((asp->flags & F_ATTR_LINKED) == 0)
@@ -665,7 +961,7 @@ path_ref(struct rde_aspath *asp)
 	return asp;
 }
 
-static inline void
+void
 path_unref(struct rde_aspath *asp)
 {
 	if (asp == NULL)
@@ -703,6 +999,22 @@ path_link(struct rde_aspath *asp)
 	asp->flags |= F_ATTR_LINKED;
 }
 
+/*
+ * Return a reference to the linked aspath equal to asp, creating it if
+ * needed. Release it with path_unref().
+ */
+struct rde_aspath *
+path_intern(struct rde_aspath *asp)
+{
+	struct rde_aspath *nasp;
+
+	if ((nasp = path_lookup(asp)) == NULL) {
+		nasp = path_copy(path_get(), asp);
+		path_link(nasp);
+	}
+	return (path_ref(nasp));
+}
+
 /*
  * This function can only be called when all prefix have been removed first.
  * Normally this happens directly out of the prefix removal functions.
@@ -982,17 +1294,19 @@ prefix_update(struct rib *rib, struct rde_peer *peer, uint32_t path_id,
 	if ((p = prefix_get(rib, peer, path_id, prefix, prefixlen)) != NULL) {
 		if (path_id_tx != p->path_id_tx)
 			fatalx("path_id mismatch");
-		if (prefix_nexthop(p) == state->nexthop &&
-		    prefix_nhflags(p) == state->nhflags &&
-		    communities_equal(ncomm, prefix_communities(p)) &&
-		    path_compare(nasp, prefix_aspath(p)) == 0) {
+		if (prefix_same_state(p, state)) {
 			/* no change, update last change */
+			rib_snap_save(prefix_re(p));
 			p->lastchange = getmonotime();
 			p->validation_state = state->vstate;
-			if (filtered)
-				p->flags |= PREFIX_FLAG_FILTERED;
-			else
-				p->flags &= ~PREFIX_FLAG_FILTERED;
+			if ((filtered != 0) != prefix_filtered(p)) {
+				/* eligibility changed, resort the prefix */
+				if (filtered)
+					p->flags |= PREFIX_FLAG_FILTERED;
+				else
+					p->flags &= ~PREFIX_FLAG_FILTERED;
+				prefix_evaluate(prefix_re(p), p, p);
+			}
 			return (0);
 		}
 	}
@@ -1023,6 +1337,18 @@ prefix_update(struct rib *rib, struct rde_peer *peer, uint32_t path_id,
 		    state->vstate, filtered));
 }
 
+/*
+ * Check if the prefix p carries the same path as state.
+ */
+int
+prefix_same_state(struct prefix *p, struct filterstate *state)
+{
+	return (prefix_nexthop(p) == state->nexthop &&
+	    prefix_nhflags(p) == state->nhflags &&
+	    communities_equal(&state->communities, prefix_communities(p)) &&
+	    path_compare(&state->aspath, prefix_aspath(p)) == 0);
+}
+
 /*
  * Adds or updates a prefix.
  */
@@ -1234,6 +1560,18 @@ prefix_add_eor(struct rde_peer *peer, uint8_t aid)
 	/* EOR marker is not inserted into the adj_rib_out index */
 }
 
+/*
+ * A newer change of a prefix replaced the one still pending for peer.
+ * Holding changes back for this is what the MRAI does, count it only
+ * if one is set.
+ */
+static inline void
+prefix_adjout_coalesced(struct rde_peer *peer)
+{
+	if (peer_mrai(peer) != 0)
+		peer->stats.prefix_coalesced++;
+}
+
 /*
  * Put a prefix from the Adj-RIB-Out onto the update queue.
  */
@@ -1283,6 +1621,7 @@ prefix_adjout_update(struct prefix *p, struct rde_peer *peer,
 		if (p->flags & PREFIX_FLAG_UPDATE) {
 			RB_REMOVE(prefix_tree, &peer->updates[pte->aid], p);
 			peer->stats.pending_update--;
+			prefix_adjout_coalesced(peer);
 		}
 
 		/* unlink prefix so it can be relinked below */
@@ -1290,8 +1629,10 @@ prefix_adjout_update(struct prefix *p, struct rde_peer *peer,
 		peer->stats.prefix_out_cnt--;
 	}
 	if (p->flags & PREFIX_FLAG_WITHDRAW) {
+		/* the pending withdraw collapses into this update */
 		RB_REMOVE(prefix_tree, &peer->withdraws[pte->aid], p);
 		peer->stats.pending_withdraw--;
+		prefix_adjout_coalesced(peer);
 	}
 
 	/* nothing needs to be done for PREFIX_FLAG_DEAD and STALE */
@@ -1353,6 +1694,7 @@ prefix_adjout_withdraw(struct prefix *p)
 	if (p->flags & PREFIX_FLAG_UPDATE) {
 		RB_REMOVE(prefix_tree, &peer->updates[p->pt->aid], p);
 		peer->stats.pending_update--;
+		prefix_adjout_coalesced(peer);
 	}
 	/* unlink prefix if it was linked (not a withdraw or dead) */
 	if ((p->flags & (PREFIX_FLAG_WITHDRAW | PREFIX_FLAG_DEAD)) == 0) {
@@ -1377,6 +1719,24 @@ prefix_adjout_withdraw(struct prefix *p)
 	}
 }
 
+/*
+ * Withdraw a prefix as part of a flush of the whole Adj-RIB-Out. A pending
+ * update is dropped without being counted as coalesced, it was not
+ * replaced by a newer change of the prefix.
+ */
+void
+prefix_adjout_flush(struct prefix *p)
+{
+	struct rde_peer *peer = prefix_peer(p);
+
+	if (p->flags & PREFIX_FLAG_UPDATE) {
+		RB_REMOVE(prefix_tree, &peer->updates[p->pt->aid], p);
+		peer->stats.pending_update--;
+		p->flags &= ~PREFIX_FLAG_UPDATE;
+	}
+	prefix_adjout_withdraw(p);
+}
+
 void
 prefix_adjout_destroy(struct prefix *p)
 {
@@ -1631,6 +1991,11 @@ prefix_link(struct prefix *p, struct rib_entry *re, struct pt_entry *pt,
 	p->nexthop = nexthop_ref(nexthop);
 	nexthop_link(p);
 	p->lastchange = getmonotime();
+
+	/* index Adj-RIB-In prefixes per peer for fast flushing */
+	if (re && re->rib_id == RIB_ADJ_IN)
+		LIST_INSERT_HEAD(&peer->adj_rib_in[pt->aid], p,
+		    entry.list.adjin);
 }
 
 /*
@@ -1641,6 +2006,9 @@ prefix_unlink(struct prefix *p)
 {
 	struct rib_entry	*re = prefix_re(p);
 
+	if (re && re->rib_id == RIB_ADJ_IN)
+		LIST_REMOVE(p, entry.list.adjin);
+
 	/* destroy all references to other objects */
 	/* remove nexthop ref ... */
 	nexthop_unlink(p);
@@ -1757,6 +2125,22 @@ nexthop_runner(void)
 		    log_addr(&nh->exit_nexthop));
 }
 
+static int
+nexthop_addr_equal(const struct bgpd_addr *a, const struct bgpd_addr *b)
+{
+	if (a->aid != b->aid)
+		return 0;
+	switch (a->aid) {
+	case AID_INET:
+		return a->v4.s_addr == b->v4.s_addr;
+	case AID_INET6:
+		return memcmp(&a->v6, &b->v6, sizeof(a->v6)) == 0 &&
+		    a->scope_id == b->scope_id;
+	default:
+		return 0;
+	}
+}
+
 void
 nexthop_update(struct kroute_nexthop *msg)
 {
@@ -1793,6 +2177,20 @@ nexthop_update(struct kroute_nexthop *msg)
 	if (msg->connected)
 		nh->flags |= NEXTHOP_CONNECTED;
 
+	/*
+	 * If the state did not change the decision process is not affected.
+	 * Prefixes only need to be revisited to push a changed gateway into
+	 * the FIB, skip the walk if the resolving route is the same.
+	 */
+	if (nh->oldstate == nh->state && (nh->state != NEXTHOP_REACH ||
+	    (nexthop_addr_equal(&nh->true_nexthop, &msg->gateway) &&
+	    nexthop_addr_equal(&nh->nexthop_net, &msg->net) &&
+	    nh->nexthop_netlen == msg->netlen))) {
+		log_debug("nexthop %s update unchanged",
+		    log_addr(&nh->exit_nexthop));
+		return;
+	}
+
 	nh->true_nexthop = msg->gateway;
 	nh->nexthop_net = msg->net;
 	nh->nexthop_netlen = msg->netlen;
@@ -34,6 +34,23 @@ struct set_table {
 	size_t			 max;
 };
 
+struct set_idx {
+	RB_ENTRY(set_idx)	 entry;
+	const char		*name;
+	void			*set;
+	int			 type;
+};
+
+static inline int
+set_idx_cmp(struct set_idx *a, struct set_idx *b)
+{
+	if (a->type != b->type)
+		return (a->type < b->type ? -1 : 1);
+	return strcmp(a->name, b->name);
+}
+
+RB_GENERATE_STATIC(set_index, set_idx, entry, set_idx_cmp);
+
 struct as_set *
 as_sets_new(struct as_set_head *as_sets, const char *name, size_t nmemb,
     size_t size)
@@ -87,13 +104,22 @@ as_sets_free(struct as_set_head *as_sets)
 }
 
 void
-as_sets_mark_dirty(struct as_set_head *old, struct as_set_head *new)
+as_sets_mark_dirty(struct set_index *old, struct as_set_head *new)
 {
 	struct as_set	*n, *o;
+	struct set_table *st;
 
 	SIMPLEQ_FOREACH(n, new, entry) {
-		if (old == NULL || (o = as_sets_lookup(old, n->name)) == NULL ||
-		    !set_equal(n->set, o->set)) {
+		o = old == NULL ? NULL : set_index_get(old, ASNUM_SET, n->name);
+		if (n->kept) {
+			/* the parent did not resend it, take the old table */
+			if (o == NULL)
+				fatalx("kept as-set %s is unknown", n->name);
+			st = n->set;
+			n->set = o->set;
+			o->set = st;
+			n->lastchange = o->lastchange;
+		} else if (o == NULL || !set_equal(n->set, o->set)) {
 			n->dirty = 1;
 			n->lastchange = getmonotime();
 		} else
@@ -236,3 +262,46 @@ set_nmemb(const struct set_table *set)
 {
 	return set->nmemb;
 }
+
+/*
+ * Name index over prefix-, origin- and as-sets. Large configs have
+ * thousands of sets and filter rules, so looking up every rule's set
+ * with a list walk becomes quadratic. The index only references the
+ * set and its name, it does not own them.
+ */
+void
+set_index_add(struct set_index *idx, int type, const char *name, void *set)
+{
+	struct set_idx *si;
+
+	if ((si = calloc(1, sizeof(*si))) == NULL)
+		fatal(NULL);
+	si->type = type;
+	si->name = name;
+	si->set = set;
+	if (RB_INSERT(set_index, idx, si) != NULL)
+		fatalx("duplicate set %s", name);
+}
+
+void *
+set_index_get(struct set_index *idx, int type, const char *name)
+{
+	struct set_idx needle, *si;
+
+	needle.type = type;
+	needle.name = name;
+	if ((si = RB_FIND(set_index, idx, &needle)) == NULL)
+		return NULL;
+	return si->set;
+}
+
+void
+set_index_free(struct set_index *idx)
+{
+	struct set_idx *si, *nsi;
+
+	RB_FOREACH_SAFE(si, set_index, idx, nsi) {
+		RB_REMOVE(set_index, idx, si);
+		free(si);
+	}
+}
@@ -173,10 +173,10 @@ up_process_prefix(struct rde_peer *peer, struct prefix *new, struct prefix *p)
 	if (!up_test_update(peer, new))
 		excluded = 1;
 
-	rde_filterstate_prep(&state, new);
 	pt_getaddr(new->pt, &addr);
-	if (rde_filter(peer->out_rules, peer, prefix_peer(new), &addr,
-	    new->pt->prefixlen, &state) == ACTION_DENY) {
+	if (rde_filter_cached(peer->out_cache, peer->out_rules, peer,
+	    prefix_peer(new), new, &addr, new->pt->prefixlen,
+	    &state) == ACTION_DENY) {
 		rde_filterstate_clean(&state);
 		return UP_FILTERED;
 	}
@@ -245,19 +245,155 @@ done:
 		prefix_adjout_withdraw(p);
 }
 
+/*
+ * Per peer cache of the paths denied by the output filters or by
+ * up_test_update() for peers using add-path send with a limited eval mode.
+ * Together with the Adj-RIB-Out, which holds the paths that passed,
+ * this allows up_generate_addpath() to only run the filters for paths
+ * that changed. The verdicts stay valid until the path changes or the
+ * output filters of the peer are reloaded.
+ */
+struct up_denied {
+	RB_ENTRY(up_denied)	 entry;
+	struct pt_entry		*pt;
+	uint32_t		*ids;		/* denied path_id_tx */
+	uint16_t		 cnt;
+	uint16_t		 max;
+};
+
+static inline int
+up_denied_cmp(struct up_denied *a, struct up_denied *b)
+{
+	if ((uintptr_t)a->pt > (uintptr_t)b->pt)
+		return 1;
+	if ((uintptr_t)a->pt < (uintptr_t)b->pt)
+		return -1;
+	return 0;
+}
+
+RB_GENERATE_STATIC(up_denied_tree, up_denied, entry, up_denied_cmp);
+
+static struct up_denied *
+up_denied_get(struct rde_peer *peer, struct pt_entry *pt)
+{
+	struct up_denied	 needle;
+
+	needle.pt = pt;
+	return RB_FIND(up_denied_tree, &peer->addpath_denied, &needle);
+}
+
+static void
+up_denied_free(struct rde_peer *peer, struct up_denied *d)
+{
+	RB_REMOVE(up_denied_tree, &peer->addpath_denied, d);
+	pt_unref(d->pt);
+	free(d->ids);
+	free(d);
+}
+
+static int
+up_denied_match(struct up_denied *d, uint32_t path_id_tx)
+{
+	uint16_t	 i;
+
+	if (d == NULL)
+		return 0;
+	for (i = 0; i < d->cnt; i++)
+		if (d->ids[i] == path_id_tx)
+			return 1;
+	return 0;
+}
+
+static void
+up_denied_add(struct rde_peer *peer, struct up_denied **dp,
+    struct pt_entry *pt, uint32_t path_id_tx)
+{
+	struct up_denied	*d = *dp;
+	uint32_t		*ids;
+
+	if (d == NULL) {
+		if ((d = calloc(1, sizeof(*d))) == NULL)
+			fatal(NULL);
+		d->pt = pt_ref(pt);
+		if (RB_INSERT(up_denied_tree, &peer->addpath_denied, d) != NULL)
+			fatalx("%s: RB tree invariant violated", __func__);
+		*dp = d;
+	}
+	if (d->cnt == d->max) {
+		if (d->max > UINT16_MAX - 4)
+			return;		/* just don't cache the verdict */
+		if ((ids = recallocarray(d->ids, d->max, d->max + 4,
+		    sizeof(*ids))) == NULL)
+			fatal(NULL);
+		d->ids = ids;
+		d->max += 4;
+	}
+	d->ids[d->cnt++] = path_id_tx;
+}
+
+static void
+up_denied_del(struct rde_peer *peer, struct up_denied **dp,
+    uint32_t path_id_tx)
+{
+	struct up_denied	*d = *dp;
+	uint16_t		 i;
+
+	if (d == NULL)
+		return;
+	for (i = 0; i < d->cnt; i++) {
+		if (d->ids[i] == path_id_tx) {
+			d->ids[i] = d->ids[--d->cnt];
+			break;
+		}
+	}
+	if (d->cnt == 0) {
+		up_denied_free(peer, d);
+		*dp = NULL;
+	}
+}
+
+/* drop all cached filter verdicts of the peer */
+void
+up_denied_flush(struct rde_peer *peer)
+{
+	struct up_denied	*d, *nd;
+
+	RB_FOREACH_SAFE(d, up_denied_tree, &peer->addpath_denied, nd)
+		up_denied_free(peer, d);
+}
+
 /*
  * Generate updates for the add-path send case. Depending on the
  * peer eval settings prefixes are selected and distributed.
- * This highly depends on the Adj-RIB-Out to handle prefixes with no
- * changes gracefully. It may be possible to improve the API so that
- * less churn is needed.
+ * Only newpath and oldpath changed, all other paths are unchanged and
+ * so is their filter verdict: paths with a valid Adj-RIB-Out entry
+ * passed the filters, paths in the denied cache did not. Filters are
+ * therefore only run for the changed paths and for paths not evaluated
+ * before. If both newpath and oldpath are NULL all paths are evaluated
+ * again.
  */
 void
-up_generate_addpath(struct rde_peer *peer, struct rib_entry *re)
+up_generate_addpath(struct rde_peer *peer, struct rib_entry *re,
+    struct prefix *newpath, struct prefix *oldpath)
 {
 	struct prefix		*head, *new, *p;
+	struct up_denied	*denied;
 	int			maxpaths = 0, extrapaths = 0, extra;
-	int			checkmode = 1;
+	int			checkmode = 1, reload = 0;
+	enum up_state		state;
+
+	denied = up_denied_get(peer, re->prefix);
+	if (newpath == NULL && oldpath == NULL) {
+		/* filters changed, nothing can be assumed about old verdicts */
+		reload = 1;
+		if (denied != NULL)
+			up_denied_free(peer, denied);
+		denied = NULL;
+	}
+	if (newpath != NULL)
+		up_denied_del(peer, &denied, newpath->path_id_tx);
+	if (oldpath != NULL)
+		up_denied_del(peer, &denied, oldpath->path_id_tx);
 
 	head = prefix_adjout_first(peer, re->prefix);
 
@@ -309,7 +445,26 @@ up_generate_addpath(struct rde_peer *peer, struct rib_entry *re)
 			}
 		}
 
-		switch (up_process_prefix(peer, new, (void *)-1)) {
+		if (up_denied_match(denied, new->path_id_tx)) {
+			state = UP_FILTERED;
+		} else {
+			p = prefix_adjout_get(peer, new->path_id_tx, new->pt);
+			if (!reload && new != newpath && new != oldpath &&
+			    p != NULL && (p->flags &
+			    (PREFIX_FLAG_WITHDRAW | PREFIX_FLAG_DEAD)) == 0) {
+				/* unchanged path already in the Adj-RIB-Out */
+				p->flags &= ~PREFIX_FLAG_STALE;
+				state = UP_OK;
+			} else {
+				state = up_process_prefix(peer, new, p);
+				if (state == UP_FILTERED ||
+				    state == UP_EXCLUDED)
+					up_denied_add(peer, &denied, new->pt,
+					    new->path_id_tx);
+			}
+		}
+
+		switch (state) {
 		case UP_OK:
 			maxpaths++;
 			extrapaths += extra;
@@ -337,13 +492,14 @@ up_generate_addpath(struct rde_peer *peer, struct rib_entry *re)
 
 /*
  * Generate updates for the add-path send all case. Since all prefixes
- * are distributed just remove old and add new.
+ * are distributed just remove old and add new. Only the changed path
+ * is passed through the filters.
  */
 void
 up_generate_addpath_all(struct rde_peer *peer, struct rib_entry *re,
     struct prefix *new, struct prefix *old)
 {
-	struct prefix		*p, *head = NULL;
+	struct prefix		*p, *head = NULL, *replaced = NULL;
 	int			all = 0;
 
 	/*
@@ -368,16 +524,28 @@ up_generate_addpath_all(struct rde_peer *peer, struct rib_entry *re,
 	if (old != NULL) {
 		/* withdraw stale paths */
 		p = prefix_adjout_get(peer, old->path_id_tx, old->pt);
-		if (p != NULL)
-			prefix_adjout_withdraw(p);
+		if (p != NULL) {
+			/*
+			 * If new replaces old let prefix_adjout_update()
+			 * handle the change, a withdraw is only needed if
+			 * the new path is filtered.
+			 */
+			if (new != NULL && new->path_id_tx == old->path_id_tx)
+				replaced = p;
+			else
+				prefix_adjout_withdraw(p);
+		}
 	}
 
 	/* add new path (or multiple if all is set) */
 	while (new != NULL) {
 		switch (up_process_prefix(peer, new, (void *)-1)) {
 		case UP_OK:
+			break;
 		case UP_FILTERED:
 		case UP_EXCLUDED:
+			if (replaced != NULL)
+				prefix_adjout_withdraw(replaced);
 			break;
 		case UP_ERR_LIMIT:
 			/* just give up */
@@ -859,8 +1027,10 @@ up_dump_prefix(struct ibuf *buf, struct prefix_tree *prefix_head,
     struct rde_peer *peer, int withdraw)
 {
 	struct prefix	*p, *np;
+	monotime_t	 now;
 	int		 done = 0, has_ap = -1, rv = -1;
 
+	now = getmonotime();
 	RB_FOREACH_SAFE(p, prefix_tree, prefix_head, np) {
 		if (has_ap == -1)
 			has_ap = peer_has_add_path(peer, p->pt->aid,
@@ -879,6 +1049,10 @@ up_dump_prefix(struct ibuf *buf, struct prefix_tree *prefix_head,
 			done = 1;
 
 		rv = 0;
+		/* lastchange is the time the prefix got queued */
+		hist_add(&rdemetrics.update_adjout,
+		    monotime_sub(now, p->lastchange).monotime);
+		rde_lat_dump(peer, p, now);
 		up_prefix_free(prefix_head, p, peer, withdraw);
 		if (done)
 			break;
@@ -1020,14 +1194,14 @@ up_generate_mp_reach(struct ibuf *buf, struct rde_peer *peer,
 
 /*
  * Write UPDATE message for withdrawn routes. The size of buf limits
- * how may routes can be added. Return 0 on success -1 on error which
- * includes generating an empty withdraw message.
+ * how may routes can be added. Returns the size of the message queued,
+ * 0 on error which includes generating an empty withdraw message.
  */
-void
+size_t
 up_dump_withdraws(struct imsgbuf *imsg, struct rde_peer *peer, uint8_t aid)
 {
 	struct ibuf *buf;
-	size_t off, pkgsize = MAX_PKTSIZE;
+	size_t off, size, pkgsize = MAX_PKTSIZE;
 	uint16_t afi, len;
 	uint8_t safi;
 
@@ -1088,13 +1262,15 @@ up_dump_withdraws(struct imsgbuf *imsg, struct rde_peer *peer, uint8_t aid)
 		}
 	}
 
+	size = ibuf_size(buf);
 	imsg_close(imsg, buf);
-	return;
+	return size;
 
  fail:
 	/* something went horribly wrong */
 	log_peer_warn(&peer->conf, "generating withdraw failed, peer desynced");
 	ibuf_free(buf);
+	return 0;
 }
 
 /*
@@ -1167,21 +1343,22 @@ up_dump_withdraw_one(struct rde_peer *peer, struct prefix *p, struct ibuf *buf)
  * Write UPDATE message for changed and added routes. The size of buf limits
  * how may routes can be added. The function first dumps the path attributes
  * and then tries to add as many prefixes using these attributes.
- * Return 0 on success -1 on error which includes producing an empty message.
+ * Returns the size of the message queued, 0 on error which includes
+ * producing an empty message.
  */
-void
+size_t
 up_dump_update(struct imsgbuf *imsg, struct rde_peer *peer, uint8_t aid)
 {
 	struct ibuf *buf;
 	struct bgpd_addr addr;
 	struct prefix *p;
-	size_t off, pkgsize = MAX_PKTSIZE;
+	size_t off, size, pkgsize = MAX_PKTSIZE;
 	uint16_t len;
 	int force_ip4mp = 0;
 
 	p = RB_MIN(prefix_tree, &peer->updates[aid]);
 	if (p == NULL)
-		return;
+		return 0;
 
 	if (aid == AID_INET && peer_has_ext_nexthop(peer, AID_INET)) {
 		struct nexthop *nh = prefix_nexthop(p);
@@ -1236,8 +1413,9 @@ up_dump_update(struct imsgbuf *imsg, struct rde_peer *peer, uint8_t aid)
 			goto drop;
 	}
 
+	size = ibuf_size(buf);
 	imsg_close(imsg, buf);
-	return;
+	return size;
 
  drop:
 	/* Not enough space. Drop current prefix, it will never fit. */
@@ -1249,11 +1427,13 @@ up_dump_update(struct imsgbuf *imsg, struct rde_peer *peer, uint8_t aid)
 	up_prefix_free(&peer->updates[aid], p, peer, 0);
 	if (up_dump_withdraw_one(peer, p, buf) == -1)
 		goto fail;
+	size = ibuf_size(buf);
 	imsg_close(imsg, buf);
-	return;
+	return size;
 
  fail:
 	/* something went horribly wrong */
 	log_peer_warn(&peer->conf, "generating update failed, peer desynced");
 	ibuf_free(buf);
+	return 0;
 }
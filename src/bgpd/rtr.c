@@ -305,6 +305,7 @@ rtr_main(int debug, int verbose)
 	close(ibuf_main->fd);
 	free(ibuf_main);
 
+	trace_flush();
 	log_info("rtr engine exiting");
 	exit(0);
 }
@@ -326,6 +327,7 @@ rtr_dispatch_imsg_parent(struct imsgbuf *imsgbuf)
 			fatal("%s: imsg_get error", __func__);
 		if (n == 0)
 			break;
+		trace_imsg(PROC_MAIN, &imsg);
 
 		rtrid = imsg_get_id(&imsg);
 		switch (imsg_get_type(&imsg)) {
@@ -471,6 +473,7 @@ rtr_dispatch_imsg_rde(struct imsgbuf *imsgbuf)
 			fatal("%s: imsg_get error", __func__);
 		if (n == 0)
 			break;
+		trace_imsg(PROC_RDE, &imsg);
 
 		/* NOTHING */
 
@@ -52,7 +52,8 @@
 #define PFD_PIPE_ROUTE_CTL	2
 #define PFD_SOCK_CTL		3
 #define PFD_SOCK_RCTL		4
-#define PFD_LISTENERS_START	5
+#define PFD_SOCK_METRICS	5
+#define PFD_LISTENERS_START	6
 
 #define MAX_TIMEOUT		240
 #define PAUSEACCEPT_TIMEOUT	1
@@ -70,6 +71,7 @@ void	merge_peers(struct bgpd_config *, struct bgpd_config *);
 void	session_template_clone(struct peer *, struct sockaddr *,
 	    uint32_t, uint32_t);
 int	session_match_mask(struct peer *, struct bgpd_addr *);
+static void	session_lat_written(struct peer *, u_int);
 
 static struct bgpd_config	*conf, *nconf;
 static struct imsgbuf		*ibuf_rde;
@@ -79,11 +81,12 @@ static struct imsgbuf		*ibuf_main;
 struct bgpd_sysdep	 sysdep;
 volatile sig_atomic_t	 session_quit;
 int			 pending_reconf;
-int			 csock = -1, rcsock = -1;
+int			 csock = -1, rcsock = -1, msock = -1;
 u_int			 peer_cnt;
 
 struct mrt_head		 mrthead;
 monotime_t		 pauseaccept;
+struct ctl_latency	 se_latency;
 
 static inline int
 peer_compare(const struct peer *a, const struct peer *b)
@@ -159,13 +162,14 @@ setup_listeners(u_int *la_cnt)
 void
 session_main(int debug, int verbose)
 {
-	unsigned int		 i, j, idx_peers, idx_listeners, idx_mrts;
-	u_int			 pfd_elms = 0, peer_l_elms = 0, mrt_l_elms = 0;
-	u_int			 listener_cnt, ctl_cnt, mrt_cnt;
+	unsigned int		 i, j, idx_peers, idx_listeners;
+	unsigned int		 idx_ctls;
+	u_int			 pfd_elms = 0, peer_l_elms = 0;
+	u_int			 listener_cnt, ctl_cnt, metrics_cnt;
 	u_int			 new_cnt;
 	struct passwd		*pw;
 	struct peer		*p, **peer_l = NULL, *next;
-	struct mrt		*m, *xm, **mrt_l = NULL;
+	struct mrt		*m, *xm;
 	struct pollfd		*pfd = NULL;
 	struct listen_addr	*la;
 	void			*newp;
@@ -213,6 +217,7 @@ session_main(int debug, int verbose)
 	listener_cnt = 0;
 	peer_cnt = 0;
 	ctl_cnt = 0;
+	metrics_cnt = 0;
 
 	conf = new_config();
 	log_info("session engine ready");
@@ -259,7 +264,7 @@ session_main(int debug, int verbose)
 			peer_l_elms = peer_cnt;
 		}
 
-		mrt_cnt = 0;
+		/* mrt dumps are written by their own thread */
 		LIST_FOREACH_SAFE(m, &mrthead, entry, xm) {
 			if (m->state == MRT_STATE_REMOVE) {
 				mrt_clean(m);
@@ -267,24 +272,11 @@ session_main(int debug, int verbose)
 				free(m);
 				continue;
 			}
-			if (msgbuf_queuelen(m->wbuf) > 0)
-				mrt_cnt++;
-		}
-
-		if (mrt_cnt > mrt_l_elms) {
-			if ((newp = reallocarray(mrt_l, mrt_cnt,
-			    sizeof(struct mrt *))) == NULL) {
-				/* panic for now */
-				log_warn("could not resize mrt_l from %u -> %u"
-				    " entries", mrt_l_elms, mrt_cnt);
-				fatalx("exiting");
-			}
-			mrt_l = newp;
-			mrt_l_elms = mrt_cnt;
+			mrt_write(m);
 		}
 
 		new_cnt = PFD_LISTENERS_START + listener_cnt + peer_cnt +
-		    ctl_cnt + mrt_cnt;
+		    ctl_cnt + metrics_cnt;
 		if (new_cnt > pfd_elms) {
 			if ((newp = reallocarray(pfd, new_cnt,
 			    sizeof(struct pollfd))) == NULL) {
@@ -308,9 +300,12 @@ session_main(int debug, int verbose)
 			pfd[PFD_SOCK_CTL].events = POLLIN;
 			pfd[PFD_SOCK_RCTL].fd = rcsock;
 			pfd[PFD_SOCK_RCTL].events = POLLIN;
+			pfd[PFD_SOCK_METRICS].fd = msock;
+			pfd[PFD_SOCK_METRICS].events = POLLIN;
 		} else {
 			pfd[PFD_SOCK_CTL].fd = -1;
 			pfd[PFD_SOCK_RCTL].fd = -1;
+			pfd[PFD_SOCK_METRICS].fd = -1;
 		}
 
 		i = PFD_LISTENERS_START;
@@ -422,17 +417,9 @@ session_main(int debug, int verbose)
 
 		idx_peers = i;
 
-		LIST_FOREACH(m, &mrthead, entry)
-			if (msgbuf_queuelen(m->wbuf) > 0) {
-				pfd[i].fd = m->fd;
-				pfd[i].events = POLLOUT;
-				mrt_l[i - idx_peers] = m;
-				i++;
-			}
-
-		idx_mrts = i;
-
 		i += control_fill_pfds(pfd + i, pfd_elms -i);
+		idx_ctls = i;
+		i += metrics_fill_pfds(pfd + i, pfd_elms - i);
 
 		if (i > pfd_elms)
 			fatalx("poll pfd overflow");
@@ -492,6 +479,9 @@ session_main(int debug, int verbose)
 		if (pfd[PFD_SOCK_RCTL].revents & POLLIN)
 			ctl_cnt += control_accept(rcsock, 1);
 
+		if (pfd[PFD_SOCK_METRICS].revents & POLLIN)
+			metrics_cnt += metrics_accept(msock);
+
 		for (j = PFD_LISTENERS_START; j < idx_listeners; j++)
 			if (pfd[j].revents & POLLIN)
 				session_accept(pfd[j].fd);
@@ -503,12 +493,12 @@ session_main(int debug, int verbose)
 		RB_FOREACH(p, peer_head, &conf->peers)
 			session_process_msg(p);
 
-		for (; j < idx_mrts; j++)
-			if (pfd[j].revents & POLLOUT)
-				mrt_write(mrt_l[j - idx_peers]);
+		for (; j < idx_ctls; j++)
+			ctl_cnt -= control_dispatch_msg(&pfd[j], &conf->peers);
 
 		for (; j < i; j++)
-			ctl_cnt -= control_dispatch_msg(&pfd[j], &conf->peers);
+			metrics_cnt -= metrics_dispatch_msg(&pfd[j],
+			    &conf->peers);
 	}
 
 	RB_FOREACH_SAFE(p, peer_head, &conf->peers, next) {
@@ -524,10 +514,10 @@ session_main(int debug, int verbose)
 		LIST_REMOVE(m, entry);
 		free(m);
 	}
+	mrt_writer_shutdown();
 
 	free_config(conf);
 	free(peer_l);
-	free(mrt_l);
 	free(pfd);
 
 	/* close pipes */
@@ -549,6 +539,9 @@ session_main(int debug, int verbose)
 
 	control_shutdown(csock);
 	control_shutdown(rcsock);
+	control_shutdown(msock);
+	metrics_shutdown();
+	trace_flush();
 	log_info("session engine exiting");
 	exit(0);
 }
@@ -602,6 +595,7 @@ int
 session_dispatch_msg(struct pollfd *pfd, struct peer *p)
 {
 	socklen_t	len;
+	u_int		queued;
 	int		error;
 
 	if (p->state == STATE_CONNECT) {
@@ -646,6 +640,7 @@ session_dispatch_msg(struct pollfd *pfd, struct peer *p)
 	}
 
 	if (pfd->revents & POLLOUT && msgbuf_queuelen(p->wbuf) > 0) {
+		queued = msgbuf_queuelen(p->wbuf);
 		if (ibuf_write(p->fd, p->wbuf) == -1) {
 			if (errno == EPIPE)
 				log_peer_warnx(&p->conf, "Connection closed");
@@ -655,6 +650,9 @@ session_dispatch_msg(struct pollfd *pfd, struct peer *p)
 			return (1);
 		}
 		p->stats.last_write = getmonotime();
+		if (p->lat_wait != 0)
+			session_lat_written(p,
+			    queued - msgbuf_queuelen(p->wbuf));
 		start_timer_sendholdtime(p);
 		if (!(pfd->revents & POLLIN))
 			return (1);
@@ -1028,11 +1026,74 @@ get_alternate_addr(struct bgpd_addr *local, struct bgpd_addr *remote,
 	freeifaddrs(ifap);
 }
 
+/*
+ * UPDATEs are passed verbatim to the rde. Consecutive UPDATEs of a peer
+ * are packed into one IMSG_UPDATE_BATCH, each prefixed by its length, so
+ * a full read costs a single imsg instead of one per message. The batch
+ * starts with the time the first UPDATE was received for the latency
+ * metrics of the rde.
+ * The batch is closed by session_flush_updates() before any other imsg
+ * is sent to the rde and at the end of session_process_msg().
+ */
+static struct ibuf	*update_batch;
+static uint32_t		 update_batch_peer;
+
 void
 session_handle_update(struct peer *peer, struct ibuf *msg)
 {
-	/* pass the message verbatim to the rde. */
-	imsg_rde(IMSG_UPDATE, peer->conf.id, ibuf_data(msg), ibuf_size(msg));
+	if (ibuf_rde == NULL)
+		return;
+
+	if (update_batch != NULL && (update_batch_peer != peer->conf.id ||
+	    ibuf_size(update_batch) + sizeof(uint16_t) + ibuf_size(msg) >
+	    MAX_BGPD_IMSGSIZE))
+		session_flush_updates();
+
+	if (update_batch == NULL) {
+		if ((update_batch = imsg_create(ibuf_rde, IMSG_UPDATE_BATCH,
+		    peer->conf.id, 0, 4 * MAX_PKTSIZE)) == NULL)
+			fatal("imsg_create");
+		if (ibuf_add_n64(update_batch, getmonotime().monotime) == -1)
+			fatal("%s", __func__);
+		update_batch_peer = peer->conf.id;
+	}
+	if (ibuf_add_n16(update_batch, ibuf_size(msg)) == -1 ||
+	    ibuf_add_ibuf(update_batch, msg) == -1)
+		fatal("%s", __func__);
+}
+
+void
+session_flush_updates(void)
+{
+	if (update_batch == NULL)
+		return;
+	if (ibuf_rde != NULL)
+		imsg_close(ibuf_rde, update_batch);
+	else
+		ibuf_free(update_batch);
+	update_batch = NULL;
+}
+
+/*
+ * A sampled UPDATE was queued when lat_wait messages were in the wbuf.
+ * Count down the messages written and record its latency once it left.
+ */
+static void
+session_lat_written(struct peer *p, u_int written)
+{
+	monotime_t	now;
+
+	if (written < p->lat_wait) {
+		p->lat_wait -= written;
+		return;
+	}
+	p->lat_wait = 0;
+
+	now = getmonotime();
+	hist_add(&se_latency.stage[LAT_WRITE],
+	    monotime_sub(now, p->lat_stamp.dumped).monotime);
+	hist_add(&se_latency.stage[LAT_TOTAL],
+	    monotime_sub(now, p->lat_stamp.received).monotime);
 }
 
 void
@@ -1177,6 +1238,7 @@ la_cmp(struct listen_addr *a, struct listen_addr *b)
 void
 session_dispatch_imsg(struct imsgbuf *imsgbuf, int idx, u_int *listener_cnt)
 {
+	static int		 shmfd = -1;
 	struct imsg		 imsg;
 	struct ibuf		 ibuf;
 	struct mrt		 xmrt;
@@ -1198,6 +1260,7 @@ session_dispatch_imsg(struct imsgbuf *imsgbuf, int idx, u_int *listener_cnt)
 
 		if (n == 0)
 			break;
+		trace_imsg(idx == PFD_PIPE_MAIN ? PROC_MAIN : PROC_RDE, &imsg);
 
 		peerid = imsg_get_id(&imsg);
 		switch (imsg_get_type(&imsg)) {
@@ -1222,6 +1285,10 @@ session_dispatch_imsg(struct imsgbuf *imsgbuf, int idx, u_int *listener_cnt)
 					imsgbuf_clear(ibuf_rde);
 					free(ibuf_rde);
 				}
+				if (shmfd != -1) {
+					imsgbuf_attach_shm(i, shmfd, 0);
+					shmfd = -1;
+				}
 				ibuf_rde = i;
 			} else {
 				if (ibuf_rde_ctl) {
@@ -1230,9 +1297,20 @@ session_dispatch_imsg(struct imsgbuf *imsgbuf, int idx, u_int *listener_cnt)
 					imsgbuf_clear(ibuf_rde_ctl);
 					free(ibuf_rde_ctl);
 				}
+				/* control connections are handed over on it */
+				imsgbuf_allow_fdpass(i);
 				ibuf_rde_ctl = i;
 			}
 			break;
+		case IMSG_SOCKET_SHM:
+			if (idx != PFD_PIPE_MAIN)
+				fatalx("shared memory fd not from parent");
+			if (shmfd != -1)
+				close(shmfd);
+			if ((shmfd = imsg_get_fd(&imsg)) == -1)
+				log_warnx("expected to receive shared memory "
+				    "fd but didn't receive any");
+			break;
 		case IMSG_RECONF_CONF:
 			if (idx != PFD_PIPE_MAIN)
 				fatalx("reconf request not from parent");
@@ -1325,6 +1403,17 @@ session_dispatch_imsg(struct imsgbuf *imsgbuf, int idx, u_int *listener_cnt)
 				csock = fd;
 			}
 			break;
+		case IMSG_RECONF_METRICS:
+			if (idx != PFD_PIPE_MAIN)
+				fatalx("reconf request not from parent");
+			if ((fd = imsg_get_fd(&imsg)) == -1) {
+				log_warnx("expected to receive fd for metrics "
+				    "socket but didn't receive any");
+				break;
+			}
+			control_shutdown(msock);
+			msock = fd;
+			break;
 		case IMSG_RECONF_DRAIN:
 			switch (idx) {
 			case PFD_PIPE_ROUTE:
@@ -1423,12 +1512,19 @@ session_dispatch_imsg(struct imsgbuf *imsgbuf, int idx, u_int *listener_cnt)
 				if (mrt == NULL)
 					fatal("session_dispatch_imsg");
 				memcpy(mrt, &xmrt, sizeof(struct mrt));
-				if ((mrt->wbuf = msgbuf_new()) == NULL)
-					fatal("session_dispatch_imsg");
+				mrt->wbuf = NULL;
+				/* only dumps with a writer go on the list */
+				mrt->writer = mrt_writer_new(xmrt.fd);
+				if (mrt->writer == NULL) {
+					log_warn("mrt dump aborted, mrt_open");
+					close(xmrt.fd);
+					free(mrt);
+					break;
+				}
 				LIST_INSERT_HEAD(&mrthead, mrt, entry);
 			} else {
 				/* old dump reopened */
-				close(mrt->fd);
+				mrt_writer_reopen(mrt->writer, xmrt.fd);
 			}
 			mrt->fd = xmrt.fd;
 			break;
@@ -1471,7 +1567,9 @@ session_dispatch_imsg(struct imsgbuf *imsgbuf, int idx, u_int *listener_cnt)
 		case IMSG_CTL_SHOW_RIB_PREFIX:
 		case IMSG_CTL_SHOW_RIB_COMMUNITIES:
 		case IMSG_CTL_SHOW_RIB_ATTR:
+		case IMSG_CTL_SHOW_RIB_BULK:
 		case IMSG_CTL_SHOW_RIB_MEM:
+		case IMSG_CTL_SHOW_RIB_LATENCY:
 		case IMSG_CTL_SHOW_NETWORK:
 		case IMSG_CTL_SHOW_FLOWSPEC:
 		case IMSG_CTL_SHOW_SET:
@@ -1480,6 +1578,11 @@ session_dispatch_imsg(struct imsgbuf *imsgbuf, int idx, u_int *listener_cnt)
 			if (control_imsg_relay(&imsg, NULL) == -1)
 				log_warn("control_imsg_relay");
 			break;
+		case IMSG_CTL_SHOW_METRICS:
+			if (idx != PFD_PIPE_ROUTE_CTL)
+				fatalx("ctl metrics reply not from RDE");
+			metrics_rde_reply(&imsg, &conf->peers);
+			break;
 		case IMSG_CTL_END:
 		case IMSG_CTL_RESULT:
 			if (control_imsg_relay(&imsg, NULL) == -1)
@@ -1498,6 +1601,21 @@ session_dispatch_imsg(struct imsgbuf *imsgbuf, int idx, u_int *listener_cnt)
 			else
 				session_update(p, &ibuf);
 			break;
+		case IMSG_UPDATE_TRACE:
+			if (idx != PFD_PIPE_ROUTE)
+				fatalx("update request not from RDE");
+			if ((p = getpeerbyid(conf, peerid)) == NULL)
+				break;
+			/* one sampled UPDATE per peer at a time */
+			if (p->lat_wait != 0 || p->lat_armed)
+				break;
+			if (imsg_get_data(&imsg, &p->lat_stamp,
+			    sizeof(p->lat_stamp)) == -1) {
+				log_warnx("RDE sent invalid update trace");
+				break;
+			}
+			p->lat_armed = 1;
+			break;
 		case IMSG_UPDATE_ERR:
 			if (idx != PFD_PIPE_ROUTE)
 				fatalx("update request not from RDE");
@@ -1811,6 +1929,24 @@ imsg_ctl_rde(struct imsg *imsg)
 	return imsg_forward(ibuf_rde_ctl, imsg);
 }
 
+/*
+ * Hand the control connection fd together with the request imsg over to
+ * the RDE which then answers directly on the connection. Returns 0 if
+ * the RDE does not accept control connections.
+ */
+int
+imsg_ctl_rde_handover(struct imsg *imsg, int fd)
+{
+	struct ibuf	ibuf;
+
+	if (ibuf_rde_ctl == NULL || (conf->flags & BGPD_FLAG_CTL_DIRECT) == 0)
+		return (0);
+	if (imsg_get_ibuf(imsg, &ibuf) == -1)
+		return (-1);
+	return imsg_compose(ibuf_rde_ctl, imsg_get_type(imsg), 0,
+	    imsg_get_pid(imsg), fd, ibuf_data(&ibuf), ibuf_size(&ibuf));
+}
+
 int
 imsg_ctl_rde_msg(int type, uint32_t peerid, pid_t pid)
 {
@@ -1829,6 +1965,7 @@ imsg_rde(int type, uint32_t peerid, void *data, uint16_t datalen)
 {
 	if (ibuf_rde == NULL)
 		return;
+	session_flush_updates();
 	if (imsg_compose(ibuf_rde, type, peerid, 0, -1, data, datalen) == -1)
 		fatal("imsg_compose");
 }
@@ -144,6 +144,9 @@ struct peer_stats {
 	unsigned long long	 prefix_sent_update;
 	unsigned long long	 prefix_sent_withdraw;
 	unsigned long long	 prefix_sent_eor;
+	unsigned long long	 filter_out_hit;
+	unsigned long long	 filter_out_miss;
+	unsigned long long	 prefix_coalesced;
 	monotime_t		 last_updown;
 	monotime_t		 last_read;
 	monotime_t		 last_write;
@@ -152,6 +155,8 @@ struct peer_stats {
 	uint32_t		 prefix_out_cnt;
 	uint32_t		 pending_update;
 	uint32_t		 pending_withdraw;
+	uint32_t		 drain_last;
+	uint32_t		 drain_max;
 	uint8_t			 last_sent_errcode;
 	uint8_t			 last_sent_suberr;
 	uint8_t			 last_rcvd_errcode;
@@ -210,6 +215,9 @@ struct peer {
 	struct bgpd_addr	 remote;
 	struct timer_head	 timers;
 	struct msgbuf		*wbuf;
+	struct bgpd_hist	 queue_depth;	/* wbuf length per UPDATE */
+	struct lat_stamp	 lat_stamp;	/* sampled UPDATE from RDE */
+	u_int			 lat_wait;	/* wbuf messages up to it */
 	struct peer		*template;
 	int			 fd;
 	int			 lasterr;
@@ -232,9 +240,11 @@ struct peer {
 	uint8_t			 throttled;
 	uint8_t			 rpending;
 	uint8_t			 rdesession;
+	uint8_t			 lat_armed;
 };
 
 extern monotime_t		 pauseaccept;
+extern struct ctl_latency	 se_latency;
 
 struct ctl_timer {
 	enum Timer	type;
@@ -261,6 +271,13 @@ void	control_shutdown(int);
 int	control_dispatch_msg(struct pollfd *, struct peer_head *);
 unsigned int	control_accept(int, int);
 
+/* metrics.c */
+int	metrics_accept(int);
+size_t	metrics_fill_pfds(struct pollfd *, size_t);
+int	metrics_dispatch_msg(struct pollfd *, struct peer_head *);
+void	metrics_rde_reply(struct imsg *, struct peer_head *);
+void	metrics_shutdown(void);
+
 /* log.c */
 char	*log_fmt_peer(const struct peer_config *);
 void	 log_statechange(struct peer *, enum session_state,
@@ -277,6 +294,15 @@ void	 mrt_dump_state(struct mrt *, uint16_t, uint16_t,
 	    struct peer *);
 void	 mrt_done(struct mrt *);
 
+/* mrt_writer.c */
+struct mrt_writer	*mrt_writer_new(int);
+int	 mrt_writer_put(struct mrt_writer *, const struct ibuf *,
+	    const struct ibuf *);
+void	 mrt_writer_reopen(struct mrt_writer *, int);
+int	 mrt_writer_check(struct mrt_writer *);
+void	 mrt_writer_free(struct mrt_writer *);
+void	 mrt_writer_shutdown(void);
+
 /* pfkey.c */
 struct sadb_msg;
 int	pfkey_read(int, struct sadb_msg *);
@@ -336,6 +362,7 @@ struct peer	*getpeerbydesc(struct bgpd_config *, const char *);
 struct peer	*getpeerbyip(struct bgpd_config *, struct sockaddr *);
 struct peer	*getpeerbyid(struct bgpd_config *, uint32_t);
 void		 session_handle_update(struct peer *, struct ibuf *);
+void		 session_flush_updates(void);
 void		 session_handle_rrefresh(struct peer *, struct route_refresh *);
 void		 session_graceful_restart(struct peer *);
 void		 session_graceful_flush(struct peer *, uint8_t, const char *);
@@ -347,6 +374,7 @@ int		 peer_matched(struct peer *, struct ctl_neighbor *);
 int		 imsg_ctl_parent(struct imsg *);
 int		 imsg_ctl_rde(struct imsg *);
 int		 imsg_ctl_rde_msg(int, uint32_t, pid_t);
+int		 imsg_ctl_rde_handover(struct imsg *, int);
 int		 session_connect(struct peer *);
 void		 session_close(struct peer *);
 void		 session_up(struct peer *);
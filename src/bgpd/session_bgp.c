@@ -397,6 +397,11 @@ session_update(struct peer *p, struct ibuf *ibuf)
 	session_sendmsg(buf, p, BGP_UPDATE);
 	start_timer_keepalive(p);
 	p->stats.msg_sent_update++;
+	hist_add(&p->queue_depth, msgbuf_queuelen(p->wbuf));
+	if (p->lat_armed) {
+		p->lat_armed = 0;
+		p->lat_wait = msgbuf_queuelen(p->wbuf);
+	}
 }
 
 /* Return 1 if a hard reset should be issued, 0 for a graceful notification */
@@ -1232,7 +1237,7 @@ session_process_msg(struct peer *p)
 			log_peer_warn(&p->conf, "process message failed");
 			bgp_fsm(p, EVNT_CON_FATAL, NULL);
 			ibuf_free(msg);
-			return;
+			break;
 		}
 		ibuf_rewind(msg);
 
@@ -1274,6 +1279,7 @@ session_process_msg(struct peer *p)
 			break;
 		}
 	}
+	session_flush_updates();
 }
 
 static int
@@ -1831,6 +1837,8 @@ change_state(struct peer *peer, enum session_state state,
 		timer_stop(&peer->timers, Timer_IdleHoldReset);
 		session_close(peer);
 		msgbuf_clear(peer->wbuf);
+		peer->lat_wait = 0;
+		peer->lat_armed = 0;
 		peer->rpending = 0;
 		memset(&peer->capa.peer, 0, sizeof(peer->capa.peer));
 		session_md5_reload(peer);
@@ -1885,6 +1893,8 @@ change_state(struct peer *peer, enum session_state state,
 			timer_stop(&peer->timers, Timer_IdleHoldReset);
 			session_close(peer);
 			msgbuf_clear(peer->wbuf);
+			peer->lat_wait = 0;
+			peer->lat_armed = 0;
 			memset(&peer->capa.peer, 0, sizeof(peer->capa.peer));
 		}
 		break;
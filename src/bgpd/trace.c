@@ -0,0 +1,280 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2025 The OpenBGPD portable contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * imsg traces: every message a process takes off one of its imsg pipes
+ * is appended to <tracedir>/<process>.trace.  The file starts with a
+ * header (magic, version, recording process) followed by records:
+ *
+ *	uint64_t	timestamp in nanoseconds (CLOCK_MONOTONIC)
+ *	uint8_t		process the message came from
+ *	uint32_t	imsg type
+ *	uint32_t	imsg peerid
+ *	uint32_t	imsg pid
+ *	uint32_t	payload length
+ *	...		payload
+ *
+ * All fields are in network byte order.  Passed file descriptors are
+ * not recorded.  The replay side lives in bgpd.c and uses trace_read()
+ * and the per-type latency histograms below.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bgpd.h"
+#include "log.h"
+
+#define TRACE_MAGIC		0x62677472	/* "bgtr" */
+#define TRACE_VERSION		1
+#define TRACE_HDR_LEN		8
+#define TRACE_REC_LEN		25
+#define TRACE_HIST_BUCKETS	32
+
+struct trace_hist {
+	uint64_t	count;
+	uint64_t	total;
+	uint64_t	max;
+	uint64_t	bucket[TRACE_HIST_BUCKETS];
+};
+
+struct trace {
+	FILE		*fp;
+};
+
+static FILE			*tracefp;
+static struct ibuf		*tracerec;
+static struct trace_hist	 trace_hist[IMSG_TYPE_COUNT];
+
+uint64_t
+trace_now(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+/*
+ * Open the trace file for process proc. Needs to be called before the
+ * process chroots and drops privileges.
+ */
+void
+trace_init(const char *dir, enum bgpd_process proc)
+{
+	struct ibuf	*hdr;
+	char		*path;
+	int		 fd;
+
+	if (asprintf(&path, "%s/%s.trace", dir, log_procnames[proc]) == -1)
+		fatal(NULL);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0600)) == -1)
+		fatal("%s: open %s", __func__, path);
+	if ((tracefp = fdopen(fd, "w")) == NULL)
+		fatal("%s: fdopen %s", __func__, path);
+	free(path);
+
+	if ((hdr = ibuf_open(TRACE_HDR_LEN)) == NULL ||
+	    (tracerec = ibuf_open(TRACE_REC_LEN)) == NULL)
+		fatal(NULL);
+	if (ibuf_add_n32(hdr, TRACE_MAGIC) == -1 ||
+	    ibuf_add_n16(hdr, TRACE_VERSION) == -1 ||
+	    ibuf_add_n8(hdr, proc) == -1 ||
+	    ibuf_add_zero(hdr, 1) == -1)
+		fatal("%s", __func__);
+	if (fwrite(ibuf_data(hdr), ibuf_size(hdr), 1, tracefp) != 1)
+		fatal("%s: write header", __func__);
+	ibuf_free(hdr);
+}
+
+/*
+ * Record an imsg received from process from. The trace is written through
+ * stdio so the cost in the hot path is a memcpy most of the time.
+ */
+void
+trace_imsg(enum bgpd_process from, struct imsg *imsg)
+{
+	struct ibuf	 data;
+
+	if (tracefp == NULL)
+		return;
+
+	if (imsg_get_ibuf(imsg, &data) == -1)
+		ibuf_from_buffer(&data, NULL, 0);
+
+	ibuf_truncate(tracerec, 0);
+	if (ibuf_add_n64(tracerec, trace_now()) == -1 ||
+	    ibuf_add_n8(tracerec, from) == -1 ||
+	    ibuf_add_n32(tracerec, imsg_get_type(imsg)) == -1 ||
+	    ibuf_add_n32(tracerec, imsg_get_id(imsg)) == -1 ||
+	    ibuf_add_n32(tracerec, imsg_get_pid(imsg)) == -1 ||
+	    ibuf_add_n32(tracerec, ibuf_size(&data)) == -1)
+		fatal("%s", __func__);
+
+	if (fwrite(ibuf_data(tracerec), ibuf_size(tracerec), 1,
+	    tracefp) != 1 ||
+	    (ibuf_size(&data) != 0 &&
+	    fwrite(ibuf_data(&data), ibuf_size(&data), 1, tracefp) != 1)) {
+		log_warn("%s: write failed, tracing disabled", __func__);
+		fclose(tracefp);
+		tracefp = NULL;
+	}
+}
+
+void
+trace_flush(void)
+{
+	if (tracefp != NULL)
+		fflush(tracefp);
+}
+
+/*
+ * Open a trace for replay and return the process it was recorded in.
+ */
+struct trace *
+trace_open(const char *path, enum bgpd_process *proc)
+{
+	struct ibuf	 hdr;
+	struct trace	*t;
+	FILE		*fp;
+	uint8_t		 buf[TRACE_HDR_LEN], p;
+	uint32_t	 magic;
+	uint16_t	 version;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		log_warn("%s", path);
+		return NULL;
+	}
+	if (fread(buf, sizeof(buf), 1, fp) != 1)
+		goto bad;
+	ibuf_from_buffer(&hdr, buf, sizeof(buf));
+	if (ibuf_get_n32(&hdr, &magic) == -1 ||
+	    ibuf_get_n16(&hdr, &version) == -1 ||
+	    ibuf_get_n8(&hdr, &p) == -1)
+		goto bad;
+	if (magic != TRACE_MAGIC || version != TRACE_VERSION ||
+	    p >= PROC_COUNT)
+		goto bad;
+	if ((t = malloc(sizeof(*t))) == NULL)
+		fatal(NULL);
+	t->fp = fp;
+	*proc = p;
+	return t;
+
+ bad:
+	log_warnx("%s: not a bgpd imsg trace", path);
+	fclose(fp);
+	return NULL;
+}
+
+/*
+ * Read the next record. Returns 1 on success, 0 at end of file and -1
+ * on error. The payload is stored in data which is len bytes big.
+ */
+int
+trace_read(struct trace *t, struct trace_rec *tr, void *data, size_t len)
+{
+	struct ibuf	 rec;
+	uint8_t		 buf[TRACE_REC_LEN];
+
+	if (fread(buf, sizeof(buf), 1, t->fp) != 1) {
+		if (feof(t->fp))
+			return 0;
+		log_warn("%s", __func__);
+		return -1;
+	}
+	ibuf_from_buffer(&rec, buf, sizeof(buf));
+	if (ibuf_get_n64(&rec, &tr->ts) == -1 ||
+	    ibuf_get_n8(&rec, &tr->proc) == -1 ||
+	    ibuf_get_n32(&rec, &tr->type) == -1 ||
+	    ibuf_get_n32(&rec, &tr->peerid) == -1 ||
+	    ibuf_get_n32(&rec, &tr->pid) == -1 ||
+	    ibuf_get_n32(&rec, &tr->len) == -1)
+		return -1;
+	if (tr->len > len) {
+		log_warnx("%s: record too large (%u bytes)", __func__,
+		    tr->len);
+		return -1;
+	}
+	if (tr->len != 0 && fread(data, tr->len, 1, t->fp) != 1) {
+		log_warnx("%s: truncated record", __func__);
+		return -1;
+	}
+	return 1;
+}
+
+void
+trace_close(struct trace *t)
+{
+	fclose(t->fp);
+	free(t);
+}
+
+void
+trace_hist_add(uint32_t type, uint64_t ns)
+{
+	struct trace_hist	*h;
+	uint64_t		 us;
+	int			 b;
+
+	if (type >= IMSG_TYPE_COUNT)
+		return;
+	h = &trace_hist[type];
+	h->count++;
+	h->total += ns;
+	if (ns > h->max)
+		h->max = ns;
+
+	/* bucket b holds samples below 2^b microseconds */
+	us = ns / 1000;
+	for (b = 0; us != 0 && b < TRACE_HIST_BUCKETS - 1; b++)
+		us >>= 1;
+	h->bucket[b]++;
+}
+
+void
+trace_hist_print(void)
+{
+	struct trace_hist	*h;
+	uint32_t		 type;
+	int			 b;
+
+	for (type = 0; type < IMSG_TYPE_COUNT; type++) {
+		h = &trace_hist[type];
+		if (h->count == 0)
+			continue;
+		printf("imsg type %u: %llu msgs, avg %llu ns, max %llu ns\n",
+		    type, (unsigned long long)h->count,
+		    (unsigned long long)(h->total / h->count),
+		    (unsigned long long)h->max);
+		for (b = 0; b < TRACE_HIST_BUCKETS; b++) {
+			if (h->bucket[b] == 0)
+				continue;
+			printf("    < %10llu us: %llu\n",
+			    1ULL << b, (unsigned long long)h->bucket[b]);
+		}
+	}
+}
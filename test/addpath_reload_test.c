@@ -0,0 +1,366 @@
+/*
+ * Add-path send reload test
+ *
+ * Runs up_generate_addpath() for a peer with "announce add-path send all"
+ * against a single RIB entry with two paths. The Adj-RIB-Out and the
+ * output filters are replaced by the small models below so the test can
+ * count filter runs and see what ends up announced.
+ *
+ * A regular update must only filter the changed path. After a reload
+ * the RDE calls up_generate_addpath() with neither a new nor an old path
+ * and all paths must be filtered again: a path that the new filters deny
+ * has to be withdrawn even if it is still in the Adj-RIB-Out.
+ *
+ * usage: addpath_reload_test
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "bgpd.h"
+#include "rde.h"
+#include "log.h"
+
+#define NPATHS		2
+
+struct rde_memstats	 rdemem;
+struct ctl_metrics	 rdemetrics;
+struct rde_peer		*peerself;
+
+/* model of the Adj-RIB-Out of the test peer, indexed by path_id_tx - 1 */
+static struct prefix	 adjout[NPATHS];
+/* path_id_tx denied by the output filters, 0 for none */
+static uint32_t		 deny_id;
+static unsigned int	 filter_runs;
+
+enum filter_actions
+rde_filter_cached(struct rde_filter_cache *cache, struct filter_head *rules,
+    struct rde_peer *peer, struct rde_peer *from, struct prefix *p,
+    struct bgpd_addr *prefix, uint8_t plen, struct filterstate *state)
+{
+	filter_runs++;
+	memset(state, 0, sizeof(*state));
+	if (p->path_id_tx == deny_id)
+		return ACTION_DENY;
+	return ACTION_ALLOW;
+}
+
+void
+rde_filterstate_clean(struct filterstate *state)
+{
+}
+
+struct prefix *
+prefix_adjout_get(struct rde_peer *peer, uint32_t path_id_tx,
+    struct pt_entry *pt)
+{
+	struct prefix	*p;
+
+	if (path_id_tx < 1 || path_id_tx > NPATHS)
+		errx(1, "%s: bad path id %u", __func__, path_id_tx);
+	p = &adjout[path_id_tx - 1];
+	if ((p->flags & PREFIX_FLAG_ADJOUT) == 0)
+		return NULL;
+	return p;
+}
+
+struct prefix *
+prefix_adjout_next(struct rde_peer *peer, struct prefix *p)
+{
+	while (++p < &adjout[NPATHS])
+		if (p->flags & PREFIX_FLAG_ADJOUT)
+			return p;
+	return NULL;
+}
+
+struct prefix *
+prefix_adjout_first(struct rde_peer *peer, struct pt_entry *pt)
+{
+	if (adjout[0].flags & PREFIX_FLAG_ADJOUT)
+		return &adjout[0];
+	return prefix_adjout_next(peer, &adjout[0]);
+}
+
+void
+prefix_adjout_update(struct prefix *p, struct rde_peer *peer,
+    struct filterstate *state, struct pt_entry *pt, uint32_t path_id_tx)
+{
+	p = &adjout[path_id_tx - 1];
+	p->pt = pt;
+	p->path_id_tx = path_id_tx;
+	p->flags = PREFIX_FLAG_ADJOUT | PREFIX_FLAG_UPDATE;
+}
+
+void
+prefix_adjout_withdraw(struct prefix *p)
+{
+	p->flags &= ~(PREFIX_FLAG_UPDATE | PREFIX_FLAG_STALE);
+	p->flags |= PREFIX_FLAG_WITHDRAW;
+}
+
+/* everything below is not reached by up_generate_addpath() */
+
+void
+prefix_adjout_destroy(struct prefix *p)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+struct prefix *
+prefix_adjout_lookup(struct rde_peer *peer, struct bgpd_addr *addr, int plen)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+static int
+prefix_cmp(struct prefix *a, struct prefix *b)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+RB_GENERATE(prefix_tree, prefix, entry.tree.update, prefix_cmp)
+
+enum filter_actions
+rde_filter(struct filter_head *rules, struct rde_peer *peer,
+    struct rde_peer *from, struct bgpd_addr *prefix, uint8_t plen,
+    struct filterstate *state)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+void
+rde_filterstate_init(struct filterstate *state)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+void
+rde_filterstate_set_vstate(struct filterstate *state, uint8_t roa,
+    uint8_t aspa)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+void
+rde_lat_dump(struct rde_peer *peer, struct prefix *p, monotime_t now)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+void
+rde_update_err(struct rde_peer *peer, uint8_t error, uint8_t suberr,
+    struct ibuf *opt)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+int
+prefix_eligible(struct prefix *p)
+{
+	return 1;
+}
+
+struct prefix *
+prefix_best(struct rib_entry *re)
+{
+	return TAILQ_FIRST(&re->prefix_h);
+}
+
+int
+peer_has_as4byte(struct rde_peer *peer)
+{
+	return 1;
+}
+
+int
+peer_has_add_path(struct rde_peer *peer, uint8_t aid, int mode)
+{
+	return 1;
+}
+
+int
+peer_has_ext_msg(struct rde_peer *peer)
+{
+	return 0;
+}
+
+int
+peer_has_ext_nexthop(struct rde_peer *peer, uint8_t aid)
+{
+	return 0;
+}
+
+struct nexthop *
+nexthop_get(struct bgpd_addr *nexthop)
+{
+	return NULL;
+}
+
+int
+nexthop_unref(struct nexthop *nh)
+{
+	return 0;
+}
+
+int
+community_match(struct rde_community *comm, struct community *fc,
+    struct rde_peer *peer)
+{
+	return 0;
+}
+
+int
+community_writebuf(struct rde_community *comm, uint8_t type, int ebgp,
+    struct ibuf *buf)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+int
+attr_writebuf(struct ibuf *buf, uint8_t flags, uint8_t type, void *data,
+    uint16_t len)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+int
+attr_optadd(struct rde_aspath *asp, uint8_t flags, uint8_t type,
+    void *data, uint16_t len)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+struct aspath *
+aspath_get(void *data, uint16_t len)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+void
+aspath_put(struct aspath *aspath)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+u_char *
+aspath_deflate(u_char *data, uint16_t *len, int *flagnew)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+u_char *
+aspath_prepend(struct aspath *asp, uint32_t as, int quantum, uint16_t *len)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+void
+log_peer_warn(const struct peer_config *peer, const char *emsg, ...)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+void
+log_peer_warnx(const struct peer_config *peer, const char *emsg, ...)
+{
+	errx(1, "%s: unexpected call", __func__);
+}
+
+static int
+announced(uint32_t path_id_tx)
+{
+	struct prefix	*p = &adjout[path_id_tx - 1];
+
+	return (p->flags & PREFIX_FLAG_ADJOUT) &&
+	    (p->flags & (PREFIX_FLAG_WITHDRAW | PREFIX_FLAG_DEAD)) == 0;
+}
+
+static int
+check(const char *what, unsigned int runs, int ann1, int ann2)
+{
+	if (filter_runs != runs || announced(1) != ann1 ||
+	    announced(2) != ann2) {
+		warnx("%s: %u filter runs, path 1 %s, path 2 %s", what,
+		    filter_runs, announced(1) ? "announced" : "withdrawn",
+		    announced(2) ? "announced" : "withdrawn");
+		return 1;
+	}
+	printf("%s: ok\n", what);
+	filter_runs = 0;
+	return 0;
+}
+
+int
+main(void)
+{
+	struct rde_peer		 peer, from;
+	struct rde_aspath	 asp;
+	struct rib_entry	 re;
+	struct prefix		 path[NPATHS];
+	struct bgpd_addr	 addr;
+	int			 i, fail = 0;
+
+	log_init(1, LOG_DAEMON);
+	pt_init();
+
+	memset(&addr, 0, sizeof(addr));
+	addr.aid = AID_INET;
+	addr.v4.s_addr = htonl(0xc0000200);		/* 192.0.2.0/24 */
+
+	memset(&peer, 0, sizeof(peer));
+	RB_INIT(&peer.addpath_denied);
+	peer.eval.mode = ADDPATH_EVAL_ALL;
+	memset(&from, 0, sizeof(from));
+	from.conf.reflector_client = 1;
+	memset(&asp, 0, sizeof(asp));
+
+	memset(&re, 0, sizeof(re));
+	TAILQ_INIT(&re.prefix_h);
+	re.prefix = pt_ref(pt_add(&addr, 24));
+	memset(path, 0, sizeof(path));
+	for (i = 0; i < NPATHS; i++) {
+		path[i].pt = re.prefix;
+		path[i].aspath = &asp;
+		path[i].peer = &from;
+		path[i].path_id_tx = i + 1;
+		path[i].dmetric = i == 0 ?
+		    PREFIX_DMETRIC_BEST : PREFIX_DMETRIC_VALID;
+		TAILQ_INSERT_TAIL(&re.prefix_h, &path[i], entry.list.rib);
+	}
+
+	/* initial dump, both paths are filtered and announced */
+	up_generate_addpath(&peer, &re, NULL, NULL);
+	fail |= check("initial", 2, 1, 1);
+
+	/* path 1 changed, path 2 keeps its Adj-RIB-Out entry */
+	up_generate_addpath(&peer, &re, &path[0], NULL);
+	fail |= check("update", 1, 1, 1);
+
+	/* reload with filters denying path 2, all paths are filtered again */
+	deny_id = 2;
+	up_generate_addpath(&peer, &re, NULL, NULL);
+	fail |= check("reload", 2, 1, 0);
+
+	/* path 1 changed, path 2 stays denied without running the filter */
+	up_generate_addpath(&peer, &re, &path[0], NULL);
+	fail |= check("update after reload", 1, 1, 0);
+
+	/* reload with filters allowing everything again */
+	deny_id = 0;
+	up_generate_addpath(&peer, &re, NULL, NULL);
+	fail |= check("second reload", 2, 1, 1);
+
+	up_denied_flush(&peer);
+	pt_unref(re.prefix);
+	return fail;
+}
@@ -0,0 +1,494 @@
+/*
+ * Config cache round trip test
+ *
+ * Builds a config with peers, a group, filters with sets, networks,
+ * prefix-, roa-, aspa- and as-sets and an rtr session, writes it with
+ * confcache_write(), loads it back with confcache_load() and compares
+ * the result with the original. Then checks that the cache is refused
+ * once the config source changes and that configs with includes that
+ * can't be followed are not cached.
+ *
+ * usage: confcache_test
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "bgpd.h"
+#include "session.h"
+#include "rde.h"
+#include "log.h"
+
+struct rib_names	ribnames = SIMPLEQ_HEAD_INITIALIZER(ribnames);
+struct rde_memstats	rdemem;
+
+static int
+peer_compare(const struct peer *a, const struct peer *b)
+{
+	return a->conf.id - b->conf.id;
+}
+
+RB_GENERATE(peer_head, peer, entry, peer_compare);
+
+/* the parts of bgpd confcache.c and config.c use but don't test */
+void
+filterset_free(struct filter_set_head *sh)
+{
+	struct filter_set	*s;
+
+	while ((s = TAILQ_FIRST(sh)) != NULL) {
+		TAILQ_REMOVE(sh, s, entry);
+		free(s);
+	}
+}
+
+void
+filterlist_free(struct filter_head *fh)
+{
+	struct filter_rule	*r;
+
+	if (fh == NULL)
+		return;
+	while ((r = TAILQ_FIRST(fh)) != NULL) {
+		TAILQ_REMOVE(fh, r, entry);
+		filterset_free(&r->set);
+		free(r);
+	}
+	free(fh);
+}
+
+void
+filterset_move(struct filter_set_head *source, struct filter_set_head *dest)
+{
+	TAILQ_CONCAT(dest, source, entry);
+}
+
+void
+filterset_copy(struct filter_set_head *source, struct filter_set_head *dest)
+{
+	errx(1, "%s: not expected", __func__);
+}
+
+struct prefixset *
+find_prefixset(char *name, struct prefixset_head *p)
+{
+	return NULL;
+}
+
+struct peer *
+getpeerbyid(struct bgpd_config *c, uint32_t id)
+{
+	return NULL;
+}
+
+void
+mrt_mergeconfig(struct mrt_head *xconf, struct mrt_head *nconf)
+{
+}
+
+void
+send_nexthop_update(struct kroute_nexthop *msg)
+{
+}
+
+void
+send_imsg_session(int type, pid_t pid, void *data, uint16_t datalen)
+{
+}
+
+int
+send_network(int type, struct network_config *net, struct filter_set_head *h)
+{
+	return 0;
+}
+
+static struct peer *
+add_peer(struct bgpd_config *conf, uint32_t id, uint32_t groupid,
+    const char *addr)
+{
+	struct peer	*p;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		err(1, NULL);
+	p->conf.id = id;
+	p->conf.groupid = groupid;
+	if (groupid != 0)
+		strlcpy(p->conf.group, "group", sizeof(p->conf.group));
+	snprintf(p->conf.descr, sizeof(p->conf.descr), "peer %s", addr);
+	p->conf.remote_addr.aid = AID_INET;
+	if (inet_pton(AF_INET, addr, &p->conf.remote_addr.v4) != 1)
+		errx(1, "bad address %s", addr);
+	p->conf.remote_masklen = 32;
+	p->conf.remote_as = 64500 + id;
+	p->conf.mrai = 5;
+	p->conf.capabilities.mp[AID_INET] = 1;
+	p->auth_conf.method = AUTH_MD5SIG;
+	strlcpy(p->auth_conf.md5key, "secret", sizeof(p->auth_conf.md5key));
+	p->auth_conf.md5key_len = 6;
+	if (RB_INSERT(peer_head, &conf->peers, p) != NULL)
+		errx(1, "duplicate peer");
+	return p;
+}
+
+static void
+add_set(struct filter_set_head *sh, enum action_types type, uint32_t metric)
+{
+	struct filter_set	*s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		err(1, NULL);
+	s->type = type;
+	s->action.metric = metric;
+	TAILQ_INSERT_TAIL(sh, s, entry);
+}
+
+static struct bgpd_config *
+build_config(void)
+{
+	struct bgpd_config	*conf;
+	struct rde_rib		*rr;
+	struct listen_addr	*la;
+	struct network		*n;
+	struct filter_rule	*r;
+	struct prefixset	*ps;
+	struct prefixset_item	*psi;
+	struct roa		*roa;
+	struct aspa_set		*aspa;
+	struct as_set		*aset;
+	struct rtr_config	*rtr;
+	uint32_t		 asnums[] = { 64496, 64497, 64511 };
+
+	conf = new_config();
+	conf->flags = BGPD_FLAG_DECISION_MED_ALWAYS;
+	conf->as = 64500;
+	conf->short_as = 64500;
+	conf->bgpid = 0xc0000201;
+	conf->holdtime = 30;
+	conf->mrai = 7;
+	conf->fib_priority = 48;
+	if ((conf->csock = strdup("/tmp/bgpd.sock")) == NULL)
+		err(1, NULL);
+
+	if ((rr = calloc(1, sizeof(*rr))) == NULL)
+		err(1, NULL);
+	strlcpy(rr->name, "Loc-RIB", sizeof(rr->name));
+	rr->flags = F_RIB_LOCAL;
+	SIMPLEQ_INSERT_TAIL(&ribnames, rr, entry);
+
+	add_peer(conf, 2, 4, "192.0.2.2");
+	add_peer(conf, 3, 0, "192.0.2.3");
+
+	if ((la = calloc(1, sizeof(*la))) == NULL)
+		err(1, NULL);
+	la->sa.ss_family = AF_INET;
+	la->sa_len = sizeof(struct sockaddr_in);
+	la->fd = 17;
+	TAILQ_INSERT_TAIL(conf->listen_addrs, la, entry);
+
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&n->net.attrset);
+	n->net.prefix.aid = AID_INET;
+	inet_pton(AF_INET, "198.51.100.0", &n->net.prefix.v4);
+	n->net.prefixlen = 24;
+	add_set(&n->net.attrset, ACTION_SET_MED, 100);
+	TAILQ_INSERT_TAIL(&conf->networks, n, entry);
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&r->set);
+	r->action = ACTION_ALLOW;
+	r->dir = DIR_IN;
+	r->peer.peerid = 3;
+	strlcpy(r->match.prefixset.name, "pfx",
+	    sizeof(r->match.prefixset.name));
+	add_set(&r->set, ACTION_SET_LOCALPREF, 200);
+	add_set(&r->set, ACTION_SET_MED, 50);
+	TAILQ_INSERT_TAIL(conf->filters, r, entry);
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&r->set);
+	r->action = ACTION_DENY;
+	r->dir = DIR_OUT;
+	r->peer.groupid = 4;
+	TAILQ_INSERT_TAIL(conf->filters, r, entry);
+
+	if ((ps = calloc(1, sizeof(*ps))) == NULL)
+		err(1, NULL);
+	strlcpy(ps->name, "pfx", sizeof(ps->name));
+	RB_INIT(&ps->psitems);
+	RB_INIT(&ps->roaitems);
+	if ((psi = calloc(1, sizeof(*psi))) == NULL)
+		err(1, NULL);
+	psi->p.addr.aid = AID_INET;
+	inet_pton(AF_INET, "203.0.113.0", &psi->p.addr.v4);
+	psi->p.len = 24;
+	psi->p.op = OP_RANGE;
+	psi->p.len_min = 24;
+	psi->p.len_max = 32;
+	RB_INSERT(prefixset_tree, &ps->psitems, psi);
+	SIMPLEQ_INSERT_TAIL(&conf->prefixsets, ps, entry);
+
+	if ((roa = calloc(1, sizeof(*roa))) == NULL)
+		err(1, NULL);
+	roa->aid = AID_INET;
+	roa->prefixlen = 24;
+	roa->maxlen = 24;
+	roa->asnum = 64500;
+	inet_pton(AF_INET, "198.51.100.0", &roa->prefix.inet);
+	RB_INSERT(roa_tree, &conf->roa, roa);
+
+	if ((aspa = calloc(1, sizeof(*aspa))) == NULL ||
+	    (aspa->tas = calloc(2, sizeof(uint32_t))) == NULL)
+		err(1, NULL);
+	aspa->as = 64500;
+	aspa->num = 2;
+	aspa->tas[0] = 64501;
+	aspa->tas[1] = 64502;
+	RB_INSERT(aspa_tree, &conf->aspa, aspa);
+
+	if ((aset = as_sets_new(&conf->as_sets, "asns", 0,
+	    sizeof(uint32_t))) == NULL ||
+	    set_add(aset->set, asnums, 3) != 0)
+		err(1, NULL);
+
+	if ((rtr = calloc(1, sizeof(*rtr))) == NULL)
+		err(1, NULL);
+	strlcpy(rtr->descr, "validator", sizeof(rtr->descr));
+	rtr->remote_addr.aid = AID_INET;
+	inet_pton(AF_INET, "192.0.2.100", &rtr->remote_addr.v4);
+	rtr->remote_port = 323;
+	rtr->id = 1;
+	SIMPLEQ_INSERT_TAIL(&conf->rtrs, rtr, entry);
+
+	return conf;
+}
+
+static struct peer *
+peer_by_addr(struct bgpd_config *conf, struct peer *p)
+{
+	struct peer	*x;
+
+	RB_FOREACH(x, peer_head, &conf->peers)
+		if (memcmp(&x->conf.remote_addr, &p->conf.remote_addr,
+		    sizeof(x->conf.remote_addr)) == 0)
+			return x;
+	errx(1, "peer %s missing", p->conf.descr);
+}
+
+static void
+compare_sets(struct filter_set_head *a, struct filter_set_head *b)
+{
+	struct filter_set	*x, *y;
+
+	for (x = TAILQ_FIRST(a), y = TAILQ_FIRST(b); x != NULL && y != NULL;
+	    x = TAILQ_NEXT(x, entry), y = TAILQ_NEXT(y, entry))
+		if (x->type != y->type ||
+		    x->action.metric != y->action.metric)
+			errx(1, "filter set differs");
+	if (x != NULL || y != NULL)
+		errx(1, "filter set length differs");
+}
+
+static void
+compare_config(struct bgpd_config *a, struct bgpd_config *b)
+{
+	struct peer		*p, *q;
+	struct filter_rule	*r, *s;
+	struct network		*n, *m;
+	struct prefixset	*ps, *qs;
+	struct prefixset_item	*psi, *qsi;
+	struct roa		*roa, *qroa;
+	struct aspa_set		*aspa, *qaspa;
+	struct as_set		*aset, *qset;
+	struct rtr_config	*rtr, *qrtr;
+	struct listen_addr	*la, *qla;
+	struct peer_config	 pc;
+	const uint32_t		*as, *qas;
+	size_t			 nas, nqas;
+
+	if (a->flags != b->flags || a->as != b->as ||
+	    a->short_as != b->short_as || a->bgpid != b->bgpid ||
+	    a->holdtime != b->holdtime || a->mrai != b->mrai ||
+	    a->fib_priority != b->fib_priority ||
+	    strcmp(a->csock, b->csock) != 0)
+		errx(1, "global config differs");
+
+	RB_FOREACH(p, peer_head, &a->peers) {
+		q = peer_by_addr(b, p);
+		pc = q->conf;
+		/* ids are renumbered on load */
+		pc.id = p->conf.id;
+		pc.groupid = p->conf.groupid;
+		if (memcmp(&pc, &p->conf, sizeof(pc)) != 0 ||
+		    memcmp(&q->auth_conf, &p->auth_conf,
+		    sizeof(q->auth_conf)) != 0)
+			errx(1, "peer %s differs", p->conf.descr);
+		if ((p->conf.groupid == 0) != (q->conf.groupid == 0))
+			errx(1, "peer %s group differs", p->conf.descr);
+	}
+
+	la = TAILQ_FIRST(a->listen_addrs);
+	qla = TAILQ_FIRST(b->listen_addrs);
+	if (qla == NULL || TAILQ_NEXT(qla, entry) != NULL ||
+	    memcmp(&la->sa, &qla->sa, sizeof(la->sa)) != 0 ||
+	    la->sa_len != qla->sa_len || qla->fd != -1)
+		errx(1, "listen address differs");
+
+	n = TAILQ_FIRST(&a->networks);
+	m = TAILQ_FIRST(&b->networks);
+	if (m == NULL || TAILQ_NEXT(m, entry) != NULL ||
+	    memcmp(&n->net.prefix, &m->net.prefix, sizeof(n->net.prefix)) ||
+	    n->net.prefixlen != m->net.prefixlen)
+		errx(1, "network differs");
+	compare_sets(&n->net.attrset, &m->net.attrset);
+
+	for (r = TAILQ_FIRST(a->filters), s = TAILQ_FIRST(b->filters);
+	    r != NULL && s != NULL;
+	    r = TAILQ_NEXT(r, entry), s = TAILQ_NEXT(s, entry)) {
+		if (r->action != s->action || r->dir != s->dir ||
+		    strcmp(r->match.prefixset.name,
+		    s->match.prefixset.name) != 0)
+			errx(1, "filter rule differs");
+		compare_sets(&r->set, &s->set);
+	}
+	if (r != NULL || s != NULL)
+		errx(1, "filter rule count differs");
+	/* the rules must follow the renumbered peers */
+	r = TAILQ_FIRST(b->filters);
+	p = RB_FIND(peer_head, &a->peers, &(struct peer){ .conf.id = 3 });
+	if (r->peer.peerid != peer_by_addr(b, p)->conf.id)
+		errx(1, "filter rule peer not renumbered");
+	r = TAILQ_NEXT(r, entry);
+	p = RB_FIND(peer_head, &a->peers, &(struct peer){ .conf.id = 2 });
+	if (r->peer.groupid != peer_by_addr(b, p)->conf.groupid)
+		errx(1, "filter rule group not renumbered");
+
+	ps = SIMPLEQ_FIRST(&a->prefixsets);
+	qs = SIMPLEQ_FIRST(&b->prefixsets);
+	if (qs == NULL || strcmp(ps->name, qs->name) != 0)
+		errx(1, "prefix-set differs");
+	psi = RB_MIN(prefixset_tree, &ps->psitems);
+	qsi = RB_MIN(prefixset_tree, &qs->psitems);
+	if (qsi == NULL || memcmp(&psi->p, &qsi->p, sizeof(psi->p)) != 0 ||
+	    RB_NEXT(prefixset_tree, &qs->psitems, qsi) != NULL)
+		errx(1, "prefix-set items differ");
+
+	roa = RB_MIN(roa_tree, &a->roa);
+	qroa = RB_MIN(roa_tree, &b->roa);
+	if (qroa == NULL || roa->aid != qroa->aid ||
+	    roa->prefixlen != qroa->prefixlen ||
+	    roa->maxlen != qroa->maxlen || roa->asnum != qroa->asnum ||
+	    memcmp(&roa->prefix, &qroa->prefix, sizeof(roa->prefix)) != 0)
+		errx(1, "roa-set differs");
+
+	aspa = RB_MIN(aspa_tree, &a->aspa);
+	qaspa = RB_MIN(aspa_tree, &b->aspa);
+	if (qaspa == NULL || aspa->as != qaspa->as ||
+	    aspa->num != qaspa->num ||
+	    memcmp(aspa->tas, qaspa->tas, aspa->num * sizeof(uint32_t)) != 0)
+		errx(1, "aspa-set differs");
+
+	aset = SIMPLEQ_FIRST(&a->as_sets);
+	qset = SIMPLEQ_FIRST(&b->as_sets);
+	if (qset == NULL || strcmp(aset->name, qset->name) != 0)
+		errx(1, "as-set differs");
+	as = set_get(aset->set, &nas);
+	qas = set_get(qset->set, &nqas);
+	if (nas != nqas || memcmp(as, qas, nas * sizeof(*as)) != 0)
+		errx(1, "as-set items differ");
+
+	rtr = SIMPLEQ_FIRST(&a->rtrs);
+	qrtr = SIMPLEQ_FIRST(&b->rtrs);
+	if (qrtr == NULL || strcmp(rtr->descr, qrtr->descr) != 0 ||
+	    memcmp(&rtr->remote_addr, &qrtr->remote_addr,
+	    sizeof(rtr->remote_addr)) != 0 ||
+	    rtr->remote_port != qrtr->remote_port)
+		errx(1, "rtr differs");
+}
+
+static void
+write_file(const char *path, const char *content)
+{
+	FILE	*f;
+
+	if ((f = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	fputs(content, f);
+	if (fclose(f) == EOF)
+		err(1, "%s", path);
+}
+
+int
+main(void)
+{
+	struct bgpd_config	*conf, *loaded;
+	struct rde_rib		*rr;
+	char			 dir[] = "/tmp/confcache.XXXXXXXXXX";
+	char			 conffile[PATH_MAX], incfile[PATH_MAX];
+	char			 cachefile[PATH_MAX], buf[PATH_MAX + 32];
+
+	log_init(1, LOG_DAEMON);
+	log_setverbose(1);
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(conffile, sizeof(conffile), "%s/bgpd.conf", dir);
+	snprintf(incfile, sizeof(incfile), "%s/peers.conf", dir);
+	snprintf(cachefile, sizeof(cachefile), "%s/bgpd.conf.cache", dir);
+	snprintf(buf, sizeof(buf), "AS 64500\ninclude \"%s\"\n", incfile);
+	write_file(conffile, buf);
+	write_file(incfile, "neighbor 192.0.2.2 { remote-as 64502 }\n");
+
+	conf = build_config();
+	if (confcache_write(conf, &ribnames, conffile, cachefile) == -1)
+		errx(1, "confcache_write failed");
+	/* confcache_load() appends the cached ribs */
+	while ((rr = SIMPLEQ_FIRST(&ribnames)) != NULL) {
+		SIMPLEQ_REMOVE_HEAD(&ribnames, entry);
+		free(rr);
+	}
+
+	if ((loaded = confcache_load(conffile, cachefile, NULL, NULL)) ==
+	    NULL)
+		errx(1, "confcache_load failed");
+	compare_config(conf, loaded);
+	rr = SIMPLEQ_FIRST(&ribnames);
+	if (rr == NULL || strcmp(rr->name, "Loc-RIB") != 0 ||
+	    rr->flags != F_RIB_LOCAL || SIMPLEQ_NEXT(rr, entry) != NULL)
+		errx(1, "rib differs");
+	free_config(loaded);
+	printf("round trip ok\n");
+
+	/* a change in an included file makes the cache stale */
+	write_file(incfile, "neighbor 192.0.2.2 { remote-as 64503 }\n");
+	if ((loaded = confcache_load(conffile, cachefile, NULL, NULL)) !=
+	    NULL)
+		errx(1, "stale cache loaded");
+	printf("stale cache refused\n");
+
+	/* includes that can't be followed disable the cache */
+	write_file(conffile, "peers=\"peers.conf\"\ninclude $peers\n");
+	if (confcache_write(conf, &ribnames, conffile, cachefile) != -1)
+		errx(1, "cache written for an include using a macro");
+	if (confcache_load(conffile, cachefile, NULL, NULL) != NULL)
+		errx(1, "cache loaded for an include using a macro");
+	printf("unresolvable include not cached\n");
+
+	free_config(conf);
+	unlink(cachefile);
+	unlink(incfile);
+	unlink(conffile);
+	rmdir(dir);
+	return 0;
+}
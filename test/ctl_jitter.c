@@ -0,0 +1,361 @@
+/*
+ * Session engine keepalive jitter during control dumps
+ *
+ * Acts as a minimal eBGP peer of a running bgpd, announces a full table
+ * worth of IPv4 prefixes and then records when bgpd sends its KEEPALIVE
+ * messages. The gaps are measured once while bgpd is idle and once while
+ * a "bgpctl show rib" dump of the whole table is running. Run it against
+ * bgpd with and without -Q to compare relayed and direct rib dumps.
+ *
+ * bgpd needs a neighbor entry for this peer with a holdtime of 3 seconds,
+ * for example:
+ *
+ *	neighbor 127.0.0.1 { remote-as 65001; holdtime 3 }
+ *
+ * usage: ctl_jitter [-a as] [-n prefixes] [-p port] [-s socket] [-t secs]
+ *	  address
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSG_HDR_LEN	19
+#define MSG_MAX_LEN	4096
+#define MSG_OPEN	1
+#define MSG_UPDATE	2
+#define MSG_NOTIFY	3
+#define MSG_KEEPALIVE	4
+#define HOLDTIME	3
+
+struct gaps {
+	double		last;
+	double		max;
+	double		sum;
+	unsigned int	cnt;
+};
+
+static uint8_t	rbuf[MSG_MAX_LEN * 4];
+static size_t	rlen;
+static int	sock, established;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t *
+put16(uint8_t *p, uint16_t v)
+{
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+static uint8_t *
+put32(uint8_t *p, uint32_t v)
+{
+	p = put16(p, v >> 16);
+	return put16(p, v);
+}
+
+static void
+send_msg(uint8_t type, const uint8_t *data, size_t len)
+{
+	uint8_t		 msg[MSG_MAX_LEN];
+	size_t		 off = 0;
+	ssize_t		 n;
+
+	memset(msg, 0xff, 16);
+	put16(msg + 16, MSG_HDR_LEN + len);
+	msg[18] = type;
+	memcpy(msg + MSG_HDR_LEN, data, len);
+	len += MSG_HDR_LEN;
+
+	while (off < len) {
+		if ((n = write(sock, msg + off, len - off)) == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				struct pollfd pfd = { sock, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			err(1, "write");
+		}
+		off += n;
+	}
+}
+
+static void
+send_open(uint32_t as)
+{
+	uint8_t	 buf[64], *p = buf, *opt;
+
+	*p++ = 4;
+	p = put16(p, as > 0xffff ? 23456 : as);
+	p = put16(p, HOLDTIME);
+	p = put32(p, 0x0a000001);
+	opt = p++;
+	/* capabilities: multiprotocol IPv4 unicast and 4-byte AS */
+	*p++ = 2;
+	*p++ = 12;
+	*p++ = 1;
+	*p++ = 4;
+	p = put16(p, 1);
+	*p++ = 0;
+	*p++ = 1;
+	*p++ = 65;
+	*p++ = 4;
+	p = put32(p, as);
+	*opt = p - opt - 1;
+	send_msg(MSG_OPEN, buf, p - buf);
+}
+
+/*
+ * Announce n /24 prefixes out of 16.0.0.0/4 with as path "as" and the
+ * local address of the session as nexthop.
+ */
+static void
+send_table(uint32_t as, unsigned int n)
+{
+	struct sockaddr_in	 sin;
+	socklen_t		 slen = sizeof(sin);
+	static const uint8_t	 attrs[] = {
+		0x40, 1, 1, 0,			/* ORIGIN IGP */
+		0x40, 2, 6, 2, 1, 0, 0, 0, 0,	/* AS_PATH, AS filled in */
+		0x40, 3, 4, 0, 0, 0, 0		/* NEXTHOP, filled in */
+	};
+	uint8_t			 buf[MSG_MAX_LEN - MSG_HDR_LEN], *p, *nlri;
+	uint32_t		 pfx;
+	unsigned int		 i = 0;
+
+	if (getsockname(sock, (struct sockaddr *)&sin, &slen) == -1)
+		err(1, "getsockname");
+
+	while (i < n) {
+		p = put16(buf, 0);		/* no withdrawn routes */
+		p = put16(p, sizeof(attrs));
+		memcpy(p, attrs, sizeof(attrs));
+		put32(p + 9, as);
+		memcpy(p + 16, &sin.sin_addr, 4);
+		p += sizeof(attrs);
+		for (nlri = p; i < n && p + 4 <= buf + sizeof(buf); i++) {
+			pfx = 0x10000000 + (i << 8);
+			*p++ = 24;
+			*p++ = pfx >> 24;
+			*p++ = pfx >> 16;
+			*p++ = pfx >> 8;
+		}
+		if (p == nlri)
+			break;
+		send_msg(MSG_UPDATE, buf, p - buf);
+	}
+}
+
+static void
+gap_add(struct gaps *g, double t)
+{
+	double	d;
+
+	if (g->last != 0) {
+		d = t - g->last;
+		if (d > g->max)
+			g->max = d;
+		g->sum += d;
+		g->cnt++;
+	}
+	g->last = t;
+}
+
+/*
+ * Read and handle everything bgpd sent.
+ */
+static void
+recv_msgs(struct gaps *g)
+{
+	ssize_t		 n;
+	size_t		 len;
+	int		 type;
+
+	n = read(sock, rbuf + rlen, sizeof(rbuf) - rlen);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		err(1, "read");
+	}
+	if (n == 0)
+		errx(1, "bgpd closed the session");
+	rlen += n;
+
+	while (rlen >= MSG_HDR_LEN) {
+		len = rbuf[16] << 8 | rbuf[17];
+		if (len < MSG_HDR_LEN || len > MSG_MAX_LEN * 4)
+			errx(1, "bad message length %zu", len);
+		if (rlen < len)
+			break;
+		type = rbuf[18];
+		if (type == MSG_NOTIFY)
+			errx(1, "received notification %u/%u", rbuf[19],
+			    rbuf[20]);
+		if (type == MSG_OPEN)
+			established = 1;
+		if (type == MSG_KEEPALIVE && g != NULL)
+			gap_add(g, now());
+		memmove(rbuf, rbuf + len, rlen - len);
+		rlen -= len;
+	}
+}
+
+/*
+ * Run the session for secs seconds or until child exits, sending our own
+ * keepalives once a second.
+ */
+static void
+run(struct gaps *g, double secs, pid_t child)
+{
+	struct pollfd	 pfd;
+	double		 start, ka;
+	int		 status;
+
+	start = ka = now();
+	for (;;) {
+		if (child != -1 && waitpid(child, &status, WNOHANG) == child)
+			break;
+		if (child == -1 && now() - start > secs)
+			break;
+		if (now() - ka >= 1) {
+			send_msg(MSG_KEEPALIVE, NULL, 0);
+			ka = now();
+		}
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 50) == -1 && errno != EINTR)
+			err(1, "poll");
+		if (pfd.revents & POLLIN)
+			recv_msgs(g);
+	}
+}
+
+static void
+report(const char *what, struct gaps *g)
+{
+	if (g->cnt == 0) {
+		printf("%-12s no keepalives received\n", what);
+		return;
+	}
+	printf("%-12s %u keepalives, avg gap %.3f s, max gap %.3f s, "
+	    "jitter %.3f s\n", what, g->cnt, g->sum / g->cnt, g->max,
+	    g->max - HOLDTIME / 3.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in	 sin;
+	struct gaps		 idle = { 0 }, dump = { 0 };
+	const char		*ctlsock = NULL;
+	unsigned int		 nprefix = 900000, secs = 10;
+	uint32_t		 as = 65001;
+	uint16_t		 port = 179;
+	pid_t			 pid;
+	int			 ch, fd;
+
+	while ((ch = getopt(argc, argv, "a:n:p:s:t:")) != -1) {
+		switch (ch) {
+		case 'a':
+			as = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			nprefix = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			ctlsock = optarg;
+			break;
+		case 't':
+			secs = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1) {
+ usage:
+		fprintf(stderr, "usage: ctl_jitter [-a as] [-n prefixes] "
+		    "[-p port] [-s socket] [-t secs] address\n");
+		return 1;
+	}
+	if (nprefix > 1 << 20)
+		errx(1, "at most %u prefixes", 1 << 20);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, argv[0], &sin.sin_addr) != 1)
+		errx(1, "bad address %s", argv[0]);
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (connect(sock, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "connect");
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	send_open(as);
+	while (!established) {
+		struct pollfd pfd = { sock, POLLIN, 0 };
+
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			err(1, "poll");
+		recv_msgs(NULL);
+	}
+	send_msg(MSG_KEEPALIVE, NULL, 0);
+
+	printf("announcing %u prefixes\n", nprefix);
+	send_table(as, nprefix);
+	/* let bgpd process the table before measuring */
+	run(NULL, secs, -1);
+
+	run(&idle, secs, -1);
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_WRONLY)) == -1)
+			err(1, "/dev/null");
+		dup2(fd, STDOUT_FILENO);
+		if (ctlsock != NULL)
+			execlp("bgpctl", "bgpctl", "-s", ctlsock, "show",
+			    "rib", (char *)NULL);
+		else
+			execlp("bgpctl", "bgpctl", "show", "rib", (char *)NULL);
+		err(1, "bgpctl");
+	}
+	dump.last = idle.last;
+	run(&dump, 0, pid);
+
+	report("idle:", &idle);
+	report("show rib:", &dump);
+
+	close(sock);
+	return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Route flap damping test
+ *
+ * Drives rde_damp.c with a fake clock. Checks that the penalty halves
+ * with every half-life, that a route pushed to the penalty ceiling is
+ * reused after the maximum suppress time, and that the state of a route
+ * is forgotten once its penalty decayed below half the reuse limit.
+ * Routes from iBGP peers must not be damped at all.
+ *
+ * usage: damp_test
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "bgpd.h"
+#include "rde.h"
+#include "log.h"
+
+/* the RFC 7196 parameters rde_damp.c uses */
+#define HALFLIFE	(15 * 60)
+#define MAX_SUPPRESS	(60 * 60)
+/* the rounding of the decay steps and the timer wheel */
+#define SLACK		(HALFLIFE / 64 + 5 + 1)
+
+#define NPTS		8
+
+static struct rde_peer	 ebgp, ibgp;
+static struct pt_entry	 pts[NPTS];
+static time_t		 now = 100000;
+static unsigned int	 reuse_cnt;
+
+monotime_t
+getmonotime(void)
+{
+	return monotime_from_sec(now);
+}
+
+struct rde_peer *
+peer_get(uint32_t id)
+{
+	if (id == ebgp.conf.id)
+		return &ebgp;
+	if (id == ibgp.conf.id)
+		return &ibgp;
+	return NULL;
+}
+
+void
+rde_update_reuse(struct rde_peer *peer, struct pt_entry *pt,
+    uint32_t path_id)
+{
+	reuse_cnt++;
+}
+
+void
+pt_remove(struct pt_entry *pt)
+{
+}
+
+static int
+withdraw(struct rde_peer *peer, struct pt_entry *pt, int n)
+{
+	int suppressed = 0;
+
+	while (n-- > 0)
+		suppressed = damp_update(peer, pt, 0, DAMP_WITHDRAW);
+	return suppressed;
+}
+
+/* run the clock forward until done() or limit seconds passed */
+static time_t
+run_until(int (*done)(struct pt_entry *), struct pt_entry *pt, time_t limit)
+{
+	time_t start = now;
+
+	while (!done(pt) && now - start < limit) {
+		now++;
+		damp_runner();
+	}
+	return now - start;
+}
+
+static int
+is_reused(struct pt_entry *pt)
+{
+	return reuse_cnt != 0;
+}
+
+static int
+is_forgotten(struct pt_entry *pt)
+{
+	return damp_timeout() == -1;
+}
+
+static int
+check_decay(void)
+{
+	/* withdraws needed on top of 5000 / 2^n to reach 6000 */
+	static const int need[] = { 0, 4, 5, 6, 6 };
+	int n, fail = 0;
+
+	for (n = 1; n <= 4; n++) {
+		withdraw(&ebgp, &pts[n], 5);
+		now += n * HALFLIFE;
+		if (withdraw(&ebgp, &pts[n], need[n] - 1) ||
+		    !withdraw(&ebgp, &pts[n], 1)) {
+			warnx("decay: wrong penalty after %d half-lives", n);
+			fail = 1;
+		}
+	}
+	damp_shutdown();
+	if (!fail)
+		printf("decay: ok\n");
+	return fail;
+}
+
+static int
+check_reuse(void)
+{
+	struct pt_entry	*pt = &pts[0];
+	time_t		 t;
+
+	reuse_cnt = 0;
+	now += HALFLIFE;
+	if (!withdraw(&ebgp, pt, 20)) {
+		warnx("reuse: route not suppressed");
+		return 1;
+	}
+	/* the ceiling is reached, more flaps must not extend the time */
+	withdraw(&ebgp, pt, 20);
+	if (!damp_update(&ebgp, pt, 0, DAMP_UPDATE)) {
+		warnx("reuse: update not suppressed");
+		return 1;
+	}
+
+	t = run_until(is_reused, pt, 2 * MAX_SUPPRESS);
+	if (reuse_cnt != 1 || t < MAX_SUPPRESS || t > MAX_SUPPRESS + SLACK) {
+		warnx("reuse: after %lld seconds, expected %d",
+		    (long long)t, MAX_SUPPRESS);
+		return 1;
+	}
+	if (damp_suppressed(&ebgp, pt, 0)) {
+		warnx("reuse: still suppressed");
+		return 1;
+	}
+	printf("reuse: ok, after %lld seconds\n", (long long)t);
+
+	/* forgotten once below 375, one more half-life after reuse */
+	t += run_until(is_forgotten, pt, 2 * HALFLIFE);
+	if (t < MAX_SUPPRESS + HALFLIFE ||
+	    t > MAX_SUPPRESS + HALFLIFE + 2 * SLACK) {
+		warnx("forget: after %lld seconds, expected %d",
+		    (long long)t, MAX_SUPPRESS + HALFLIFE);
+		return 1;
+	}
+	printf("forget: ok, after %lld seconds\n", (long long)t);
+	return 0;
+}
+
+static int
+check_forget(void)
+{
+	time_t t;
+
+	/* a single flap, 1000 drops below 375 after 1.42 half-lives */
+	if (withdraw(&ebgp, &pts[1], 1)) {
+		warnx("forget: suppressed after one flap");
+		return 1;
+	}
+	t = run_until(is_forgotten, &pts[1], 2 * HALFLIFE);
+	if (t < HALFLIFE * 142 / 100 || t > HALFLIFE * 142 / 100 + 2 * SLACK) {
+		warnx("forget: single flap after %lld seconds", (long long)t);
+		return 1;
+	}
+	if (pts[1].refcnt != 0) {
+		warnx("forget: pt_entry still referenced");
+		return 1;
+	}
+	printf("forget: ok, single flap after %lld seconds\n", (long long)t);
+	return 0;
+}
+
+static int
+check_ibgp(void)
+{
+	if (withdraw(&ibgp, &pts[2], 20) || damp_timeout() != -1) {
+		warnx("ibgp: route damped");
+		return 1;
+	}
+	printf("ibgp: ok\n");
+	return 0;
+}
+
+int
+main(void)
+{
+	int fail = 0;
+
+	log_init(1, LOG_DAEMON);
+
+	memset(&ebgp, 0, sizeof(ebgp));
+	ebgp.conf.id = 2;
+	ebgp.conf.ebgp = 1;
+	memset(&ibgp, 0, sizeof(ibgp));
+	ibgp.conf.id = 3;
+
+	fail |= check_decay();
+	fail |= check_reuse();
+	fail |= check_forget();
+	fail |= check_ibgp();
+
+	damp_shutdown();
+	return fail;
+}
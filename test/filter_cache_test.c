@@ -0,0 +1,506 @@
+/*
+ * Filter result cache test
+ *
+ * Runs a set of paths that differ in AS path, communities, nexthop and
+ * validation state, each announced for several prefixes, through the
+ * real filter code twice: once through rde_filter() and once through the
+ * result cache bgpd uses for the output filters. Both must agree on the
+ * action and on every attribute the rules set. A second round checks
+ * that answers served from the cache agree as well, and a rule list that
+ * matches on the prefix checks that such lists bypass the cache. The
+ * same is done for the input filters, where the path comes from the
+ * UPDATE and the interned attributes only serve as the cache key.
+ *
+ * The RIB side of the RDE (paths and nexthops) is replaced by the small
+ * versions below, everything else is the code bgpd runs.
+ *
+ * usage: filter_cache_test
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "bgpd.h"
+#include "rde.h"
+#include "log.h"
+
+#define LOCAL_AS	65000
+#define NPATHS		4
+#define NCOMMS		5
+#define NNEXTHOPS	2
+#define NPREFIXES	8
+
+struct rde_memstats	 rdemem;
+
+uint32_t
+rde_local_as(void)
+{
+	return LOCAL_AS;
+}
+
+/* paths are only referenced, never linked into a path table here */
+struct rde_aspath *
+path_ref(struct rde_aspath *asp)
+{
+	if ((asp->flags & F_ATTR_LINKED) == 0)
+		errx(1, "%s: unlinked object", __func__);
+	asp->refcnt++;
+	return asp;
+}
+
+void
+path_unref(struct rde_aspath *asp)
+{
+	if (asp == NULL)
+		return;
+	if ((asp->flags & F_ATTR_LINKED) == 0 || asp->refcnt <= 1)
+		errx(1, "%s: refcnt error", __func__);
+	asp->refcnt--;
+}
+
+struct rde_aspath *
+path_copy(struct rde_aspath *dst, const struct rde_aspath *src)
+{
+	dst->aspath = aspath_copy(src->aspath);
+	dst->refcnt = 0;
+	dst->flags = src->flags & ~F_ATTR_LINKED;
+	dst->med = src->med;
+	dst->lpref = src->lpref;
+	dst->weight = src->weight;
+	dst->rtlabelid = rtlabel_ref(src->rtlabelid);
+	dst->pftableid = pftable_ref(src->pftableid);
+	dst->origin = src->origin;
+	attr_copy(dst, src);
+	return dst;
+}
+
+struct rde_aspath *
+path_prep(struct rde_aspath *asp)
+{
+	memset(asp, 0, sizeof(*asp));
+	asp->origin = ORIGIN_INCOMPLETE;
+	asp->lpref = DEFAULT_LPREF;
+	return asp;
+}
+
+void
+path_clean(struct rde_aspath *asp)
+{
+	if (asp->flags & F_ATTR_LINKED)
+		errx(1, "%s: linked object", __func__);
+	rtlabel_unref(asp->rtlabelid);
+	pftable_unref(asp->pftableid);
+	aspath_put(asp->aspath);
+	asp->aspath = NULL;
+	attr_freeall(asp);
+}
+
+struct nexthop *
+nexthop_ref(struct nexthop *nh)
+{
+	if (nh != NULL)
+		nh->refcnt++;
+	return nh;
+}
+
+int
+nexthop_unref(struct nexthop *nh)
+{
+	if (nh == NULL)
+		return 0;
+	if (--nh->refcnt <= 0)
+		errx(1, "%s: refcnt error", __func__);
+	return 0;
+}
+
+void
+nexthop_modify(struct nexthop *setnh, enum action_types type, uint8_t aid,
+    struct nexthop **nexthop, uint8_t *flags)
+{
+	switch (type) {
+	case ACTION_SET_NEXTHOP_REJECT:
+		*flags = NEXTHOP_REJECT;
+		break;
+	case ACTION_SET_NEXTHOP_BLACKHOLE:
+		*flags = NEXTHOP_BLACKHOLE;
+		break;
+	case ACTION_SET_NEXTHOP_NOMODIFY:
+		*flags = NEXTHOP_NOMODIFY;
+		break;
+	case ACTION_SET_NEXTHOP_SELF:
+		*flags = NEXTHOP_SELF;
+		break;
+	case ACTION_SET_NEXTHOP_REF:
+		if (aid != setnh->exit_nexthop.aid)
+			break;
+		nexthop_unref(*nexthop);
+		*nexthop = nexthop_ref(setnh);
+		*flags = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+static struct rde_aspath	 paths[NPATHS];
+static struct rde_community	*comms[NCOMMS];
+static struct nexthop		 nexthops[NNEXTHOPS];
+
+static void
+make_paths(void)
+{
+	uint8_t		 seg[2 + 3 * 4];
+	uint32_t	 as;
+	int		 i, j;
+
+	for (i = 0; i < NPATHS; i++) {
+		/* AS_SEQUENCE of 1 to 3 ASes */
+		seg[0] = AS_SEQUENCE;
+		seg[1] = i % 3 + 1;
+		for (j = 0; j < seg[1]; j++) {
+			as = htonl(64512 + i * 10 + j);
+			memcpy(seg + 2 + j * 4, &as, 4);
+		}
+		path_prep(&paths[i]);
+		paths[i].aspath = aspath_get(seg, 2 + seg[1] * 4);
+		paths[i].origin = i % 3;
+		paths[i].med = i * 10;
+		paths[i].flags = F_ATTR_LINKED;
+		paths[i].refcnt = 1;
+	}
+}
+
+static void
+make_comms(void)
+{
+	/* none, 65000:1, 65000:2, 65000:3, 65000:1 65000:3 */
+	static const uint32_t	 vals[NCOMMS][2] = {
+		{ 0, 0 }, { 1, 0 }, { 2, 0 }, { 3, 0 }, { 1, 3 }
+	};
+	struct rde_community	 c;
+	struct community	 fc;
+	int			 i, j;
+
+	for (i = 0; i < NCOMMS; i++) {
+		memset(&c, 0, sizeof(c));
+		for (j = 0; j < 2; j++) {
+			if (vals[i][j] == 0)
+				continue;
+			memset(&fc, 0, sizeof(fc));
+			fc.flags = COMMUNITY_TYPE_BASIC;
+			fc.data1 = LOCAL_AS;
+			fc.data2 = vals[i][j];
+			community_set(&c, &fc, NULL);
+		}
+		/* one reference for the table, one for the prefixes */
+		comms[i] = communities_ref(communities_link(&c));
+		communities_clean(&c);
+	}
+}
+
+static void
+make_nexthops(void)
+{
+	int	i;
+
+	for (i = 0; i < NNEXTHOPS; i++) {
+		memset(&nexthops[i], 0, sizeof(nexthops[i]));
+		nexthops[i].exit_nexthop.aid = AID_INET;
+		nexthops[i].exit_nexthop.v4.s_addr = htonl(0xc6336401 + i);
+		nexthops[i].refcnt = 1;
+		nexthops[i].state = NEXTHOP_REACH;
+	}
+}
+
+static struct filter_rule *
+add_rule(struct filter_head *rules, enum filter_actions action,
+    uint32_t comm)
+{
+	struct filter_rule	*r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&r->set);
+	r->action = action;
+	r->dir = DIR_OUT;
+	if (comm != 0) {
+		r->match.community[0].flags = COMMUNITY_TYPE_BASIC;
+		r->match.community[0].data1 = LOCAL_AS;
+		r->match.community[0].data2 = comm;
+	}
+	TAILQ_INSERT_TAIL(rules, r, entry);
+	return r;
+}
+
+static struct filter_set *
+add_set(struct filter_rule *r, enum action_types type)
+{
+	struct filter_set	*s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		err(1, NULL);
+	s->type = type;
+	TAILQ_INSERT_TAIL(&r->set, s, entry);
+	return s;
+}
+
+static struct filter_head *
+make_rules(int byprefix)
+{
+	struct filter_head	*rules;
+	struct filter_rule	*r;
+	struct filter_set	*s;
+
+	if ((rules = calloc(1, sizeof(*rules))) == NULL)
+		err(1, NULL);
+	TAILQ_INIT(rules);
+
+	/* allow to any set community 65000:99 */
+	r = add_rule(rules, ACTION_ALLOW, 0);
+	s = add_set(r, ACTION_SET_COMMUNITY);
+	s->action.community.flags = COMMUNITY_TYPE_BASIC;
+	s->action.community.data1 = LOCAL_AS;
+	s->action.community.data2 = 99;
+
+	/* match to any community 65000:1 set { localpref 200 med +5 } */
+	r = add_rule(rules, ACTION_NONE, 1);
+	s = add_set(r, ACTION_SET_LOCALPREF);
+	s->action.metric = 200;
+	s = add_set(r, ACTION_SET_RELATIVE_MED);
+	s->action.relative = 5;
+
+	/* deny quick to any community 65000:2 */
+	r = add_rule(rules, ACTION_DENY, 2);
+	r->quick = 1;
+
+	/* match to any community 65000:3 set { nexthop self prepend-self 2 } */
+	r = add_rule(rules, ACTION_NONE, 3);
+	add_set(r, ACTION_SET_NEXTHOP_SELF);
+	s = add_set(r, ACTION_SET_PREPEND_SELF);
+	s->action.prepend = 2;
+
+	if (byprefix) {
+		/* match to any prefix 10.0.0.0/8 prefixlen >= 24 set weight */
+		r = add_rule(rules, ACTION_NONE, 0);
+		r->match.prefix.addr.aid = AID_INET;
+		r->match.prefix.addr.v4.s_addr = htonl(0x0a000000);
+		r->match.prefix.len = 8;
+		r->match.prefix.op = OP_RANGE;
+		r->match.prefix.len_min = 24;
+		r->match.prefix.len_max = 32;
+		s = add_set(r, ACTION_SET_WEIGHT);
+		s->action.metric = 1000;
+	}
+	return rules;
+}
+
+static void
+make_prefix(int i, struct bgpd_addr *addr, uint8_t *plen)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->aid = AID_INET;
+	/* half of them in 10/8, with two different lengths */
+	if (i % 2 == 0)
+		addr->v4.s_addr = htonl(0x0a000000 | i << 8);
+	else
+		addr->v4.s_addr = htonl(0xcb000000 | i << 8);
+	*plen = i % 4 < 2 ? 24 : 16;
+	if (*plen == 16)
+		addr->v4.s_addr &= htonl(0xffff0000);
+}
+
+static int
+same_state(struct filterstate *a, struct filterstate *b)
+{
+	return a->aspath.lpref == b->aspath.lpref &&
+	    a->aspath.med == b->aspath.med &&
+	    a->aspath.weight == b->aspath.weight &&
+	    a->aspath.origin == b->aspath.origin &&
+	    a->aspath.flags == b->aspath.flags &&
+	    aspath_compare(a->aspath.aspath, b->aspath.aspath) == 0 &&
+	    communities_equal(&a->communities, &b->communities) &&
+	    a->nexthop == b->nexthop &&
+	    a->nhflags == b->nhflags &&
+	    a->vstate == b->vstate;
+}
+
+static int
+check_outbound(const char *what, struct rde_filter_cache *fc,
+    struct filter_head *rules, struct rde_peer *peer, struct rde_peer *from)
+{
+	struct filterstate	 s1, s2;
+	struct prefix		 p;
+	struct bgpd_addr	 addr;
+	enum filter_actions	 a1, a2;
+	uint8_t			 plen;
+	int			 i, c, n, x, bad = 0, runs = 0;
+
+	for (i = 0; i < NPATHS; i++)
+	for (c = 0; c < NCOMMS; c++)
+	for (n = 0; n < NNEXTHOPS; n++)
+	for (x = 0; x < NPREFIXES; x++) {
+		memset(&p, 0, sizeof(p));
+		p.aspath = &paths[i];
+		p.communities = comms[c];
+		p.nexthop = &nexthops[n];
+		p.peer = from;
+		p.validation_state = (i + x) % 3;
+		make_prefix(x, &addr, &plen);
+
+		rde_filterstate_prep(&s1, &p);
+		a1 = rde_filter(rules, peer, from, &addr, plen, &s1);
+		a2 = rde_filter_cached(fc, rules, peer, from, &p, &addr, plen,
+		    &s2);
+		if (a1 != a2 || (a1 != ACTION_DENY && !same_state(&s1, &s2))) {
+			if (bad++ == 0)
+				warnx("%s: path %d comm %d nexthop %d prefix "
+				    "%d differs", what, i, c, n, x);
+		}
+		rde_filterstate_clean(&s1);
+		rde_filterstate_clean(&s2);
+		runs++;
+	}
+	if (bad != 0) {
+		warnx("%s: %d of %d results differ", what, bad, runs);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+check_inbound(const char *what, struct rde_filter_cache *fc,
+    struct filter_head *rules, struct rde_peer *peer)
+{
+	struct filterstate	 in, s1, s2;
+	struct prefix		 p;
+	struct bgpd_addr	 addr;
+	enum filter_actions	 a1, a2;
+	uint8_t			 plen;
+	int			 i, c, n, x, bad = 0, runs = 0;
+
+	for (i = 0; i < NPATHS; i++)
+	for (c = 0; c < NCOMMS; c++)
+	for (n = 0; n < NNEXTHOPS; n++)
+	for (x = 0; x < NPREFIXES; x++) {
+		/* the attributes as parsed from the UPDATE */
+		memset(&p, 0, sizeof(p));
+		p.aspath = &paths[i];
+		p.communities = comms[c];
+		p.nexthop = &nexthops[n];
+		p.peer = peer;
+		p.validation_state = (i + x) % 3;
+		rde_filterstate_prep(&in, &p);
+		make_prefix(x, &addr, &plen);
+
+		rde_filterstate_copy(&s1, &in);
+		a1 = rde_filter(rules, peer, peer, &addr, plen, &s1);
+		a2 = rde_filter_cached_state(fc, rules, peer, peer, &paths[i],
+		    comms[c], &in, &addr, plen, &s2);
+		if (a1 != a2 || (a1 != ACTION_DENY && !same_state(&s1, &s2))) {
+			if (bad++ == 0)
+				warnx("%s: path %d comm %d nexthop %d prefix "
+				    "%d differs", what, i, c, n, x);
+		}
+		rde_filterstate_clean(&in);
+		rde_filterstate_clean(&s1);
+		rde_filterstate_clean(&s2);
+		runs++;
+	}
+	if (bad != 0) {
+		warnx("%s: %d of %d results differ", what, bad, runs);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(void)
+{
+	struct rde_peer		 peer, from;
+	struct rde_filter_cache	*fc;
+	struct filter_head	*rules, *prules;
+	uint64_t		 hits, misses;
+	int			 fail = 0;
+
+	log_init(1, LOG_DAEMON);
+
+	memset(&peer, 0, sizeof(peer));
+	peer.conf.id = 2;
+	peer.conf.ebgp = 1;
+	peer.conf.local_as = LOCAL_AS;
+	peer.conf.remote_as = 64600;
+	memset(&from, 0, sizeof(from));
+	from.conf.id = 3;
+	from.conf.ebgp = 1;
+	from.conf.remote_as = 64512;
+
+	make_paths();
+	make_comms();
+	make_nexthops();
+	rules = make_rules(0);
+	prules = make_rules(1);
+
+	fc = rde_filter_cache_new();
+	fail |= check_outbound("outbound", fc, rules, &peer, &from);
+	rde_filter_cache_stats(fc, &hits, &misses);
+	if (misses == 0 || hits == 0) {
+		warnx("outbound: %llu hits, %llu misses, cache not used",
+		    (unsigned long long)hits, (unsigned long long)misses);
+		fail = 1;
+	}
+	fail |= check_outbound("outbound cached", fc, rules, &peer, &from);
+	if (!fail)
+		printf("outbound: ok, %llu of %llu answered by the cache\n",
+		    (unsigned long long)hits,
+		    (unsigned long long)(hits + misses));
+
+	rde_filter_cache_free(fc);
+	fc = rde_filter_cache_new();
+	fail |= check_inbound("inbound", fc, rules, &from);
+	rde_filter_cache_stats(fc, &hits, &misses);
+	if (misses == 0 || hits == 0) {
+		warnx("inbound: %llu hits, %llu misses, cache not used",
+		    (unsigned long long)hits, (unsigned long long)misses);
+		fail = 1;
+	}
+	fail |= check_inbound("inbound cached", fc, rules, &from);
+	if (!fail)
+		printf("inbound: ok, %llu of %llu answered by the cache\n",
+		    (unsigned long long)hits,
+		    (unsigned long long)(hits + misses));
+
+	/* a list matching on the prefix must not use the cache */
+	rde_filter_cache_free(fc);
+	fc = rde_filter_cache_new();
+	fail |= check_outbound("by prefix", fc, prules, &peer, &from);
+	rde_filter_cache_stats(fc, &hits, &misses);
+	if (hits != 0 || misses != 0) {
+		warnx("by prefix: cache used");
+		fail = 1;
+	} else if (!fail)
+		printf("by prefix: ok\n");
+
+	/* a flushed cache drops all its references */
+	fail |= check_outbound("outbound", fc, rules, &peer, &from);
+	rde_filter_cache_flush(fc);
+	if (paths[0].refcnt != 1 || nexthops[0].refcnt != 1 ||
+	    comms[1]->refcnt != 2) {
+		warnx("flush: references left");
+		fail = 1;
+	} else if (!fail)
+		printf("flush: ok\n");
+
+	rde_filter_cache_free(fc);
+	filterlist_free(rules);
+	filterlist_free(prules);
+	return fail;
+}
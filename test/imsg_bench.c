@@ -0,0 +1,146 @@
+/*
+ * imsg throughput benchmark
+ *
+ * Pushes a stream of small imsgs (sized like the UPDATE and ROA messages
+ * exchanged between the bgpd processes) through a socketpair and reports
+ * messages per second and the number of write and read calls needed.
+ * With -m the data goes through a shared memory ring instead.
+ *
+ * usage: imsg_bench [-m] [-n count] [-s size]
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imsg.h"
+
+#define IMSG_BENCH	42
+#define SHM_SIZE	(8 * 1024 * 1024)
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct imsgbuf	 wbuf, rbuf;
+	struct imsg	 imsg;
+	struct pollfd	 pfd[2];
+	char		*payload;
+	void		*shm;
+	double		 start, elapsed;
+	unsigned long	 count = 1000000, sent = 0, recvd = 0;
+	unsigned long	 writes = 0, reads = 0;
+	size_t		 size = 64;
+	int		 fds[2], ch, mflag = 0;
+	ssize_t		 n;
+
+	while ((ch = getopt(argc, argv, "mn:s:")) != -1) {
+		switch (ch) {
+		case 'm':
+			mflag = 1;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: imsg_bench [-m] [-n count] "
+			    "[-s size]\n");
+			return 1;
+		}
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, PF_UNSPEC,
+	    fds) == -1)
+		err(1, "socketpair");
+	if (imsgbuf_init(&wbuf, fds[0]) == -1 ||
+	    imsgbuf_init(&rbuf, fds[1]) == -1)
+		err(1, "imsgbuf_init");
+	if (mflag) {
+		shm = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANON, -1, 0);
+		if (shm == MAP_FAILED)
+			err(1, "mmap");
+		if (imsgbuf_set_shm(&wbuf, shm, SHM_SIZE, 0) == -1 ||
+		    imsgbuf_set_shm(&rbuf, shm, SHM_SIZE, 1) == -1)
+			err(1, "imsgbuf_set_shm");
+	}
+	if ((payload = calloc(1, size)) == NULL)
+		err(1, NULL);
+
+	start = now();
+	while (recvd < count) {
+		/* queue up to a pipe full of messages like the RDE does */
+		while (sent < count && imsgbuf_queuelen(&wbuf) < 10000) {
+			if (imsg_compose(&wbuf, IMSG_BENCH, sent, 0, -1,
+			    payload, size) == -1)
+				err(1, "imsg_compose");
+			sent++;
+		}
+
+		pfd[0].fd = fds[0];
+		pfd[0].events = imsgbuf_queuelen(&wbuf) > 0 &&
+		    !imsgbuf_write_blocked(&wbuf) ? POLLOUT : 0;
+		pfd[1].fd = fds[1];
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, 1000) == -1)
+			err(1, "poll");
+
+		if (pfd[0].revents & POLLOUT) {
+			if (imsgbuf_write(&wbuf) == -1)
+				err(1, "imsgbuf_write");
+			writes++;
+		}
+		if (pfd[1].revents & POLLIN) {
+			if ((n = imsgbuf_read(&rbuf)) == -1)
+				err(1, "imsgbuf_read");
+			if (n == 0)
+				errx(1, "connection closed");
+			reads++;
+			while ((n = imsg_get(&rbuf, &imsg)) > 0) {
+				if (imsg_get_type(&imsg) != IMSG_BENCH ||
+				    imsg_get_len(&imsg) != size)
+					errx(1, "bad message");
+				recvd++;
+				imsg_free(&imsg);
+			}
+			if (n == -1)
+				err(1, "imsg_get");
+		}
+	}
+	elapsed = now() - start;
+
+	printf("%lu msgs of %zu bytes in %.3f s: %.0f msgs/s, %.1f MB/s\n",
+	    count, size, elapsed, count / elapsed,
+	    count * (size + IMSG_HEADER_SIZE) / elapsed / 1e6);
+	printf("%lu write calls (%.1f msgs each), %lu read calls "
+	    "(%.1f msgs each)\n", writes, (double)count / writes,
+	    reads, (double)count / reads);
+
+	imsgbuf_clear(&wbuf);
+	imsgbuf_clear(&rbuf);
+	free(payload);
+	return 0;
+}
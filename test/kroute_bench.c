@@ -0,0 +1,222 @@
+/*
+ * kroute longest prefix match benchmark
+ *
+ * Builds a synthetic IPv4 kernel table (a full table worth of prefixes
+ * plus connected networks) and a set of BGP nexthops inside the connected
+ * networks. Then an interface flap is simulated: the connected networks
+ * are removed, all nexthops are revalidated, the networks are added back
+ * and the nexthops are revalidated again.
+ * The revalidation is done once with the old per prefixlen RB tree lookup
+ * and once with the kroute trie and the results are compared.
+ *
+ * usage: kroute_bench [-c connected] [-n nexthops] [-p prefixes]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/tree.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bgpd.h"
+
+struct route {
+	RB_ENTRY(route)	 entry;
+	struct in_addr	 prefix;
+	uint8_t		 prefixlen;
+};
+
+static RB_HEAD(route_tree, route) rt = RB_INITIALIZER(&rt);
+static struct ktrie_head th;
+
+static int
+route_cmp(struct route *a, struct route *b)
+{
+	if (ntohl(a->prefix.s_addr) < ntohl(b->prefix.s_addr))
+		return -1;
+	if (ntohl(a->prefix.s_addr) > ntohl(b->prefix.s_addr))
+		return 1;
+	return a->prefixlen - b->prefixlen;
+}
+
+RB_GENERATE_STATIC(route_tree, route, entry, route_cmp)
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static in_addr_t
+mask(in_addr_t a, uint8_t plen)
+{
+	if (plen == 0)
+		return 0;
+	return htonl(ntohl(a) & (0xffffffffU << (32 - plen)));
+}
+
+static void
+add(in_addr_t a, uint8_t plen)
+{
+	struct route	*r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		err(1, NULL);
+	r->prefix.s_addr = mask(a, plen);
+	r->prefixlen = plen;
+	if (RB_INSERT(route_tree, &rt, r) != NULL) {
+		free(r);
+		return;
+	}
+	if (ktrie_add(&th, &r->prefix, plen) == -1)
+		err(1, "ktrie_add");
+}
+
+static void
+del(in_addr_t a, uint8_t plen)
+{
+	struct route	 s, *r;
+
+	s.prefix.s_addr = mask(a, plen);
+	s.prefixlen = plen;
+	if ((r = RB_FIND(route_tree, &rt, &s)) == NULL)
+		return;
+	RB_REMOVE(route_tree, &rt, r);
+	ktrie_del(&th, &r->prefix, plen);
+	free(r);
+}
+
+/* the lookup done by kroute_match() before the trie */
+static struct route *
+match_loop(in_addr_t a)
+{
+	struct route	 s, *r;
+	int		 i;
+
+	for (i = 32; i >= 0; i--) {
+		s.prefix.s_addr = mask(a, i);
+		s.prefixlen = i;
+		if ((r = RB_FIND(route_tree, &rt, &s)) != NULL)
+			return r;
+	}
+	return NULL;
+}
+
+static struct route *
+match_trie(in_addr_t a)
+{
+	struct route	 s, *r;
+	uint8_t		 plens[33];
+	int		 i;
+
+	i = ktrie_match(&th, &a, plens);
+	while (--i >= 0) {
+		s.prefix.s_addr = mask(a, plens[i]);
+		s.prefixlen = plens[i];
+		if ((r = RB_FIND(route_tree, &rt, &s)) != NULL)
+			return r;
+	}
+	return NULL;
+}
+
+static double
+revalidate(struct route *(*match)(in_addr_t), in_addr_t *nh,
+    struct route **res, size_t n)
+{
+	double	start;
+	size_t	i;
+
+	start = now();
+	for (i = 0; i < n; i++)
+		res[i] = match(nh[i]);
+	return now() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct route	**r1, **r2;
+	in_addr_t	 *nh, *conn;
+	double		  t1 = 0, t2 = 0;
+	size_t		  nprefix = 900000, nnexthop = 10000, nconn = 256;
+	size_t		  i;
+	int		  ch, round;
+
+	while ((ch = getopt(argc, argv, "c:n:p:")) != -1) {
+		switch (ch) {
+		case 'c':
+			nconn = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			nnexthop = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			nprefix = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: kroute_bench [-c connected] "
+			    "[-n nexthops] [-p prefixes]\n");
+			return 1;
+		}
+	}
+	if (nconn == 0)
+		errx(1, "need at least one connected network");
+
+	ktrie_init(&th, sizeof(struct in_addr));
+	srandom(42);
+
+	/* default route and a full table with mostly /24 */
+	add(0, 0);
+	for (i = 0; i < nprefix; i++)
+		add(random(), random() % 100 < 60 ? 24 : 8 + random() % 17);
+
+	/* connected /30 networks spread over the address space */
+	if ((conn = calloc(nconn, sizeof(*conn))) == NULL ||
+	    (nh = calloc(nnexthop, sizeof(*nh))) == NULL ||
+	    (r1 = calloc(nnexthop, sizeof(*r1))) == NULL ||
+	    (r2 = calloc(nnexthop, sizeof(*r2))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < nconn; i++) {
+		conn[i] = random();
+		add(conn[i], 30);
+	}
+	for (i = 0; i < nnexthop; i++)
+		nh[i] = htonl(ntohl(conn[i % nconn]) | 1);
+
+	for (round = 0; round < 2; round++) {
+		/* interface down: connected networks are gone */
+		for (i = 0; i < nconn; i++)
+			del(conn[i], 30);
+		t1 += revalidate(match_loop, nh, r1, nnexthop);
+		t2 += revalidate(match_trie, nh, r2, nnexthop);
+		if (memcmp(r1, r2, nnexthop * sizeof(*r1)) != 0)
+			errx(1, "lookup mismatch after interface down");
+
+		/* interface up again */
+		for (i = 0; i < nconn; i++)
+			add(conn[i], 30);
+		t1 += revalidate(match_loop, nh, r1, nnexthop);
+		t2 += revalidate(match_trie, nh, r2, nnexthop);
+		if (memcmp(r1, r2, nnexthop * sizeof(*r1)) != 0)
+			errx(1, "lookup mismatch after interface up");
+	}
+
+	printf("%zu prefixes, %zu nexthops, 2 interface flaps\n",
+	    nprefix, nnexthop);
+	printf("per prefixlen lookup: %.3f ms (%.0f ns per nexthop)\n",
+	    t1 * 1e3, t1 * 1e9 / (4 * nnexthop));
+	printf("trie lookup:          %.3f ms (%.0f ns per nexthop)\n",
+	    t2 * 1e3, t2 * 1e9 / (4 * nnexthop));
+
+	ktrie_free(&th);
+	return 0;
+}
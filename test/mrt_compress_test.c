@@ -0,0 +1,185 @@
+/*
+ * MRT dump compression round trip test
+ *
+ * Writes BGP4MP state change records through the compressor bgpd uses
+ * for ".gz" (and, if built with zstd, ".zst") dumps, then reads the file
+ * back with the bgpctl MRT parser and checks that every record arrives
+ * unchanged and in order. A plain dump is checked the same way.
+ *
+ * usage: mrt_compress_test [-n records]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "bgpd.h"
+#include "mrt.h"
+#include "mrtparser.h"
+#include "log.h"
+
+#define SRC_AS		64500
+#define DST_AS		4200000000U
+
+struct check {
+	const char	*name;
+	unsigned int	 seen;
+	unsigned int	 bad;
+};
+
+static void
+put_record(int fd, unsigned int i)
+{
+	uint8_t		 rec[MRT_HEADER_SIZE + 24], *p = rec;
+	uint32_t	 v32;
+	uint16_t	 v16;
+	size_t		 off = 0;
+	ssize_t		 n;
+
+	v32 = htonl(1700000000 + i);			/* timestamp */
+	memcpy(p, &v32, 4);
+	v16 = htons(MSG_PROTOCOL_BGP4MP);
+	memcpy(p + 4, &v16, 2);
+	v16 = htons(BGP4MP_STATE_CHANGE_AS4);
+	memcpy(p + 6, &v16, 2);
+	v32 = htonl(sizeof(rec) - MRT_HEADER_SIZE);
+	memcpy(p + 8, &v32, 4);
+	p += MRT_HEADER_SIZE;
+
+	v32 = htonl(SRC_AS);
+	memcpy(p, &v32, 4);
+	v32 = htonl(DST_AS);
+	memcpy(p + 4, &v32, 4);
+	v16 = 0;					/* if_index */
+	memcpy(p + 8, &v16, 2);
+	v16 = htons(AFI_IPv4);
+	memcpy(p + 10, &v16, 2);
+	v32 = htonl(0xc0000200 | (i & 0xff));		/* 192.0.2.x */
+	memcpy(p + 12, &v32, 4);
+	v32 = htonl(i);
+	memcpy(p + 16, &v32, 4);
+	v16 = htons(i % 6 + 1);
+	memcpy(p + 20, &v16, 2);
+	v16 = htons((i + 1) % 6 + 1);
+	memcpy(p + 22, &v16, 2);
+
+	/* the compressor pipe is non-blocking like for the RDE and SE */
+	while (off < sizeof(rec)) {
+		if ((n = write(fd, rec + off, sizeof(rec) - off)) == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				struct pollfd pfd = { fd, POLLOUT, 0 };
+
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			err(1, "write");
+		}
+		off += n;
+	}
+}
+
+static void
+check_state(struct mrt_bgp_state *s, void *arg)
+{
+	struct check	*c = arg;
+	unsigned int	 i = c->seen++;
+
+	if (s->time.tv_sec != 1700000000 + i ||
+	    s->src_as != SRC_AS || s->dst_as != DST_AS ||
+	    s->src.aid != AID_INET ||
+	    ntohl(s->src.v4.s_addr) != (0xc0000200 | (i & 0xff)) ||
+	    ntohl(s->dst.v4.s_addr) != i ||
+	    s->old_state != i % 6 + 1 || s->new_state != (i + 1) % 6 + 1) {
+		if (c->bad++ == 0)
+			warnx("%s: record %u differs", c->name, i);
+	}
+}
+
+static int
+roundtrip(const char *dir, const char *suffix, unsigned int nrec)
+{
+	struct mrt_parser	 p;
+	struct check		 c;
+	char			 file[PATH_MAX];
+	unsigned int		 i;
+	int			 fd, wfd;
+
+	snprintf(file, sizeof(file), "%s/dump.mrt%s", dir, suffix);
+	if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		err(1, "%s", file);
+	wfd = mrt_compress_open(file, fd);
+	for (i = 0; i < nrec; i++)
+		put_record(wfd, i);
+	close(wfd);
+	/* finalizes the compressed stream */
+	mrt_compress_shutdown();
+
+	memset(&c, 0, sizeof(c));
+	c.name = file;
+	memset(&p, 0, sizeof(p));
+	p.state = check_state;
+	p.arg = &c;
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(1, "%s", file);
+	mrt_parse(fd, &p, 1);
+	close(fd);
+	unlink(file);
+
+	if (c.seen != nrec || c.bad != 0) {
+		warnx("%s: %u of %u records read, %u bad", file, c.seen, nrec,
+		    c.bad);
+		return 1;
+	}
+	printf("%s: %u records ok\n", suffix[0] ? suffix : "plain", nrec);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char		 dir[] = "/tmp/mrtcomp.XXXXXXXXXX";
+	const char	*errstr;
+	unsigned int	 nrec = 100000;
+	int		 ch, fail = 0;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nrec = strtonum(optarg, 1, 10000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "records is %s: %s", errstr, optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: mrt_compress_test "
+			    "[-n records]\n");
+			return 1;
+		}
+	}
+
+	log_init(1, LOG_DAEMON);
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+
+	fail |= roundtrip(dir, "", nrec);
+#ifdef HAVE_ZLIB
+	fail |= roundtrip(dir, ".gz", nrec);
+#endif
+#ifdef HAVE_ZSTD
+	fail |= roundtrip(dir, ".zst", nrec);
+#endif
+
+	rmdir(dir);
+	return fail;
+}
@@ -0,0 +1,142 @@
+#!/bin/sh
+#
+# Measure how fast bgpd moves its FIB routes when the route resolving
+# their BGP nexthop changes, as happens on an IGP failover.
+#
+# Two network namespaces are connected by two links. The peer runs a
+# bgpd announcing N /32 networks over iBGP between loopbacks, so the BGP
+# nexthop is the peer's loopback. The bgpd under test reaches it over a
+# primary and a backup static route. Once all routes are installed the
+# primary route is removed and the time until the last prefix resolves
+# over the backup link is reported. On Linux bgpd programs the routes
+# through a kernel nexthop object, so this is a single nexthop replace.
+#
+# usage: nexthop_failover.sh [routes]
+# Needs root, iproute2 with nexthop object support and a built bgpd, set
+# BGPD to use another binary than ../src/bgpd/bgpd.
+
+set -e
+
+N=${1:-100000}
+BGPD=${BGPD:-$(dirname "$0")/../src/bgpd/bgpd}
+DUT=bgpd-nh-dut
+PEER=bgpd-nh-peer
+TMP=$(mktemp -d)
+
+cleanup() {
+	for ns in $DUT $PEER; do
+		[ -f "$TMP/$ns.pid" ] && kill "$(cat "$TMP/$ns.pid")" 2>/dev/null
+		ip netns del $ns 2>/dev/null || true
+	done
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+now() {
+	date +%s.%N
+}
+
+# print the i-th /32 route in 100.64.0.0/10
+route() {
+	echo "100.$((64 + $1 / 65536)).$(($1 / 256 % 256)).$(($1 % 256))/32"
+}
+
+# wait up to 300s for command to succeed
+waitfor() {
+	t=0
+	until "$@" >/dev/null 2>&1; do
+		t=$((t + 1))
+		if [ $t -gt 3000 ]; then
+			echo "timeout waiting for: $*" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+installed() {
+	[ "$(ip -n $DUT route show proto bgp | wc -l)" -eq "$N" ]
+}
+
+via_backup() {
+	ip -n $DUT route get "${LAST%/32}" | grep -q "dev up2"
+}
+
+ip netns add $DUT
+ip netns add $PEER
+for i in 1 2; do
+	ip link add up$i netns $DUT type veth peer name dn$i netns $PEER
+	ip -n $DUT addr add 192.0.2.$((i * 4 + 1))/30 dev up$i
+	ip -n $PEER addr add 192.0.2.$((i * 4 + 2))/30 dev dn$i
+	ip -n $DUT link set up$i up
+	ip -n $PEER link set dn$i up
+done
+ip -n $DUT link set lo up
+ip -n $PEER link set lo up
+ip -n $DUT addr add 198.51.100.2/32 dev lo
+ip -n $PEER addr add 198.51.100.1/32 dev lo
+
+# primary and backup route towards the other loopback
+ip -n $DUT route add 198.51.100.1/32 via 192.0.2.6 metric 10
+ip -n $DUT route add 198.51.100.1/32 via 192.0.2.10 metric 20
+ip -n $PEER route add 198.51.100.2/32 via 192.0.2.5 metric 10
+ip -n $PEER route add 198.51.100.2/32 via 192.0.2.9 metric 20
+
+cat > "$TMP/$PEER.conf" <<EOF
+AS 64500
+router-id 198.51.100.1
+socket "$TMP/$PEER.sock"
+listen on 198.51.100.1
+fib-update no
+neighbor 198.51.100.2 {
+	remote-as 64500
+	local-address 198.51.100.1
+}
+allow to ibgp
+EOF
+i=0
+while [ $i -lt "$N" ]; do
+	echo "network $(route $i)" >> "$TMP/$PEER.conf"
+	i=$((i + 1))
+done
+LAST=$(route $((N - 1)))
+
+cat > "$TMP/$DUT.conf" <<EOF
+AS 64500
+router-id 198.51.100.2
+socket "$TMP/$DUT.sock"
+listen on 198.51.100.2
+neighbor 198.51.100.1 {
+	remote-as 64500
+	local-address 198.51.100.2
+}
+allow from ibgp
+EOF
+
+for ns in $PEER $DUT; do
+	ip netns exec $ns "$BGPD" -d -f "$TMP/$ns.conf" \
+	    > "$TMP/$ns.log" 2>&1 &
+	echo $! > "$TMP/$ns.pid"
+done
+
+echo "$N routes"
+start=$(now)
+waitfor installed
+end=$(now)
+awk -v s="$start" -v e="$end" \
+    'BEGIN { printf "initial install:  %.3f s\n", e - s }'
+
+nhobj=$(ip -n $DUT route show proto bgp | grep -c " nhid " || true)
+echo "routes using nexthop objects: $nhobj"
+
+start=$(now)
+ip -n $DUT route del 198.51.100.1/32 via 192.0.2.6 metric 10
+waitfor via_backup
+end=$(now)
+awk -v s="$start" -v e="$end" \
+    'BEGIN { printf "nexthop failover: %.3f s\n", e - s }'
+
+if [ "$(ip -n $DUT route show proto bgp | wc -l)" -ne "$N" ]; then
+	echo "routes lost during failover" >&2
+	exit 1
+fi
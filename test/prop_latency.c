@@ -0,0 +1,440 @@
+/*
+ * Prefix propagation latency through bgpd
+ *
+ * Opens two eBGP sessions to a running bgpd, announces prefixes on the
+ * first one and measures how long it takes until bgpd sends them out on
+ * the second one. Every UPDATE carries its send time in a large community
+ * so the receiving side does not need to keep any state. At the end the
+ * per stage latencies of bgpd itself are shown with "bgpctl show rib
+ * latency", run bgpd with -L to have them sampled.
+ *
+ * bgpd needs neighbor entries for both local addresses and has to pass
+ * the routes on, for example:
+ *
+ *	neighbor 127.0.0.2 { remote-as 65001 }
+ *	neighbor 127.0.0.3 { remote-as 65002 }
+ *	allow from any
+ *	allow to any
+ *
+ * usage: prop_latency [-i usec] [-n prefixes] [-p port] [-R receiver]
+ *	  [-S sender] [-s socket] address
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSG_HDR_LEN	19
+#define MSG_MAX_LEN	4096
+#define MSG_OPEN	1
+#define MSG_UPDATE	2
+#define MSG_NOTIFY	3
+#define MSG_KEEPALIVE	4
+#define HOLDTIME	90
+#define ATTR_LARGE_COMM	32
+
+struct peer {
+	const char	*name;
+	uint8_t		 rbuf[MSG_MAX_LEN * 4];
+	size_t		 rlen;
+	int		 sock;
+	int		 established;
+};
+
+static double		*lat;
+static unsigned int	 nlat, maxlat;
+static uint64_t		 last_ka;
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint8_t *
+put16(uint8_t *p, uint16_t v)
+{
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+static uint8_t *
+put32(uint8_t *p, uint32_t v)
+{
+	p = put16(p, v >> 16);
+	return put16(p, v);
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void
+send_msg(struct peer *pe, uint8_t type, const uint8_t *data, size_t len)
+{
+	uint8_t		 msg[MSG_MAX_LEN];
+	size_t		 off = 0;
+	ssize_t		 n;
+
+	memset(msg, 0xff, 16);
+	put16(msg + 16, MSG_HDR_LEN + len);
+	msg[18] = type;
+	memcpy(msg + MSG_HDR_LEN, data, len);
+	len += MSG_HDR_LEN;
+
+	while (off < len) {
+		if ((n = write(pe->sock, msg + off, len - off)) == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				struct pollfd pfd = { pe->sock, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			err(1, "%s: write", pe->name);
+		}
+		off += n;
+	}
+}
+
+static void
+send_open(struct peer *pe, uint32_t as, uint32_t id)
+{
+	uint8_t	 buf[64], *p = buf, *opt;
+
+	*p++ = 4;
+	p = put16(p, as > 0xffff ? 23456 : as);
+	p = put16(p, HOLDTIME);
+	p = put32(p, id);
+	opt = p++;
+	/* capabilities: multiprotocol IPv4 unicast and 4-byte AS */
+	*p++ = 2;
+	*p++ = 12;
+	*p++ = 1;
+	*p++ = 4;
+	p = put16(p, 1);
+	*p++ = 0;
+	*p++ = 1;
+	*p++ = 65;
+	*p++ = 4;
+	p = put32(p, as);
+	*opt = p - opt - 1;
+	send_msg(pe, MSG_OPEN, buf, p - buf);
+}
+
+/*
+ * Announce prefix number i out of 16.0.0.0/4 as a /24 with the current
+ * time in a large community.
+ */
+static void
+send_prefix(struct peer *pe, uint32_t as, unsigned int i)
+{
+	struct sockaddr_in	 sin;
+	socklen_t		 slen = sizeof(sin);
+	uint8_t			 buf[128], *p;
+	uint64_t		 t;
+	uint32_t		 pfx;
+
+	if (getsockname(pe->sock, (struct sockaddr *)&sin, &slen) == -1)
+		err(1, "getsockname");
+
+	p = put16(buf, 0);		/* no withdrawn routes */
+	p = put16(p, 4 + 9 + 7 + 15);
+	/* ORIGIN IGP */
+	*p++ = 0x40; *p++ = 1; *p++ = 1; *p++ = 0;
+	/* AS_PATH */
+	*p++ = 0x40; *p++ = 2; *p++ = 6; *p++ = 2; *p++ = 1;
+	p = put32(p, as);
+	/* NEXTHOP */
+	*p++ = 0x40; *p++ = 3; *p++ = 4;
+	memcpy(p, &sin.sin_addr, 4);
+	p += 4;
+	/* LARGE_COMMUNITY as:seconds:microseconds */
+	t = now_usec();
+	*p++ = 0xc0; *p++ = ATTR_LARGE_COMM; *p++ = 12;
+	p = put32(p, as);
+	p = put32(p, t / 1000000);
+	p = put32(p, t % 1000000);
+
+	pfx = 0x10000000 + (i << 8);
+	*p++ = 24;
+	*p++ = pfx >> 24;
+	*p++ = pfx >> 16;
+	*p++ = pfx >> 8;
+	send_msg(pe, MSG_UPDATE, buf, p - buf);
+}
+
+/*
+ * Take the send time out of the large community and account it for
+ * every prefix in the NLRI.
+ */
+static void
+recv_update(const uint8_t *p, size_t len)
+{
+	size_t		 wlen, alen, off, l;
+	uint64_t	 sent = 0, t;
+	uint8_t		 flags, type;
+	unsigned int	 n = 0;
+
+	if (len < 4)
+		return;
+	wlen = p[0] << 8 | p[1];
+	if (2 + wlen + 2 > len)
+		return;
+	alen = p[2 + wlen] << 8 | p[3 + wlen];
+	p += 4 + wlen;
+	len -= 4 + wlen;
+	if (alen > len)
+		return;
+
+	for (off = 0; off + 4 <= alen; off += l) {
+		flags = p[off];
+		type = p[off + 1];
+		if (flags & 0x10) {
+			l = (p[off + 2] << 8 | p[off + 3]) + 4;
+			if (type == ATTR_LARGE_COMM && l >= 16)
+				sent = get32(p + off + 8) * 1000000ULL +
+				    get32(p + off + 12);
+		} else {
+			l = p[off + 2] + 3;
+			if (type == ATTR_LARGE_COMM && l >= 15)
+				sent = get32(p + off + 7) * 1000000ULL +
+				    get32(p + off + 11);
+		}
+	}
+	if (sent == 0)
+		return;
+
+	/* count the /24 prefixes in the NLRI */
+	for (off = alen; off < len; off += 1 + (p[off] + 7) / 8)
+		n++;
+
+	t = now_usec();
+	while (n-- > 0 && nlat < maxlat)
+		lat[nlat++] = (t - sent) / 1000.0;
+}
+
+static void
+recv_msgs(struct peer *pe)
+{
+	ssize_t		 n;
+	size_t		 len;
+	int		 type;
+
+	n = read(pe->sock, pe->rbuf + pe->rlen, sizeof(pe->rbuf) - pe->rlen);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		err(1, "%s: read", pe->name);
+	}
+	if (n == 0)
+		errx(1, "%s: bgpd closed the session", pe->name);
+	pe->rlen += n;
+
+	while (pe->rlen >= MSG_HDR_LEN) {
+		len = pe->rbuf[16] << 8 | pe->rbuf[17];
+		if (len < MSG_HDR_LEN || len > sizeof(pe->rbuf))
+			errx(1, "%s: bad message length %zu", pe->name, len);
+		if (pe->rlen < len)
+			break;
+		type = pe->rbuf[18];
+		if (type == MSG_NOTIFY)
+			errx(1, "%s: received notification %u/%u", pe->name,
+			    pe->rbuf[19], pe->rbuf[20]);
+		if (type == MSG_OPEN) {
+			pe->established = 1;
+			send_msg(pe, MSG_KEEPALIVE, NULL, 0);
+		}
+		if (type == MSG_UPDATE)
+			recv_update(pe->rbuf + MSG_HDR_LEN, len - MSG_HDR_LEN);
+		memmove(pe->rbuf, pe->rbuf + len, pe->rlen - len);
+		pe->rlen -= len;
+	}
+}
+
+static void
+peer_connect(struct peer *pe, const char *name, const char *local,
+    struct sockaddr_in *remote)
+{
+	struct sockaddr_in	 sin;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	if (inet_pton(AF_INET, local, &sin.sin_addr) != 1)
+		errx(1, "bad address %s", local);
+
+	pe->name = name;
+	if ((pe->sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (bind(pe->sock, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "bind %s", local);
+	if (connect(pe->sock, (struct sockaddr *)remote,
+	    sizeof(*remote)) == -1)
+		err(1, "connect from %s", local);
+	if (fcntl(pe->sock, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+}
+
+/*
+ * Poll both sessions for up to usec microseconds.
+ */
+static void
+run(struct peer *pe, uint64_t usec)
+{
+	struct pollfd	 pfd[2];
+	uint64_t	 end, t;
+	int		 i, timeout;
+
+	end = now_usec() + usec;
+	do {
+		if (now_usec() - last_ka > HOLDTIME / 3 * 1000000ULL) {
+			send_msg(&pe[0], MSG_KEEPALIVE, NULL, 0);
+			send_msg(&pe[1], MSG_KEEPALIVE, NULL, 0);
+			last_ka = now_usec();
+		}
+		for (i = 0; i < 2; i++) {
+			pfd[i].fd = pe[i].sock;
+			pfd[i].events = POLLIN;
+		}
+		t = now_usec();
+		timeout = t < end ? (end - t) / 1000 : 0;
+		if (poll(pfd, 2, timeout) == -1 &&
+		    errno != EINTR)
+			err(1, "poll");
+		for (i = 0; i < 2; i++)
+			if (pfd[i].revents & (POLLIN|POLLHUP))
+				recv_msgs(&pe[i]);
+	} while (now_usec() < end);
+}
+
+static int
+dblcmp(const void *a, const void *b)
+{
+	double	x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in	 sin;
+	struct peer		 pe[2];
+	const char		*ctlsock = NULL, *sender = "127.0.0.2";
+	const char		*receiver = "127.0.0.3";
+	unsigned int		 nprefix = 10000, interval = 1000, i;
+	uint16_t		 port = 179;
+	pid_t			 pid;
+	int			 ch, status;
+
+	while ((ch = getopt(argc, argv, "i:n:p:R:S:s:")) != -1) {
+		switch (ch) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			nprefix = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 10);
+			break;
+		case 'R':
+			receiver = optarg;
+			break;
+		case 'S':
+			sender = optarg;
+			break;
+		case 's':
+			ctlsock = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1) {
+ usage:
+		fprintf(stderr, "usage: prop_latency [-i usec] [-n prefixes] "
+		    "[-p port] [-R receiver] [-S sender] [-s socket] "
+		    "address\n");
+		return 1;
+	}
+	if (nprefix == 0 || nprefix > 1 << 20)
+		errx(1, "between 1 and %u prefixes", 1 << 20);
+
+	maxlat = nprefix;
+	if ((lat = calloc(maxlat, sizeof(*lat))) == NULL)
+		err(1, NULL);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, argv[0], &sin.sin_addr) != 1)
+		errx(1, "bad address %s", argv[0]);
+
+	memset(pe, 0, sizeof(pe));
+	peer_connect(&pe[0], "sender", sender, &sin);
+	peer_connect(&pe[1], "receiver", receiver, &sin);
+	send_open(&pe[0], 65001, 0x0a000002);
+	send_open(&pe[1], 65002, 0x0a000003);
+	while (!pe[0].established || !pe[1].established)
+		run(pe, 100000);
+	/* give bgpd time to finish the initial table exchange */
+	run(pe, 1000000);
+
+	printf("announcing %u prefixes, one every %u usec\n", nprefix,
+	    interval);
+	for (i = 0; i < nprefix; i++) {
+		send_prefix(&pe[0], 65001, i);
+		run(pe, interval);
+	}
+	/* wait for the stragglers */
+	for (i = 0; i < 50 && nlat < nprefix; i++)
+		run(pe, 100000);
+
+	if (nlat == 0)
+		errx(1, "no prefixes received, check the bgpd filters");
+	qsort(lat, nlat, sizeof(*lat), dblcmp);
+	printf("received %u of %u prefixes, latency in ms: min %.3f "
+	    "p50 %.3f p90 %.3f p99 %.3f max %.3f\n", nlat, nprefix, lat[0],
+	    lat[nlat / 2], lat[nlat * 9 / 10], lat[nlat * 99 / 100],
+	    lat[nlat - 1]);
+
+	fflush(stdout);
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		if (ctlsock != NULL)
+			execlp("bgpctl", "bgpctl", "-s", ctlsock, "show",
+			    "rib", "latency", (char *)NULL);
+		else
+			execlp("bgpctl", "bgpctl", "show", "rib", "latency",
+			    (char *)NULL);
+		warn("bgpctl");
+		_exit(1);
+	}
+	waitpid(pid, &status, 0);
+
+	close(pe[0].sock);
+	close(pe[1].sock);
+	free(lat);
+	return 0;
+}
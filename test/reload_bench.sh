@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# Measure config reload time of bgpd with a large synthetic config.
+#
+# Writes a bgpd.conf with N neighbors, prefix-sets holding P prefixes
+# in total, as-sets and R filter rules referencing them. With -r the
+# bgpd running with that file is reloaded once without any change and
+# once after adding a prefix to a single prefix-set, and the time until
+# each reload finished in all processes is printed.
+#
+# Generate the file first, start bgpd with it (bgpd -f file) and then
+# run again with -r. The neighbors are never reachable, only the config
+# handling is measured.
+#
+# usage: reload_bench.sh [-r] [-n neighbors] [-p prefixes] [-f rules]
+#	 [-s socket] file
+
+set -e
+
+NEIGH=3000
+PFX=200000
+RULES=40000
+SETS=1000
+RELOAD=0
+SOCK=
+
+usage() {
+	echo "usage: reload_bench.sh [-r] [-n neighbors] [-p prefixes]" \
+	    "[-f rules] [-s socket] file" >&2
+	exit 1
+}
+
+while getopts "f:n:p:rs:" ch; do
+	case $ch in
+	f) RULES=$OPTARG ;;
+	n) NEIGH=$OPTARG ;;
+	p) PFX=$OPTARG ;;
+	r) RELOAD=1 ;;
+	s) SOCK="-s $OPTARG" ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || usage
+CONF=$1
+
+# gen <extra> <file>: write the config, extra is added to the first
+# prefix-set
+gen() {
+	awk -v neigh=$NEIGH -v pfx=$PFX -v rules=$RULES -v sets=$SETS \
+	    -v extra="$1" 'BEGIN {
+		print "AS 65000"
+		print "router-id 10.255.255.1"
+		print ""
+		per = int(pfx / sets)
+		if (per < 1)
+			per = 1
+		n = 0
+		for (s = 0; s < sets; s++) {
+			printf "prefix-set ps%d {", s
+			if (s == 0 && extra != "")
+				printf " %s", extra
+			for (i = 0; i < per && n < pfx; i++) {
+				printf " %d.%d.%d.0/24 or-longer", \
+				    16 + int(n / 65536) % 200, \
+				    int(n / 256) % 256, n % 256
+				n++
+			}
+			print " }"
+		}
+		for (s = 0; s < sets; s++) {
+			printf "as-set as%d {", s
+			for (i = 0; i < 20; i++)
+				printf " %d", 64512 + (s * 20 + i) % 1000
+			print " }"
+		}
+		print ""
+		for (g = 0; g < 50; g++) {
+			printf "group g%d {\n", g
+			for (i = g; i < neigh; i += 50) {
+				printf "\tneighbor 10.%d.%d.%d {\n", \
+				    int(i / 65024) % 256, int(i / 254) % 256, \
+				    i % 254 + 1
+				printf "\t\tremote-as %d\n", 64512 + i % 1000
+				print "\t\tpassive"
+				print "\t}"
+			}
+			print "}"
+		}
+		print ""
+		for (i = 0; i < rules; i++) {
+			s = i % sets
+			if (i % 4 == 0)
+				printf "allow from group g%d prefix-set ps%d\n", \
+				    i % 50, s
+			else if (i % 4 == 1)
+				printf "deny from any AS as-set as%d\n", s
+			else if (i % 4 == 2)
+				printf "match to group g%d prefix-set ps%d " \
+				    "set localpref %d\n", i % 50, s, 100 + i % 100
+			else
+				printf "allow to ebgp prefix-set ps%d\n", s
+		}
+	}' > "$2"
+}
+
+# bgpd refuses a reload while the previous one is still running, so
+# retrying until one is accepted marks the end of the previous reload.
+reload() {
+	while bgpctl $SOCK reload 2>&1 | grep -q "still running"; do
+		sleep 0.01
+	done
+	date +%s.%N
+}
+
+gen "" "$CONF"
+echo "$CONF: $NEIGH neighbors, $PFX prefixes in $SETS prefix-sets," \
+    "$RULES rules"
+[ $RELOAD -eq 1 ] || exit 0
+
+# the reload is answered once the parent parsed the file, so the changed
+# config generated up front can be moved in place right after
+gen "192.0.2.0/24" "$CONF.new"
+t0=$(reload)
+mv "$CONF.new" "$CONF"
+t1=$(reload)
+t2=$(reload)
+echo "unchanged: $(echo "$t1 - $t0" | bc) s"
+echo "one set changed: $(echo "$t2 - $t1" | bc) s"
@@ -90,6 +90,14 @@ if [ -n "$(ls -A patches/*.patch 2>/dev/null)" ]; then
 	done
 fi
 
+# the imsg code in compat is always built, see compat/Makefile.am
+if [ -n "$(ls -A patches/compat/*.patch 2>/dev/null)" ]; then
+	for i in patches/compat/*.patch; do
+		echo Patching ${i}
+		${PATCH} -p0 < "${dir}/${i}"
+	done
+fi
+
 # after patching rename man-page so that configure can adjust placeholders
 for j in bgpd bgpctl bgplgd ; do
 	for i in `awk '/MANS (\+)?=/ { print $3 }' src/$j/Makefile.am |grep -v top_srcdir` ; do